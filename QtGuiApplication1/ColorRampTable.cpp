@@ -0,0 +1,233 @@
+#include "ColorRampTable.h"
+#include "QtConcurrentMap"
+#include "qgscolorrampshader.h"
+#include "qgsrasterrenderer.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace
+{
+	struct Rows
+	{
+		int begin;
+		int end;
+	};
+
+	// QgsColorRampShader compares with a tolerance of 1e-7; values this
+	// close to a break or the ends of the ramp are shaded exactly
+	const double Margin = 1e-6;
+
+	QVector<Rows> rowChunks(int height, int chunkRows)
+	{
+		QVector<Rows> chunks;
+		for (int begin = 0; begin < height; begin += chunkRows)
+		{
+			const Rows rows = { begin, qMin(begin + chunkRows, height) };
+			chunks.append(rows);
+		}
+		return chunks;
+	}
+}
+
+ColorRampTable::ColorRampTable(QgsRasterShaderFunction *function, double opacity, int bins)
+	: mFunction(function)
+	, mOpacity(opacity)
+	, mBinCount(qMax(1, bins))
+	, mChunkRows(32)
+	, mBinsBuilt(false)
+	, mBinsValid(false)
+	, mLow(0)
+	, mHigh(0)
+	, mScale(0)
+	, mBelow(QgsRasterRenderer::NODATA_COLOR)
+	, mAbove(QgsRasterRenderer::NODATA_COLOR)
+{
+}
+
+bool ColorRampTable::shadeBlock(QgsRasterBlock *block, QRgb *output)
+{
+	if (!mFunction || !block || block->isEmpty())
+		return false;
+
+	switch (block->dataType())
+	{
+	case Qgis::Byte:
+		return shadeIntegers<quint8>(block, output);
+	case Qgis::UInt16:
+		return shadeIntegers<quint16>(block, output);
+	case Qgis::Int16:
+		return shadeIntegers<qint16>(block, output);
+	case Qgis::UInt32:
+		return shadeIntegers<quint32>(block, output);
+	case Qgis::Int32:
+		return shadeIntegers<qint32>(block, output);
+	case Qgis::Float32:
+		return shadeValues<float>(block, output);
+	case Qgis::Float64:
+		return shadeValues<double>(block, output);
+	default:
+		return false;
+	}
+}
+
+QRgb ColorRampTable::color(double value)
+{
+	// as QgsSingleBandPseudoColorRenderer::block
+	int red, green, blue, alpha;
+	if (!mFunction->shade(value, &red, &green, &blue, &alpha))
+		return QgsRasterRenderer::NODATA_COLOR;
+
+	if (alpha < 255)
+	{
+		red *= (alpha / 255.0);
+		blue *= (alpha / 255.0);
+		green *= (alpha / 255.0);
+	}
+	if (qgsDoubleNear(mOpacity, 1.0))
+		return qRgba(red, green, blue, alpha);
+	return qRgba(static_cast<int>(mOpacity * red), static_cast<int>(mOpacity * green), static_cast<int>(mOpacity * blue), static_cast<int>(mOpacity * alpha));
+}
+
+bool ColorRampTable::buildBins()
+{
+	QgsColorRampShader *ramp = dynamic_cast<QgsColorRampShader *>(mFunction);
+	if (!ramp)
+		return false;
+
+	QVector<double> breaks;
+	for (const QgsColorRampShader::ColorRampItem &item : ramp->colorRampItemList())
+		breaks.append(item.value);
+	if (breaks.isEmpty())
+	{
+		// nothing is shaded
+		mLow = std::numeric_limits<double>::max();
+		mHigh = -std::numeric_limits<double>::max();
+		return true;
+	}
+	std::sort(breaks.begin(), breaks.end());
+
+	mLow = breaks.first();
+	mHigh = breaks.last();
+	mBelow = color(mLow - 1);
+	mAbove = color(mHigh + 1);
+	if (!(mHigh > mLow))
+		return true;
+
+	mScale = mBinCount / (mHigh - mLow);
+	mBins.resize(mBinCount);
+	mExact.resize(mBinCount);
+	int next = 0;
+	for (int k = 0; k < mBinCount; ++k)
+	{
+		const double begin = mLow + k / mScale;
+		const double end = mLow + (k + 1) / mScale;
+		while (next < breaks.size() && breaks[next] < begin - Margin)
+			++next;
+		mExact[k] = next < breaks.size() && breaks[next] <= end + Margin;
+		mBins[k] = mExact[k] ? QgsRasterRenderer::NODATA_COLOR : color(mLow + (k + 0.5) / mScale);
+	}
+	return true;
+}
+
+template <typename T>
+bool ColorRampTable::shadeIntegers(QgsRasterBlock *block, QRgb *output)
+{
+	const T *values = reinterpret_cast<const T *>(block->bits());
+	const int width = block->width();
+	const int height = block->height();
+	const qgssize count = static_cast<qgssize>(width) * height;
+
+	T low = std::numeric_limits<T>::max();
+	T high = std::numeric_limits<T>::min();
+	for (qgssize i = 0; i < count; ++i)
+	{
+		low = qMin(low, values[i]);
+		high = qMax(high, values[i]);
+	}
+	const qint64 span = static_cast<qint64>(high) - static_cast<qint64>(low) + 1;
+	if (span > qMax<qint64>(65536, count))
+		return shadeValues<T>(block, output);
+
+	// every value in the block's span, nodata folded in
+	const bool hasNoDataValue = block->hasNoDataValue();
+	const double noDataValue = block->noDataValue();
+	const bool bitmapNoData = block->hasNoData() && !hasNoDataValue;
+	QVector<QRgb> table(static_cast<int>(span));
+	for (int k = 0; k < span; ++k)
+	{
+		const double value = static_cast<double>(low) + k;
+		table[k] = hasNoDataValue && qgsDoubleNear(value, noDataValue) ? QgsRasterRenderer::NODATA_COLOR : color(value);
+	}
+
+	const QRgb *colors = table.constData();
+	QtConcurrent::blockingMap(rowChunks(height, mChunkRows), [&](const Rows &rows)
+	{
+		for (int i = rows.begin; i < rows.end; ++i)
+		{
+			const T *line = values + static_cast<qgssize>(i) * width;
+			QRgb *out = output + static_cast<qgssize>(i) * width;
+			for (int j = 0; j < width; ++j)
+				out[j] = colors[static_cast<qint64>(line[j]) - static_cast<qint64>(low)];
+			if (bitmapNoData)
+			{
+				for (int j = 0; j < width; ++j)
+				{
+					if (block->isNoData(i, j))
+						out[j] = QgsRasterRenderer::NODATA_COLOR;
+				}
+			}
+		}
+	});
+	return true;
+}
+
+template <typename T>
+bool ColorRampTable::shadeValues(QgsRasterBlock *block, QRgb *output)
+{
+	if (!mBinsBuilt)
+	{
+		mBinsValid = buildBins();
+		mBinsBuilt = true;
+	}
+	if (!mBinsValid)
+		return false;
+
+	const T *values = reinterpret_cast<const T *>(block->bits());
+	const int width = block->width();
+	const int height = block->height();
+	const bool hasNoDataValue = block->hasNoDataValue();
+	const double noDataValue = block->noDataValue();
+	const bool bitmapNoData = block->hasNoData() && !hasNoDataValue;
+
+	// the function is only called for the few cells the bins cannot answer,
+	// after the ramp has built its own lookup table above
+	QtConcurrent::blockingMap(rowChunks(height, mChunkRows), [&](const Rows &rows)
+	{
+		for (int i = rows.begin; i < rows.end; ++i)
+		{
+			const T *line = values + static_cast<qgssize>(i) * width;
+			QRgb *out = output + static_cast<qgssize>(i) * width;
+			for (int j = 0; j < width; ++j)
+			{
+				const double value = static_cast<double>(line[j]);
+				QRgb c;
+				if (!std::isfinite(value) || (hasNoDataValue && qgsDoubleNear(value, noDataValue)) || (bitmapNoData && block->isNoData(i, j)))
+					c = QgsRasterRenderer::NODATA_COLOR;
+				else if (value < mLow)
+					c = value < mLow - Margin ? mBelow : color(value);
+				else if (value > mHigh)
+					c = value > mHigh + Margin ? mAbove : color(value);
+				else if (mBins.isEmpty())
+					c = color(value);
+				else
+				{
+					const int k = qMin(static_cast<int>((value - mLow) * mScale), mBinCount - 1);
+					c = mExact[k] ? color(value) : mBins[k];
+				}
+				out[j] = c;
+			}
+		}
+	});
+	return true;
+}
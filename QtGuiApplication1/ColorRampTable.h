@@ -0,0 +1,58 @@
+#pragma once
+
+#include "QRgb"
+#include "QVector"
+#include "qgsrasterblock.h"
+
+class QgsRasterShaderFunction;
+
+// Colours whole raster blocks through lookup tables instead of one virtual
+// QgsRasterShaderFunction::shade() call, with its search of the colour ramp
+// items, per cell:
+//
+// - integer blocks whose values span at most 65536 (or as many as there
+//   are cells) get a dense table over that span, so every cell is one load;
+// - other blocks shaded by a QgsColorRampShader use a table of bins over
+//   the range of the ramp items, coloured at their centres. Bins holding a
+//   class break, and values just outside the ramp, are shaded exactly.
+//
+// Colours are premultiplied and include the opacity, as in
+// QgsSingleBandPseudoColorRenderer. The tables are built by calling the
+// function on the calling thread; rows are then split over the global
+// thread pool.
+class ColorRampTable
+{
+public:
+	ColorRampTable(QgsRasterShaderFunction *function, double opacity = 1.0, int bins = 4096);
+
+	// Fills output with a colour for every cell of block, NODATA_COLOR for
+	// nodata and values the function does not shade. False, with output
+	// untouched, for blocks the tables cannot serve.
+	bool shadeBlock(QgsRasterBlock *block, QRgb *output);
+
+	// Rows per work item.
+	void setChunkRows(int rows) { mChunkRows = qMax(1, rows); }
+
+private:
+	QRgb color(double value);
+	bool buildBins();
+	template <typename T> bool shadeIntegers(QgsRasterBlock *block, QRgb *output);
+	template <typename T> bool shadeValues(QgsRasterBlock *block, QRgb *output);
+
+	QgsRasterShaderFunction *mFunction;
+	double mOpacity;
+	int mBinCount;
+	int mChunkRows;
+
+	// bins over [mLow, mHigh] of a colour ramp; mExact marks the ones
+	// holding a class break
+	bool mBinsBuilt;
+	bool mBinsValid;
+	double mLow;
+	double mHigh;
+	double mScale;
+	QRgb mBelow;
+	QRgb mAbove;
+	QVector<QRgb> mBins;
+	QVector<char> mExact;
+};
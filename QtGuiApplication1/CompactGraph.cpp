@@ -0,0 +1,90 @@
+#include "CompactGraph.h"
+#include "qgsgraph.h"
+#include <cmath>
+#include <limits>
+#pragma comment(lib,"../include/qgis_analysis.lib")
+
+CompactGraph::CompactGraph()
+	: mVertexCount(0)
+	, mOutOffsets(1, 0)
+	, mInOffsets(1, 0)
+	, mCostPerDistance(0)
+{
+}
+
+CompactGraph::CompactGraph(int vertexCount, const QVector<Edge> &edges, const QVector<QgsPoint> &points)
+	: mVertexCount(vertexCount)
+	, mOutOffsets(vertexCount + 1, 0)
+	, mInOffsets(vertexCount + 1, 0)
+	, mPoints(points.size() == vertexCount ? points : QVector<QgsPoint>())
+	, mCostPerDistance(0)
+{
+	// counting sort of the edges by tail for out arcs and by head for in arcs
+	int arcs = 0;
+	for (const Edge &e : edges)
+	{
+		if (e.cost < 0 || e.from < 0 || e.to < 0 || e.from >= vertexCount || e.to >= vertexCount)
+			continue;
+		++mOutOffsets[e.from + 1];
+		++mInOffsets[e.to + 1];
+		++arcs;
+	}
+	for (int v = 0; v < vertexCount; ++v)
+	{
+		mOutOffsets[v + 1] += mOutOffsets[v];
+		mInOffsets[v + 1] += mInOffsets[v];
+	}
+
+	mOutHeads.resize(arcs);
+	mOutCosts.resize(arcs);
+	mOutEdges.resize(arcs);
+	mInTails.resize(arcs);
+	mInCosts.resize(arcs);
+	mInEdges.resize(arcs);
+
+	QVector<int> outFill = mOutOffsets;
+	QVector<int> inFill = mInOffsets;
+	double factor = std::numeric_limits<double>::infinity();
+	for (const Edge &e : edges)
+	{
+		if (e.cost < 0 || e.from < 0 || e.to < 0 || e.from >= vertexCount || e.to >= vertexCount)
+			continue;
+
+		const int out = outFill[e.from]++;
+		mOutHeads[out] = e.to;
+		mOutCosts[out] = e.cost;
+		mOutEdges[out] = e.id;
+
+		const int in = inFill[e.to]++;
+		mInTails[in] = e.from;
+		mInCosts[in] = e.cost;
+		mInEdges[in] = e.id;
+
+		if (!mPoints.isEmpty())
+		{
+			const double length = std::sqrt(mPoints[e.from].sqrDist(mPoints[e.to]));
+			if (length > 0)
+				factor = qMin(factor, e.cost / length);
+		}
+	}
+	if (!mPoints.isEmpty() && factor != std::numeric_limits<double>::infinity())
+		mCostPerDistance = factor;
+}
+
+CompactGraph CompactGraph::fromGraph(const QgsGraph &graph, int criterionNum)
+{
+	QVector<QgsPoint> points(graph.vertexCount());
+	for (int v = 0; v < graph.vertexCount(); ++v)
+		points[v] = graph.vertex(v).point();
+
+	QVector<Edge> edges;
+	edges.reserve(graph.edgeCount());
+	for (int i = 0; i < graph.edgeCount(); ++i)
+	{
+		const QgsGraphEdge &edge = graph.edge(i);
+		// edges run from their outgoing vertex to their incoming vertex
+		const Edge e = { edge.outVertex(), edge.inVertex(), edge.cost(criterionNum).toDouble(), i };
+		edges.append(e);
+	}
+	return CompactGraph(graph.vertexCount(), edges, points);
+}
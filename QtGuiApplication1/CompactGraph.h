@@ -0,0 +1,79 @@
+#pragma once
+
+#include "QVector"
+#include "qgspoint.h"
+
+class QgsGraph;
+
+// Result of a point to point query. Edge ids are the ids of the source
+// QgsGraph, so the path can be mapped back to the network geometry.
+struct GraphPath
+{
+	GraphPath() : cost(-1) {}
+
+	bool isValid() const { return cost >= 0; }
+
+	double cost;
+	QVector<int> vertices;
+	QVector<int> edges;
+};
+
+// Read-only graph in compressed sparse row form with a single double cost
+// per edge. QgsGraph keeps one QVariant vector per edge and QList edge ids
+// per vertex; searches over this layout touch a few flat arrays instead.
+// Both outgoing and incoming arcs are stored so searches can run backwards.
+class CompactGraph
+{
+public:
+	struct Edge
+	{
+		int from;
+		int to;
+		double cost;
+		int id;
+	};
+
+	CompactGraph();
+	// Edges with a negative cost are skipped. Points are optional; without
+	// them A* falls back to Dijkstra.
+	CompactGraph(int vertexCount, const QVector<Edge> &edges, const QVector<QgsPoint> &points = QVector<QgsPoint>());
+
+	// Uses the given QgsGraph strategy as cost.
+	static CompactGraph fromGraph(const QgsGraph &graph, int criterionNum);
+
+	int vertexCount() const { return mVertexCount; }
+	int arcCount() const { return mOutHeads.size(); }
+
+	int outBegin(int v) const { return mOutOffsets[v]; }
+	int outEnd(int v) const { return mOutOffsets[v + 1]; }
+	int outHead(int arc) const { return mOutHeads[arc]; }
+	double outCost(int arc) const { return mOutCosts[arc]; }
+	int outEdge(int arc) const { return mOutEdges[arc]; }
+
+	int inBegin(int v) const { return mInOffsets[v]; }
+	int inEnd(int v) const { return mInOffsets[v + 1]; }
+	int inTail(int arc) const { return mInTails[arc]; }
+	double inCost(int arc) const { return mInCosts[arc]; }
+	int inEdge(int arc) const { return mInEdges[arc]; }
+
+	bool hasPoints() const { return !mPoints.isEmpty(); }
+	const QgsPoint &point(int v) const { return mPoints[v]; }
+
+	// Largest factor k with cost >= k * straight line length for every edge,
+	// which makes k * distance an admissible A* heuristic whatever the costs
+	// represent. 0 when there are no points.
+	double costPerDistance() const { return mCostPerDistance; }
+
+private:
+	int mVertexCount;
+	QVector<int> mOutOffsets;
+	QVector<int> mOutHeads;
+	QVector<double> mOutCosts;
+	QVector<int> mOutEdges;
+	QVector<int> mInOffsets;
+	QVector<int> mInTails;
+	QVector<double> mInCosts;
+	QVector<int> mInEdges;
+	QVector<QgsPoint> mPoints;
+	double mCostPerDistance;
+};
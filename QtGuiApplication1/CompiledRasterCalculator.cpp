@@ -0,0 +1,174 @@
+#include "CompiledRasterCalculator.h"
+#include "QVarLengthArray"
+#include "RasterTileWriter.h"
+#include "qgsrasterblock.h"
+#include "qgsrasterdataprovider.h"
+#include "qgsrasterlayer.h"
+#include "qgsrasterprojector.h"
+#include <cfloat>
+#include <cstring>
+#include <limits>
+
+CompiledRasterCalculator::CompiledRasterCalculator(const QString &formulaString, const QString &outputFile, const QString &outputFormat,
+	const QgsRectangle &outputExtent, int nOutputColumns, int nOutputRows, const QVector<Entry> &rasterEntries)
+	: mFormulaString(formulaString)
+	, mOutputFile(outputFile)
+	, mOutputFormat(outputFormat)
+	, mOutputRectangle(outputExtent)
+	, mNumOutputColumns(nOutputColumns)
+	, mNumOutputRows(nOutputRows)
+	, mRasterEntries(rasterEntries)
+	, mTileSize(512)
+	, mThreadCount(0)
+{
+	if (!mRasterEntries.isEmpty() && mRasterEntries.first().raster)
+		mOutputCrs = mRasterEntries.first().raster->crs();
+}
+
+CompiledRasterCalculator::CompiledRasterCalculator(const QString &formulaString, const QString &outputFile, const QString &outputFormat,
+	const QgsRectangle &outputExtent, const QgsCoordinateReferenceSystem &outputCrs, int nOutputColumns, int nOutputRows,
+	const QVector<Entry> &rasterEntries)
+	: mFormulaString(formulaString)
+	, mOutputFile(outputFile)
+	, mOutputFormat(outputFormat)
+	, mOutputRectangle(outputExtent)
+	, mOutputCrs(outputCrs)
+	, mNumOutputColumns(nOutputColumns)
+	, mNumOutputRows(nOutputRows)
+	, mRasterEntries(rasterEntries)
+	, mTileSize(512)
+	, mThreadCount(0)
+{
+}
+
+int CompiledRasterCalculator::processCalculation(QProgressDialog *p)
+{
+	RasterExpression expression;
+	if (!expression.parse(mFormulaString, mError))
+		return ParserError;
+
+	// only the bands the formula refers to, in the order of its inputs
+	QVector<const Entry *> inputs;
+	for (const QString &ref : expression.references())
+	{
+		const Entry *entry = nullptr;
+		for (const Entry &e : mRasterEntries)
+		{
+			if (e.ref == ref)
+				entry = &e;
+		}
+		if (!entry)
+		{
+			mError = QString("unknown raster reference '%1'").arg(ref);
+			return ParserError;
+		}
+		if (!entry->raster || !entry->raster->dataProvider())
+			return InputLayerError;
+		inputs.append(entry);
+	}
+
+	const double cellSizeX = mOutputRectangle.width() / mNumOutputColumns;
+	const double cellSizeY = mOutputRectangle.height() / mNumOutputRows;
+	double geoTransform[6] = { mOutputRectangle.xMinimum(), cellSizeX, 0, mOutputRectangle.yMaximum(), 0, -cellSizeY };
+	QgsRasterDataProvider *output = QgsRasterDataProvider::create("gdal", mOutputFile, mOutputFormat, 1, Qgis::Float32,
+		mNumOutputColumns, mNumOutputRows, geoTransform, mOutputCrs);
+	if (!output || !output->isValid())
+	{
+		delete output;
+		return CreateOutputError;
+	}
+	const float outputNodataValue = -FLT_MAX;
+	output->setNoDataValue(1, outputNodataValue);
+
+	RasterTileWriter writer(output, mNumOutputColumns, mNumOutputRows);
+	writer.setTileSize(mTileSize);
+	writer.setThreadCount(mThreadCount);
+
+	// every worker reads through its own provider clones, reprojected
+	// like QgsRasterCalculator does when the CRS differs
+	struct Sources
+	{
+		QVector<QgsRasterInterface *> interfaces;
+		QVector<QgsRasterInterface *> owned;
+		QVector<QVector<float> > values;
+	};
+	QVector<Sources> sources(writer.threadCount());
+	for (Sources &s : sources)
+	{
+		for (const Entry *entry : inputs)
+		{
+			QgsRasterInterface *provider = entry->raster->dataProvider()->clone();
+			s.owned.append(provider);
+			if (provider && entry->raster->crs() != mOutputCrs)
+			{
+				QgsRasterProjector *projector = new QgsRasterProjector;
+				projector->setCrs(entry->raster->crs(), mOutputCrs);
+				projector->setPrecision(QgsRasterProjector::Exact);
+				projector->setInput(provider);
+				s.owned.append(projector);
+				provider = projector;
+			}
+			s.interfaces.append(provider);
+		}
+		s.values.resize(inputs.size());
+	}
+
+	const RasterTileWriter::Result result = writer.run([&](int worker, RasterTileWriter::Tile &tile)
+	{
+		Sources &s = sources[worker];
+		const int count = tile.width * tile.height;
+		const QgsRectangle extent(mOutputRectangle.xMinimum() + tile.x * cellSizeX, mOutputRectangle.yMaximum() - (tile.y + tile.height) * cellSizeY,
+			mOutputRectangle.xMinimum() + (tile.x + tile.width) * cellSizeX, mOutputRectangle.yMaximum() - tile.y * cellSizeY);
+
+		QVarLengthArray<const float *, 16> values;
+		for (int i = 0; i < inputs.size(); ++i)
+		{
+			if (!s.interfaces[i])
+				return false;
+			QgsRasterBlock *block = s.interfaces[i]->block(inputs[i]->bandNumber, extent, tile.width, tile.height);
+			if (!block || !block->isValid() || block->isEmpty() || !block->convert(Qgis::Float32))
+			{
+				delete block;
+				return false;
+			}
+
+			// nodata becomes NaN, which the expression propagates
+			QVector<float> &v = s.values[i];
+			v.resize(count);
+			std::memcpy(v.data(), block->bits(), count * sizeof(float));
+			if (block->hasNoData())
+			{
+				for (int k = 0; k < count; ++k)
+				{
+					if (block->isNoData(k))
+						v[k] = std::numeric_limits<float>::quiet_NaN();
+				}
+			}
+			delete block;
+			values.append(v.constData());
+		}
+
+		float *out = tile.data.data();
+		expression.evaluate(values.constData(), out, count);
+		for (int k = 0; k < count; ++k)
+		{
+			if (out[k] != out[k])
+				out[k] = outputNodataValue;
+		}
+		return true;
+	}, p);
+
+	for (Sources &s : sources)
+		qDeleteAll(s.owned);
+	delete output;
+
+	switch (result)
+	{
+	case RasterTileWriter::Failed:
+		return InputLayerError;
+	case RasterTileWriter::Cancelled:
+		return Cancelled;
+	default:
+		return Success;
+	}
+}
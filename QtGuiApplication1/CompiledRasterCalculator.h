@@ -0,0 +1,72 @@
+#pragma once
+
+#include "QString"
+#include "QVector"
+#include "RasterExpression.h"
+#include "qgscoordinatereferencesystem.h"
+#include "qgsrectangle.h"
+
+class QProgressDialog;
+class QgsRasterLayer;
+
+// Replacement for QgsRasterCalculator with the same constructors and
+// results. The formula is compiled once into a RasterExpression, and the
+// output is computed by RasterTileWriter: worker threads read one tile of
+// every referenced band through their own provider clones, evaluate the
+// formula over it and queue it, while the calling thread writes. Bands the
+// formula does not use are not read at all.
+//
+// qgsrastercalculator.h pulls in gdal.h, which is not part of this
+// project's include path, so the entry and result types are mirrored here.
+class CompiledRasterCalculator
+{
+public:
+	// as QgsRasterCalculatorEntry
+	struct Entry
+	{
+		QString ref;
+		QgsRasterLayer *raster;
+		int bandNumber;
+	};
+
+	// as QgsRasterCalculator::Result
+	enum Result
+	{
+		Success = 0,
+		CreateOutputError = 1,
+		InputLayerError = 2,
+		Cancelled = 3,
+		ParserError = 4,
+		MemoryError = 5,
+	};
+
+	// The output CRS is the one of the first entry.
+	CompiledRasterCalculator(const QString &formulaString, const QString &outputFile, const QString &outputFormat,
+		const QgsRectangle &outputExtent, int nOutputColumns, int nOutputRows, const QVector<Entry> &rasterEntries);
+	CompiledRasterCalculator(const QString &formulaString, const QString &outputFile, const QString &outputFormat,
+		const QgsRectangle &outputExtent, const QgsCoordinateReferenceSystem &outputCrs, int nOutputColumns, int nOutputRows,
+		const QVector<Entry> &rasterEntries);
+
+	// Returns a Result; p may be 0.
+	int processCalculation(QProgressDialog *p = nullptr);
+
+	// Parser message of the last ParserError.
+	QString lastError() const { return mError; }
+
+	void setTileSize(int cells) { mTileSize = qMax(16, cells); }
+	// 0 uses QThread::idealThreadCount().
+	void setThreadCount(int threads) { mThreadCount = qMax(0, threads); }
+
+private:
+	QString mFormulaString;
+	QString mOutputFile;
+	QString mOutputFormat;
+	QgsRectangle mOutputRectangle;
+	QgsCoordinateReferenceSystem mOutputCrs;
+	int mNumOutputColumns;
+	int mNumOutputRows;
+	QVector<Entry> mRasterEntries;
+	QString mError;
+	int mTileSize;
+	int mThreadCount;
+};
@@ -0,0 +1,480 @@
+#include "ContractionHierarchy.h"
+#include "QDataStream"
+#include "QHash"
+#include "QIODevice"
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <queue>
+
+namespace
+{
+	typedef std::pair<double, int> QueueEntry;
+	typedef std::priority_queue<QueueEntry, std::vector<QueueEntry>, std::greater<QueueEntry> > Queue;
+
+	const double INF = std::numeric_limits<double>::infinity();
+	const quint32 FILE_MAGIC = 0x43484731; // "CHG1"
+	const qint32 FILE_VERSION = 1;
+
+	struct Label
+	{
+		double cost;
+		int parentArc;
+		bool settled;
+	};
+}
+
+ContractionHierarchy::ContractionHierarchy()
+	: mVertexCount(0)
+	, mSourceArcCount(0)
+	, mWitnessSettleLimit(500)
+{
+}
+
+int ContractionHierarchy::shortcutCount() const
+{
+	int count = 0;
+	for (const Arc &a : mArcs)
+	{
+		if (a.edge < 0)
+			++count;
+	}
+	return count;
+}
+
+void ContractionHierarchy::build(const CompactGraph &graph)
+{
+	const int n = graph.vertexCount();
+	mVertexCount = n;
+	mSourceArcCount = graph.arcCount();
+	mArcs.clear();
+	mRank.fill(-1, n);
+
+	// adjacency of the vertices not contracted yet
+	QVector<QVector<int> > out(n), in(n);
+	for (int v = 0; v < n; ++v)
+	{
+		for (int i = graph.outBegin(v); i < graph.outEnd(v); ++i)
+		{
+			const Arc a = { v, graph.outHead(i), graph.outCost(i), graph.outEdge(i), -1, -1 };
+			mArcs.append(a);
+			// loops never lie on a shortest path
+			if (a.from == a.to)
+				continue;
+			out[a.from].append(mArcs.size() - 1);
+			in[a.to].append(mArcs.size() - 1);
+		}
+	}
+
+	// witness search state, reset by stamp
+	QVector<double> dist(n);
+	QVector<unsigned> stamp(n, 0);
+	unsigned currentStamp = 0;
+	// heap storage is kept between searches to avoid reallocating it
+	std::vector<QueueEntry> heap;
+	const std::greater<QueueEntry> heapOrder;
+	auto witnessSearch = [&](int source, int excluded, double maxCost, int settleLimit)
+	{
+		++currentStamp;
+		heap.clear();
+		dist[source] = 0;
+		stamp[source] = currentStamp;
+		heap.push_back(QueueEntry(0, source));
+		int settled = 0;
+		while (!heap.empty() && settled < settleLimit)
+		{
+			std::pop_heap(heap.begin(), heap.end(), heapOrder);
+			const QueueEntry top = heap.back();
+			heap.pop_back();
+			if (top.first > maxCost)
+				break;
+			if (top.first > dist[top.second])
+				continue;
+			++settled;
+			for (int arc : out[top.second])
+			{
+				const int w = mArcs[arc].to;
+				if (w == excluded)
+					continue;
+				const double c = top.first + mArcs[arc].cost;
+				if (stamp[w] == currentStamp && c >= dist[w])
+					continue;
+				stamp[w] = currentStamp;
+				dist[w] = c;
+				heap.push_back(QueueEntry(c, w));
+				std::push_heap(heap.begin(), heap.end(), heapOrder);
+			}
+		}
+	};
+
+	// Returns the number of shortcuts contracting v needs, adding them if apply is set.
+	auto contract = [&](int v, bool apply)
+	{
+		int shortcuts = 0;
+		const QVector<int> incoming = in[v];
+		const QVector<int> outgoing = out[v];
+		for (int inArc : incoming)
+		{
+			const Arc a1 = mArcs[inArc];
+			double maxCost = -1;
+			for (int outArc : outgoing)
+			{
+				if (mArcs[outArc].to != a1.from)
+					maxCost = qMax(maxCost, a1.cost + mArcs[outArc].cost);
+			}
+			if (maxCost < 0)
+				continue;
+
+			// estimating priorities only needs a rough shortcut count
+			witnessSearch(a1.from, v, maxCost, apply ? mWitnessSettleLimit : qMax(1, mWitnessSettleLimit / 10));
+			for (int outArc : outgoing)
+			{
+				const Arc a2 = mArcs[outArc];
+				if (a2.to == a1.from)
+					continue;
+				const double c = a1.cost + a2.cost;
+				if (stamp[a2.to] == currentStamp && dist[a2.to] <= c)
+					continue;
+
+				// a dearer shortcut u->w from an earlier contraction is
+				// replaced in place instead of adding a parallel arc
+				int existing = -1;
+				for (int arc : out[a1.from])
+				{
+					if (mArcs[arc].to == a2.to && mArcs[arc].edge < 0)
+					{
+						existing = arc;
+						break;
+					}
+				}
+				if (existing >= 0 && mArcs[existing].cost <= c)
+					continue;
+				if (existing < 0)
+					++shortcuts;
+				if (!apply)
+					continue;
+
+				// appended even when it replaces one, so that shortcuts always
+				// come after the arcs they replace; the dearer one is dropped
+				const Arc shortcut = { a1.from, a2.to, c, -1, inArc, outArc };
+				mArcs.append(shortcut);
+				if (existing >= 0)
+				{
+					mArcs[existing].from = -1;
+					out[a1.from].replace(out[a1.from].indexOf(existing), mArcs.size() - 1);
+					in[a2.to].replace(in[a2.to].indexOf(existing), mArcs.size() - 1);
+					continue;
+				}
+				out[a1.from].append(mArcs.size() - 1);
+				in[a2.to].append(mArcs.size() - 1);
+			}
+		}
+		return shortcuts;
+	};
+
+	// priority: edge difference, plus the number of contracted neighbours and
+	// the depth of the hierarchy below the vertex, which both spread the
+	// contraction evenly over the network
+	QVector<int> deletedNeighbours(n, 0);
+	QVector<int> depth(n, 0);
+	auto priority = [&](int v)
+	{
+		const int edgeDifference = contract(v, false) - in[v].size() - out[v].size();
+		return static_cast<double>(2 * edgeDifference + deletedNeighbours[v] + depth[v]);
+	};
+
+	QVector<double> current(n);
+	Queue queue;
+	for (int v = 0; v < n; ++v)
+	{
+		current[v] = priority(v);
+		queue.push(QueueEntry(current[v], v));
+	}
+
+	int order = 0;
+	QVector<int> neighbours;
+	while (!queue.empty())
+	{
+		const QueueEntry top = queue.top();
+		queue.pop();
+		const int v = top.second;
+		if (mRank[v] >= 0 || top.first != current[v])
+			continue;
+
+		// lazy update: recheck the cheapest vertex before contracting it
+		current[v] = priority(v);
+		if (!queue.empty() && current[v] > queue.top().first)
+		{
+			queue.push(QueueEntry(current[v], v));
+			continue;
+		}
+
+		contract(v, true);
+		mRank[v] = order++;
+
+		neighbours.clear();
+		for (int arc : in[v])
+		{
+			const int u = mArcs[arc].from;
+			out[u].removeOne(arc);
+			neighbours.append(u);
+		}
+		for (int arc : out[v])
+		{
+			const int w = mArcs[arc].to;
+			in[w].removeOne(arc);
+			neighbours.append(w);
+		}
+		in[v].clear();
+		out[v].clear();
+
+		std::sort(neighbours.begin(), neighbours.end());
+		neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+		for (int u : neighbours)
+		{
+			++deletedNeighbours[u];
+			depth[u] = qMax(depth[u], depth[v] + 1);
+			current[u] = priority(u);
+			queue.push(QueueEntry(current[u], u));
+		}
+	}
+
+	// drop the replaced shortcuts; only uncontracted vertices' arcs are
+	// replaced, so no other shortcut refers to them
+	QVector<int> index(mArcs.size(), -1);
+	int kept = 0;
+	for (int i = 0; i < mArcs.size(); ++i)
+	{
+		Arc a = mArcs[i];
+		if (a.from < 0)
+			continue;
+		if (a.edge < 0)
+		{
+			a.first = index[a.first];
+			a.second = index[a.second];
+		}
+		index[i] = kept;
+		mArcs[kept++] = a;
+	}
+	mArcs.resize(kept);
+
+	buildSearchGraph();
+}
+
+void ContractionHierarchy::buildSearchGraph()
+{
+	mUpOffsets.fill(0, mVertexCount + 1);
+	mDownOffsets.fill(0, mVertexCount + 1);
+	for (const Arc &a : mArcs)
+	{
+		if (a.from == a.to)
+			continue;
+		if (mRank[a.to] > mRank[a.from])
+			++mUpOffsets[a.from + 1];
+		else
+			++mDownOffsets[a.to + 1];
+	}
+	for (int v = 0; v < mVertexCount; ++v)
+	{
+		mUpOffsets[v + 1] += mUpOffsets[v];
+		mDownOffsets[v + 1] += mDownOffsets[v];
+	}
+
+	mUpArcs.resize(mUpOffsets[mVertexCount]);
+	mDownArcs.resize(mDownOffsets[mVertexCount]);
+	QVector<int> upFill = mUpOffsets;
+	QVector<int> downFill = mDownOffsets;
+	for (int i = 0; i < mArcs.size(); ++i)
+	{
+		const Arc &a = mArcs[i];
+		if (a.from == a.to)
+			continue;
+		if (mRank[a.to] > mRank[a.from])
+			mUpArcs[upFill[a.from]++] = i;
+		else
+			mDownArcs[downFill[a.to]++] = i;
+	}
+}
+
+GraphPath ContractionHierarchy::shortestPath(int from, int to) const
+{
+	GraphPath path;
+	if (from < 0 || to < 0 || from >= mVertexCount || to >= mVertexCount)
+		return path;
+
+	// search spaces are tiny, so sparse labels beat per-vertex arrays and
+	// keep queries const and safe to run from several threads
+	QHash<int, Label> forward, backward;
+	Queue forwardQueue, backwardQueue;
+	const Label start = { 0, -1, false };
+	forward.insert(from, start);
+	backward.insert(to, start);
+	forwardQueue.push(QueueEntry(0, from));
+	backwardQueue.push(QueueEntry(0, to));
+
+	double best = INF;
+	int meet = -1;
+	bool searchForward = true;
+	while (!forwardQueue.empty() || !backwardQueue.empty())
+	{
+		// a direction is finished once its smallest key cannot improve the result
+		if (!forwardQueue.empty() && forwardQueue.top().first >= best)
+			forwardQueue = Queue();
+		if (!backwardQueue.empty() && backwardQueue.top().first >= best)
+			backwardQueue = Queue();
+		if (forwardQueue.empty() && backwardQueue.empty())
+			break;
+		if (forwardQueue.empty())
+			searchForward = false;
+		else if (backwardQueue.empty())
+			searchForward = true;
+
+		QHash<int, Label> &labels = searchForward ? forward : backward;
+		const QHash<int, Label> &other = searchForward ? backward : forward;
+		Queue &queue = searchForward ? forwardQueue : backwardQueue;
+
+		const int v = queue.top().second;
+		queue.pop();
+		Label &label = labels[v];
+		if (label.settled)
+		{
+			searchForward = !searchForward;
+			continue;
+		}
+		label.settled = true;
+		const double cost = label.cost;
+
+		QHash<int, Label>::const_iterator meeting = other.constFind(v);
+		if (meeting != other.constEnd() && cost + meeting->cost < best)
+		{
+			best = cost + meeting->cost;
+			meet = v;
+		}
+
+		const int begin = searchForward ? mUpOffsets[v] : mDownOffsets[v];
+		const int end = searchForward ? mUpOffsets[v + 1] : mDownOffsets[v + 1];
+		for (int i = begin; i < end; ++i)
+		{
+			const int arc = searchForward ? mUpArcs[i] : mDownArcs[i];
+			const Arc &a = mArcs[arc];
+			const int w = searchForward ? a.to : a.from;
+			const double c = cost + a.cost;
+			QHash<int, Label>::iterator it = labels.find(w);
+			if (it != labels.end() && (it->settled || it->cost <= c))
+				continue;
+			const Label reached = { c, arc, false };
+			labels.insert(w, reached);
+			queue.push(QueueEntry(c, w));
+		}
+		searchForward = !searchForward;
+	}
+
+	if (meet < 0)
+		return path;
+
+	path.cost = best;
+	path.vertices.append(from);
+	QVector<int> arcs;
+	for (int v = meet; forward.value(v).parentArc >= 0; v = mArcs[forward.value(v).parentArc].from)
+		arcs.prepend(forward.value(v).parentArc);
+	for (int v = meet; backward.value(v).parentArc >= 0; v = mArcs[backward.value(v).parentArc].to)
+		arcs.append(backward.value(v).parentArc);
+	for (int arc : arcs)
+		unpack(arc, path);
+	return path;
+}
+
+void ContractionHierarchy::unpack(int arc, GraphPath &path) const
+{
+	QVector<int> stack;
+	stack.append(arc);
+	while (!stack.isEmpty())
+	{
+		const Arc &a = mArcs[stack.last()];
+		stack.removeLast();
+		if (a.edge >= 0)
+		{
+			path.edges.append(a.edge);
+			path.vertices.append(a.to);
+			continue;
+		}
+		stack.append(a.second);
+		stack.append(a.first);
+	}
+}
+
+bool ContractionHierarchy::save(QIODevice *device) const
+{
+	if (!isValid())
+		return false;
+
+	QDataStream stream(device);
+	stream.setVersion(QDataStream::Qt_5_0);
+	stream << FILE_MAGIC << FILE_VERSION << qint32(mVertexCount) << qint32(mSourceArcCount);
+	stream << mRank;
+	stream << qint32(mArcs.size());
+	for (const Arc &a : mArcs)
+		stream << qint32(a.from) << qint32(a.to) << a.cost << qint32(a.edge) << qint32(a.first) << qint32(a.second);
+	return stream.status() == QDataStream::Ok;
+}
+
+bool ContractionHierarchy::load(QIODevice *device, const CompactGraph &graph)
+{
+	QDataStream stream(device);
+	stream.setVersion(QDataStream::Qt_5_0);
+
+	quint32 magic = 0;
+	qint32 version = 0, vertexCount = 0, sourceArcCount = 0, arcCount = 0;
+	stream >> magic >> version >> vertexCount >> sourceArcCount;
+	if (stream.status() != QDataStream::Ok || magic != FILE_MAGIC || version != FILE_VERSION)
+		return false;
+	if (vertexCount != graph.vertexCount() || sourceArcCount != graph.arcCount())
+		return false;
+
+	QVector<int> rank;
+	stream >> rank >> arcCount;
+	if (stream.status() != QDataStream::Ok || rank.size() != vertexCount || arcCount < 0)
+		return false;
+
+	QVector<Arc> arcs(arcCount);
+	for (Arc &a : arcs)
+	{
+		qint32 from = -1, to = -1, edge = -1, first = -1, second = -1;
+		stream >> from >> to >> a.cost >> edge >> first >> second;
+		a.from = from;
+		a.to = to;
+		a.edge = edge;
+		a.first = first;
+		a.second = second;
+		if (from < 0 || to < 0 || from >= vertexCount || to >= vertexCount)
+			return false;
+	}
+	if (stream.status() != QDataStream::Ok || arcCount < sourceArcCount)
+		return false;
+
+	// the graph's arcs come first, in its order; every shortcut joins two
+	// earlier arcs, which rules out cycles in unpack()
+	for (int v = 0; v < vertexCount; ++v)
+	{
+		for (int i = graph.outBegin(v); i < graph.outEnd(v); ++i)
+		{
+			if (arcs[i].from != v || arcs[i].to != graph.outHead(i) || arcs[i].edge != graph.outEdge(i))
+				return false;
+		}
+	}
+	for (int i = sourceArcCount; i < arcCount; ++i)
+	{
+		const Arc &a = arcs[i];
+		if (a.edge >= 0 || a.first < 0 || a.second < 0 || a.first >= i || a.second >= i)
+			return false;
+		if (arcs[a.first].from != a.from || arcs[a.second].to != a.to || arcs[a.first].to != arcs[a.second].from)
+			return false;
+	}
+
+	mVertexCount = vertexCount;
+	mSourceArcCount = sourceArcCount;
+	mRank = rank;
+	mArcs = arcs;
+	buildSearchGraph();
+	return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "QVector"
+#include "CompactGraph.h"
+
+class QIODevice;
+
+// Contraction hierarchy over a CompactGraph. build() contracts vertices one
+// by one in order of importance and adds shortcut arcs that preserve all
+// shortest paths. A query then only needs upward searches from both ends,
+// which settle a few hundred vertices even on regional road networks.
+//
+// The hierarchy only keeps original edge ids, so it can be saved once and
+// reloaded for the same graph without repeating the preprocessing.
+class ContractionHierarchy
+{
+public:
+	ContractionHierarchy();
+
+	// Vertices settled by one witness search while contracting. Lower limits
+	// build faster but may add superfluous shortcuts.
+	void setWitnessSettleLimit(int limit) { mWitnessSettleLimit = limit; }
+
+	void build(const CompactGraph &graph);
+	bool isValid() const { return mVertexCount > 0; }
+	int vertexCount() const { return mVertexCount; }
+	int shortcutCount() const;
+
+	GraphPath shortestPath(int from, int to) const;
+
+	// Serialized hierarchies are checked against the vertex and arc count of
+	// the graph they are loaded for.
+	bool save(QIODevice *device) const;
+	bool load(QIODevice *device, const CompactGraph &graph);
+
+private:
+	friend class CostMatrix;
+
+	struct Arc
+	{
+		int from;
+		int to;
+		double cost;
+		// original edge id, or -1 for a shortcut
+		int edge;
+		// arcs a shortcut replaces, -1 for original edges
+		int first;
+		int second;
+	};
+
+	void buildSearchGraph();
+	void unpack(int arc, GraphPath &path) const;
+
+	int mVertexCount;
+	int mSourceArcCount;
+	int mWitnessSettleLimit;
+	QVector<int> mRank;
+	QVector<Arc> mArcs;
+	// arcs to higher ranked vertices, grouped by tail
+	QVector<int> mUpOffsets;
+	QVector<int> mUpArcs;
+	// arcs from higher ranked vertices, grouped by head
+	QVector<int> mDownOffsets;
+	QVector<int> mDownArcs;
+};
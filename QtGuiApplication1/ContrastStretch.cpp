@@ -0,0 +1,108 @@
+#include "ContrastStretch.h"
+#include "FloatLanes.h"
+#include "qgscontrastenhancement.h"
+#include "qgsrasterblock.h"
+#include <cstring>
+#include <limits>
+
+namespace
+{
+	// Enhances values from begin while a full vector fits; returns the
+	// first value left over.
+	template <typename L>
+	int applySpan(const float *input, float *output, int begin, int count, const ContrastStretch::Parameters &p)
+	{
+		typedef typename L::V V;
+		const V zero = L::set(0);
+		const V full = L::set(255);
+		const V minimum = L::set(p.minimum);
+		const V maximum = L::set(p.maximum);
+		const V range = L::set(p.maximum - p.minimum);
+		const V nan = L::set(std::numeric_limits<float>::quiet_NaN());
+
+		int i = begin;
+		for (; i + L::Width <= count; i += L::Width)
+		{
+			const V v = L::load(input + i);
+			V shown = L::isNumber(v);
+			if (p.mode != ContrastStretch::Stretch)
+				shown = L::both(shown, L::both(L::greaterEqual(v, minimum), L::lessEqual(v, maximum)));
+			V out = p.mode == ContrastStretch::Clip ? v : L::mul(L::div(L::sub(v, minimum), range), full);
+			// hidden cells are zeroed first so that only numbers are truncated
+			out = L::min(L::max(L::select(shown, out, zero), zero), full);
+			L::store(output + i, L::select(shown, L::truncate(out), nan));
+		}
+		return i;
+	}
+}
+
+ContrastStretch::ContrastStretch(const QgsContrastEnhancement *enhancement)
+	: mValid(true)
+{
+	mParameters.mode = PassThrough;
+	mParameters.minimum = 0;
+	mParameters.maximum = 0;
+	if (!enhancement)
+		return;
+
+	mParameters.minimum = static_cast<float>(enhancement->minimumValue());
+	mParameters.maximum = static_cast<float>(enhancement->maximumValue());
+	switch (enhancement->contrastEnhancementAlgorithm())
+	{
+	case QgsContrastEnhancement::StretchToMinimumMaximum:
+		mParameters.mode = Stretch;
+		break;
+	case QgsContrastEnhancement::StretchAndClipToMinimumMaximum:
+		mParameters.mode = StretchAndClip;
+		break;
+	case QgsContrastEnhancement::ClipToMinimumMaximum:
+		mParameters.mode = Clip;
+		break;
+	default:
+		mValid = false;
+		break;
+	}
+}
+
+void ContrastStretch::apply(const float *input, float *output, int count) const
+{
+	if (mParameters.mode == PassThrough)
+	{
+		if (input != output)
+			std::memmove(output, input, count * sizeof(float));
+		return;
+	}
+
+	int i = 0;
+#ifdef FLOATLANES_AVX
+	if (FloatLanes::avx())
+	{
+		i = applySpan<AvxLanes>(input, output, i, count, mParameters);
+		AvxLanes::leave();
+	}
+#endif
+#ifdef FLOATLANES_SSE
+	i = applySpan<SseLanes>(input, output, i, count, mParameters);
+#endif
+	applySpan<ScalarLanes>(input, output, i, count, mParameters);
+}
+
+bool ContrastStretch::values(QgsRasterBlock *block, QVector<float> &values)
+{
+	if (!block || block->isEmpty() || !block->convert(Qgis::Float32))
+		return false;
+
+	const int count = block->width() * block->height();
+	values.resize(count);
+	std::memcpy(values.data(), block->bits(), count * sizeof(float));
+	if (block->hasNoData())
+	{
+		const float nan = std::numeric_limits<float>::quiet_NaN();
+		for (int i = 0; i < count; ++i)
+		{
+			if (block->isNoData(i))
+				values[i] = nan;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "QVector"
+
+class QgsContrastEnhancement;
+class QgsRasterBlock;
+
+// The min/max algorithms of QgsContrastEnhancement over rows of float
+// cells, eight (AVX CPUs) or four (SSE2) at a time, instead of a virtual
+// enhanceContrast() and isValueInDisplayableRange() call per cell. Values
+// are those of the stock functions: (value - min) / (max - min) * 255
+// truncated to 0 - 255 for the stretches, the value itself for clipping
+// (clamped to 0 - 255 here), and NaN where the enhancement hides the cell.
+class ContrastStretch
+{
+public:
+	// enhancement may be 0, values are then passed through.
+	explicit ContrastStretch(const QgsContrastEnhancement *enhancement);
+
+	// False for the algorithms without a vector form (no enhancement and
+	// user defined), which renderers leave to QgsContrastEnhancement.
+	bool isValid() const { return mValid; }
+
+	// input and output may be the same; NaN stays NaN.
+	void apply(const float *input, float *output, int count) const;
+
+	// The cells of block as floats, NaN for nodata; false if the block
+	// cannot be converted.
+	static bool values(QgsRasterBlock *block, QVector<float> &values);
+
+	enum Mode
+	{
+		PassThrough,
+		Stretch,
+		StretchAndClip,
+		Clip,
+	};
+
+	struct Parameters
+	{
+		Mode mode;
+		float minimum;
+		float maximum;
+	};
+
+private:
+	Parameters mParameters;
+	bool mValid;
+};
@@ -0,0 +1,299 @@
+#include "CostMatrix.h"
+#include "CompactGraph.h"
+#include "ContractionHierarchy.h"
+#include "QThread"
+#include "QtConcurrentMap"
+#include <algorithm>
+#include <functional>
+
+namespace
+{
+	typedef std::pair<double, int> QueueEntry;
+
+	const double INF = std::numeric_limits<double>::infinity();
+
+	// Search state owned by one block of sources and reused for each of them,
+	// so a worker allocates its arrays and heap once rather than per search.
+	struct Workspace
+	{
+		explicit Workspace(int vertexCount)
+			: cost(vertexCount)
+			, parentEdge(vertexCount)
+			, stamp(vertexCount, 0)
+			, settled(vertexCount, 0)
+			, current(0)
+		{
+		}
+
+		void reset()
+		{
+			heap.clear();
+			if (++current != 0)
+				return;
+			stamp.fill(0);
+			settled.fill(0);
+			current = 1;
+		}
+
+		bool reached(int v) const { return stamp[v] == current; }
+		bool isSettled(int v) const { return settled[v] == current; }
+
+		void relax(int v, double c, int edge)
+		{
+			if (reached(v) && c >= cost[v])
+				return;
+			stamp[v] = current;
+			cost[v] = c;
+			parentEdge[v] = edge;
+			heap.push_back(QueueEntry(c, v));
+			std::push_heap(heap.begin(), heap.end(), std::greater<QueueEntry>());
+		}
+
+		// Next vertex to settle, or -1 when the heap is empty or above maxCost.
+		int pop(double maxCost)
+		{
+			while (!heap.empty())
+			{
+				std::pop_heap(heap.begin(), heap.end(), std::greater<QueueEntry>());
+				const QueueEntry top = heap.back();
+				heap.pop_back();
+				if (top.first > maxCost)
+				{
+					heap.clear();
+					return -1;
+				}
+				if (isSettled(top.second))
+					continue;
+				settled[top.second] = current;
+				return top.second;
+			}
+			return -1;
+		}
+
+		QVector<double> cost;
+		QVector<int> parentEdge;
+		QVector<unsigned> stamp;
+		QVector<unsigned> settled;
+		unsigned current;
+		std::vector<QueueEntry> heap;
+	};
+
+	struct Block
+	{
+		int begin;
+		int end;
+	};
+
+	QVector<Block> blocks(int count)
+	{
+		// a few blocks per core evens out searches of different sizes
+		const int blockCount = qMax(1, qMin(count, QThread::idealThreadCount() * 4));
+		QVector<Block> result;
+		for (int i = 0; i < blockCount; ++i)
+		{
+			const Block b = { static_cast<int>(static_cast<qint64>(count) * i / blockCount), static_cast<int>(static_cast<qint64>(count) * (i + 1) / blockCount) };
+			result.append(b);
+		}
+		return result;
+	}
+
+	struct BucketEntry
+	{
+		int vertex;
+		int column;
+		double cost;
+	};
+}
+
+CostMatrix::CostMatrix()
+	: mRows(0)
+	, mColumns(0)
+{
+}
+
+CostMatrix::CostMatrix(int rows, int columns)
+	: mRows(rows)
+	, mColumns(columns)
+	, mCosts(rows * columns, INF)
+{
+}
+
+CostMatrix CostMatrix::compute(const CompactGraph &graph, const QVector<int> &sources, const QVector<int> &targets, double maxCost)
+{
+	CostMatrix matrix(sources.size(), targets.size());
+	const int n = graph.vertexCount();
+
+	// vertex -> first column targeting it; repeated targets are copied afterwards
+	QVector<int> columnOf(n, -1);
+	int distinctTargets = 0;
+	for (int column = 0; column < targets.size(); ++column)
+	{
+		const int t = targets[column];
+		if (t >= 0 && t < n && columnOf[t] < 0)
+		{
+			columnOf[t] = column;
+			++distinctTargets;
+		}
+	}
+
+	QVector<Block> work = blocks(sources.size());
+	QtConcurrent::blockingMap(work, [&](const Block &block)
+	{
+		Workspace ws(n);
+		for (int r = block.begin; r < block.end; ++r)
+		{
+			const int source = sources[r];
+			if (source < 0 || source >= n)
+				continue;
+
+			double *row = matrix.row(r);
+			ws.reset();
+			ws.relax(source, 0, -1);
+			int remaining = distinctTargets;
+			int v;
+			while (remaining > 0 && (v = ws.pop(maxCost)) >= 0)
+			{
+				if (columnOf[v] >= 0)
+				{
+					row[columnOf[v]] = ws.cost[v];
+					--remaining;
+				}
+				for (int arc = graph.outBegin(v); arc < graph.outEnd(v); ++arc)
+					ws.relax(graph.outHead(arc), ws.cost[v] + graph.outCost(arc), graph.outEdge(arc));
+			}
+		}
+	});
+
+	for (int column = 0; column < targets.size(); ++column)
+	{
+		const int t = targets[column];
+		if (t < 0 || t >= n || columnOf[t] == column)
+			continue;
+		for (int r = 0; r < matrix.rowCount(); ++r)
+			matrix.row(r)[column] = matrix.cost(r, columnOf[t]);
+	}
+	return matrix;
+}
+
+CostMatrix CostMatrix::compute(const ContractionHierarchy &hierarchy, const QVector<int> &sources, const QVector<int> &targets, double maxCost)
+{
+	typedef ContractionHierarchy::Arc Arc;
+
+	CostMatrix matrix(sources.size(), targets.size());
+	const int n = hierarchy.vertexCount();
+
+	// backward upward searches from the targets
+	QVector<Block> targetWork = blocks(targets.size());
+	QVector<QVector<BucketEntry> > blockEntries(targetWork.size());
+	QtConcurrent::blockingMap(targetWork, [&](const Block &block)
+	{
+		// blockingMap hands out references into targetWork, which gives the block index
+		QVector<BucketEntry> &entries = blockEntries[static_cast<int>(&block - targetWork.constData())];
+		Workspace ws(n);
+		for (int column = block.begin; column < block.end; ++column)
+		{
+			const int target = targets[column];
+			if (target < 0 || target >= n)
+				continue;
+
+			ws.reset();
+			ws.relax(target, 0, -1);
+			int v;
+			while ((v = ws.pop(maxCost)) >= 0)
+			{
+				const BucketEntry entry = { v, column, ws.cost[v] };
+				entries.append(entry);
+				for (int i = hierarchy.mDownOffsets[v]; i < hierarchy.mDownOffsets[v + 1]; ++i)
+				{
+					const Arc &a = hierarchy.mArcs[hierarchy.mDownArcs[i]];
+					ws.relax(a.from, ws.cost[v] + a.cost, -1);
+				}
+			}
+		}
+	});
+
+	// group the entries into per-vertex buckets
+	QVector<int> bucketOffsets(n + 1, 0);
+	for (const QVector<BucketEntry> &entries : blockEntries)
+	{
+		for (const BucketEntry &e : entries)
+			++bucketOffsets[e.vertex + 1];
+	}
+	for (int v = 0; v < n; ++v)
+		bucketOffsets[v + 1] += bucketOffsets[v];
+	QVector<BucketEntry> buckets(bucketOffsets[n]);
+	QVector<int> fill = bucketOffsets;
+	for (const QVector<BucketEntry> &entries : blockEntries)
+	{
+		for (const BucketEntry &e : entries)
+			buckets[fill[e.vertex]++] = e;
+	}
+	blockEntries.clear();
+
+	// forward upward searches from the sources scan the buckets they settle
+	QVector<Block> sourceWork = blocks(sources.size());
+	QtConcurrent::blockingMap(sourceWork, [&](const Block &block)
+	{
+		Workspace ws(n);
+		for (int r = block.begin; r < block.end; ++r)
+		{
+			const int source = sources[r];
+			if (source < 0 || source >= n)
+				continue;
+
+			double *row = matrix.row(r);
+			ws.reset();
+			ws.relax(source, 0, -1);
+			int v;
+			while ((v = ws.pop(maxCost)) >= 0)
+			{
+				const double cost = ws.cost[v];
+				for (int i = bucketOffsets[v]; i < bucketOffsets[v + 1]; ++i)
+				{
+					const BucketEntry &e = buckets[i];
+					const double total = cost + e.cost;
+					if (total < row[e.column] && total <= maxCost)
+						row[e.column] = total;
+				}
+				for (int i = hierarchy.mUpOffsets[v]; i < hierarchy.mUpOffsets[v + 1]; ++i)
+				{
+					const Arc &a = hierarchy.mArcs[hierarchy.mUpArcs[i]];
+					ws.relax(a.to, cost + a.cost, -1);
+				}
+			}
+		}
+	});
+	return matrix;
+}
+
+QVector<ServiceArea> ServiceArea::compute(const CompactGraph &graph, const QVector<int> &sources, double maxCost)
+{
+	QVector<ServiceArea> areas(sources.size());
+	const int n = graph.vertexCount();
+
+	QVector<Block> work = blocks(sources.size());
+	QtConcurrent::blockingMap(work, [&](const Block &block)
+	{
+		Workspace ws(n);
+		for (int i = block.begin; i < block.end; ++i)
+		{
+			ServiceArea &area = areas[i];
+			area.source = sources[i];
+			if (area.source < 0 || area.source >= n)
+				continue;
+
+			ws.reset();
+			ws.relax(area.source, 0, -1);
+			int v;
+			while ((v = ws.pop(maxCost)) >= 0)
+			{
+				area.vertices.append(v);
+				area.costs.append(ws.cost[v]);
+				area.edges.append(ws.parentEdge[v]);
+				for (int arc = graph.outBegin(v); arc < graph.outEnd(v); ++arc)
+					ws.relax(graph.outHead(arc), ws.cost[v] + graph.outCost(arc), graph.outEdge(arc));
+			}
+		}
+	});
+	return areas;
+}
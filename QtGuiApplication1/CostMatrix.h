@@ -0,0 +1,55 @@
+#pragma once
+
+#include "QVector"
+#include <limits>
+
+class CompactGraph;
+class ContractionHierarchy;
+
+// Origin-destination costs between two sets of vertices, row-major with one
+// row per source. Unreachable pairs, and pairs dearer than the cost bound,
+// are infinite.
+class CostMatrix
+{
+public:
+	CostMatrix();
+	CostMatrix(int rows, int columns);
+
+	int rowCount() const { return mRows; }
+	int columnCount() const { return mColumns; }
+	double cost(int row, int column) const { return mCosts[row * mColumns + column]; }
+	bool isReachable(int row, int column) const { return cost(row, column) != std::numeric_limits<double>::infinity(); }
+	const double *row(int row) const { return mCosts.constData() + row * mColumns; }
+
+	// One Dijkstra per source, sources spread over the global thread pool.
+	// Each search stops once all targets are settled or maxCost is passed.
+	static CostMatrix compute(const CompactGraph &graph, const QVector<int> &sources, const QVector<int> &targets,
+		double maxCost = std::numeric_limits<double>::infinity());
+
+	// Bucket based many-to-many search over a contraction hierarchy: one
+	// backward upward search per target fills per-vertex buckets, then one
+	// forward upward search per source scans them. Both phases run in parallel.
+	static CostMatrix compute(const ContractionHierarchy &hierarchy, const QVector<int> &sources, const QVector<int> &targets,
+		double maxCost = std::numeric_limits<double>::infinity());
+
+private:
+	double *row(int row) { return mCosts.data() + row * mColumns; }
+
+	int mRows;
+	int mColumns;
+	QVector<double> mCosts;
+};
+
+// Vertices reachable from a source within a cost bound, i.e. the service area
+// or isochrone of the source, with the edge each vertex is reached through.
+struct ServiceArea
+{
+	int source;
+	QVector<int> vertices;
+	QVector<double> costs;
+	// id of the source graph edge leading to each vertex, -1 for the source
+	QVector<int> edges;
+
+	// Searches all sources in parallel; each stops at maxCost.
+	static QVector<ServiceArea> compute(const CompactGraph &graph, const QVector<int> &sources, double maxCost);
+};
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "QVector"
+#include <functional>
+
+// Indexed d-ary min heap over the ids 0 .. maxId - 1, a replacement for
+// pal::PriorityQueue. PAL's queue keeps a binary heap of ids, looks up the
+// priority of each in a separate array and compares through a function
+// pointer, so every comparison is an indirect call on two dependent loads.
+// Here keys are stored in heap order next to the ids, the comparison is a
+// template argument the compiler inlines, and with four or eight children
+// per node the heap is about half as deep as a binary one, while all
+// children of a node share one or two cache lines.
+//
+// Each id is in the heap at most once, so updating a priority moves the
+// entry instead of pushing a duplicate and skipping stale ones later.
+template <typename Key, typename Less = std::less<Key>, int Arity = 4>
+class DaryHeap
+{
+	static_assert(Arity >= 2, "a heap node needs at least two children");
+
+public:
+	explicit DaryHeap(int maxId = 0, const Less &less = Less())
+		: mLess(less)
+	{
+		reset(maxId);
+	}
+
+	// Empties the heap and allows the ids 0 .. maxId - 1. Keeps the memory.
+	void reset(int maxId)
+	{
+		mKeys.resize(0);
+		mIds.resize(0);
+		mPositions.fill(-1, maxId);
+	}
+
+	bool isEmpty() const { return mIds.isEmpty(); }
+	int size() const { return mIds.size(); }
+	bool contains(int id) const { return mPositions[id] >= 0; }
+	const Key &key(int id) const { return mKeys[mPositions[id]]; }
+
+	int top() const { return mIds[0]; }
+	const Key &topKey() const { return mKeys[0]; }
+
+	// Inserts id, or changes its key if it is already in the heap.
+	void push(int id, const Key &key)
+	{
+		int pos = mPositions[id];
+		if (pos >= 0)
+		{
+			update(id, key);
+			return;
+		}
+		pos = mIds.size();
+		mKeys.append(key);
+		mIds.append(id);
+		mPositions[id] = pos;
+		siftUp(pos);
+	}
+
+	// For keys that did not get larger; cheaper than update().
+	void decrease(int id, const Key &key)
+	{
+		const int pos = mPositions[id];
+		mKeys[pos] = key;
+		siftUp(pos);
+	}
+
+	void update(int id, const Key &key)
+	{
+		const int pos = mPositions[id];
+		const bool smaller = mLess(key, mKeys[pos]);
+		mKeys[pos] = key;
+		if (smaller)
+			siftUp(pos);
+		else
+			siftDown(pos);
+	}
+
+	int pop()
+	{
+		const int id = mIds[0];
+		removeAt(0);
+		return id;
+	}
+
+	void remove(int id)
+	{
+		const int pos = mPositions[id];
+		if (pos >= 0)
+			removeAt(pos);
+	}
+
+private:
+	void removeAt(int pos)
+	{
+		mPositions[mIds[pos]] = -1;
+		const int last = mIds.size() - 1;
+		if (pos != last)
+		{
+			const bool smaller = mLess(mKeys[last], mKeys[pos]);
+			mKeys[pos] = mKeys[last];
+			mIds[pos] = mIds[last];
+			mPositions[mIds[pos]] = pos;
+			mKeys.resize(last);
+			mIds.resize(last);
+			if (smaller)
+				siftUp(pos);
+			else
+				siftDown(pos);
+			return;
+		}
+		mKeys.resize(last);
+		mIds.resize(last);
+	}
+
+	// The moving entry is held aside and written once at its final slot.
+	void siftUp(int pos)
+	{
+		const Key key = mKeys[pos];
+		const int id = mIds[pos];
+		while (pos > 0)
+		{
+			const int parent = (pos - 1) / Arity;
+			if (!mLess(key, mKeys[parent]))
+				break;
+			mKeys[pos] = mKeys[parent];
+			mIds[pos] = mIds[parent];
+			mPositions[mIds[pos]] = pos;
+			pos = parent;
+		}
+		mKeys[pos] = key;
+		mIds[pos] = id;
+		mPositions[id] = pos;
+	}
+
+	void siftDown(int pos)
+	{
+		const int count = mIds.size();
+		const Key key = mKeys[pos];
+		const int id = mIds[pos];
+		for (;;)
+		{
+			const int first = pos * Arity + 1;
+			if (first >= count)
+				break;
+			const int last = qMin(first + Arity, count);
+			int best = first;
+			for (int child = first + 1; child < last; ++child)
+			{
+				if (mLess(mKeys[child], mKeys[best]))
+					best = child;
+			}
+			if (!mLess(mKeys[best], key))
+				break;
+			mKeys[pos] = mKeys[best];
+			mIds[pos] = mIds[best];
+			mPositions[mIds[pos]] = pos;
+			pos = best;
+		}
+		mKeys[pos] = key;
+		mIds[pos] = id;
+		mPositions[id] = pos;
+	}
+
+	Less mLess;
+	// heap order
+	QVector<Key> mKeys;
+	QVector<int> mIds;
+	// slot of each id, -1 when not queued
+	QVector<int> mPositions;
+};
@@ -0,0 +1,536 @@
+#include "DelaunayTriangulation.h"
+#include "QPair"
+#include "QThread"
+#include "QVarLengthArray"
+#include "QtConcurrentRun"
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+	// halves smaller than this are not worth a task
+	const int ParallelPoints = 1 << 14;
+
+	// Shewchuk's error bounds for the floating point determinants; results
+	// within them are decided by exact arithmetic
+	const double Epsilon = 1.1102230246251565e-16;
+	const double OrientBound = (3.0 + 16.0 * Epsilon) * Epsilon;
+	const double InCircleBound = (10.0 + 96.0 * Epsilon) * Epsilon;
+
+	// Exact sums of doubles as nonoverlapping terms, smallest first; only
+	// used for the rare nearly degenerate cases.
+	typedef QVarLengthArray<double, 32> Expansion;
+
+	void grow(Expansion &e, double b)
+	{
+		Expansion result;
+		double q = b;
+		for (int i = 0; i < e.size(); ++i)
+		{
+			// two sum
+			const double sum = q + e[i];
+			const double bv = sum - q;
+			const double av = sum - bv;
+			const double error = (q - av) + (e[i] - bv);
+			if (error != 0.0)
+				result.append(error);
+			q = sum;
+		}
+		if (q != 0.0 || result.isEmpty())
+			result.append(q);
+		e = result;
+	}
+
+	Expansion difference(double a, double b)
+	{
+		Expansion e;
+		grow(e, a);
+		grow(e, -b);
+		return e;
+	}
+
+	Expansion product(const Expansion &a, const Expansion &b)
+	{
+		Expansion e;
+		for (int i = 0; i < a.size(); ++i)
+		{
+			for (int j = 0; j < b.size(); ++j)
+			{
+				const double p = a[i] * b[j];
+				grow(e, p);
+				const double error = std::fma(a[i], b[j], -p);
+				if (error != 0.0)
+					grow(e, error);
+			}
+		}
+		return e;
+	}
+
+	Expansion sum(const Expansion &a, const Expansion &b, double sign = 1.0)
+	{
+		Expansion e = a;
+		for (int i = 0; i < b.size(); ++i)
+			grow(e, sign * b[i]);
+		return e;
+	}
+
+	double signOf(const Expansion &e)
+	{
+		for (int i = e.size() - 1; i >= 0; --i)
+		{
+			if (e[i] != 0.0)
+				return e[i] > 0 ? 1.0 : -1.0;
+		}
+		return 0.0;
+	}
+
+	// Positive when a, b, c turn counterclockwise, negative clockwise, 0
+	// when collinear.
+	double orientation(double ax, double ay, double bx, double by, double cx, double cy)
+	{
+		const double left = (ax - cx) * (by - cy);
+		const double right = (ay - cy) * (bx - cx);
+		const double det = left - right;
+		if (std::fabs(det) > OrientBound * (std::fabs(left) + std::fabs(right)))
+			return det;
+
+		const Expansion acx = difference(ax, cx), bcy = difference(by, cy);
+		const Expansion acy = difference(ay, cy), bcx = difference(bx, cx);
+		return signOf(sum(product(acx, bcy), product(acy, bcx), -1.0));
+	}
+
+	// Positive when d lies inside the circle through the counterclockwise
+	// a, b, c, negative outside, 0 on it.
+	double inCircle(double ax, double ay, double bx, double by, double cx, double cy, double dx, double dy)
+	{
+		const double adx = ax - dx, ady = ay - dy;
+		const double bdx = bx - dx, bdy = by - dy;
+		const double cdx = cx - dx, cdy = cy - dy;
+		const double bdxcdy = bdx * cdy, cdxbdy = cdx * bdy;
+		const double cdxady = cdx * ady, adxcdy = adx * cdy;
+		const double adxbdy = adx * bdy, bdxady = bdx * ady;
+		const double alift = adx * adx + ady * ady;
+		const double blift = bdx * bdx + bdy * bdy;
+		const double clift = cdx * cdx + cdy * cdy;
+		const double det = alift * (bdxcdy - cdxbdy) + blift * (cdxady - adxcdy) + clift * (adxbdy - bdxady);
+		const double permanent = (std::fabs(bdxcdy) + std::fabs(cdxbdy)) * alift
+			+ (std::fabs(cdxady) + std::fabs(adxcdy)) * blift
+			+ (std::fabs(adxbdy) + std::fabs(bdxady)) * clift;
+		if (std::fabs(det) > InCircleBound * permanent)
+			return det;
+
+		const Expansion eadx = difference(ax, dx), eady = difference(ay, dy);
+		const Expansion ebdx = difference(bx, dx), ebdy = difference(by, dy);
+		const Expansion ecdx = difference(cx, dx), ecdy = difference(cy, dy);
+		const Expansion ealift = sum(product(eadx, eadx), product(eady, eady));
+		const Expansion eblift = sum(product(ebdx, ebdx), product(ebdy, ebdy));
+		const Expansion eclift = sum(product(ecdx, ecdx), product(ecdy, ecdy));
+		const Expansion a = product(ealift, sum(product(ebdx, ecdy), product(ecdx, ebdy), -1.0));
+		const Expansion b = product(eblift, sum(product(ecdx, eady), product(eadx, ecdy), -1.0));
+		const Expansion c = product(eclift, sum(product(eadx, ebdy), product(ebdx, eady), -1.0));
+		return signOf(sum(sum(a, b), c));
+	}
+
+	// Half-edges in pairs, e and e ^ 1 running both ways along an edge, with
+	// the next and previous half-edge counterclockwise around their origin.
+	// Deleted pairs are reused.
+	struct Mesh
+	{
+		QVector<int> org;
+		QVector<int> onext;
+		QVector<int> oprev;
+		QVector<int> free;
+
+		int dest(int e) const { return org[e ^ 1]; }
+		int lnext(int e) const { return oprev[e ^ 1]; }
+		int rprev(int e) const { return onext[e ^ 1]; }
+
+		int makeEdge(int a, int b)
+		{
+			int e;
+			if (!free.isEmpty())
+			{
+				e = free.last();
+				free.removeLast();
+			}
+			else
+			{
+				e = org.size();
+				org.resize(e + 2);
+				onext.resize(e + 2);
+				oprev.resize(e + 2);
+			}
+			org[e] = a;
+			org[e + 1] = b;
+			onext[e] = oprev[e] = e;
+			onext[e + 1] = oprev[e + 1] = e + 1;
+			return e;
+		}
+
+		void splice(int a, int b)
+		{
+			const int an = onext[a];
+			const int bn = onext[b];
+			onext[a] = bn;
+			onext[b] = an;
+			oprev[bn] = a;
+			oprev[an] = b;
+		}
+
+		// a new edge from the destination of a to the origin of b
+		int connect(int a, int b)
+		{
+			const int e = makeEdge(dest(a), org[b]);
+			splice(e, lnext(a));
+			splice(e ^ 1, b);
+			return e;
+		}
+
+		void deleteEdge(int e)
+		{
+			splice(e, oprev[e]);
+			splice(e ^ 1, oprev[e ^ 1]);
+			e &= ~1;
+			org[e] = org[e + 1] = -1;
+			free.append(e);
+		}
+
+		// the half-edges of other appended, other emptied
+		int adopt(Mesh &other)
+		{
+			const int offset = org.size();
+			org += other.org;
+			for (int e : other.onext)
+				onext.append(e + offset);
+			for (int e : other.oprev)
+				oprev.append(e + offset);
+			for (int e : other.free)
+				free.append(e + offset);
+			other = Mesh();
+			return offset;
+		}
+	};
+
+	// Guibas and Stolfi's divide and conquer over points sorted by x, then y
+	struct Builder
+	{
+		const double *x;
+		const double *y;
+
+		bool ccw(int a, int b, int c) const { return orientation(x[a], y[a], x[b], y[b], x[c], y[c]) > 0; }
+		bool rightOf(const Mesh &m, int p, int e) const { return ccw(p, m.dest(e), m.org[e]); }
+		bool leftOf(const Mesh &m, int p, int e) const { return ccw(p, m.org[e], m.dest(e)); }
+		bool inside(int a, int b, int c, int d) const { return inCircle(x[a], y[a], x[b], y[b], x[c], y[c], x[d], y[d]) > 0; }
+
+		// the counterclockwise convex hull edge out of the leftmost point and
+		// the clockwise one out of the rightmost point
+		QPair<int, int> triangulate(Mesh &m, int lo, int hi, int depth) const
+		{
+			const int n = hi - lo;
+			if (n == 2)
+			{
+				const int a = m.makeEdge(lo, lo + 1);
+				return qMakePair(a, a ^ 1);
+			}
+			if (n == 3)
+			{
+				const int a = m.makeEdge(lo, lo + 1);
+				const int b = m.makeEdge(lo + 1, lo + 2);
+				m.splice(a ^ 1, b);
+				if (ccw(lo, lo + 1, lo + 2))
+				{
+					m.connect(b, a);
+					return qMakePair(a, b ^ 1);
+				}
+				if (ccw(lo, lo + 2, lo + 1))
+				{
+					const int c = m.connect(b, a);
+					return qMakePair(c ^ 1, c);
+				}
+				return qMakePair(a, b ^ 1);
+			}
+
+			const int mid = lo + n / 2;
+			QPair<int, int> left, right;
+			if (depth > 0 && n >= 2 * ParallelPoints)
+			{
+				Mesh other;
+				QFuture<void> future = QtConcurrent::run([&]() { right = triangulate(other, mid, hi, depth - 1); });
+				left = triangulate(m, lo, mid, depth - 1);
+				future.waitForFinished();
+				const int offset = m.adopt(other);
+				right.first += offset;
+				right.second += offset;
+			}
+			else
+			{
+				left = triangulate(m, lo, mid, depth);
+				right = triangulate(m, mid, hi, depth);
+			}
+			return merge(m, left, right);
+		}
+
+		QPair<int, int> merge(Mesh &m, QPair<int, int> left, QPair<int, int> right) const
+		{
+			int ldo = left.first, ldi = left.second;
+			int rdi = right.first, rdo = right.second;
+
+			// lower common tangent
+			for (;;)
+			{
+				if (leftOf(m, m.org[rdi], ldi))
+					ldi = m.lnext(ldi);
+				else if (rightOf(m, m.org[ldi], rdi))
+					rdi = m.rprev(rdi);
+				else
+					break;
+			}
+
+			int basel = m.connect(rdi ^ 1, ldi);
+			if (m.org[ldi] == m.org[ldo])
+				ldo = basel ^ 1;
+			if (m.org[rdi] == m.org[rdo])
+				rdo = basel;
+
+			// rising bubble
+			for (;;)
+			{
+				int lcand = m.onext[basel ^ 1];
+				if (rightOf(m, m.dest(lcand), basel))
+				{
+					while (inside(m.dest(basel), m.org[basel], m.dest(lcand), m.dest(m.onext[lcand])))
+					{
+						const int t = m.onext[lcand];
+						m.deleteEdge(lcand);
+						lcand = t;
+					}
+				}
+				int rcand = m.oprev[basel];
+				if (rightOf(m, m.dest(rcand), basel))
+				{
+					while (inside(m.dest(basel), m.org[basel], m.dest(rcand), m.dest(m.oprev[rcand])))
+					{
+						const int t = m.oprev[rcand];
+						m.deleteEdge(rcand);
+						rcand = t;
+					}
+				}
+
+				const bool lvalid = rightOf(m, m.dest(lcand), basel);
+				const bool rvalid = rightOf(m, m.dest(rcand), basel);
+				if (!lvalid && !rvalid)
+					break;
+				if (!lvalid || (rvalid && inside(m.dest(lcand), m.org[lcand], m.org[rcand], m.dest(rcand))))
+					basel = m.connect(rcand, basel ^ 1);
+				else
+					basel = m.connect(basel ^ 1, lcand ^ 1);
+			}
+			return qMakePair(ldo, rdo);
+		}
+	};
+}
+
+DelaunayTriangulation::DelaunayTriangulation()
+	: mThreadCount(0)
+	, mGridX0(0)
+	, mGridY0(0)
+	, mGridCellSize(0)
+	, mGridColumns(0)
+	, mGridRows(0)
+{
+}
+
+void DelaunayTriangulation::build(const QVector<QgsPoint> &points)
+{
+	const int count = points.size();
+	mX.resize(count);
+	mY.resize(count);
+	for (int i = 0; i < count; ++i)
+	{
+		mX[i] = points[i].x();
+		mY[i] = points[i].y();
+	}
+	mTriangles.clear();
+	mHalfEdges.clear();
+	mGridStart.clear();
+	mGridColumns = mGridRows = 0;
+
+	// sorted by x, then y, without repeated positions
+	QVector<int> order;
+	order.reserve(count);
+	for (int i = 0; i < count; ++i)
+	{
+		if (std::isfinite(mX[i]) && std::isfinite(mY[i]))
+			order.append(i);
+	}
+	std::sort(order.begin(), order.end(), [this](int a, int b)
+	{
+		if (mX[a] != mX[b])
+			return mX[a] < mX[b];
+		if (mY[a] != mY[b])
+			return mY[a] < mY[b];
+		return a < b;
+	});
+	order.erase(std::unique(order.begin(), order.end(), [this](int a, int b) { return mX[a] == mX[b] && mY[a] == mY[b]; }), order.end());
+	const int unique = order.size();
+	if (unique < 3)
+		return;
+
+	QVector<double> sx(unique), sy(unique);
+	for (int i = 0; i < unique; ++i)
+	{
+		sx[i] = mX[order[i]];
+		sy[i] = mY[order[i]];
+	}
+
+	int depth = 0;
+	const int threads = mThreadCount > 0 ? mThreadCount : QThread::idealThreadCount();
+	while ((1 << depth) < threads)
+		++depth;
+
+	Builder builder = { sx.constData(), sy.constData() };
+	// a triangulation has fewer than three edges per point
+	Mesh mesh;
+	mesh.org.reserve(6 * unique);
+	mesh.onext.reserve(6 * unique);
+	mesh.oprev.reserve(6 * unique);
+	builder.triangulate(mesh, 0, unique, depth);
+
+	// faces of three half-edges turning counterclockwise are triangles;
+	// the outer face runs clockwise
+	const int edges = mesh.org.size();
+	QVector<int> triangleEdge(edges, -1);
+	for (int e = 0; e < edges; ++e)
+	{
+		if (mesh.org[e] < 0 || triangleEdge[e] >= 0)
+			continue;
+		const int e1 = mesh.lnext(e);
+		const int e2 = mesh.lnext(e1);
+		if (mesh.lnext(e2) != e || !builder.ccw(mesh.org[e], mesh.org[e1], mesh.org[e2]))
+			continue;
+		const int t = mTriangles.size();
+		mTriangles.append(order[mesh.org[e]]);
+		mTriangles.append(order[mesh.org[e1]]);
+		mTriangles.append(order[mesh.org[e2]]);
+		triangleEdge[e] = t;
+		triangleEdge[e1] = t + 1;
+		triangleEdge[e2] = t + 2;
+	}
+	mHalfEdges.fill(-1, mTriangles.size());
+	for (int e = 0; e < edges; ++e)
+	{
+		if (triangleEdge[e] >= 0)
+			mHalfEdges[triangleEdge[e]] = triangleEdge[e ^ 1];
+	}
+	buildLocator();
+}
+
+void DelaunayTriangulation::buildLocator()
+{
+	const int triangles = triangleCount();
+	if (triangles == 0)
+		return;
+
+	double xmin = mX[mTriangles[0]], xmax = xmin;
+	double ymin = mY[mTriangles[0]], ymax = ymin;
+	for (int v : mTriangles)
+	{
+		xmin = qMin(xmin, mX[v]);
+		xmax = qMax(xmax, mX[v]);
+		ymin = qMin(ymin, mY[v]);
+		ymax = qMax(ymax, mY[v]);
+	}
+
+	// about four triangles per cell
+	const double cells = qMax(1.0, triangles / 4.0);
+	mGridCellSize = std::sqrt((xmax - xmin) * (ymax - ymin) / cells);
+	if (!(mGridCellSize > 0))
+		mGridCellSize = qMax(xmax - xmin, ymax - ymin);
+	mGridX0 = xmin;
+	mGridY0 = ymin;
+	mGridColumns = qBound(1, static_cast<int>((xmax - xmin) / mGridCellSize) + 1, 4096);
+	mGridRows = qBound(1, static_cast<int>((ymax - ymin) / mGridCellSize) + 1, 4096);
+	mGridCellSize = qMax((xmax - xmin) / mGridColumns, (ymax - ymin) / mGridRows);
+	if (!(mGridCellSize > 0))
+		mGridCellSize = 1;
+
+	mGridStart.fill(-1, mGridColumns * mGridRows);
+	for (int t = 0; t < triangles; ++t)
+	{
+		const double cx = (mX[mTriangles[3 * t]] + mX[mTriangles[3 * t + 1]] + mX[mTriangles[3 * t + 2]]) / 3;
+		const double cy = (mY[mTriangles[3 * t]] + mY[mTriangles[3 * t + 1]] + mY[mTriangles[3 * t + 2]]) / 3;
+		const int column = qBound(0, static_cast<int>((cx - mGridX0) / mGridCellSize), mGridColumns - 1);
+		const int row = qBound(0, static_cast<int>((cy - mGridY0) / mGridCellSize), mGridRows - 1);
+		mGridStart[row * mGridColumns + column] = t;
+	}
+
+	// empty cells start where a neighbour does
+	for (int row = 0; row < mGridRows; ++row)
+	{
+		int *cell = mGridStart.data() + row * mGridColumns;
+		for (int column = 1; column < mGridColumns; ++column)
+		{
+			if (cell[column] < 0)
+				cell[column] = cell[column - 1];
+		}
+		for (int column = mGridColumns - 2; column >= 0; --column)
+		{
+			if (cell[column] < 0)
+				cell[column] = cell[column + 1];
+		}
+	}
+	for (int row = 1; row < mGridRows; ++row)
+	{
+		if (mGridStart[row * mGridColumns] < 0)
+			std::copy(mGridStart.constData() + (row - 1) * mGridColumns, mGridStart.constData() + row * mGridColumns, mGridStart.data() + row * mGridColumns);
+	}
+	for (int row = mGridRows - 2; row >= 0; --row)
+	{
+		if (mGridStart[row * mGridColumns] < 0)
+			std::copy(mGridStart.constData() + (row + 1) * mGridColumns, mGridStart.constData() + (row + 2) * mGridColumns, mGridStart.data() + row * mGridColumns);
+	}
+}
+
+int DelaunayTriangulation::locate(double x, double y, int hint) const
+{
+	const int triangles = triangleCount();
+	if (triangles == 0 || !std::isfinite(x) || !std::isfinite(y))
+		return -1;
+
+	int t = hint;
+	if (t < 0 || t >= triangles)
+	{
+		const int column = qBound(0, static_cast<int>(qBound(-1.0, (x - mGridX0) / mGridCellSize, static_cast<double>(mGridColumns))), mGridColumns - 1);
+		const int row = qBound(0, static_cast<int>(qBound(-1.0, (y - mGridY0) / mGridCellSize, static_cast<double>(mGridRows))), mGridRows - 1);
+		t = mGridStart[row * mGridColumns + column];
+	}
+
+	// visibility walk; it ends on a Delaunay triangulation. The edge the
+	// walk came through is not tested again.
+	int entered = -1;
+	for (int step = 0; step <= triangles; ++step)
+	{
+		const int base = 3 * t;
+		int next = -1;
+		for (int k = 0; k < 3; ++k)
+		{
+			const int h = base + k;
+			if (h == entered)
+				continue;
+			const int a = mTriangles[h];
+			const int b = mTriangles[base + (k + 1) % 3];
+			if (orientation(mX[a], mY[a], mX[b], mY[b], x, y) < 0)
+			{
+				next = mHalfEdges[h];
+				if (next < 0)
+					return -1;
+				break;
+			}
+		}
+		if (next < 0)
+			return t;
+		t = next / 3;
+		entered = next;
+	}
+	return -1;
+}
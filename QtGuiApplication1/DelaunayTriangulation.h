@@ -0,0 +1,63 @@
+#pragma once
+
+#include "QVector"
+#include "qgspoint.h"
+
+// Delaunay triangulation of a point set built in one pass, for inputs too
+// large for DualEdgeTriangulation's one point at a time insertion. Points
+// are sorted once and triangulated by divide and conquer (Guibas and
+// Stolfi) on half-edges kept in flat arrays; with more than one thread the
+// upper levels of the recursion build their halves on the global thread
+// pool before merging them. The orientation and in-circle tests are exact,
+// so gridded and cocircular input is triangulated consistently.
+//
+// The result is stored as three vertex ids per triangle, counterclockwise,
+// and for every half-edge the opposite one. Vertex ids are positions in
+// the input; points at the position of an earlier point are left out, as
+// DualEdgeTriangulation ignores a point inserted twice. Once built the
+// triangulation is never modified, so any number of threads may query it
+// at the same time.
+class DelaunayTriangulation
+{
+public:
+	DelaunayTriangulation();
+
+	// 0 uses QThread::idealThreadCount(); 1 builds on the calling thread.
+	void setThreadCount(int threads) { mThreadCount = qMax(0, threads); }
+
+	// Replaces the triangulation with one of points.
+	void build(const QVector<QgsPoint> &points);
+
+	int pointCount() const { return mX.size(); }
+	int triangleCount() const { return mTriangles.size() / 3; }
+	double x(int vertex) const { return mX[vertex]; }
+	double y(int vertex) const { return mY[vertex]; }
+
+	// Vertices of triangle t are triangles()[3t], [3t + 1] and [3t + 2].
+	const QVector<int> &triangles() const { return mTriangles; }
+	// Half-edge 3t + k runs from vertex k of triangle t to the next one;
+	// halfEdges() holds the half-edge running the other way, -1 on the hull.
+	const QVector<int> &halfEdges() const { return mHalfEdges; }
+
+	// The triangle holding x, y, -1 outside the convex hull. The walk
+	// starts from hint if given, else from a cell of a coarse grid over the
+	// points.
+	int locate(double x, double y, int hint = -1) const;
+
+private:
+	void buildLocator();
+
+	int mThreadCount;
+	QVector<double> mX;
+	QVector<double> mY;
+	QVector<int> mTriangles;
+	QVector<int> mHalfEdges;
+
+	// a triangle near the centre of every grid cell
+	double mGridX0;
+	double mGridY0;
+	double mGridCellSize;
+	int mGridColumns;
+	int mGridRows;
+	QVector<int> mGridStart;
+};
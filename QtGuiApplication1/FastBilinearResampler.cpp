@@ -0,0 +1,94 @@
+#include "FastBilinearResampler.h"
+#include "FastRasterProjector.h"
+#include "QImage"
+#include "QtConcurrentMap"
+#include <cmath>
+
+namespace
+{
+	struct Rows
+	{
+		int begin;
+		int end;
+	};
+
+	// First source pixel and weight 0 - 256 of the second one for every
+	// destination pixel along one axis.
+	void taps(int sourceSize, int size, QVector<int> &first, QVector<int> &weight)
+	{
+		first.resize(size);
+		weight.resize(size);
+		const double scale = static_cast<double>(sourceSize) / size;
+		for (int i = 0; i < size; ++i)
+		{
+			const double f = (i + 0.5) * scale - 0.5;
+			int p = static_cast<int>(std::floor(f));
+			int w = static_cast<int>((f - p) * 256 + 0.5);
+			if (p < 0)
+			{
+				p = 0;
+				w = 0;
+			}
+			else if (p > sourceSize - 2)
+			{
+				p = sourceSize - 2;
+				w = 256;
+			}
+			first[i] = p;
+			weight[i] = w;
+		}
+	}
+}
+
+FastBilinearResampler::FastBilinearResampler()
+	: mChunkRows(32)
+{
+}
+
+FastBilinearResampler *FastBilinearResampler::clone() const
+{
+	FastBilinearResampler *resampler = new FastBilinearResampler;
+	resampler->setChunkRows(mChunkRows);
+	return resampler;
+}
+
+void FastBilinearResampler::resample(const QImage &srcImage, QImage &dstImage)
+{
+	const int width = dstImage.width();
+	const int height = dstImage.height();
+	const QImage source = srcImage.format() == QImage::Format_ARGB32_Premultiplied ? srcImage : srcImage.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+	if (source.width() < 2 || source.height() < 2 || width <= 0 || height <= 0)
+	{
+		dstImage = source.scaled(width, height, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+		return;
+	}
+	if (dstImage.format() != QImage::Format_ARGB32_Premultiplied)
+		dstImage = QImage(width, height, QImage::Format_ARGB32_Premultiplied);
+
+	QVector<int> columns, columnWeights, rowsFirst, rowWeights;
+	taps(source.width(), width, columns, columnWeights);
+	taps(source.height(), height, rowsFirst, rowWeights);
+
+	QVector<Rows> chunks;
+	for (int begin = 0; begin < height; begin += mChunkRows)
+	{
+		const Rows rows = { begin, qMin(begin + mChunkRows, height) };
+		chunks.append(rows);
+	}
+
+	// bits() detaches, so it is called once before the workers start
+	uchar *destination = dstImage.bits();
+	const int destinationStride = dstImage.bytesPerLine();
+	QtConcurrent::blockingMap(chunks, [&](const Rows &rows)
+	{
+		for (int i = rows.begin; i < rows.end; ++i)
+		{
+			const QRgb *top = reinterpret_cast<const QRgb *>(source.constScanLine(rowsFirst[i]));
+			const QRgb *bottom = reinterpret_cast<const QRgb *>(source.constScanLine(rowsFirst[i] + 1));
+			QRgb *out = reinterpret_cast<QRgb *>(destination + i * destinationStride);
+			const int weightY = rowWeights[i];
+			for (int j = 0; j < width; ++j)
+				out[j] = FastRasterProjector::interpolate(top + columns[j], bottom + columns[j], columnWeights[j], weightY);
+		}
+	});
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "qgsrasterresampler.h"
+
+// Bilinear resampler for QgsRasterResampleFilter. The stock one scales the
+// whole image through QImage::scaled on the render thread; here every
+// destination row interpolates its four source pixels in 8.8 fixed point
+// (SSE2 where available, see FastRasterProjector::interpolate) and rows
+// are split over the global thread pool. Pixel centres are mapped as in
+// QgsCubicRasterResampler. The type name is the stock one.
+class FastBilinearResampler : public QgsRasterResampler
+{
+public:
+	FastBilinearResampler();
+
+	void resample(const QImage &srcImage, QImage &dstImage) override;
+	QString type() const override { return QStringLiteral("bilinear"); }
+	FastBilinearResampler *clone() const override;
+
+	// Rows per work item.
+	void setChunkRows(int rows) { mChunkRows = qMax(1, rows); }
+
+private:
+	int mChunkRows;
+};
@@ -0,0 +1,129 @@
+#include "FastCubicResampler.h"
+#include "FloatLanes.h"
+#include "QImage"
+#include "QtConcurrentMap"
+#include <cmath>
+
+namespace
+{
+	struct Rows
+	{
+		int begin;
+		int end;
+	};
+
+	QVector<FastCubicResampler::Taps> taps(int sourceSize, int size)
+	{
+		QVector<FastCubicResampler::Taps> result(size);
+		const double scale = static_cast<double>(sourceSize) / size;
+		for (int i = 0; i < size; ++i)
+		{
+			const double f = (i + 0.5) * scale - 0.5;
+			const int p = static_cast<int>(std::floor(f));
+			const float t = static_cast<float>(f - p);
+			FastCubicResampler::Taps &taps = result[i];
+			for (int k = 0; k < 4; ++k)
+				taps.index[k] = qBound(0, p - 1 + k, sourceSize - 1);
+			// Catmull-Rom
+			taps.weight[0] = ((-t + 2) * t - 1) * t / 2;
+			taps.weight[1] = ((3 * t - 5) * t * t + 2) / 2;
+			taps.weight[2] = ((-3 * t + 4) * t + 1) * t / 2;
+			taps.weight[3] = (t - 1) * t * t / 2;
+		}
+		return result;
+	}
+}
+
+FastCubicResampler::FastCubicResampler()
+	: mChunkRows(32)
+{
+}
+
+FastCubicResampler *FastCubicResampler::clone() const
+{
+	FastCubicResampler *resampler = new FastCubicResampler;
+	resampler->setChunkRows(mChunkRows);
+	return resampler;
+}
+
+QRgb FastCubicResampler::interpolate(const QRgb *const *rows, const Taps &columns, const Taps &rowTaps)
+{
+#ifdef FLOATLANES_SSE
+	// channels in lanes, alpha in the last one
+	const __m128i zero = _mm_setzero_si128();
+	__m128 sum = _mm_setzero_ps();
+	for (int r = 0; r < 4; ++r)
+	{
+		const QRgb *line = rows[r];
+		__m128 row = _mm_setzero_ps();
+		for (int c = 0; c < 4; ++c)
+		{
+			const __m128i pixel = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(static_cast<int>(line[columns.index[c]])), zero), zero);
+			row = _mm_add_ps(row, _mm_mul_ps(_mm_cvtepi32_ps(pixel), _mm_set1_ps(columns.weight[c])));
+		}
+		sum = _mm_add_ps(sum, _mm_mul_ps(row, _mm_set1_ps(rowTaps.weight[r])));
+	}
+	sum = _mm_min_ps(_mm_max_ps(sum, _mm_setzero_ps()), _mm_set1_ps(255));
+	sum = _mm_min_ps(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(3, 3, 3, 3)));
+	const __m128i value = _mm_cvtps_epi32(sum);
+	return static_cast<QRgb>(_mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(value, value), zero)));
+#else
+	float sum[4] = { 0, 0, 0, 0 };
+	for (int r = 0; r < 4; ++r)
+	{
+		const QRgb *line = rows[r];
+		float row[4] = { 0, 0, 0, 0 };
+		for (int c = 0; c < 4; ++c)
+		{
+			const QRgb pixel = line[columns.index[c]];
+			for (int k = 0; k < 4; ++k)
+				row[k] += static_cast<float>(pixel >> (8 * k) & 0xff) * columns.weight[c];
+		}
+		for (int k = 0; k < 4; ++k)
+			sum[k] += row[k] * rowTaps.weight[r];
+	}
+	const float alpha = qBound(0.0f, sum[3], 255.0f);
+	QRgb result = 0;
+	for (int k = 0; k < 4; ++k)
+		result |= static_cast<QRgb>(std::lrint(qBound(0.0f, sum[k], alpha))) << (8 * k);
+	return result;
+#endif
+}
+
+void FastCubicResampler::resample(const QImage &srcImage, QImage &dstImage)
+{
+	const int width = dstImage.width();
+	const int height = dstImage.height();
+	const QImage source = srcImage.format() == QImage::Format_ARGB32_Premultiplied ? srcImage : srcImage.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+	if (source.isNull() || width <= 0 || height <= 0)
+		return;
+	if (dstImage.format() != QImage::Format_ARGB32_Premultiplied)
+		dstImage = QImage(width, height, QImage::Format_ARGB32_Premultiplied);
+
+	const QVector<Taps> columns = taps(source.width(), width);
+	const QVector<Taps> rowTaps = taps(source.height(), height);
+
+	QVector<Rows> chunks;
+	for (int begin = 0; begin < height; begin += mChunkRows)
+	{
+		const Rows rows = { begin, qMin(begin + mChunkRows, height) };
+		chunks.append(rows);
+	}
+
+	// bits() detaches, so it is called once before the workers start
+	uchar *destination = dstImage.bits();
+	const int destinationStride = dstImage.bytesPerLine();
+	QtConcurrent::blockingMap(chunks, [&](const Rows &rows)
+	{
+		for (int i = rows.begin; i < rows.end; ++i)
+		{
+			const Taps &rowTap = rowTaps[i];
+			const QRgb *lines[4];
+			for (int r = 0; r < 4; ++r)
+				lines[r] = reinterpret_cast<const QRgb *>(source.constScanLine(rowTap.index[r]));
+			QRgb *out = reinterpret_cast<QRgb *>(destination + i * destinationStride);
+			for (int j = 0; j < width; ++j)
+				out[j] = interpolate(lines, columns[j], rowTap);
+		}
+	});
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "qgsrasterresampler.h"
+
+// Bicubic (Catmull-Rom) resampler for QgsRasterResampleFilter. The stock
+// one fits Bezier patches through derivative matrices of each colour
+// channel, pixel by pixel in double precision. Here the weights of every
+// destination column and row are computed once, the four channels of a
+// pixel share one SSE2 register, and rows are split over the global thread
+// pool. Colours are clamped to the alpha, so the result stays a valid
+// premultiplied image. The type name is the stock one.
+class FastCubicResampler : public QgsRasterResampler
+{
+public:
+	FastCubicResampler();
+
+	void resample(const QImage &srcImage, QImage &dstImage) override;
+	QString type() const override { return QStringLiteral("cubic"); }
+	FastCubicResampler *clone() const override;
+
+	// Rows per work item.
+	void setChunkRows(int rows) { mChunkRows = qMax(1, rows); }
+
+	// Source pixels and weights of one destination pixel along one axis.
+	struct Taps
+	{
+		int index[4];
+		float weight[4];
+	};
+
+	// Weighted sum of a 4 x 4 neighbourhood; rows holds the four source
+	// rows, columns the taps across them.
+	static QRgb interpolate(const QRgb *const *rows, const Taps &columns, const Taps &rowTaps);
+
+private:
+	int mChunkRows;
+};
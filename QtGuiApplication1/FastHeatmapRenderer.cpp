@@ -0,0 +1,563 @@
+#include "FastHeatmapRenderer.h"
+#include "FloatLanes.h"
+#include "QCache"
+#include "QImage"
+#include "QMutex"
+#include "QMutexLocker"
+#include "QPainter"
+#include "QtConcurrentMap"
+#include "qgscolorramp.h"
+#include "qgscsexception.h"
+#include "qgspainteffect.h"
+#include "qgsrendercontext.h"
+#include "qgssymbollayerutils.h"
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+	// cells per side of a cached tile
+	const int TileSize = 256;
+	// colours in the table of the ramp
+	const int RampSize = 4096;
+	// cells further from the origin do not fit an int
+	const double CellLimit = 1e9;
+
+	struct Rows
+	{
+		int begin;
+		int end;
+	};
+
+	// rows of one cached tile
+	struct TileRows
+	{
+		int tile;
+		int begin;
+		int end;
+	};
+
+	struct TileStore
+	{
+		TileStore() : tiles(128 * 1024 * 1024) {}
+
+		QMutex mutex;
+		// cost is bytes
+		QCache<QString, QVector<float> > tiles;
+	};
+
+	TileStore &tileStore()
+	{
+		static TileStore store;
+		return store;
+	}
+
+	QVector<Rows> rowChunks(int height, int chunkRows)
+	{
+		QVector<Rows> chunks;
+		for (int begin = 0; begin < height; begin += chunkRows)
+		{
+			const Rows rows = { begin, qMin(begin + chunkRows, height) };
+			chunks.append(rows);
+		}
+		return chunks;
+	}
+
+	int floorDiv(int a, int b)
+	{
+		return a >= 0 ? a / b : -((-a + b - 1) / b);
+	}
+
+	QString tileKey(const QString &gridKey, int x, int y)
+	{
+		return gridKey + '|' + QString::number(x) + '|' + QString::number(y);
+	}
+
+	// out += weight * stamp
+	template <class L>
+	int addSpan(float *out, const float *stamp, float weight, int i, int count)
+	{
+		const typename L::V w = L::set(weight);
+		for (; i + L::Width <= count; i += L::Width)
+			L::store(out + i, L::add(L::load(out + i), L::mul(w, L::load(stamp + i))));
+		return i;
+	}
+
+	void addRow(float *out, const float *stamp, float weight, int count)
+	{
+		int i = 0;
+#ifdef FLOATLANES_AVX
+		if (FloatLanes::avx())
+		{
+			i = addSpan<AvxLanes>(out, stamp, weight, i, count);
+			AvxLanes::leave();
+		}
+#endif
+#ifdef FLOATLANES_SSE
+		i = addSpan<SseLanes>(out, stamp, weight, i, count);
+#endif
+		addSpan<ScalarLanes>(out, stamp, weight, i, count);
+	}
+}
+
+FastHeatmapRenderer::FastHeatmapRenderer()
+	: mGridCached(false)
+	, mChunkRows(32)
+	, mWidth(0)
+	, mHeight(0)
+	, mRadiusPixels(0)
+	, mWeightAttrNum(-1)
+	, mUseGrid(false)
+	, mCellSize(0)
+	, mGridX(0)
+	, mGridY(0)
+	, mTileX0(0)
+	, mTileY0(0)
+	, mTilesX(0)
+	, mTilesY(0)
+	, mRequestCovered(false)
+{
+}
+
+FastHeatmapRenderer *FastHeatmapRenderer::clone() const
+{
+	FastHeatmapRenderer *newRenderer = new FastHeatmapRenderer();
+	if (colorRamp())
+		newRenderer->setColorRamp(colorRamp()->clone());
+	newRenderer->setRadius(radius());
+	newRenderer->setRadiusUnit(radiusUnit());
+	newRenderer->setRadiusMapUnitScale(radiusMapUnitScale());
+	newRenderer->setMaximumValue(maximumValue());
+	newRenderer->setRenderQuality(static_cast<int>(renderQuality()));
+	newRenderer->setWeightExpression(weightExpression());
+	newRenderer->setGridCached(mGridCached);
+	newRenderer->setChunkRows(mChunkRows);
+	copyRendererData(newRenderer);
+	return newRenderer;
+}
+
+FastHeatmapRenderer *FastHeatmapRenderer::convertFromRenderer(const QgsFeatureRenderer *renderer)
+{
+	if (const FastHeatmapRenderer *fast = dynamic_cast<const FastHeatmapRenderer *>(renderer))
+		return fast->clone();
+	const QgsHeatmapRenderer *heatmap = dynamic_cast<const QgsHeatmapRenderer *>(renderer);
+	if (!heatmap)
+		return nullptr;
+
+	FastHeatmapRenderer *newRenderer = new FastHeatmapRenderer();
+	if (heatmap->colorRamp())
+		newRenderer->setColorRamp(heatmap->colorRamp()->clone());
+	newRenderer->setRadius(heatmap->radius());
+	newRenderer->setRadiusUnit(heatmap->radiusUnit());
+	newRenderer->setRadiusMapUnitScale(heatmap->radiusMapUnitScale());
+	newRenderer->setMaximumValue(heatmap->maximumValue());
+	newRenderer->setRenderQuality(static_cast<int>(heatmap->renderQuality()));
+	newRenderer->setWeightExpression(heatmap->weightExpression());
+	newRenderer->setOrderBy(heatmap->orderBy());
+	newRenderer->setOrderByEnabled(heatmap->orderByEnabled());
+	if (heatmap->paintEffect())
+		newRenderer->setPaintEffect(heatmap->paintEffect()->clone());
+	return newRenderer;
+}
+
+void FastHeatmapRenderer::startRender(QgsRenderContext &context, const QgsFields &fields)
+{
+	// not QgsHeatmapRenderer::startRender(), which allocates its own buffer
+	QgsFeatureRenderer::startRender(context, fields);
+	mPoints.clear();
+	mTiles.clear();
+	mMissing.clear();
+	mUseGrid = false;
+	mRequestCovered = false;
+	if (!context.painter())
+		return;
+
+	// as the stock renderer
+	mWeightAttrNum = fields.lookupField(weightExpression());
+	if (mWeightAttrNum == -1)
+	{
+		mWeightExpression.reset(new QgsExpression(weightExpression()));
+		mWeightExpression->prepare(&context.expressionContext());
+	}
+
+	const int quality = qMax(1, static_cast<int>(renderQuality()));
+	mWidth = context.painter()->device()->width() / quality;
+	mHeight = context.painter()->device()->height() / quality;
+	mRadiusPixels = qMax(0, qRound(QgsSymbolLayerUtils::convertToPainterUnits(context, radius(), radiusUnit(), radiusMapUnitScale()) / quality));
+
+	// the quartic kernel at whole cell offsets, zero outside the radius
+	const int side = 2 * mRadiusPixels;
+	const double radiusSquared = static_cast<double>(mRadiusPixels) * mRadiusPixels;
+	mStamp.resize(side * side);
+	for (int dy = -mRadiusPixels; dy < mRadiusPixels; ++dy)
+	{
+		for (int dx = -mRadiusPixels; dx < mRadiusPixels; ++dx)
+		{
+			const double distanceSquared = static_cast<double>(dx) * dx + static_cast<double>(dy) * dy;
+			const double t = 1.0 - distanceSquared / radiusSquared;
+			mStamp[(dy + mRadiusPixels) * side + dx + mRadiusPixels] = distanceSquared > radiusSquared ? 0.0f : static_cast<float>(t * t);
+		}
+	}
+
+	const QgsMapToPixel &mapToPixel = context.mapToPixel();
+	const QString layerId = context.expressionContext().variable(QStringLiteral("layer_id")).toString();
+	if (!mGridCached || layerId.isEmpty() || mRadiusPixels <= 0 || mWidth <= 0 || mHeight <= 0 || !qgsDoubleNear(mapToPixel.mapRotation(), 0.0))
+		return;
+	const double cellSize = quality * mapToPixel.mapUnitsPerPixel();
+	const QgsPoint topLeft = mapToPixel.toMapCoordinatesF(0, 0);
+	const double gridX = topLeft.x() / cellSize + 0.5;
+	const double gridY = 0.5 - topLeft.y() / cellSize;
+	if (!(cellSize > 0) || std::fabs(gridX) > CellLimit || std::fabs(gridY) > CellLimit)
+		return;
+
+	mUseGrid = true;
+	mCellSize = cellSize;
+	mGridX = static_cast<int>(std::floor(gridX));
+	mGridY = static_cast<int>(std::floor(gridY));
+	const QgsCoordinateTransform xform = context.coordinateTransform();
+	mGridKey = layerId + '|' + (xform.isValid() ? xform.destinationCrs().authid() : QString()) + '|' + QString::number(cellSize, 'g', 17)
+		+ '|' + QString::number(mRadiusPixels) + '|' + weightExpression();
+
+	mTileX0 = floorDiv(mGridX, TileSize);
+	mTileY0 = floorDiv(mGridY, TileSize);
+	mTilesX = floorDiv(mGridX + mWidth - 1, TileSize) - mTileX0 + 1;
+	mTilesY = floorDiv(mGridY + mHeight - 1, TileSize) - mTileY0 + 1;
+	mTiles.resize(mTilesX * mTilesY);
+	TileStore &store = tileStore();
+	QMutexLocker locker(&store.mutex);
+	for (int t = 0; t < mTiles.size(); ++t)
+	{
+		if (const QVector<float> *cached = store.tiles.object(tileKey(mGridKey, mTileX0 + t % mTilesX, mTileY0 + t / mTilesX)))
+			mTiles[t] = *cached;
+		else
+			mMissing.append(t);
+	}
+}
+
+void FastHeatmapRenderer::modifyRequestExtent(QgsRectangle &extent, QgsRenderContext &context)
+{
+	if (!mUseGrid)
+	{
+		QgsHeatmapRenderer::modifyRequestExtent(extent, context);
+		return;
+	}
+	if (mMissing.isEmpty())
+	{
+		// every tile is known; whatever is found here is ignored
+		extent = QgsRectangle(extent.xMinimum(), extent.yMinimum(), extent.xMinimum() + extent.width() * 1e-9, extent.yMinimum() + extent.height() * 1e-9);
+		return;
+	}
+
+	// the missing tiles and the points within a radius of them, plus a
+	// cell for rounding
+	int minX = mTilesX, maxX = -1, minY = mTilesY, maxY = -1;
+	for (int t : mMissing)
+	{
+		minX = qMin(minX, t % mTilesX);
+		maxX = qMax(maxX, t % mTilesX);
+		minY = qMin(minY, t / mTilesX);
+		maxY = qMax(maxY, t / mTilesX);
+	}
+	const int reach = mRadiusPixels + 1;
+	QgsRectangle request(((mTileX0 + minX) * static_cast<double>(TileSize) - reach) * mCellSize,
+		-((mTileY0 + maxY + 1) * static_cast<double>(TileSize) + reach) * mCellSize,
+		((mTileX0 + maxX + 1) * static_cast<double>(TileSize) + reach) * mCellSize,
+		-((mTileY0 + minY) * static_cast<double>(TileSize) - reach) * mCellSize);
+	const QgsCoordinateTransform xform = context.coordinateTransform();
+	if (xform.isValid())
+	{
+		try
+		{
+			request = xform.transformBoundingBox(request, QgsCoordinateTransform::ReverseTransform);
+		}
+		catch (QgsCsException &)
+		{
+			// render this one without the grid
+			mUseGrid = false;
+			mTiles.clear();
+			mMissing.clear();
+			QgsHeatmapRenderer::modifyRequestExtent(extent, context);
+			return;
+		}
+	}
+	extent = request;
+	mRequestCovered = true;
+}
+
+bool FastHeatmapRenderer::renderFeature(QgsFeature &feature, QgsRenderContext &context, int layer, bool selected, bool drawVertexMarker)
+{
+	Q_UNUSED(layer);
+	Q_UNUSED(selected);
+	Q_UNUSED(drawVertexMarker);
+
+	if (!context.painter())
+		return false;
+	if (!feature.hasGeometry() || feature.geometry().type() != QgsWkbTypes::PointGeometry)
+		return false;
+	if (mUseGrid && mMissing.isEmpty())
+		return true;
+
+	// as the stock renderer
+	double weight = 1.0;
+	if (!weightExpression().isEmpty())
+	{
+		QVariant value;
+		if (mWeightAttrNum == -1)
+		{
+			Q_ASSERT(mWeightExpression.data());
+			value = mWeightExpression->evaluate(&context.expressionContext());
+		}
+		else
+		{
+			QgsAttributes attrs = feature.attributes();
+			value = attrs.value(mWeightAttrNum);
+		}
+		bool ok = false;
+		double evalWeight = value.toDouble(&ok);
+		if (ok)
+			weight = evalWeight;
+	}
+
+	QgsGeometry geom = feature.geometry();
+	const QgsCoordinateTransform xform = context.coordinateTransform();
+	if (xform.isValid())
+		geom.transform(xform);
+	QgsMultiPoint multiPoint;
+	if (!geom.isMultipart())
+		multiPoint.append(geom.asPoint());
+	else
+		multiPoint = geom.asMultiPoint();
+
+	const int quality = qMax(1, static_cast<int>(renderQuality()));
+	for (const QgsPoint &point : multiPoint)
+	{
+		double x, y;
+		if (mUseGrid)
+		{
+			x = std::floor(point.x() / mCellSize);
+			y = std::floor(-point.y() / mCellSize);
+		}
+		else
+		{
+			const QgsPoint pixel = context.mapToPixel().transform(point);
+			x = pixel.x() / quality;
+			y = pixel.y() / quality;
+		}
+		if (!(std::fabs(x) < CellLimit) || !(std::fabs(y) < CellLimit))
+			continue;
+		const Point p = { static_cast<int>(x), static_cast<int>(y), static_cast<float>(weight) };
+		mPoints.append(p);
+	}
+	return true;
+}
+
+void FastHeatmapRenderer::stopRender(QgsRenderContext &context)
+{
+	QgsFeatureRenderer::stopRender(context);
+	if (context.painter() && colorRamp() && !context.renderingStopped() && mWidth > 0 && mHeight > 0)
+	{
+		const int radius = mRadiusPixels;
+		QVector<float> values(mWidth * mHeight, 0.0f);
+		if (!mUseGrid)
+		{
+			// points by the bands of rows they reach
+			const QVector<Rows> chunks = rowChunks(mHeight, mChunkRows);
+			QVector<QVector<int> > bins(chunks.size());
+			for (int k = 0; k < mPoints.size(); ++k)
+			{
+				const Point &p = mPoints[k];
+				const int y0 = qMax(p.y - radius, 0);
+				const int y1 = qMin(p.y + radius, mHeight);
+				if (y0 >= y1 || p.x + radius <= 0 || p.x - radius >= mWidth)
+					continue;
+				for (int b = y0 / mChunkRows; b <= (y1 - 1) / mChunkRows; ++b)
+					bins[b].append(k);
+			}
+
+			float *data = values.data();
+			QVector<int> bands(chunks.size());
+			for (int b = 0; b < bands.size(); ++b)
+				bands[b] = b;
+			QtConcurrent::blockingMap(bands, [&](int b)
+			{
+				const Rows &rows = chunks[b];
+				accumulate(data + static_cast<qgssize>(rows.begin) * mWidth, mWidth, 0, rows.begin, rows.end - rows.begin, bins.at(b));
+			});
+		}
+		else
+		{
+			if (!mMissing.isEmpty())
+			{
+				// points by the missing tiles they reach
+				QVector<QVector<int> > bins(mTiles.size());
+				QVector<char> missing(mTiles.size(), 0);
+				for (int t : mMissing)
+					missing[t] = 1;
+				for (int k = 0; k < mPoints.size(); ++k)
+				{
+					const Point &p = mPoints[k];
+					const int tx0 = qMax(floorDiv(p.x - radius, TileSize) - mTileX0, 0);
+					const int tx1 = qMin(floorDiv(p.x + radius - 1, TileSize) - mTileX0, mTilesX - 1);
+					const int ty0 = qMax(floorDiv(p.y - radius, TileSize) - mTileY0, 0);
+					const int ty1 = qMin(floorDiv(p.y + radius - 1, TileSize) - mTileY0, mTilesY - 1);
+					for (int ty = ty0; ty <= ty1; ++ty)
+					{
+						for (int tx = tx0; tx <= tx1; ++tx)
+						{
+							if (missing[ty * mTilesX + tx])
+								bins[ty * mTilesX + tx].append(k);
+						}
+					}
+				}
+
+				QVector<float *> tileData(mTiles.size(), nullptr);
+				QVector<TileRows> work;
+				for (int t : mMissing)
+				{
+					mTiles[t] = QVector<float>(TileSize * TileSize, 0.0f);
+					tileData[t] = mTiles[t].data();
+					for (int begin = 0; begin < TileSize; begin += mChunkRows)
+					{
+						const TileRows rows = { t, begin, qMin(begin + mChunkRows, TileSize) };
+						work.append(rows);
+					}
+				}
+				QtConcurrent::blockingMap(work, [&](const TileRows &rows)
+				{
+					const int originX = (mTileX0 + rows.tile % mTilesX) * TileSize;
+					const int originY = (mTileY0 + rows.tile / mTilesX) * TileSize + rows.begin;
+					accumulate(tileData.at(rows.tile) + rows.begin * TileSize, TileSize, originX, originY, rows.end - rows.begin, bins.at(rows.tile));
+				});
+
+				// tiles of an interrupted render or of a request that was not
+				// widened may lack points
+				if (mRequestCovered && !context.renderingStopped())
+				{
+					TileStore &store = tileStore();
+					QMutexLocker locker(&store.mutex);
+					for (int t : mMissing)
+						store.tiles.insert(tileKey(mGridKey, mTileX0 + t % mTilesX, mTileY0 + t / mTilesX), new QVector<float>(mTiles[t]), TileSize * TileSize * sizeof(float));
+				}
+			}
+
+			// the image's cells from the tiles
+			float *data = values.data();
+			QtConcurrent::blockingMap(rowChunks(mHeight, mChunkRows), [&](const Rows &rows)
+			{
+				for (int i = rows.begin; i < rows.end; ++i)
+				{
+					const int gy = mGridY + i;
+					const int ty = floorDiv(gy, TileSize);
+					const int r = gy - ty * TileSize;
+					float *out = data + static_cast<qgssize>(i) * mWidth;
+					for (int j = 0; j < mWidth;)
+					{
+						const int gx = mGridX + j;
+						const int tx = floorDiv(gx, TileSize);
+						const int c = gx - tx * TileSize;
+						const int n = qMin(TileSize - c, mWidth - j);
+						const QVector<float> &tile = mTiles.at((ty - mTileY0) * mTilesX + tx - mTileX0);
+						std::memcpy(out + j, tile.constData() + r * TileSize + c, n * sizeof(float));
+						j += n;
+					}
+				}
+			});
+		}
+		if (!context.renderingStopped())
+			renderImage(context, values);
+	}
+	mWeightExpression.reset();
+	mPoints.clear();
+	mTiles.clear();
+	mMissing.clear();
+}
+
+void FastHeatmapRenderer::accumulate(float *values, int width, int originX, int originY, int rows, const QVector<int> &points) const
+{
+	const int radius = mRadiusPixels;
+	const int side = 2 * radius;
+	const float *stamp = mStamp.constData();
+	for (int k : points)
+	{
+		// the stock footprint, [x - radius, x + radius) clipped to the cells
+		const Point &p = mPoints[k];
+		const int x0 = qMax(p.x - radius, originX);
+		const int x1 = qMin(p.x + radius, originX + width);
+		const int y0 = qMax(p.y - radius, originY);
+		const int y1 = qMin(p.y + radius, originY + rows);
+		if (x0 >= x1 || y0 >= y1)
+			continue;
+		for (int y = y0; y < y1; ++y)
+			addRow(values + static_cast<qgssize>(y - originY) * width + (x0 - originX), stamp + (y - p.y + radius) * side + (x0 - p.x + radius), p.weight, x1 - x0);
+	}
+}
+
+void FastHeatmapRenderer::renderImage(QgsRenderContext &context, const QVector<float> &values)
+{
+	const QVector<Rows> chunks = rowChunks(mHeight, mChunkRows);
+	const float *data = values.constData();
+
+	double scaleMax = maximumValue();
+	if (!(scaleMax > 0))
+	{
+		QVector<float> maxima(chunks.size(), 0.0f);
+		QVector<int> bands(chunks.size());
+		for (int b = 0; b < bands.size(); ++b)
+			bands[b] = b;
+		QtConcurrent::blockingMap(bands, [&](int b)
+		{
+			float high = 0.0f;
+			const float *end = data + static_cast<qgssize>(chunks[b].end) * mWidth;
+			for (const float *v = data + static_cast<qgssize>(chunks[b].begin) * mWidth; v < end; ++v)
+				high = qMax(high, *v);
+			maxima[b] = high;
+		});
+		scaleMax = 0;
+		for (float high : maxima)
+			scaleMax = qMax(scaleMax, static_cast<double>(high));
+	}
+
+	// the ramp at RampSize evenly spaced values in [0, 1]
+	QVector<QRgb> table(RampSize);
+	for (int k = 0; k < RampSize; ++k)
+		table[k] = colorRamp()->color(static_cast<double>(k) / (RampSize - 1)).rgba();
+	const QRgb *colors = table.constData();
+	const float scale = scaleMax > 0 ? static_cast<float>((RampSize - 1) / scaleMax) : 0.0f;
+
+	QImage image(mWidth, mHeight, QImage::Format_ARGB32);
+	if (image.isNull())
+		return;
+	uchar *bits = image.bits();
+	const int bytesPerLine = image.bytesPerLine();
+	QtConcurrent::blockingMap(chunks, [&](const Rows &rows)
+	{
+		for (int i = rows.begin; i < rows.end; ++i)
+		{
+			const float *line = data + static_cast<qgssize>(i) * mWidth;
+			QRgb *out = reinterpret_cast<QRgb *>(bits + static_cast<qgssize>(i) * bytesPerLine);
+			for (int j = 0; j < mWidth; ++j)
+			{
+				const float v = line[j];
+				out[j] = colors[v > 0 ? qMin(static_cast<int>(v * scale + 0.5f), RampSize - 1) : 0];
+			}
+		}
+	});
+
+	// as the stock renderer
+	if (renderQuality() > 1)
+	{
+		QImage resized = image.scaled(context.painter()->device()->width(), context.painter()->device()->height());
+		context.painter()->drawImage(0, 0, resized);
+	}
+	else
+	{
+		context.painter()->drawImage(0, 0, image);
+	}
+}
+
+void FastHeatmapRenderer::clearCache()
+{
+	TileStore &store = tileStore();
+	QMutexLocker locker(&store.mutex);
+	store.tiles.clear();
+}
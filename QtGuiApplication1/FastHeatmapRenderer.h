@@ -0,0 +1,88 @@
+#pragma once
+
+#include "QScopedPointer"
+#include "QVector"
+#include "qgsexpression.h"
+#include "qgsheatmaprenderer.h"
+
+// QgsHeatmapRenderer that only collects the points while features are
+// rendered. stopRender() stamps a table of the quartic kernel, computed
+// once per render, over bands of rows on the global thread pool, adding
+// whole rows of it with FloatLanes, and colours the values through a
+// lookup table of the ramp.
+//
+// With a cached grid the values live on cells anchored to map units, one
+// render quality step wide, in tiles of 256 x 256 cells kept in a process
+// wide cache per layer and scale. Panning at the same scale then only
+// computes the tiles that come into view, and no features are requested
+// when every tile is known. The image snaps to the cells, so it may be
+// offset by less than one cell. Cached tiles do not notice edits; call
+// clearCache() when the data changes.
+//
+// The renderer is saved with the stock type.
+class FastHeatmapRenderer : public QgsHeatmapRenderer
+{
+public:
+	FastHeatmapRenderer();
+
+	FastHeatmapRenderer *clone() const override;
+
+	void startRender(QgsRenderContext &context, const QgsFields &fields) override;
+	bool renderFeature(QgsFeature &feature, QgsRenderContext &context, int layer = -1, bool selected = false, bool drawVertexMarker = false) override;
+	void stopRender(QgsRenderContext &context) override;
+	void modifyRequestExtent(QgsRectangle &extent, QgsRenderContext &context) override;
+
+	bool gridCached() const { return mGridCached; }
+	void setGridCached(bool cached) { mGridCached = cached; }
+
+	// Rows per work item.
+	void setChunkRows(int rows) { mChunkRows = qMax(1, rows); }
+
+	static void clearCache();
+
+	// A FastHeatmapRenderer with the settings of a stock heatmap renderer,
+	// or nullptr for other renderers.
+	static FastHeatmapRenderer *convertFromRenderer(const QgsFeatureRenderer *renderer);
+
+private:
+	// by cell; weights are floats like the values
+	struct Point
+	{
+		int x;
+		int y;
+		float weight;
+	};
+
+	void accumulate(float *values, int width, int originX, int originY, int rows, const QVector<int> &points) const;
+	void renderImage(QgsRenderContext &context, const QVector<float> &values);
+
+	bool mGridCached;
+	int mChunkRows;
+
+	// state of the current render, in cells of renderQuality() pixels
+	int mWidth;
+	int mHeight;
+	int mRadiusPixels;
+	// (2 radius)^2 kernel values for offsets -radius to radius - 1
+	QVector<float> mStamp;
+	QVector<Point> mPoints;
+	int mWeightAttrNum;
+	QScopedPointer<QgsExpression> mWeightExpression;
+
+	// grid of the current render, when cached; rows count down from the
+	// map's y origin. The image's top left cell is mGridX, mGridY.
+	bool mUseGrid;
+	double mCellSize;
+	QString mGridKey;
+	int mGridX;
+	int mGridY;
+	int mTileX0;
+	int mTileY0;
+	int mTilesX;
+	int mTilesY;
+	// values of the visible tiles, rows first; empty ones are missing
+	QVector<QVector<float> > mTiles;
+	QVector<int> mMissing;
+	// set when the request was widened to the missing tiles
+	bool mRequestCovered;
+};
@@ -0,0 +1,281 @@
+#include "FastHillshadeRenderer.h"
+#include "FloatLanes.h"
+#include "QDomDocument"
+#include "QDomElement"
+#include "QtConcurrentMap"
+#include "qgsrasterblock.h"
+#include "qgsrastertransparency.h"
+#include "qmath.h"
+#include <cstring>
+#include <limits>
+
+namespace
+{
+	struct Rows
+	{
+		int begin;
+		int end;
+	};
+
+	// Shades pixels from begin while a full vector fits; returns the first
+	// pixel left over.
+	template <typename L>
+	int shadeSpan(const float *above, const float *row, const float *below, float *gray, int begin, int width,
+		const FastHillshadeRenderer::Shading &s)
+	{
+		typedef typename L::V V;
+		const V zero = L::set(0);
+		const V one = L::set(1);
+		const V two = L::set(2);
+		const V full = L::set(255);
+		const V z = L::set(s.zFactor);
+
+		int i = begin;
+		for (; i + L::Width <= width; i += L::Width)
+		{
+			// neighbours without data take the value of the centre cell
+			const V c = L::load(row + i + 1);
+			auto cell = [&c](const float *p)
+			{
+				const V v = L::load(p);
+				return L::select(L::isNumber(v), v, c);
+			};
+			const V x11 = cell(above + i), x12 = cell(above + i + 1), x13 = cell(above + i + 2);
+			const V x21 = cell(row + i), x23 = cell(row + i + 2);
+			const V x31 = cell(below + i), x32 = cell(below + i + 1), x33 = cell(below + i + 2);
+
+			// Horn's gradient; cells named row then column, as in the stock renderer
+			const V dx = L::mul(L::sub(L::add(L::add(x13, x33), L::mul(two, x23)), L::add(L::add(x11, x31), L::mul(two, x21))), L::set(s.scaleX));
+			const V dy = L::mul(L::sub(L::add(L::add(x31, x33), L::mul(two, x32)), L::add(L::add(x11, x13), L::mul(two, x12))), L::set(s.scaleY));
+			const V g2 = L::add(L::mul(dx, dx), L::mul(dy, dy));
+			const V cosSlope = L::div(one, L::sqrt(L::add(one, L::mul(L::mul(z, z), g2))));
+
+			V shade;
+			if (!s.multiDirectional)
+			{
+				// sin(slope) cos(azimuth - aspect) = z cos(slope) (dx sin(azimuth) - dy cos(azimuth))
+				const V toward = L::sub(L::mul(dx, L::set(s.sinAzimuth)), L::mul(dy, L::set(s.cosAzimuth)));
+				shade = L::mul(full, L::mul(cosSlope, L::add(L::set(s.cosZenith), L::mul(L::mul(L::set(s.sinZenith), z), toward))));
+			}
+			else
+			{
+				// sine and cosine of the aspect atan2(dx, -dy); flat cells have aspect 0
+				const V g = L::sqrt(g2);
+				const V sloped = L::greater(g, zero);
+				const V sinAspect = L::select(sloped, L::div(dx, g), zero);
+				const V cosAspect = L::select(sloped, L::div(L::sub(zero, dy), g), one);
+				const V flatPart = L::mul(L::set(s.cosZenith), cosSlope);
+				const V slopePart = L::mul(L::mul(L::set(s.sinZenith), L::mul(z, g)), cosSlope);
+				V sum = zero;
+				for (int k = 0; k < 4; ++k)
+				{
+					const V cosAngle = L::set(s.cosAngle[k]);
+					const V sinAngle = L::set(s.sinAngle[k]);
+					V weight = L::sub(L::mul(sinAspect, cosAngle), L::mul(cosAspect, sinAngle));
+					weight = L::mul(weight, weight);
+					const V color = L::add(flatPart, L::mul(slopePart, L::add(L::mul(cosAngle, cosAspect), L::mul(sinAngle, sinAspect))));
+					sum = L::add(sum, L::mul(weight, color));
+				}
+				shade = L::mul(L::set(127.5f), sum);
+			}
+			shade = L::min(L::max(shade, zero), full);
+			L::store(gray + i, L::select(L::isNumber(c), shade, c));
+		}
+		return i;
+	}
+}
+
+FastHillshadeRenderer::FastHillshadeRenderer(QgsRasterInterface *input, int band, double lightAzimuth, double lightAltitude)
+	: QgsRasterRenderer(input, "hillshade")
+	, mBand(band)
+	, mZFactor(1)
+	, mLightAngle(lightAltitude)
+	, mLightAzimuth(lightAzimuth)
+	, mMultiDirectional(false)
+	, mChunkRows(32)
+{
+}
+
+FastHillshadeRenderer *FastHillshadeRenderer::clone() const
+{
+	FastHillshadeRenderer *r = new FastHillshadeRenderer(nullptr, mBand, mLightAzimuth, mLightAngle);
+	r->copyCommonProperties(this);
+	r->setZFactor(mZFactor);
+	r->setMultiDirectional(mMultiDirectional);
+	r->setChunkRows(mChunkRows);
+	return r;
+}
+
+void FastHillshadeRenderer::writeXml(QDomDocument &doc, QDomElement &parentElem) const
+{
+	if (parentElem.isNull())
+		return;
+
+	// same element as QgsHillshadeRenderer::writeXml
+	QDomElement rasterRendererElem = doc.createElement("rasterrenderer");
+	_writeXml(doc, rasterRendererElem);
+	rasterRendererElem.setAttribute("band", mBand);
+	rasterRendererElem.setAttribute("azimuth", QString::number(mLightAzimuth));
+	rasterRendererElem.setAttribute("angle", QString::number(mLightAngle));
+	rasterRendererElem.setAttribute("zfactor", QString::number(mZFactor));
+	rasterRendererElem.setAttribute("multidirection", QString::number(mMultiDirectional));
+	parentElem.appendChild(rasterRendererElem);
+}
+
+QgsRasterBlock *FastHillshadeRenderer::block(int bandNo, const QgsRectangle &extent, int width, int height, QgsRasterBlockFeedback *feedback)
+{
+	Q_UNUSED(bandNo);
+	QgsRasterBlock *outputBlock = new QgsRasterBlock();
+	if (!mInput)
+		return outputBlock;
+
+	QgsRasterBlock *inputBlock = mInput->block(mBand, extent, width, height, feedback);
+	if (!inputBlock || inputBlock->isEmpty() || !inputBlock->convert(Qgis::Float32))
+	{
+		delete inputBlock;
+		return outputBlock;
+	}
+
+	QgsRasterBlock *alphaBlock = nullptr;
+	if (mAlphaBand > 0 && mBand != mAlphaBand)
+	{
+		alphaBlock = mInput->block(mAlphaBand, extent, width, height, feedback);
+		if (!alphaBlock || alphaBlock->isEmpty())
+		{
+			delete inputBlock;
+			delete alphaBlock;
+			return outputBlock;
+		}
+	}
+	else if (mAlphaBand > 0)
+	{
+		alphaBlock = inputBlock;
+	}
+
+	if (!outputBlock->reset(Qgis::ARGB32_Premultiplied, width, height))
+	{
+		delete inputBlock;
+		if (alphaBlock != inputBlock)
+			delete alphaBlock;
+		return outputBlock;
+	}
+
+	// elevations with a border of repeated edge cells, NaN for nodata
+	const int stride = width + 2;
+	QVector<float> elevation(stride * (height + 2));
+	const float nan = std::numeric_limits<float>::quiet_NaN();
+	const bool hasNoData = inputBlock->hasNoData();
+	for (int i = 0; i < height; ++i)
+	{
+		float *line = elevation.data() + (i + 1) * stride;
+		std::memcpy(line + 1, inputBlock->bits(i, 0), width * sizeof(float));
+		if (hasNoData)
+		{
+			for (int j = 0; j < width; ++j)
+			{
+				if (inputBlock->isNoData(i, j))
+					line[j + 1] = nan;
+			}
+		}
+		line[0] = line[1];
+		line[width + 1] = line[width];
+	}
+	std::memcpy(elevation.data(), elevation.constData() + stride, stride * sizeof(float));
+	std::memcpy(elevation.data() + (height + 1) * stride, elevation.constData() + height * stride, stride * sizeof(float));
+
+	Shading shading;
+	shading.scaleX = static_cast<float>(1.0 / (8 * (extent.width() / width)));
+	shading.scaleY = static_cast<float>(1.0 / (8 * -(extent.height() / height)));
+	shading.zFactor = static_cast<float>(mZFactor);
+	const double zenith = qMax(0.0, 90 - mLightAngle) * M_PI / 180.0;
+	const double azimuth = -1 * mLightAzimuth * M_PI / 180.0;
+	shading.cosZenith = static_cast<float>(std::cos(zenith));
+	shading.sinZenith = static_cast<float>(std::sin(zenith));
+	shading.sinAzimuth = static_cast<float>(std::sin(azimuth));
+	shading.cosAzimuth = static_cast<float>(std::cos(azimuth));
+	shading.multiDirectional = mMultiDirectional;
+	// http://pubs.usgs.gov/of/1992/of92-422/of92-422.pdf
+	const double angles[4] = { -mLightAzimuth - 45 - 45 * 0.5, -mLightAzimuth - 45 * 0.5, -mLightAzimuth + 45 * 0.5, -mLightAzimuth + 45 + 45 * 0.5 };
+	for (int k = 0; k < 4; ++k)
+	{
+		shading.cosAngle[k] = static_cast<float>(std::cos(angles[k] * M_PI / 180.0));
+		shading.sinAngle[k] = static_cast<float>(std::sin(angles[k] * M_PI / 180.0));
+	}
+
+	QVector<Rows> chunks;
+	for (int begin = 0; begin < height; begin += mChunkRows)
+	{
+		const Rows rows = { begin, qMin(begin + mChunkRows, height) };
+		chunks.append(rows);
+	}
+
+	// bits() detaches, so it is called once before the workers start
+	QRgb *output = reinterpret_cast<QRgb *>(outputBlock->bits());
+	QtConcurrent::blockingMap(chunks, [&](const Rows &rows)
+	{
+		QVector<float> gray(width);
+		for (int i = rows.begin; i < rows.end; ++i)
+		{
+			const float *line = elevation.constData() + (i + 1) * stride;
+			shadeRow(line - stride, line, line + stride, gray.data(), width, shading);
+
+			QRgb *colors = output + i * width;
+			for (int j = 0; j < width; ++j)
+			{
+				const float grayValue = gray[j];
+				if (grayValue != grayValue)
+				{
+					colors[j] = NODATA_COLOR;
+					continue;
+				}
+
+				double currentAlpha = mOpacity;
+				if (mRasterTransparency)
+					currentAlpha = mRasterTransparency->alphaValue(line[j + 1], mOpacity * 255) / 255.0;
+				if (alphaBlock)
+					currentAlpha *= alphaBlock->value(i, j) / 255.0;
+
+				if (qgsDoubleNear(currentAlpha, 1.0))
+					colors[j] = qRgba(grayValue, grayValue, grayValue, 255);
+				else
+					colors[j] = qRgba(currentAlpha * grayValue, currentAlpha * grayValue, currentAlpha * grayValue, currentAlpha * 255);
+			}
+		}
+	});
+
+	delete inputBlock;
+	if (alphaBlock != inputBlock)
+		delete alphaBlock;
+	return outputBlock;
+}
+
+void FastHillshadeRenderer::shadeRow(const float *above, const float *row, const float *below, float *gray, int width, const Shading &shading)
+{
+	int i = 0;
+#ifdef FLOATLANES_AVX
+	if (FloatLanes::avx())
+	{
+		i = shadeSpan<AvxLanes>(above, row, below, gray, i, width, shading);
+		AvxLanes::leave();
+	}
+#endif
+#ifdef FLOATLANES_SSE
+	i = shadeSpan<SseLanes>(above, row, below, gray, i, width, shading);
+#endif
+	shadeSpan<ScalarLanes>(above, row, below, gray, i, width, shading);
+}
+
+QList<int> FastHillshadeRenderer::usesBands() const
+{
+	QList<int> bandList;
+	if (mBand != -1)
+		bandList << mBand;
+	return bandList;
+}
+
+void FastHillshadeRenderer::setBand(int bandNo)
+{
+	if (!mInput || bandNo > mInput->bandCount() || bandNo <= 0)
+		return;
+	mBand = bandNo;
+}
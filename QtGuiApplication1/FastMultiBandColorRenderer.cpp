@@ -0,0 +1,104 @@
+#include "FastMultiBandColorRenderer.h"
+#include "ContrastStretch.h"
+#include "QMap"
+#include "QtConcurrentMap"
+#include "qgscontrastenhancement.h"
+#include "qgsrastertransparency.h"
+
+namespace
+{
+	struct Rows
+	{
+		int begin;
+		int end;
+	};
+}
+
+FastMultiBandColorRenderer::FastMultiBandColorRenderer(QgsRasterInterface *input, int redBand, int greenBand, int blueBand,
+	QgsContrastEnhancement *redEnhancement, QgsContrastEnhancement *greenEnhancement, QgsContrastEnhancement *blueEnhancement)
+	: QgsMultiBandColorRenderer(input, redBand, greenBand, blueBand, redEnhancement, greenEnhancement, blueEnhancement)
+	, mChunkRows(32)
+{
+}
+
+FastMultiBandColorRenderer *FastMultiBandColorRenderer::clone() const
+{
+	FastMultiBandColorRenderer *renderer = new FastMultiBandColorRenderer(nullptr, redBand(), greenBand(), blueBand());
+	renderer->copyCommonProperties(this);
+	if (redContrastEnhancement())
+		renderer->setRedContrastEnhancement(new QgsContrastEnhancement(*redContrastEnhancement()));
+	if (greenContrastEnhancement())
+		renderer->setGreenContrastEnhancement(new QgsContrastEnhancement(*greenContrastEnhancement()));
+	if (blueContrastEnhancement())
+		renderer->setBlueContrastEnhancement(new QgsContrastEnhancement(*blueContrastEnhancement()));
+	renderer->setChunkRows(mChunkRows);
+	return renderer;
+}
+
+QgsRasterBlock *FastMultiBandColorRenderer::block(int bandNo, const QgsRectangle &extent, int width, int height, QgsRasterBlockFeedback *feedback)
+{
+	const int bands[3] = { redBand(), greenBand(), blueBand() };
+	const ContrastStretch stretches[3] = { ContrastStretch(redContrastEnhancement()), ContrastStretch(greenContrastEnhancement()), ContrastStretch(blueContrastEnhancement()) };
+	bool vectorized = mInput && mAlphaBand <= 0 && !(mRasterTransparency && !mRasterTransparency->isEmpty());
+	for (int k = 0; k < 3; ++k)
+		vectorized = vectorized && bands[k] > 0 && stretches[k].isValid();
+	if (!vectorized)
+		return QgsMultiBandColorRenderer::block(bandNo, extent, width, height, feedback);
+
+	QgsRasterBlock *outputBlock = new QgsRasterBlock();
+	QMap<int, QVector<float> > values;
+	for (int k = 0; k < 3; ++k)
+	{
+		if (values.contains(bands[k]))
+			continue;
+		QgsRasterBlock *inputBlock = mInput->block(bands[k], extent, width, height, feedback);
+		const bool ok = ContrastStretch::values(inputBlock, values[bands[k]]);
+		delete inputBlock;
+		if (!ok)
+			return outputBlock;
+	}
+	if (!outputBlock->reset(Qgis::ARGB32_Premultiplied, width, height))
+		return outputBlock;
+
+	QVector<Rows> chunks;
+	for (int begin = 0; begin < height; begin += mChunkRows)
+	{
+		const Rows rows = { begin, qMin(begin + mChunkRows, height) };
+		chunks.append(rows);
+	}
+
+	const float *inputs[3] = { values[bands[0]].constData(), values[bands[1]].constData(), values[bands[2]].constData() };
+	const bool opaque = qgsDoubleNear(mOpacity, 1.0);
+	// bits() detaches, so it is called once before the workers start
+	QRgb *output = reinterpret_cast<QRgb *>(outputBlock->bits());
+	QtConcurrent::blockingMap(chunks, [&](const Rows &rows)
+	{
+		QVector<float> channels[3];
+		for (int k = 0; k < 3; ++k)
+			channels[k].resize(width);
+		for (int i = rows.begin; i < rows.end; ++i)
+		{
+			for (int k = 0; k < 3; ++k)
+				stretches[k].apply(inputs[k] + i * width, channels[k].data(), width);
+
+			const float *red = channels[0].constData();
+			const float *green = channels[1].constData();
+			const float *blue = channels[2].constData();
+			QRgb *colors = output + i * width;
+			for (int j = 0; j < width; ++j)
+			{
+				// nodata in any band, or a value an enhancement hides
+				if (red[j] != red[j] || green[j] != green[j] || blue[j] != blue[j])
+				{
+					colors[j] = NODATA_COLOR;
+					continue;
+				}
+				if (opaque)
+					colors[j] = qRgba(static_cast<int>(red[j]), static_cast<int>(green[j]), static_cast<int>(blue[j]), 255);
+				else
+					colors[j] = qRgba(static_cast<int>(mOpacity * red[j]), static_cast<int>(mOpacity * green[j]), static_cast<int>(mOpacity * blue[j]), static_cast<int>(mOpacity * 255));
+			}
+		}
+	});
+	return outputBlock;
+}
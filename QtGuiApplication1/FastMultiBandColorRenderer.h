@@ -0,0 +1,28 @@
+#pragma once
+
+#include "qgsmultibandcolorrenderer.h"
+
+// QgsMultiBandColorRenderer with the contrast enhancements applied by
+// ContrastStretch over whole rows, and rows split over the global thread
+// pool. Every band is read once even when it feeds several channels. Per
+// value transparency, alpha bands, unset bands and enhancements without a
+// vector form are left to the stock loop. The renderer is saved with the
+// stock type.
+class FastMultiBandColorRenderer : public QgsMultiBandColorRenderer
+{
+public:
+	// Takes ownership of the enhancements.
+	FastMultiBandColorRenderer(QgsRasterInterface *input, int redBand, int greenBand, int blueBand,
+		QgsContrastEnhancement *redEnhancement = nullptr, QgsContrastEnhancement *greenEnhancement = nullptr,
+		QgsContrastEnhancement *blueEnhancement = nullptr);
+
+	FastMultiBandColorRenderer *clone() const override;
+
+	QgsRasterBlock *block(int bandNo, const QgsRectangle &extent, int width, int height, QgsRasterBlockFeedback *feedback = nullptr) override;
+
+	// Rows per work item.
+	void setChunkRows(int rows) { mChunkRows = qMax(1, rows); }
+
+private:
+	int mChunkRows;
+};
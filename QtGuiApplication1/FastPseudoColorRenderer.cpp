@@ -0,0 +1,55 @@
+#include "FastPseudoColorRenderer.h"
+#include "ColorRampTable.h"
+#include "qgscolorrampshader.h"
+#include "qgsrastershader.h"
+#include "qgsrastertransparency.h"
+
+FastPseudoColorRenderer::FastPseudoColorRenderer(QgsRasterInterface *input, int band, QgsRasterShader *shader)
+	: QgsSingleBandPseudoColorRenderer(input, band, shader)
+	, mChunkRows(32)
+{
+}
+
+FastPseudoColorRenderer *FastPseudoColorRenderer::clone() const
+{
+	// as QgsSingleBandPseudoColorRenderer::clone
+	QgsRasterShader *shaderCopy = nullptr;
+	if (const QgsRasterShader *s = shader())
+	{
+		QgsRasterShader *original = const_cast<QgsRasterShader *>(s);
+		shaderCopy = new QgsRasterShader(original->minimumValue(), original->maximumValue());
+		if (const QgsColorRampShader *ramp = dynamic_cast<const QgsColorRampShader *>(s->rasterShaderFunction()))
+			shaderCopy->setRasterShaderFunction(new QgsColorRampShader(*ramp));
+	}
+	FastPseudoColorRenderer *renderer = new FastPseudoColorRenderer(nullptr, band(), shaderCopy);
+	renderer->copyCommonProperties(this);
+	renderer->setClassificationMin(classificationMin());
+	renderer->setClassificationMax(classificationMax());
+	renderer->setChunkRows(mChunkRows);
+	return renderer;
+}
+
+QgsRasterBlock *FastPseudoColorRenderer::block(int bandNo, const QgsRectangle &extent, int width, int height, QgsRasterBlockFeedback *feedback)
+{
+	QgsRasterShader *s = shader();
+	if (!mInput || !s || !s->rasterShaderFunction() || mAlphaBand > 0 || (mRasterTransparency && !mRasterTransparency->isEmpty()))
+		return QgsSingleBandPseudoColorRenderer::block(bandNo, extent, width, height, feedback);
+
+	QgsRasterBlock *outputBlock = new QgsRasterBlock();
+	QgsRasterBlock *inputBlock = mInput->block(band(), extent, width, height, feedback);
+	if (!inputBlock || inputBlock->isEmpty() || !outputBlock->reset(Qgis::ARGB32_Premultiplied, width, height))
+	{
+		delete inputBlock;
+		return outputBlock;
+	}
+
+	ColorRampTable table(s->rasterShaderFunction(), mOpacity);
+	table.setChunkRows(mChunkRows);
+	const bool shaded = table.shadeBlock(inputBlock, reinterpret_cast<QRgb *>(outputBlock->bits()));
+	delete inputBlock;
+	if (shaded)
+		return outputBlock;
+
+	delete outputBlock;
+	return QgsSingleBandPseudoColorRenderer::block(bandNo, extent, width, height, feedback);
+}
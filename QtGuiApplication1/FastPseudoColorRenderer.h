@@ -0,0 +1,25 @@
+#pragma once
+
+#include "qgssinglebandpseudocolorrenderer.h"
+
+// QgsSingleBandPseudoColorRenderer that colours blocks through a
+// ColorRampTable instead of calling the shader for every cell. Per value
+// transparency and alpha bands are left to the stock loop, as are blocks
+// the tables cannot serve. The renderer is saved with the stock type, so
+// projects load without this class.
+class FastPseudoColorRenderer : public QgsSingleBandPseudoColorRenderer
+{
+public:
+	// Takes ownership of shader.
+	FastPseudoColorRenderer(QgsRasterInterface *input, int band = -1, QgsRasterShader *shader = nullptr);
+
+	FastPseudoColorRenderer *clone() const override;
+
+	QgsRasterBlock *block(int bandNo, const QgsRectangle &extent, int width, int height, QgsRasterBlockFeedback *feedback = nullptr) override;
+
+	// Rows per work item.
+	void setChunkRows(int rows) { mChunkRows = qMax(1, rows); }
+
+private:
+	int mChunkRows;
+};
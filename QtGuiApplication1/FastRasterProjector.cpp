@@ -0,0 +1,478 @@
+#include "FastRasterProjector.h"
+#include "FloatLanes.h"
+#include "QCache"
+#include "QMutex"
+#include "QMutexLocker"
+#include "QSharedPointer"
+#include "QtConcurrentMap"
+#include "qgscoordinatetransform.h"
+#include "qgscsexception.h"
+#include "qgsrasterblock.h"
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace
+{
+	// lattice units per patch side; control points are 1 - 64 units apart
+	const int PatchUnits = 1024;
+	const int MaxStep = 64;
+	// squared interpolation error allowed, in lattice units
+	const double SqrTolerance = 0.25 * 0.25;
+
+	struct Patch
+	{
+		int step;
+		// control points per side
+		int points;
+		// source coordinates by rows of increasing y, NaN where the
+		// transform failed
+		QVector<double> x;
+		QVector<double> y;
+	};
+
+	struct Rows
+	{
+		int begin;
+		int end;
+	};
+
+	struct PatchCache
+	{
+		PatchCache() : patches(64 * 1024 * 1024) {}
+
+		QMutex mutex;
+		// cost is bytes
+		QCache<QString, QSharedPointer<const Patch> > patches;
+	};
+
+	PatchCache &patchCache()
+	{
+		static PatchCache cache;
+		return cache;
+	}
+
+	// Transforms in place; points that fail become NaN.
+	void transformPoints(const QgsCoordinateTransform &ct, QVector<double> &x, QVector<double> &y)
+	{
+		const double nan = std::numeric_limits<double>::quiet_NaN();
+		const QVector<double> sourceX = x;
+		const QVector<double> sourceY = y;
+		QVector<double> z(x.size());
+		try
+		{
+			ct.transformCoords(x.size(), x.data(), y.data(), z.data());
+		}
+		catch (QgsCsException &)
+		{
+			// the batch fails as a whole, find the points that do
+			for (int i = 0; i < x.size(); ++i)
+			{
+				try
+				{
+					const QgsPoint p = ct.transform(sourceX[i], sourceY[i]);
+					x[i] = p.x();
+					y[i] = p.y();
+				}
+				catch (QgsCsException &)
+				{
+					x[i] = nan;
+					y[i] = nan;
+				}
+			}
+		}
+		for (int i = 0; i < x.size(); ++i)
+		{
+			if (!std::isfinite(x[i]) || !std::isfinite(y[i]))
+			{
+				x[i] = nan;
+				y[i] = nan;
+			}
+		}
+	}
+
+	// True if the bilinear interpolation of every cell is close enough to
+	// the exact transform of its centre.
+	bool isAccurate(const QgsCoordinateTransform &ct, const Patch &patch, double originX, double originY, double unitX, double unitY)
+	{
+		const int n = patch.points;
+		const int cells = n - 1;
+		QVector<double> centreX(cells * cells);
+		QVector<double> centreY(cells * cells);
+		for (int r = 0; r < cells; ++r)
+		{
+			for (int c = 0; c < cells; ++c)
+			{
+				centreX[r * cells + c] = originX + (c + 0.5) * patch.step * unitX;
+				centreY[r * cells + c] = originY + (r + 0.5) * patch.step * unitY;
+			}
+		}
+		transformPoints(ct, centreX, centreY);
+
+		const double *x = patch.x.constData();
+		const double *y = patch.y.constData();
+		for (int r = 0; r < cells; ++r)
+		{
+			for (int c = 0; c < cells; ++c)
+			{
+				const int a = r * n + c;
+				const double cx = centreX[r * cells + c];
+				const double cy = centreY[r * cells + c];
+				const double ix = (x[a] + x[a + 1] + x[a + n] + x[a + n + 1]) / 4;
+				const double iy = (y[a] + y[a + 1] + y[a + n] + y[a + n + 1]) / 4;
+				if (ix != ix || cx != cx)
+				{
+					// cells wholly outside the projection stay empty, the
+					// border of the valid area is refined
+					const bool none = x[a] != x[a] && x[a + 1] != x[a + 1] && x[a + n] != x[a + n] && x[a + n + 1] != x[a + n + 1];
+					if (none && cx != cx)
+						continue;
+					return false;
+				}
+
+				const double unit = qMax(std::hypot(x[a + 1] - x[a], y[a + 1] - y[a]), std::hypot(x[a + n] - x[a], y[a + n] - y[a])) / patch.step;
+				const double dx = ix - cx;
+				const double dy = iy - cy;
+				if (dx * dx + dy * dy > SqrTolerance * unit * unit)
+					return false;
+			}
+		}
+		return true;
+	}
+
+	QSharedPointer<const Patch> buildPatch(const QgsCoordinateTransform &ct, double originX, double originY, double unitX, double unitY)
+	{
+		QSharedPointer<Patch> patch(new Patch);
+		for (int step = MaxStep; ; step /= 2)
+		{
+			const int n = PatchUnits / step + 1;
+			patch->step = step;
+			patch->points = n;
+			patch->x.resize(n * n);
+			patch->y.resize(n * n);
+			for (int r = 0; r < n; ++r)
+			{
+				for (int c = 0; c < n; ++c)
+				{
+					patch->x[r * n + c] = originX + c * step * unitX;
+					patch->y[r * n + c] = originY + r * step * unitY;
+				}
+			}
+			transformPoints(ct, patch->x, patch->y);
+			if (step == 1 || isAccurate(ct, *patch, originX, originY, unitX, unitY))
+				break;
+		}
+		return patch;
+	}
+}
+
+FastRasterProjector::FastRasterProjector()
+	: mSampling(Nearest)
+	, mChunkRows(32)
+{
+}
+
+FastRasterProjector *FastRasterProjector::clone() const
+{
+	FastRasterProjector *projector = new FastRasterProjector;
+	projector->setCrs(sourceCrs(), destinationCrs());
+	projector->setPrecision(precision());
+	projector->setSampling(mSampling);
+	projector->setChunkRows(mChunkRows);
+	return projector;
+}
+
+void FastRasterProjector::clearCache()
+{
+	PatchCache &cache = patchCache();
+	QMutexLocker locker(&cache.mutex);
+	cache.patches.clear();
+}
+
+QRgb FastRasterProjector::interpolate(const QRgb *top, const QRgb *bottom, int weightX, int weightY)
+{
+#ifdef FLOATLANES_SSE
+	// both pixels of a row as eight 16 bit channels; 255 * 256 + 128 fits
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i half = _mm_set1_epi16(128);
+	const __m128i t = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(top)), zero);
+	const __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(bottom)), zero);
+	__m128i v = _mm_add_epi16(_mm_mullo_epi16(t, _mm_set1_epi16(static_cast<short>(256 - weightY))), _mm_mullo_epi16(b, _mm_set1_epi16(static_cast<short>(weightY))));
+	v = _mm_srli_epi16(_mm_add_epi16(v, half), 8);
+	const short left = static_cast<short>(256 - weightX);
+	const short right = static_cast<short>(weightX);
+	v = _mm_mullo_epi16(v, _mm_set_epi16(right, right, right, right, left, left, left, left));
+	v = _mm_add_epi16(v, _mm_srli_si128(v, 8));
+	v = _mm_srli_epi16(_mm_add_epi16(v, half), 8);
+	return static_cast<QRgb>(_mm_cvtsi128_si32(_mm_packus_epi16(v, v)));
+#else
+	QRgb result = 0;
+	for (int shift = 0; shift < 32; shift += 8)
+	{
+		const int left = ((top[0] >> shift & 0xff) * (256 - weightY) + (bottom[0] >> shift & 0xff) * weightY + 128) >> 8;
+		const int right = ((top[1] >> shift & 0xff) * (256 - weightY) + (bottom[1] >> shift & 0xff) * weightY + 128) >> 8;
+		result |= static_cast<QRgb>((left * (256 - weightX) + right * weightX + 128) >> 8) << shift;
+	}
+	return result;
+#endif
+}
+
+QgsRasterBlock *FastRasterProjector::block(int bandNo, const QgsRectangle &extent, int width, int height, QgsRasterBlockFeedback *feedback)
+{
+	if (!mInput)
+		return new QgsRasterBlock();
+	if (feedback && feedback->isCanceled())
+		return new QgsRasterBlock();
+	if (!sourceCrs().isValid() || !destinationCrs().isValid() || sourceCrs() == destinationCrs())
+		return mInput->block(bandNo, extent, width, height, feedback);
+	if (precision() == Exact || width <= 0 || height <= 0)
+		return QgsRasterProjector::block(bandNo, extent, width, height, feedback);
+
+	// one lattice unit is the power of two map units at or below the pixel
+	// size, so a pixel spans one to two units
+	const double resX = extent.width() / width;
+	const double resY = extent.height() / height;
+	const int exponentX = static_cast<int>(std::floor(std::log2(resX)));
+	const int exponentY = static_cast<int>(std::floor(std::log2(resY)));
+	const double unitX = std::ldexp(1.0, exponentX);
+	const double unitY = std::ldexp(1.0, exponentY);
+
+	// pixel centres in lattice units, v growing upwards with y
+	const double uFirst = (extent.xMinimum() + 0.5 * resX) / unitX;
+	const double uLast = (extent.xMaximum() - 0.5 * resX) / unitX;
+	const double vTop = (extent.yMaximum() - 0.5 * resY) / unitY;
+	const double vBottom = (extent.yMinimum() + 0.5 * resY) / unitY;
+	const qint64 patchLeft = static_cast<qint64>(std::floor(uFirst / PatchUnits));
+	const qint64 patchBottom = static_cast<qint64>(std::floor(vBottom / PatchUnits));
+	const int patchesX = static_cast<int>(static_cast<qint64>(std::floor(uLast / PatchUnits)) - patchLeft + 1);
+	const int patchesY = static_cast<int>(static_cast<qint64>(std::floor(vTop / PatchUnits)) - patchBottom + 1);
+
+	// cached patches, the missing ones solved here since the transform
+	// must not be shared between threads
+	const QString crsKey = sourceCrs().toProj4() + '|' + destinationCrs().toProj4() + '|' + QString::number(exponentX) + '|' + QString::number(exponentY);
+	QgsCoordinateTransform inverseCt;
+	bool haveTransform = false;
+	QVector<QSharedPointer<const Patch> > patches;
+	PatchCache &cache = patchCache();
+	for (int py = 0; py < patchesY; ++py)
+	{
+		for (int px = 0; px < patchesX; ++px)
+		{
+			const QString key = crsKey + '|' + QString::number(patchLeft + px) + '|' + QString::number(patchBottom + py);
+			{
+				QMutexLocker locker(&cache.mutex);
+				if (QSharedPointer<const Patch> *cached = cache.patches.object(key))
+				{
+					patches.append(*cached);
+					continue;
+				}
+			}
+			if (!haveTransform)
+			{
+				inverseCt = QgsCoordinateTransform(destinationCrs(), sourceCrs());
+				haveTransform = true;
+			}
+			const QSharedPointer<const Patch> patch = buildPatch(inverseCt, (patchLeft + px) * PatchUnits * unitX, (patchBottom + py) * PatchUnits * unitY, unitX, unitY);
+			patches.append(patch);
+			QMutexLocker locker(&cache.mutex);
+			cache.patches.insert(key, new QSharedPointer<const Patch>(patch), patch->points * patch->points * 2 * sizeof(double));
+		}
+	}
+
+	// source extent and resolution from the control points around the
+	// block, as the stock projector takes them from its matrix
+	double minX = std::numeric_limits<double>::max();
+	double minY = std::numeric_limits<double>::max();
+	double maxX = -std::numeric_limits<double>::max();
+	double maxY = -std::numeric_limits<double>::max();
+	double minSize = std::numeric_limits<double>::max();
+	for (int py = 0; py < patchesY; ++py)
+	{
+		for (int px = 0; px < patchesX; ++px)
+		{
+			const Patch &p = *patches[py * patchesX + px];
+			const int n = p.points;
+			const double u0 = (patchLeft + px) * static_cast<double>(PatchUnits);
+			const double v0 = (patchBottom + py) * static_cast<double>(PatchUnits);
+			const int c0 = qBound(0, static_cast<int>(std::floor((uFirst - u0) / p.step)), n - 1);
+			const int c1 = qBound(0, static_cast<int>(std::ceil((uLast - u0) / p.step)), n - 1);
+			const int r0 = qBound(0, static_cast<int>(std::floor((vBottom - v0) / p.step)), n - 1);
+			const int r1 = qBound(0, static_cast<int>(std::ceil((vTop - v0) / p.step)), n - 1);
+			const double pixelsX = p.step * unitX / resX;
+			const double pixelsY = p.step * unitY / resY;
+			for (int r = r0; r <= r1; ++r)
+			{
+				for (int c = c0; c <= c1; ++c)
+				{
+					const int a = r * n + c;
+					const double x = p.x[a];
+					const double y = p.y[a];
+					if (x != x)
+						continue;
+					minX = qMin(minX, x);
+					maxX = qMax(maxX, x);
+					minY = qMin(minY, y);
+					maxY = qMax(maxY, y);
+					if (c < c1 && p.x[a + 1] == p.x[a + 1])
+						minSize = qMin(minSize, std::hypot(p.x[a + 1] - x, p.y[a + 1] - y) / pixelsX);
+					if (r < r1 && p.x[a + n] == p.x[a + n])
+						minSize = qMin(minSize, std::hypot(p.x[a + n] - x, p.y[a + n] - y) / pixelsY);
+				}
+			}
+		}
+	}
+	if (minX > maxX || minSize == std::numeric_limits<double>::max() || minSize <= 0)
+		return new QgsRasterBlock();
+
+	const QgsRectangle inputExtent = mInput->extent();
+	const QgsRectangle cpExtent(minX, minY, maxX, maxY);
+	QgsRectangle srcExtent = cpExtent.intersect(&inputExtent);
+	if (srcExtent.isEmpty())
+		return new QgsRasterBlock();
+
+	// no finer than the raster, on its cell grid
+	double srcResX = minSize;
+	double srcResY = minSize;
+	if ((mInput->capabilities() & QgsRasterInterface::Size) && mInput->xSize() > 0 && mInput->ySize() > 0)
+	{
+		const double nativeX = inputExtent.width() / mInput->xSize();
+		const double nativeY = inputExtent.height() / mInput->ySize();
+		srcResX = qMax(srcResX, nativeX);
+		srcResY = qMax(srcResY, nativeY);
+		srcExtent = QgsRectangle(inputExtent.xMinimum() + std::floor((srcExtent.xMinimum() - inputExtent.xMinimum()) / nativeX) * nativeX,
+			inputExtent.yMaximum() - std::ceil((inputExtent.yMaximum() - srcExtent.yMinimum()) / nativeY) * nativeY,
+			inputExtent.xMinimum() + std::ceil((srcExtent.xMaximum() - inputExtent.xMinimum()) / nativeX) * nativeX,
+			inputExtent.yMaximum() - std::floor((inputExtent.yMaximum() - srcExtent.yMaximum()) / nativeY) * nativeY);
+	}
+	const int srcCols = qMax(1, static_cast<int>(std::ceil(srcExtent.width() / srcResX - 1e-6)));
+	const int srcRows = qMax(1, static_cast<int>(std::ceil(srcExtent.height() / srcResY - 1e-6)));
+	srcResX = srcExtent.width() / srcCols;
+	srcResY = srcExtent.height() / srcRows;
+
+	QgsRasterBlock *inputBlock = mInput->block(bandNo, srcExtent, srcCols, srcRows, feedback);
+	if (!inputBlock || inputBlock->isEmpty())
+	{
+		delete inputBlock;
+		return new QgsRasterBlock();
+	}
+
+	QgsRasterBlock *outputBlock = new QgsRasterBlock(inputBlock->dataType(), width, height);
+	if (inputBlock->hasNoDataValue())
+		outputBlock->setNoDataValue(inputBlock->noDataValue());
+	if (!outputBlock->isValid())
+	{
+		delete inputBlock;
+		return outputBlock;
+	}
+	outputBlock->setIsNoData();
+
+	// nodata kept in a bitmap needs isNoData(); anything else is copied
+	const bool bitmapNoData = QgsRasterBlock::typeIsNumeric(inputBlock->dataType()) && inputBlock->hasNoData() && !inputBlock->hasNoDataValue();
+	const bool bilinear = mSampling == Bilinear && srcCols > 1 && srcRows > 1
+		&& (inputBlock->dataType() == Qgis::ARGB32 || inputBlock->dataType() == Qgis::ARGB32_Premultiplied);
+	const int pixelSize = inputBlock->dataTypeSize();
+
+	// the patch column and lattice position of every output column
+	QVector<int> columnPatch(width);
+	QVector<double> columnU(width);
+	for (int j = 0; j < width; ++j)
+	{
+		const double u = (extent.xMinimum() + (j + 0.5) * resX) / unitX;
+		columnPatch[j] = qBound(0, static_cast<int>(static_cast<qint64>(std::floor(u / PatchUnits)) - patchLeft), patchesX - 1);
+		columnU[j] = u - (patchLeft + columnPatch[j]) * static_cast<double>(PatchUnits);
+	}
+
+	QVector<Rows> chunks;
+	for (int begin = 0; begin < height; begin += mChunkRows)
+	{
+		const Rows rows = { begin, qMin(begin + mChunkRows, height) };
+		chunks.append(rows);
+	}
+
+	const double srcLeft = srcExtent.xMinimum();
+	const double srcTop = srcExtent.yMaximum();
+	// bits() detaches image blocks, so it is called once before the workers
+	// start
+	const char *input = inputBlock->bits();
+	char *output = outputBlock->bits();
+	QtConcurrent::blockingMap(chunks, [&](const Rows &rows)
+	{
+		if (feedback && feedback->isCanceled())
+			return;
+		for (int i = rows.begin; i < rows.end; ++i)
+		{
+			const double v = (extent.yMaximum() - (i + 0.5) * resY) / unitY;
+			const int py = qBound(0, static_cast<int>(static_cast<qint64>(std::floor(v / PatchUnits)) - patchBottom), patchesY - 1);
+			const double rowV = v - (patchBottom + py) * static_cast<double>(PatchUnits);
+			const QSharedPointer<const Patch> *rowPatches = patches.constData() + py * patchesX;
+
+			for (int j = 0; j < width; ++j)
+			{
+				const Patch &p = *rowPatches[columnPatch[j]];
+				const int n = p.points;
+				const double fu = columnU[j] / p.step;
+				const double fv = rowV / p.step;
+				const int c = qBound(0, static_cast<int>(fu), n - 2);
+				const int r = qBound(0, static_cast<int>(fv), n - 2);
+				const double tx = fu - c;
+				const double ty = fv - r;
+				const int a = r * n + c;
+				const double *x = p.x.constData() + a;
+				const double *y = p.y.constData() + a;
+				const double sx = (1 - ty) * ((1 - tx) * x[0] + tx * x[1]) + ty * ((1 - tx) * x[n] + tx * x[n + 1]);
+				const double sy = (1 - ty) * ((1 - tx) * y[0] + tx * y[1]) + ty * ((1 - tx) * y[n] + tx * y[n + 1]);
+				if (sx != sx || sy != sy)
+					continue;
+
+				const double srcCol = (sx - srcLeft) / srcResX;
+				const double srcRow = (srcTop - sy) / srcResY;
+				if (!(srcCol >= 0 && srcCol < srcCols && srcRow >= 0 && srcRow < srcRows))
+					continue;
+
+				if (bilinear)
+				{
+					const double fx = srcCol - 0.5;
+					const double fy = srcRow - 0.5;
+					int x0 = static_cast<int>(std::floor(fx));
+					int y0 = static_cast<int>(std::floor(fy));
+					int weightX = static_cast<int>((fx - x0) * 256 + 0.5);
+					int weightY = static_cast<int>((fy - y0) * 256 + 0.5);
+					if (x0 < 0)
+					{
+						x0 = 0;
+						weightX = 0;
+					}
+					else if (x0 > srcCols - 2)
+					{
+						x0 = srcCols - 2;
+						weightX = 256;
+					}
+					if (y0 < 0)
+					{
+						y0 = 0;
+						weightY = 0;
+					}
+					else if (y0 > srcRows - 2)
+					{
+						y0 = srcRows - 2;
+						weightY = 256;
+					}
+					const QRgb *top = reinterpret_cast<const QRgb *>(input) + static_cast<qgssize>(y0) * srcCols + x0;
+					const QRgb *bottom = top + srcCols;
+					reinterpret_cast<QRgb *>(output)[static_cast<qgssize>(i) * width + j] = interpolate(top, bottom, weightX, weightY);
+					continue;
+				}
+
+				const int row = static_cast<int>(srcRow);
+				const int col = static_cast<int>(srcCol);
+				if (bitmapNoData && inputBlock->isNoData(row, col))
+					continue;
+				std::memcpy(output + (static_cast<qgssize>(i) * width + j) * pixelSize, input + (static_cast<qgssize>(row) * srcCols + col) * pixelSize, pixelSize);
+				outputBlock->setIsData(i, j);
+			}
+		}
+	});
+
+	delete inputBlock;
+	return outputBlock;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "QRgb"
+#include "qgsrasterprojector.h"
+
+// Drop-in replacement for QgsRasterProjector in a layer's pipe:
+//
+//   layer->pipe()->set(new FastRasterProjector);
+//
+// The stock projector solves a fresh control point matrix for every block
+// it is asked for, so each frame of a pan transforms the same points again,
+// and then maps the pixels one by one on the render thread. Here the
+// control points lie on a lattice fixed in destination map coordinates,
+// with a spacing of a power of two times the map units per pixel. The
+// lattice is cut into patches of 1024 x 1024 units that are refined until
+// the interpolation error stays below a quarter unit and then cached for
+// all projectors, so panning and zooming within a factor of two reuse the
+// patches already solved. Pixels are warped by bands of rows on the global
+// thread pool.
+//
+// Rendered images (the projector sits behind the renderer in the pipe) can
+// be sampled bilinearly, on SSE2 in every build. Data blocks are always
+// sampled by nearest neighbour, as the stock projector does. Exact
+// precision falls back to the stock per pixel transform.
+//
+// The datum transforms passed to setCrs() are not readable from the base
+// class, so the projection uses the default ones.
+class FastRasterProjector : public QgsRasterProjector
+{
+public:
+	enum Sampling
+	{
+		Nearest,
+		Bilinear,
+	};
+
+	FastRasterProjector();
+
+	FastRasterProjector *clone() const override;
+
+	QgsRasterBlock *block(int bandNo, const QgsRectangle &extent, int width, int height, QgsRasterBlockFeedback *feedback = nullptr) override;
+
+	Sampling sampling() const { return mSampling; }
+	void setSampling(Sampling sampling) { mSampling = sampling; }
+
+	// Rows per work item.
+	void setChunkRows(int rows) { mChunkRows = qMax(1, rows); }
+
+	// Drops the control points cached for all projectors.
+	static void clearCache();
+
+	// Weighted mean of top[0], top[1], bottom[0] and bottom[1] per channel,
+	// weights 0 - 256 of the right and bottom pixels.
+	static QRgb interpolate(const QRgb *top, const QRgb *bottom, int weightX, int weightY);
+
+private:
+	Sampling mSampling;
+	int mChunkRows;
+};
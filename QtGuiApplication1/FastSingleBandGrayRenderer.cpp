@@ -0,0 +1,84 @@
+#include "FastSingleBandGrayRenderer.h"
+#include "ContrastStretch.h"
+#include "QtConcurrentMap"
+#include "qgscontrastenhancement.h"
+#include "qgsrastertransparency.h"
+
+namespace
+{
+	struct Rows
+	{
+		int begin;
+		int end;
+	};
+}
+
+FastSingleBandGrayRenderer::FastSingleBandGrayRenderer(QgsRasterInterface *input, int grayBand)
+	: QgsSingleBandGrayRenderer(input, grayBand)
+	, mChunkRows(32)
+{
+}
+
+FastSingleBandGrayRenderer *FastSingleBandGrayRenderer::clone() const
+{
+	FastSingleBandGrayRenderer *renderer = new FastSingleBandGrayRenderer(nullptr, grayBand());
+	renderer->copyCommonProperties(this);
+	renderer->setGradient(gradient());
+	if (contrastEnhancement())
+		renderer->setContrastEnhancement(new QgsContrastEnhancement(*contrastEnhancement()));
+	renderer->setChunkRows(mChunkRows);
+	return renderer;
+}
+
+QgsRasterBlock *FastSingleBandGrayRenderer::block(int bandNo, const QgsRectangle &extent, int width, int height, QgsRasterBlockFeedback *feedback)
+{
+	const ContrastStretch stretch(contrastEnhancement());
+	if (!mInput || !stretch.isValid() || mAlphaBand > 0 || (mRasterTransparency && !mRasterTransparency->isEmpty()))
+		return QgsSingleBandGrayRenderer::block(bandNo, extent, width, height, feedback);
+
+	QgsRasterBlock *outputBlock = new QgsRasterBlock();
+	QgsRasterBlock *inputBlock = mInput->block(grayBand(), extent, width, height, feedback);
+	QVector<float> gray;
+	const bool ok = ContrastStretch::values(inputBlock, gray);
+	delete inputBlock;
+	if (!ok || !outputBlock->reset(Qgis::ARGB32_Premultiplied, width, height))
+		return outputBlock;
+
+	QVector<Rows> chunks;
+	for (int begin = 0; begin < height; begin += mChunkRows)
+	{
+		const Rows rows = { begin, qMin(begin + mChunkRows, height) };
+		chunks.append(rows);
+	}
+
+	const bool opaque = qgsDoubleNear(mOpacity, 1.0);
+	const bool invert = gradient() == WhiteToBlack;
+	// bits() detaches, so it is called once before the workers start
+	QRgb *output = reinterpret_cast<QRgb *>(outputBlock->bits());
+	QtConcurrent::blockingMap(chunks, [&](const Rows &rows)
+	{
+		for (int i = rows.begin; i < rows.end; ++i)
+		{
+			float *line = gray.data() + i * width;
+			stretch.apply(line, line, width);
+
+			QRgb *colors = output + i * width;
+			for (int j = 0; j < width; ++j)
+			{
+				if (line[j] != line[j])
+				{
+					colors[j] = NODATA_COLOR;
+					continue;
+				}
+				double grayVal = line[j];
+				if (invert)
+					grayVal = 255 - grayVal;
+				if (opaque)
+					colors[j] = qRgba(static_cast<int>(grayVal), static_cast<int>(grayVal), static_cast<int>(grayVal), 255);
+				else
+					colors[j] = qRgba(static_cast<int>(mOpacity * grayVal), static_cast<int>(mOpacity * grayVal), static_cast<int>(mOpacity * grayVal), static_cast<int>(mOpacity * 255));
+			}
+		}
+	});
+	return outputBlock;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "qgssinglebandgrayrenderer.h"
+
+// QgsSingleBandGrayRenderer with the contrast enhancement applied by
+// ContrastStretch over whole rows, and rows split over the global thread
+// pool. Per value transparency, alpha bands and enhancements without a
+// vector form are left to the stock loop. The renderer is saved with the
+// stock type.
+class FastSingleBandGrayRenderer : public QgsSingleBandGrayRenderer
+{
+public:
+	FastSingleBandGrayRenderer(QgsRasterInterface *input, int grayBand);
+
+	FastSingleBandGrayRenderer *clone() const override;
+
+	QgsRasterBlock *block(int bandNo, const QgsRectangle &extent, int width, int height, QgsRasterBlockFeedback *feedback = nullptr) override;
+
+	// Rows per work item.
+	void setChunkRows(int rows) { mChunkRows = qMax(1, rows); }
+
+private:
+	int mChunkRows;
+};
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cmath>
+// MSVC defines _M_IX86_FP 2 for the default /arch:SSE2 of Win32 builds
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FLOATLANES_SSE 1
+#include <emmintrin.h>
+#endif
+// MSVC compiles AVX intrinsics for any target, so the AVX kernels are
+// built along with the SSE ones and chosen at run time
+#if defined(__AVX__) || (defined(FLOATLANES_SSE) && defined(_MSC_VER))
+#define FLOATLANES_AVX 1
+#include <immintrin.h>
+#if !defined(__AVX__)
+#include <intrin.h>
+#endif
+#endif
+
+// Thin wrappers over float vector registers with one common interface, so
+// a raster kernel is written once as a template and instantiated for AVX,
+// SSE and a scalar tail. SSE2 is the default of every MSVC target, Win32
+// included. The AVX kernels only run where FloatLanes::avx() says so,
+// and are followed by AvxLanes::leave().
+//
+// Masks come from the compare functions and are only combined with both()
+// and either(); select(mask, a, b) picks a where the mask is set.
+struct ScalarLanes
+{
+	typedef float V;
+	static const int Width = 1;
+
+	static V load(const float *p) { return *p; }
+	static void store(float *p, V v) { *p = v; }
+	static V set(float v) { return v; }
+	static V add(V a, V b) { return a + b; }
+	static V sub(V a, V b) { return a - b; }
+	static V mul(V a, V b) { return a * b; }
+	static V div(V a, V b) { return a / b; }
+	static V min(V a, V b) { return b < a ? b : a; }
+	static V max(V a, V b) { return a < b ? b : a; }
+	static V sqrt(V a) { return std::sqrt(a); }
+	// towards zero; a must fit an int
+	static V truncate(V a) { return static_cast<float>(static_cast<int>(a)); }
+	// scalar masks are 1 or 0
+	static V isNumber(V a) { return a == a ? 1.0f : 0.0f; }
+	static V greater(V a, V b) { return a > b ? 1.0f : 0.0f; }
+	static V greaterEqual(V a, V b) { return a >= b ? 1.0f : 0.0f; }
+	static V less(V a, V b) { return a < b ? 1.0f : 0.0f; }
+	static V lessEqual(V a, V b) { return a <= b ? 1.0f : 0.0f; }
+	static V equal(V a, V b) { return a == b ? 1.0f : 0.0f; }
+	static V notEqual(V a, V b) { return a != b ? 1.0f : 0.0f; }
+	static V both(V a, V b) { return a * b; }
+	static V either(V a, V b) { return a + b != 0.0f ? 1.0f : 0.0f; }
+	static V select(V mask, V a, V b) { return mask != 0.0f ? a : b; }
+};
+
+#ifdef FLOATLANES_SSE
+struct SseLanes
+{
+	typedef __m128 V;
+	static const int Width = 4;
+
+	static V load(const float *p) { return _mm_loadu_ps(p); }
+	static void store(float *p, V v) { _mm_storeu_ps(p, v); }
+	static V set(float v) { return _mm_set1_ps(v); }
+	static V add(V a, V b) { return _mm_add_ps(a, b); }
+	static V sub(V a, V b) { return _mm_sub_ps(a, b); }
+	static V mul(V a, V b) { return _mm_mul_ps(a, b); }
+	static V div(V a, V b) { return _mm_div_ps(a, b); }
+	static V min(V a, V b) { return _mm_min_ps(a, b); }
+	static V max(V a, V b) { return _mm_max_ps(a, b); }
+	static V sqrt(V a) { return _mm_sqrt_ps(a); }
+	static V truncate(V a) { return _mm_cvtepi32_ps(_mm_cvttps_epi32(a)); }
+	static V isNumber(V a) { return _mm_cmpord_ps(a, a); }
+	static V greater(V a, V b) { return _mm_cmpgt_ps(a, b); }
+	static V greaterEqual(V a, V b) { return _mm_cmpge_ps(a, b); }
+	static V less(V a, V b) { return _mm_cmplt_ps(a, b); }
+	static V lessEqual(V a, V b) { return _mm_cmple_ps(a, b); }
+	static V equal(V a, V b) { return _mm_cmpeq_ps(a, b); }
+	static V notEqual(V a, V b) { return _mm_cmpneq_ps(a, b); }
+	static V both(V a, V b) { return _mm_and_ps(a, b); }
+	static V either(V a, V b) { return _mm_or_ps(a, b); }
+	static V select(V mask, V a, V b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+};
+#endif
+
+#ifdef FLOATLANES_AVX
+struct AvxLanes
+{
+	typedef __m256 V;
+	static const int Width = 8;
+
+	static V load(const float *p) { return _mm256_loadu_ps(p); }
+	static void store(float *p, V v) { _mm256_storeu_ps(p, v); }
+	static V set(float v) { return _mm256_set1_ps(v); }
+	static V add(V a, V b) { return _mm256_add_ps(a, b); }
+	static V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+	static V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+	static V div(V a, V b) { return _mm256_div_ps(a, b); }
+	static V min(V a, V b) { return _mm256_min_ps(a, b); }
+	static V max(V a, V b) { return _mm256_max_ps(a, b); }
+	static V sqrt(V a) { return _mm256_sqrt_ps(a); }
+	static V truncate(V a) { return _mm256_cvtepi32_ps(_mm256_cvttps_epi32(a)); }
+	static V isNumber(V a) { return _mm256_cmp_ps(a, a, _CMP_ORD_Q); }
+	static V greater(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+	static V greaterEqual(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+	static V less(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+	static V lessEqual(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+	static V equal(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+	static V notEqual(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_UQ); }
+	static V both(V a, V b) { return _mm256_and_ps(a, b); }
+	static V either(V a, V b) { return _mm256_or_ps(a, b); }
+	static V select(V mask, V a, V b) { return _mm256_blendv_ps(b, a, mask); }
+	// clears the upper halves before SSE code runs again; without it
+	// every SSE instruction that follows pays for the transition
+	static void leave() { _mm256_zeroupper(); }
+};
+#endif
+
+struct FloatLanes
+{
+	// True if the CPU and the OS support the AVX kernels.
+	static bool avx()
+	{
+#if defined(__AVX__)
+		return true;
+#elif defined(FLOATLANES_AVX)
+		// AVX and OSXSAVE in CPUID, and the YMM state enabled by the OS
+		static const bool supported = []
+		{
+			int info[4];
+			__cpuid(info, 1);
+			if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0)
+				return false;
+			return (_xgetbv(0) & 6) == 6;
+		}();
+		return supported;
+#else
+		return false;
+#endif
+	}
+
+	// Floats per vector of the widest kernels that run here.
+	static int width()
+	{
+#if defined(FLOATLANES_AVX)
+		if (avx())
+			return 8;
+#endif
+#if defined(FLOATLANES_SSE)
+		return 4;
+#else
+		return 1;
+#endif
+	}
+};
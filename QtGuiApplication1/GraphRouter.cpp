@@ -0,0 +1,185 @@
+#include "GraphRouter.h"
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <queue>
+
+namespace
+{
+	typedef std::pair<double, int> QueueEntry;
+	typedef std::priority_queue<QueueEntry, std::vector<QueueEntry>, std::greater<QueueEntry> > Queue;
+
+	const double INF = std::numeric_limits<double>::infinity();
+}
+
+GraphRouter::GraphRouter(const CompactGraph &graph)
+	: mGraph(graph)
+	, mStamp(0)
+	, mSettled(0)
+{
+	const int n = graph.vertexCount();
+	for (SearchState *s : { &mForward, &mBackward })
+	{
+		s->cost.resize(n);
+		s->parentVertex.resize(n);
+		s->parentArc.resize(n);
+		s->stamp.fill(0, n);
+		s->settled.fill(0, n);
+	}
+}
+
+void GraphRouter::nextStamp()
+{
+	mSettled = 0;
+	if (++mStamp != 0)
+		return;
+
+	// wrapped around after 2^32 queries: old stamps could look current again
+	for (SearchState *s : { &mForward, &mBackward })
+	{
+		s->stamp.fill(0);
+		s->settled.fill(0);
+	}
+	mStamp = 1;
+}
+
+GraphPath GraphRouter::aStar(int from, int to)
+{
+	GraphPath path;
+	const int n = mGraph.vertexCount();
+	if (from < 0 || to < 0 || from >= n || to >= n)
+		return path;
+
+	nextStamp();
+	SearchState &s = mForward;
+	const double factor = mGraph.hasPoints() ? mGraph.costPerDistance() : 0;
+	auto heuristic = [&](int v) { return factor > 0 ? factor * std::sqrt(mGraph.point(v).sqrDist(mGraph.point(to))) : 0.0; };
+
+	Queue queue;
+	s.stamp[from] = mStamp;
+	s.cost[from] = 0;
+	s.parentVertex[from] = -1;
+	s.parentArc[from] = -1;
+	queue.push(QueueEntry(heuristic(from), from));
+	while (!queue.empty())
+	{
+		const int v = queue.top().second;
+		queue.pop();
+		if (s.settled[v] == mStamp)
+			continue;
+		s.settled[v] = mStamp;
+		++mSettled;
+		if (v == to)
+			break;
+
+		for (int arc = mGraph.outBegin(v); arc < mGraph.outEnd(v); ++arc)
+		{
+			const int w = mGraph.outHead(arc);
+			const double c = s.cost[v] + mGraph.outCost(arc);
+			if (reached(s, w) && c >= s.cost[w])
+				continue;
+			s.stamp[w] = mStamp;
+			s.cost[w] = c;
+			s.parentVertex[w] = v;
+			s.parentArc[w] = arc;
+			queue.push(QueueEntry(c + heuristic(w), w));
+		}
+	}
+
+	if (s.settled[to] != mStamp)
+		return path;
+
+	path.cost = s.cost[to];
+	for (int v = to; v != -1; v = s.parentVertex[v])
+	{
+		path.vertices.prepend(v);
+		if (s.parentArc[v] >= 0)
+			path.edges.prepend(mGraph.outEdge(s.parentArc[v]));
+	}
+	return path;
+}
+
+GraphPath GraphRouter::bidirectionalDijkstra(int from, int to)
+{
+	GraphPath path;
+	const int n = mGraph.vertexCount();
+	if (from < 0 || to < 0 || from >= n || to >= n)
+		return path;
+
+	nextStamp();
+	SearchState &f = mForward;
+	SearchState &b = mBackward;
+
+	Queue forwardQueue, backwardQueue;
+	f.stamp[from] = mStamp;
+	f.cost[from] = 0;
+	f.parentVertex[from] = -1;
+	f.parentArc[from] = -1;
+	forwardQueue.push(QueueEntry(0, from));
+	b.stamp[to] = mStamp;
+	b.cost[to] = 0;
+	b.parentVertex[to] = -1;
+	b.parentArc[to] = -1;
+	backwardQueue.push(QueueEntry(0, to));
+
+	double best = from == to ? 0 : INF;
+	int meet = from == to ? from : -1;
+	while (!forwardQueue.empty() || !backwardQueue.empty())
+	{
+		const double forwardTop = forwardQueue.empty() ? INF : forwardQueue.top().first;
+		const double backwardTop = backwardQueue.empty() ? INF : backwardQueue.top().first;
+		// no path through an unsettled vertex can beat the best meeting any more
+		if (forwardTop + backwardTop >= best)
+			break;
+
+		const bool forward = forwardTop <= backwardTop;
+		SearchState &s = forward ? f : b;
+		const SearchState &other = forward ? b : f;
+		Queue &queue = forward ? forwardQueue : backwardQueue;
+
+		const int v = queue.top().second;
+		queue.pop();
+		if (s.settled[v] == mStamp)
+			continue;
+		s.settled[v] = mStamp;
+		++mSettled;
+
+		const int begin = forward ? mGraph.outBegin(v) : mGraph.inBegin(v);
+		const int end = forward ? mGraph.outEnd(v) : mGraph.inEnd(v);
+		for (int arc = begin; arc < end; ++arc)
+		{
+			const int w = forward ? mGraph.outHead(arc) : mGraph.inTail(arc);
+			const double c = s.cost[v] + (forward ? mGraph.outCost(arc) : mGraph.inCost(arc));
+			if (reached(s, w) && c >= s.cost[w])
+				continue;
+			s.stamp[w] = mStamp;
+			s.cost[w] = c;
+			s.parentVertex[w] = v;
+			s.parentArc[w] = arc;
+			queue.push(QueueEntry(c, w));
+
+			if (reached(other, w) && c + other.cost[w] < best)
+			{
+				best = c + other.cost[w];
+				meet = w;
+			}
+		}
+	}
+
+	if (meet < 0)
+		return path;
+
+	path.cost = best;
+	for (int v = meet; v != -1; v = f.parentVertex[v])
+	{
+		path.vertices.prepend(v);
+		if (f.parentArc[v] >= 0)
+			path.edges.prepend(mGraph.outEdge(f.parentArc[v]));
+	}
+	for (int v = meet; b.parentVertex[v] != -1; v = b.parentVertex[v])
+	{
+		path.vertices.append(b.parentVertex[v]);
+		path.edges.append(mGraph.inEdge(b.parentArc[v]));
+	}
+	return path;
+}
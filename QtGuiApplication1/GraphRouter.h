@@ -0,0 +1,42 @@
+#pragma once
+
+#include "CompactGraph.h"
+
+// Point to point searches over a CompactGraph. The per-vertex search state
+// is allocated once and reset lazily with a query stamp, so a query costs
+// only the vertices it actually visits. One router per thread; any number
+// of routers can share the same graph.
+class GraphRouter
+{
+public:
+	explicit GraphRouter(const CompactGraph &graph);
+
+	// A* with the straight line distance scaled by costPerDistance() as
+	// heuristic. Identical to Dijkstra when the graph has no points.
+	GraphPath aStar(int from, int to);
+
+	// Dijkstra grown from both ends until the two searches meet.
+	GraphPath bidirectionalDijkstra(int from, int to);
+
+	// Vertices settled by the last query.
+	int settledCount() const { return mSettled; }
+
+private:
+	struct SearchState
+	{
+		QVector<double> cost;
+		QVector<int> parentVertex;
+		QVector<int> parentArc;
+		QVector<unsigned> stamp;
+		QVector<unsigned> settled;
+	};
+
+	void nextStamp();
+	bool reached(const SearchState &s, int v) const { return s.stamp[v] == mStamp; }
+
+	const CompactGraph &mGraph;
+	SearchState mForward;
+	SearchState mBackward;
+	unsigned mStamp;
+	int mSettled;
+};
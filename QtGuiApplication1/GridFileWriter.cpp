@@ -0,0 +1,142 @@
+#include "GridFileWriter.h"
+#include "IdwInterpolator.h"
+#include "QFile"
+#include "QFileInfo"
+#include "QProgressDialog"
+#include "QScopedPointer"
+#include "QThread"
+#include "QtConcurrentMap"
+#include "TinInterpolator.h"
+#include "qgsvectorlayer.h"
+
+GridFileWriter::GridFileWriter(QgsInterpolator *i, const QString &outputPath, const QgsRectangle &extent, int nCols, int nRows, double cellSizeX, double cellSizeY)
+	: mInterpolator(i)
+	, mOutputFilePath(outputPath)
+	, mInterpolationExtent(extent)
+	, mNumColumns(nCols)
+	, mNumRows(nRows)
+	, mCellSizeX(cellSizeX)
+	, mCellSizeY(cellSizeY)
+	, mChunkRows(8)
+{
+}
+
+int GridFileWriter::writeFile(bool showProgressDialog)
+{
+	QFile outputFile(mOutputFilePath);
+	if (!outputFile.open(QFile::WriteOnly))
+		return 1;
+	if (!mInterpolator)
+	{
+		outputFile.remove();
+		return 2;
+	}
+
+	QTextStream outStream(&outputFile);
+	outStream.setRealNumberPrecision(8);
+	writeHeader(outStream);
+	outStream.flush();
+
+	IdwInterpolator *idw = dynamic_cast<IdwInterpolator *>(mInterpolator);
+	TinInterpolator *tin = dynamic_cast<TinInterpolator *>(mInterpolator);
+	const bool parallel = (idw && idw->prepare() == 0) || (tin && tin->prepare() == 0);
+
+	QScopedPointer<QProgressDialog> progressDialog;
+	if (showProgressDialog)
+	{
+		progressDialog.reset(new QProgressDialog(QObject::tr("Interpolating..."), QObject::tr("Abort"), 0, mNumRows, nullptr));
+		progressDialog->setWindowModality(Qt::WindowModal);
+	}
+
+	// a few work items per thread between progress updates
+	const int batchRows = parallel ? mChunkRows * qMax(1, QThread::idealThreadCount()) * 4 : mChunkRows;
+	QVector<QByteArray> lines;
+	for (int first = 0; first < mNumRows; first += batchRows)
+	{
+		const int last = qMin(first + batchRows, mNumRows);
+		lines.resize(last - first);
+		QVector<int> chunks;
+		for (int begin = first; begin < last; begin += mChunkRows)
+			chunks.append(begin);
+
+		// cell centres and numbers as the stock writer; centres are
+		// computed from the row and column instead of summed
+		auto evaluate = [&](int begin)
+		{
+			const int end = qMin(begin + mChunkRows, last);
+			for (int i = begin; i < end; ++i)
+			{
+				const double currentYValue = mInterpolationExtent.yMaximum() - mCellSizeY / 2.0 - i * mCellSizeY;
+				QByteArray &line = lines[i - first];
+				line.clear();
+				line.reserve(mNumColumns * 12 + 1);
+				for (int j = 0; j < mNumColumns; ++j)
+				{
+					const double currentXValue = mInterpolationExtent.xMinimum() + mCellSizeX / 2.0 + j * mCellSizeX;
+					double interpolatedValue;
+					if (mInterpolator->interpolatePoint(currentXValue, currentYValue, interpolatedValue) == 0)
+						line += QByteArray::number(interpolatedValue, 'g', 8) + ' ';
+					else
+						line += "-9999 ";
+				}
+				line += '\n';
+			}
+		};
+		if (parallel)
+			QtConcurrent::blockingMap(chunks, evaluate);
+		else
+		{
+			for (int begin : chunks)
+				evaluate(begin);
+		}
+
+		for (const QByteArray &line : lines)
+		{
+			if (outputFile.write(line) != line.size())
+				return 1;
+		}
+		if (progressDialog)
+		{
+			if (progressDialog->wasCanceled())
+			{
+				outputFile.remove();
+				return 3;
+			}
+			progressDialog->setValue(last);
+		}
+	}
+	outputFile.close();
+
+	// create prj file
+	QgsInterpolator::LayerData ld;
+	ld = mInterpolator->layerData().first();
+	QgsVectorLayer *vl = ld.vectorLayer;
+	QString crs = vl->crs().toWkt();
+	QFileInfo fi(mOutputFilePath);
+	QString fileName = fi.absolutePath() + '/' + fi.completeBaseName() + ".prj";
+	QFile prjFile(fileName);
+	if (!prjFile.open(QFile::WriteOnly))
+		return 1;
+	QTextStream prjStream(&prjFile);
+	prjStream << crs;
+	prjStream << endl;
+	prjFile.close();
+	return 0;
+}
+
+int GridFileWriter::writeHeader(QTextStream &outStream)
+{
+	outStream << "NCOLS " << mNumColumns << endl;
+	outStream << "NROWS " << mNumRows << endl;
+	outStream << "XLLCORNER " << mInterpolationExtent.xMinimum() << endl;
+	outStream << "YLLCORNER " << mInterpolationExtent.yMinimum() << endl;
+	if (mCellSizeX == mCellSizeY) //standard way
+		outStream << "CELLSIZE " << mCellSizeX << endl;
+	else //this is supported by GDAL but probably not by other products
+	{
+		outStream << "DX " << mCellSizeX << endl;
+		outStream << "DY " << mCellSizeY << endl;
+	}
+	outStream << "NODATA_VALUE -9999" << endl;
+	return 0;
+}
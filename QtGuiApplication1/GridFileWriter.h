@@ -0,0 +1,38 @@
+#pragma once
+
+#include "qgsrectangle.h"
+#include "QString"
+#include "QTextStream"
+
+class QgsInterpolator;
+
+// QgsGridFileWriter that evaluates bands of rows on the global thread pool
+// and writes each finished row as one block instead of streaming cell by
+// cell. Only an IdwInterpolator or TinInterpolator, prepared before the
+// first band, is called from several threads; other interpolators are
+// evaluated on the calling thread. The output is the same ASCII grid and
+// .prj file.
+class GridFileWriter
+{
+public:
+	GridFileWriter(QgsInterpolator *i, const QString &outputPath, const QgsRectangle &extent, int nCols, int nRows, double cellSizeX, double cellSizeY);
+
+	// Writes the grid file; 1 if a file cannot be written, 2 without an
+	// interpolator, 3 when cancelled. 0 in case of success.
+	int writeFile(bool showProgressDialog = false);
+
+	// Rows per work item.
+	void setChunkRows(int rows) { mChunkRows = qMax(1, rows); }
+
+private:
+	int writeHeader(QTextStream &outStream);
+
+	QgsInterpolator *mInterpolator;
+	QString mOutputFilePath;
+	QgsRectangle mInterpolationExtent;
+	int mNumColumns;
+	int mNumRows;
+	double mCellSizeX;
+	double mCellSizeY;
+	int mChunkRows;
+};
@@ -0,0 +1,90 @@
+#include "IdwInterpolator.h"
+#include <cmath>
+#include <limits>
+
+IdwInterpolator::IdwInterpolator(const QList<LayerData> &layerData, double distanceCoefficient)
+	: QgsIDWInterpolator(layerData)
+	, mCoefficient(distanceCoefficient)
+	, mNeighbourCount(0)
+	, mSearchRadius(0)
+	, mPrepared(false)
+{
+	// the same p for QgsIDWInterpolator::interpolatePoint
+	QgsIDWInterpolator::setDistanceCoefficient(distanceCoefficient);
+}
+
+int IdwInterpolator::prepare()
+{
+	if (mPrepared)
+		return 0;
+	if (!mDataIsCached)
+	{
+		const int error = cacheBaseData();
+		if (error != 0)
+			return error;
+	}
+
+	QVector<QgsPoint> points(mCachedBaseData.size());
+	for (int i = 0; i < points.size(); ++i)
+		points[i] = QgsPoint(mCachedBaseData[i].x, mCachedBaseData[i].y);
+	mTree = PointKdTree(points);
+	mPrepared = true;
+	return 0;
+}
+
+double IdwInterpolator::weight(double distanceSquared) const
+{
+	// 1 / distance^p without the square root for the usual p
+	if (mCoefficient == 2.0)
+		return 1.0 / distanceSquared;
+	return 1.0 / std::pow(distanceSquared, 0.5 * mCoefficient);
+}
+
+int IdwInterpolator::interpolatePoint(double x, double y, double &result)
+{
+	if (!mPrepared && prepare() != 0)
+		return 1;
+
+	// read only from here, for concurrent callers
+	const QVector<vertexData> &data = mCachedBaseData;
+	double sumCounter = 0;
+	double sumDenominator = 0;
+	if (mNeighbourCount == 0 && mSearchRadius == 0)
+	{
+		// as the stock interpolator
+		for (const vertexData &vertex : data)
+		{
+			const double distanceSquared = (vertex.x - x) * (vertex.x - x) + (vertex.y - y) * (vertex.y - y);
+			if (std::sqrt(distanceSquared) < std::numeric_limits<double>::min())
+			{
+				result = vertex.z;
+				return 0;
+			}
+			const double currentWeight = weight(distanceSquared);
+			sumCounter += currentWeight * vertex.z;
+			sumDenominator += currentWeight;
+		}
+	}
+	else
+	{
+		QVector<PointKdTree::Neighbour> neighbours;
+		mTree.nearest(x, y, mNeighbourCount, mSearchRadius, neighbours);
+		for (const PointKdTree::Neighbour &neighbour : neighbours)
+		{
+			const vertexData &vertex = data[neighbour.id];
+			if (std::sqrt(neighbour.distanceSquared) < std::numeric_limits<double>::min())
+			{
+				result = vertex.z;
+				return 0;
+			}
+			const double currentWeight = weight(neighbour.distanceSquared);
+			sumCounter += currentWeight * vertex.z;
+			sumDenominator += currentWeight;
+		}
+	}
+
+	if (sumDenominator == 0.0)
+		return 1;
+	result = sumCounter / sumDenominator;
+	return 0;
+}
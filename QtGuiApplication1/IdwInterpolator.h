@@ -0,0 +1,47 @@
+#pragma once
+
+#include "PointKdTree.h"
+#include "qgsidwinterpolator.h"
+
+// QgsIDWInterpolator that can limit every estimate to the nearest cached
+// vertices, to those within a search radius, or both, found through a
+// PointKdTree instead of a loop over all vertices. Without limits it
+// weighs every vertex like the stock interpolator.
+//
+// interpolatePoint() caches the base data on first use; call prepare()
+// first to use one interpolator from several threads.
+//
+// The distance coefficient is fixed at construction: the base setter is
+// not virtual and its value cannot be read back, so it is hidden here and
+// must not be called through a QgsIDWInterpolator pointer either.
+class IdwInterpolator : public QgsIDWInterpolator
+{
+public:
+	IdwInterpolator(const QList<LayerData> &layerData, double distanceCoefficient = 2.0);
+
+	int interpolatePoint(double x, double y, double &result) override;
+
+	double distanceCoefficient() const { return mCoefficient; }
+
+	// Vertices per estimate; 0 uses all.
+	void setNeighbourCount(int count) { mNeighbourCount = qMax(0, count); }
+	int neighbourCount() const { return mNeighbourCount; }
+	// Map units; 0 does not limit the distance.
+	void setSearchRadius(double radius) { mSearchRadius = qMax(0.0, radius); }
+	double searchRadius() const { return mSearchRadius; }
+
+	// Caches the base data and builds the tree. 0 in case of success.
+	int prepare();
+
+private:
+	// the coefficient is a constructor argument
+	using QgsIDWInterpolator::setDistanceCoefficient;
+
+	double weight(double distanceSquared) const;
+
+	const double mCoefficient;
+	int mNeighbourCount;
+	double mSearchRadius;
+	bool mPrepared;
+	PointKdTree mTree;
+};
@@ -0,0 +1,662 @@
+#include "IncrementalTracer.h"
+#include "qgscoordinatetransform.h"
+#include "qgsfeatureiterator.h"
+#include "qgsgeometry.h"
+#include "qgsvectorlayer.h"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <queue>
+
+namespace
+{
+	// parameter distance under which an intersection is taken to be an end point
+	const double PARAM_EPSILON = 1e-9;
+
+	double cross(double ax, double ay, double bx, double by)
+	{
+		return ax * by - ay * bx;
+	}
+
+	double param(const QgsPoint &a, const QgsPoint &b, const QgsPoint &p)
+	{
+		const double dx = b.x() - a.x(), dy = b.y() - a.y();
+		return ((p.x() - a.x()) * dx + (p.y() - a.y()) * dy) / (dx * dx + dy * dy);
+	}
+
+	bool inside(double t)
+	{
+		return t > PARAM_EPSILON && t < 1 - PARAM_EPSILON;
+	}
+
+	// cell distance by which segments are widened in the grid, so that one
+	// through a cell corner is found from every cell meeting there
+	const double CELL_MARGIN = 1e-6;
+
+	qint64 cellKey(qint64 x, qint64 y)
+	{
+		return static_cast<qint64>((static_cast<quint64>(x) << 32) ^ static_cast<quint32>(y));
+	}
+}
+
+IncrementalTracer::IncrementalTracer()
+	: mReprojectionEnabled(false)
+	, mMaxFeatureCount(0)
+	, mSnapTolerance(1e-6)
+	, mInitialized(false)
+	, mCellSize(0)
+{
+}
+
+IncrementalTracer::~IncrementalTracer()
+{
+	disconnectLayers();
+}
+
+void IncrementalTracer::setLayers(const QList<QgsVectorLayer*> &layers)
+{
+	if (mLayers == layers)
+		return;
+
+	disconnectLayers();
+	mLayers = layers;
+	connectLayers();
+	invalidateGraph();
+}
+
+void IncrementalTracer::setCrsTransformEnabled(bool enabled)
+{
+	if (mReprojectionEnabled == enabled)
+		return;
+
+	mReprojectionEnabled = enabled;
+	invalidateGraph();
+}
+
+void IncrementalTracer::setDestinationCrs(const QgsCoordinateReferenceSystem &crs)
+{
+	if (mCRS == crs)
+		return;
+
+	mCRS = crs;
+	invalidateGraph();
+}
+
+void IncrementalTracer::setExtent(const QgsRectangle &extent)
+{
+	if (mExtent == extent)
+		return;
+
+	mExtent = extent;
+	invalidateGraph();
+}
+
+void IncrementalTracer::connectLayers()
+{
+	for (QgsVectorLayer *layer : mLayers)
+	{
+		mConnections << QObject::connect(layer, &QgsVectorLayer::featureAdded, [this, layer](QgsFeatureId fid) { addFeature(layer, fid); });
+		mConnections << QObject::connect(layer, &QgsVectorLayer::featureDeleted, [this, layer](QgsFeatureId fid) { removeFeature(layer, fid); });
+		mConnections << QObject::connect(layer, &QgsVectorLayer::geometryChanged, [this, layer](QgsFeatureId fid, const QgsGeometry &geom) { changeGeometry(layer, fid, geom); });
+		mConnections << QObject::connect(layer, &QObject::destroyed, [this, layer]()
+		{
+			QList<QgsVectorLayer*> remaining = mLayers;
+			remaining.removeAll(layer);
+			setLayers(remaining);
+		});
+	}
+}
+
+void IncrementalTracer::disconnectLayers()
+{
+	for (const QMetaObject::Connection &connection : mConnections)
+		QObject::disconnect(connection);
+	mConnections.clear();
+}
+
+void IncrementalTracer::invalidateGraph()
+{
+	mInitialized = false;
+	mVertices.clear();
+	mVertexIds.clear();
+	mSegments.clear();
+	mFreeSegments.clear();
+	mFeatureSegments.clear();
+	mGrid.clear();
+}
+
+bool IncrementalTracer::init()
+{
+	if (mInitialized)
+		return true;
+
+	invalidateGraph();
+
+	QgsFeatureRequest request;
+	request.setSubsetOfAttributes(QgsAttributeList());
+
+	QList<QPair<FeatureKey, QVector<QgsPolyline> > > features;
+	double totalLength = 0;
+	int segmentTotal = 0;
+	for (QgsVectorLayer *layer : mLayers)
+	{
+		QgsFeatureRequest layerRequest(request);
+		if (!mExtent.isEmpty())
+		{
+			QgsRectangle rect = mExtent;
+			if (mReprojectionEnabled && layer->crs() != mCRS)
+				rect = QgsCoordinateTransform(layer->crs(), mCRS).transformBoundingBox(mExtent, QgsCoordinateTransform::ReverseTransform);
+			layerRequest.setFilterRect(rect);
+		}
+
+		QgsFeatureIterator it = layer->getFeatures(layerRequest);
+		QgsFeature f;
+		while (it.nextFeature(f))
+		{
+			if (!f.hasGeometry())
+				continue;
+			if (mMaxFeatureCount > 0 && features.count() >= mMaxFeatureCount)
+				return false;
+
+			const QVector<QgsPolyline> lines = featureLines(layer, f.geometry());
+			features.append(qMakePair(FeatureKey(layer, f.id()), lines));
+			for (const QgsPolyline &line : lines)
+			{
+				for (int i = 1; i < line.size(); ++i)
+					totalLength += std::sqrt(line[i - 1].sqrDist(line[i]));
+				segmentTotal += qMax(0, line.size() - 1);
+			}
+		}
+	}
+
+	// a few average segments per cell keeps both cell lists and the number
+	// of cells touched by one segment small
+	mCellSize = segmentTotal > 0 ? 4 * totalLength / segmentTotal : 0;
+	mInitialized = true;
+	for (const QPair<FeatureKey, QVector<QgsPolyline> > &feature : features)
+		insertLines(feature.first, feature.second);
+	return true;
+}
+
+QVector<QgsPolyline> IncrementalTracer::featureLines(QgsVectorLayer *layer, const QgsGeometry &geom) const
+{
+	QVector<QgsPolyline> lines;
+	switch (geom.type())
+	{
+		case QgsWkbTypes::LineGeometry:
+			if (geom.isMultipart())
+				lines = geom.asMultiPolyline();
+			else
+				lines.append(geom.asPolyline());
+			break;
+
+		case QgsWkbTypes::PolygonGeometry:
+		{
+			const QgsMultiPolygon polygons = geom.isMultipart() ? geom.asMultiPolygon() : QgsMultiPolygon() << geom.asPolygon();
+			for (const QgsPolygon &polygon : polygons)
+				lines += polygon;
+			break;
+		}
+
+		default:
+			break;
+	}
+
+	if (mReprojectionEnabled && layer && layer->crs() != mCRS)
+	{
+		const QgsCoordinateTransform ct(layer->crs(), mCRS);
+		for (QgsPolyline &line : lines)
+		{
+			for (QgsPoint &pt : line)
+				pt = ct.transform(pt);
+		}
+	}
+	return lines;
+}
+
+void IncrementalTracer::insertLines(const FeatureKey &key, const QVector<QgsPolyline> &lines)
+{
+	for (const QgsPolyline &line : lines)
+	{
+		if (line.isEmpty())
+			continue;
+
+		QgsRectangle bbox(line.first(), line.first());
+		for (const QgsPoint &pt : line)
+			bbox.include(pt);
+		if (!mExtent.isEmpty() && !bbox.intersects(mExtent))
+			continue;
+
+		if (mCellSize <= 0)
+		{
+			// first linework of an empty graph decides the grid resolution
+			mCellSize = qMax(bbox.width(), bbox.height()) / 16;
+			if (mCellSize <= 0)
+				mCellSize = 1;
+		}
+
+		for (int i = 1; i < line.size(); ++i)
+			insertLine(line[i - 1], line[i], key);
+	}
+}
+
+void IncrementalTracer::addFeature(QgsVectorLayer *layer, QgsFeatureId fid)
+{
+	if (!mInitialized)
+		return;
+
+	QgsFeature f;
+	if (!layer->getFeatures(QgsFeatureRequest(fid).setSubsetOfAttributes(QgsAttributeList())).nextFeature(f) || !f.hasGeometry())
+		return;
+
+	insertLines(FeatureKey(layer, fid), featureLines(layer, f.geometry()));
+}
+
+void IncrementalTracer::removeFeature(QgsVectorLayer *layer, QgsFeatureId fid)
+{
+	if (!mInitialized)
+		return;
+
+	// segments of other features that were split where they crossed this
+	// one stay split; the extra degree-2 vertices do not change any path
+	const QSet<int> segments = mFeatureSegments.take(FeatureKey(layer, fid));
+	for (int id : segments)
+		removeSegment(id);
+}
+
+void IncrementalTracer::changeGeometry(QgsVectorLayer *layer, QgsFeatureId fid, const QgsGeometry &geom)
+{
+	if (!mInitialized)
+		return;
+
+	removeFeature(layer, fid);
+	insertLines(FeatureKey(layer, fid), featureLines(layer, geom));
+}
+
+int IncrementalTracer::vertexId(const QgsPoint &pt)
+{
+	const QPair<double, double> key(pt.x(), pt.y());
+	QHash<QPair<double, double>, int>::const_iterator it = mVertexIds.constFind(key);
+	if (it != mVertexIds.constEnd())
+		return it.value();
+
+	Vertex v;
+	v.pt = pt;
+	mVertices.append(v);
+	mVertexIds.insert(key, mVertices.count() - 1);
+	return mVertices.count() - 1;
+}
+
+void IncrementalTracer::gridCells(const QgsRectangle &rect, QVector<qint64> &cells) const
+{
+	// no linework yet, so no cells and nothing indexed
+	if (mCellSize <= 0)
+		return;
+	const qint64 x0 = static_cast<qint64>(std::floor(rect.xMinimum() / mCellSize));
+	const qint64 x1 = static_cast<qint64>(std::floor(rect.xMaximum() / mCellSize));
+	const qint64 y0 = static_cast<qint64>(std::floor(rect.yMinimum() / mCellSize));
+	const qint64 y1 = static_cast<qint64>(std::floor(rect.yMaximum() / mCellSize));
+	for (qint64 x = x0; x <= x1; ++x)
+	{
+		for (qint64 y = y0; y <= y1; ++y)
+			cells.append(cellKey(x, y));
+	}
+}
+
+void IncrementalTracer::segmentCells(const QgsPoint &a, const QgsPoint &b, QVector<qint64> &cells) const
+{
+	if (mCellSize <= 0)
+		return;
+
+	// walk slabs of cells across the longer axis u; in each, the segment
+	// spans the cells between its v at the two sides of the slab
+	const bool steep = std::fabs(b.y() - a.y()) > std::fabs(b.x() - a.x());
+	double u0 = steep ? a.y() : a.x(), v0 = steep ? a.x() : a.y();
+	double u1 = steep ? b.y() : b.x(), v1 = steep ? b.x() : b.y();
+	if (u1 < u0)
+	{
+		std::swap(u0, u1);
+		std::swap(v0, v1);
+	}
+
+	const double margin = CELL_MARGIN * mCellSize;
+	const double slope = u1 > u0 ? (v1 - v0) / (u1 - u0) : 0;
+	const qint64 first = static_cast<qint64>(std::floor((u0 - margin) / mCellSize));
+	const qint64 last = static_cast<qint64>(std::floor((u1 + margin) / mCellSize));
+	for (qint64 i = first; i <= last; ++i)
+	{
+		const double va = v0 + slope * (qBound(u0, i * mCellSize, u1) - u0);
+		const double vb = u1 > u0 ? v0 + slope * (qBound(u0, (i + 1) * mCellSize, u1) - u0) : v1;
+		const qint64 low = static_cast<qint64>(std::floor((qMin(va, vb) - margin) / mCellSize));
+		const qint64 high = static_cast<qint64>(std::floor((qMax(va, vb) + margin) / mCellSize));
+		for (qint64 j = low; j <= high; ++j)
+			cells.append(steep ? cellKey(j, i) : cellKey(i, j));
+	}
+}
+
+QVector<int> IncrementalTracer::segmentsNear(const QgsRectangle &rect) const
+{
+	QVector<qint64> cells;
+	gridCells(rect, cells);
+	return segmentsIn(cells);
+}
+
+QVector<int> IncrementalTracer::segmentsNear(const QgsPoint &a, const QgsPoint &b) const
+{
+	QVector<qint64> cells;
+	segmentCells(a, b, cells);
+	return segmentsIn(cells);
+}
+
+QVector<int> IncrementalTracer::segmentsIn(const QVector<qint64> &cells) const
+{
+	QVector<int> ids;
+	for (qint64 cell : cells)
+		ids += mGrid.value(cell);
+	std::sort(ids.begin(), ids.end());
+	ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+	return ids;
+}
+
+int IncrementalTracer::addSegment(int v1, int v2, const FeatureKey &owner)
+{
+	if (v1 == v2)
+		return -1;
+
+	const QgsPoint &a = mVertices[v1].pt;
+	const QgsPoint &b = mVertices[v2].pt;
+	Segment s = { v1, v2, std::sqrt(a.sqrDist(b)), owner, true };
+
+	int id;
+	if (!mFreeSegments.isEmpty())
+	{
+		id = mFreeSegments.last();
+		mFreeSegments.removeLast();
+		mSegments[id] = s;
+	}
+	else
+	{
+		id = mSegments.count();
+		mSegments.append(s);
+	}
+
+	mVertices[v1].segments.append(id);
+	mVertices[v2].segments.append(id);
+	mFeatureSegments[owner].insert(id);
+
+	QVector<qint64> cells;
+	segmentCells(a, b, cells);
+	for (qint64 cell : cells)
+		mGrid[cell].append(id);
+	return id;
+}
+
+void IncrementalTracer::removeSegment(int id)
+{
+	Segment &s = mSegments[id];
+	if (!s.alive)
+		return;
+	s.alive = false;
+
+	QVector<qint64> cells;
+	segmentCells(mVertices[s.v1].pt, mVertices[s.v2].pt, cells);
+	for (qint64 cell : cells)
+	{
+		QHash<qint64, QVector<int> >::iterator it = mGrid.find(cell);
+		if (it == mGrid.end())
+			continue;
+		it->removeOne(id);
+		if (it->isEmpty())
+			mGrid.erase(it);
+	}
+
+	for (int v : { s.v1, s.v2 })
+	{
+		Vertex &vertex = mVertices[v];
+		vertex.segments.removeOne(id);
+		// an isolated vertex must not be snapped to any more
+		if (vertex.segments.isEmpty())
+			mVertexIds.remove(qMakePair(vertex.pt.x(), vertex.pt.y()));
+	}
+
+	QHash<FeatureKey, QSet<int> >::iterator owner = mFeatureSegments.find(s.owner);
+	if (owner != mFeatureSegments.end())
+		owner->remove(id);
+	mFreeSegments.append(id);
+}
+
+void IncrementalTracer::splitSegment(int id, QVector<QPair<double, QgsPoint> > cuts)
+{
+	const Segment s = mSegments[id];
+	std::sort(cuts.begin(), cuts.end(), [](const QPair<double, QgsPoint> &a, const QPair<double, QgsPoint> &b) { return a.first < b.first; });
+
+	// add the pieces before removing the segment, otherwise its end points
+	// would briefly be isolated and lose their ids
+	int previous = s.v1;
+	for (const QPair<double, QgsPoint> &cut : cuts)
+	{
+		const int next = vertexId(cut.second);
+		addSegment(previous, next, s.owner);
+		previous = next;
+	}
+	addSegment(previous, s.v2, s.owner);
+	removeSegment(id);
+}
+
+void IncrementalTracer::insertLine(const QgsPoint &a, const QgsPoint &b, const FeatureKey &owner)
+{
+	if (a == b)
+		return;
+
+	const double rx = b.x() - a.x(), ry = b.y() - a.y();
+	const double rr = std::sqrt(rx * rx + ry * ry);
+
+	QVector<QPair<double, QgsPoint> > cuts;
+	QHash<int, QVector<QPair<double, QgsPoint> > > existingCuts;
+
+	for (int id : segmentsNear(a, b))
+	{
+		const Segment &e = mSegments[id];
+		const QgsPoint &c = mVertices[e.v1].pt;
+		const QgsPoint &d = mVertices[e.v2].pt;
+		const double sx = d.x() - c.x(), sy = d.y() - c.y();
+		const double ss = std::sqrt(sx * sx + sy * sy);
+		const double denom = cross(rx, ry, sx, sy);
+		const double qpx = c.x() - a.x(), qpy = c.y() - a.y();
+
+		if (std::fabs(denom) > PARAM_EPSILON * rr * ss)
+		{
+			double t = cross(qpx, qpy, sx, sy) / denom;
+			double u = cross(qpx, qpy, rx, ry) / denom;
+			if (t < -PARAM_EPSILON || t > 1 + PARAM_EPSILON || u < -PARAM_EPSILON || u > 1 + PARAM_EPSILON)
+				continue;
+
+			// prefer existing vertices so the new line joins the graph exactly
+			QgsPoint x(a.x() + t * rx, a.y() + t * ry);
+			if (u <= PARAM_EPSILON)
+				x = c;
+			else if (u >= 1 - PARAM_EPSILON)
+				x = d;
+			else if (t <= PARAM_EPSILON)
+				x = a;
+			else if (t >= 1 - PARAM_EPSILON)
+				x = b;
+
+			if (inside(u) && x != c && x != d)
+				existingCuts[id].append(qMakePair(u, x));
+			if (inside(t) && x != a && x != b)
+				cuts.append(qMakePair(param(a, b, x), x));
+		}
+		else if (std::fabs(cross(qpx, qpy, rx, ry)) <= PARAM_EPSILON * rr * rr)
+		{
+			// collinear: cut each segment at the other's end points inside it
+			for (const QgsPoint &p : { c, d })
+			{
+				const double t = param(a, b, p);
+				if (inside(t))
+					cuts.append(qMakePair(t, p));
+			}
+			for (const QgsPoint &p : { a, b })
+			{
+				const double u = param(c, d, p);
+				if (inside(u))
+					existingCuts[id].append(qMakePair(u, p));
+			}
+		}
+	}
+
+	for (QHash<int, QVector<QPair<double, QgsPoint> > >::const_iterator it = existingCuts.constBegin(); it != existingCuts.constEnd(); ++it)
+		splitSegment(it.key(), it.value());
+
+	std::sort(cuts.begin(), cuts.end(), [](const QPair<double, QgsPoint> &p, const QPair<double, QgsPoint> &q) { return p.first < q.first; });
+	int previous = vertexId(a);
+	for (const QPair<double, QgsPoint> &cut : cuts)
+	{
+		const int next = vertexId(cut.second);
+		addSegment(previous, next, owner);
+		previous = next;
+	}
+	addSegment(previous, vertexId(b), owner);
+}
+
+bool IncrementalTracer::locate(const QgsPoint &pt, Location &location) const
+{
+	const double tol = mSnapTolerance;
+	const QgsRectangle box(pt.x() - tol, pt.y() - tol, pt.x() + tol, pt.y() + tol);
+
+	location.vertex = -1;
+	location.segment = -1;
+	double best = tol * tol;
+	for (int id : segmentsNear(box))
+	{
+		const Segment &s = mSegments[id];
+		for (int v : { s.v1, s.v2 })
+		{
+			if (mVertices[v].pt.sqrDist(pt) <= tol * tol)
+			{
+				location.vertex = v;
+				location.pt = mVertices[v].pt;
+				return true;
+			}
+		}
+
+		const QgsPoint &a = mVertices[s.v1].pt;
+		const QgsPoint &b = mVertices[s.v2].pt;
+		QgsPoint onSegment;
+		const double d = pt.sqrDistToSegment(a.x(), a.y(), b.x(), b.y(), onSegment);
+		if (d <= best)
+		{
+			best = d;
+			location.segment = id;
+			location.pt = onSegment;
+		}
+	}
+	return location.segment >= 0;
+}
+
+bool IncrementalTracer::isPointSnapped(const QgsPoint &pt)
+{
+	if (!init())
+		return false;
+
+	Location location;
+	return locate(pt, location);
+}
+
+QVector<QgsPoint> IncrementalTracer::findShortestPath(const QgsPoint &p1, const QgsPoint &p2, PathError *error)
+{
+	if (error)
+		*error = ErrNone;
+
+	if (!init())
+	{
+		if (error)
+			*error = ErrTooManyFeatures;
+		return QVector<QgsPoint>();
+	}
+
+	Location from, to;
+	if (!locate(p1, from))
+	{
+		if (error)
+			*error = ErrPoint1;
+		return QVector<QgsPoint>();
+	}
+	if (!locate(p2, to))
+	{
+		if (error)
+			*error = ErrPoint2;
+		return QVector<QgsPoint>();
+	}
+
+	// search end points lying inside a segment get temporary ids
+	const int START = -1, GOAL = -2;
+	const int startNode = from.vertex >= 0 ? from.vertex : START;
+	const int goalNode = to.vertex >= 0 ? to.vertex : GOAL;
+	auto point = [&](int node) -> const QgsPoint & { return node == START ? from.pt : node == GOAL ? to.pt : mVertices[node].pt; };
+	auto distance = [](const QgsPoint &a, const QgsPoint &b) { return std::sqrt(a.sqrDist(b)); };
+
+	typedef QPair<double, int> Entry;
+	std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry> > queue;
+	QHash<int, double> cost;
+	QHash<int, int> previous;
+
+	auto relax = [&](int node, int next, double edgeCost)
+	{
+		const double c = cost.value(node) + edgeCost;
+		QHash<int, double>::iterator it = cost.find(next);
+		if (it != cost.end() && it.value() <= c)
+			return;
+		cost.insert(next, c);
+		previous.insert(next, node);
+		queue.push(Entry(c + distance(point(next), to.pt), next));
+	};
+
+	cost.insert(startNode, 0);
+	queue.push(Entry(distance(from.pt, to.pt), startNode));
+	QSet<int> settled;
+	while (!queue.empty())
+	{
+		const int node = queue.top().second;
+		queue.pop();
+		if (settled.contains(node))
+			continue;
+		settled.insert(node);
+		if (node == goalNode)
+			break;
+
+		if (node == START)
+		{
+			const Segment &s = mSegments[from.segment];
+			relax(node, s.v1, distance(from.pt, mVertices[s.v1].pt));
+			relax(node, s.v2, distance(from.pt, mVertices[s.v2].pt));
+			if (goalNode == GOAL && to.segment == from.segment)
+				relax(node, GOAL, distance(from.pt, to.pt));
+			continue;
+		}
+
+		for (int id : mVertices[node].segments)
+		{
+			const Segment &s = mSegments[id];
+			relax(node, s.v1 == node ? s.v2 : s.v1, s.length);
+			if (goalNode == GOAL && id == to.segment)
+				relax(node, GOAL, distance(mVertices[node].pt, to.pt));
+		}
+	}
+
+	if (!settled.contains(goalNode))
+	{
+		if (error)
+			*error = ErrNoPath;
+		return QVector<QgsPoint>();
+	}
+
+	QVector<QgsPoint> path;
+	for (int node = goalNode; ; node = previous.value(node))
+	{
+		path.prepend(point(node));
+		if (node == startNode)
+			break;
+	}
+	return path;
+}
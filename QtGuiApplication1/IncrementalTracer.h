@@ -0,0 +1,137 @@
+#pragma once
+
+#include "QHash"
+#include "QList"
+#include "QObject"
+#include "QPair"
+#include "QSet"
+#include "QVector"
+#include "qgscoordinatereferencesystem.h"
+#include "qgsfeature.h"
+#include "qgsrectangle.h"
+
+class QgsVectorLayer;
+
+// Tracer with the same interface as QgsTracer whose planar graph is kept up
+// to date while layers are edited. QgsTracer drops its graph on every
+// featureAdded/featureDeleted/geometryChanged and renodes all layers on the
+// next search; here only the changed feature is removed or inserted, and the
+// new linework is noded against the segments found in a grid index around it.
+//
+// The graph is stored at segment level: every vertex of the input lines is a
+// graph vertex, so shortest paths are searched with A* using the straight
+// line distance as heuristic.
+class IncrementalTracer
+{
+public:
+	enum PathError
+	{
+		ErrNone,
+		ErrTooManyFeatures,
+		ErrPoint1,
+		ErrPoint2,
+		ErrNoPath,
+	};
+
+	IncrementalTracer();
+	~IncrementalTracer();
+
+	QList<QgsVectorLayer*> layers() const { return mLayers; }
+	void setLayers(const QList<QgsVectorLayer*> &layers);
+
+	bool hasCrsTransformEnabled() const { return mReprojectionEnabled; }
+	void setCrsTransformEnabled(bool enabled);
+
+	QgsCoordinateReferenceSystem destinationCrs() const { return mCRS; }
+	void setDestinationCrs(const QgsCoordinateReferenceSystem &crs);
+
+	// Empty extent means no limit.
+	QgsRectangle extent() const { return mExtent; }
+	void setExtent(const QgsRectangle &extent);
+
+	// 0 means no limit; only checked when the graph is built from scratch.
+	int maxFeatureCount() const { return mMaxFeatureCount; }
+	void setMaxFeatureCount(int count) { mMaxFeatureCount = count; }
+
+	// Distance within which a point counts as lying on the graph.
+	double snapTolerance() const { return mSnapTolerance; }
+	void setSnapTolerance(double tolerance) { mSnapTolerance = tolerance; }
+
+	bool init();
+	bool isInitialized() const { return mInitialized; }
+	void invalidateGraph();
+
+	QVector<QgsPoint> findShortestPath(const QgsPoint &p1, const QgsPoint &p2, PathError *error = nullptr);
+	bool isPointSnapped(const QgsPoint &pt);
+
+	// Incremental updates. They are connected to the layers' edit signals by
+	// setLayers() and only need to be called directly for custom sources.
+	void addFeature(QgsVectorLayer *layer, QgsFeatureId fid);
+	void removeFeature(QgsVectorLayer *layer, QgsFeatureId fid);
+	void changeGeometry(QgsVectorLayer *layer, QgsFeatureId fid, const QgsGeometry &geom);
+
+	int vertexCount() const { return mVertexIds.count(); }
+	int segmentCount() const { return mSegments.count() - mFreeSegments.count(); }
+
+private:
+	typedef QPair<QgsVectorLayer*, QgsFeatureId> FeatureKey;
+
+	struct Vertex
+	{
+		QgsPoint pt;
+		QVector<int> segments;
+	};
+
+	struct Segment
+	{
+		int v1;
+		int v2;
+		double length;
+		FeatureKey owner;
+		bool alive;
+	};
+
+	// Where a search end point joins the graph: a vertex or a point on a segment.
+	struct Location
+	{
+		int vertex;
+		int segment;
+		QgsPoint pt;
+	};
+
+	void connectLayers();
+	void disconnectLayers();
+	QVector<QgsPolyline> featureLines(QgsVectorLayer *layer, const QgsGeometry &geom) const;
+	void insertLines(const FeatureKey &key, const QVector<QgsPolyline> &lines);
+
+	int vertexId(const QgsPoint &pt);
+	int addSegment(int v1, int v2, const FeatureKey &owner);
+	void removeSegment(int id);
+	void splitSegment(int id, QVector<QPair<double, QgsPoint> > cuts);
+	void insertLine(const QgsPoint &a, const QgsPoint &b, const FeatureKey &owner);
+
+	QVector<int> segmentsNear(const QgsRectangle &rect) const;
+	QVector<int> segmentsNear(const QgsPoint &a, const QgsPoint &b) const;
+	QVector<int> segmentsIn(const QVector<qint64> &cells) const;
+	void gridCells(const QgsRectangle &rect, QVector<qint64> &cells) const;
+	// only the cells the segment passes through, not its whole bounding box
+	void segmentCells(const QgsPoint &a, const QgsPoint &b, QVector<qint64> &cells) const;
+	bool locate(const QgsPoint &pt, Location &location) const;
+
+	QList<QgsVectorLayer*> mLayers;
+	QList<QMetaObject::Connection> mConnections;
+	bool mReprojectionEnabled;
+	QgsCoordinateReferenceSystem mCRS;
+	QgsRectangle mExtent;
+	int mMaxFeatureCount;
+	double mSnapTolerance;
+
+	bool mInitialized;
+	QVector<Vertex> mVertices;
+	QHash<QPair<double, double>, int> mVertexIds;
+	QVector<Segment> mSegments;
+	QVector<int> mFreeSegments;
+	QHash<FeatureKey, QSet<int> > mFeatureSegments;
+	QHash<qint64, QVector<int> > mGrid;
+	double mCellSize;
+};
@@ -0,0 +1,417 @@
+#include "KernelDensityEstimation.h"
+#include "QMap"
+#include "QMutex"
+#include "QMutexLocker"
+#include "RasterTileWriter.h"
+#include "qgsfeatureiterator.h"
+#include "qgsgeometry.h"
+#include "qgsrasterdataprovider.h"
+#include "qgsvectorlayer.h"
+#include "qmath.h"
+#include <cmath>
+#include <complex>
+#include <cstring>
+
+namespace
+{
+	const float NO_DATA = -9999;
+
+	// FFT grids are n x n complex values, one per worker and the kernel
+	// spectrum; larger ones would crowd a 32 bit address space
+	const int MAX_FFT_SIZE = 1024;
+	const qint64 MAX_FFT_BYTES = 256 * 1024 * 1024;
+
+	typedef std::complex<double> Complex;
+
+	// Kernel values of the cells within the radius of a point, which the
+	// stock class recomputes for every point.
+	struct KernelTable
+	{
+		int buffer;
+		// cells either side of the centre, by row
+		QVector<int> halfWidths;
+		// (2 buffer + 1)^2 values, row by row
+		QVector<double> values;
+	};
+
+	// In place radix 2 FFT of n = 2^k values; twiddles holds
+	// exp(-2 pi i k / n) for k < n / 2. Unscaled both ways.
+	void fft(Complex *a, int n, const Complex *twiddles, bool inverse)
+	{
+		for (int i = 1, j = 0; i < n; ++i)
+		{
+			int bit = n >> 1;
+			for (; j & bit; bit >>= 1)
+				j ^= bit;
+			j ^= bit;
+			if (i < j)
+				std::swap(a[i], a[j]);
+		}
+		for (int length = 2; length <= n; length <<= 1)
+		{
+			const int half = length / 2;
+			const int step = n / length;
+			for (int i = 0; i < n; i += length)
+			{
+				for (int k = 0; k < half; ++k)
+				{
+					const Complex w = inverse ? std::conj(twiddles[k * step]) : twiddles[k * step];
+					const Complex u = a[i + k];
+					const Complex v = a[i + k + half] * w;
+					a[i + k] = u + v;
+					a[i + k + half] = u - v;
+				}
+			}
+		}
+	}
+
+	// rows, then columns through column, of an n x n grid
+	void fft2(Complex *grid, int n, const Complex *twiddles, bool inverse, QVector<Complex> &column)
+	{
+		for (int r = 0; r < n; ++r)
+			fft(grid + r * n, n, twiddles, inverse);
+		column.resize(n);
+		for (int c = 0; c < n; ++c)
+		{
+			for (int r = 0; r < n; ++r)
+				column[r] = grid[r * n + c];
+			fft(column.data(), n, twiddles, inverse);
+			for (int r = 0; r < n; ++r)
+				grid[r * n + c] = column[r];
+		}
+	}
+}
+
+KernelDensityEstimation::KernelDensityEstimation(const Parameters &parameters, const QString &outputFile, const QString &outputFormat)
+	: mInputLayer(parameters.vectorLayer)
+	, mOutputFile(outputFile)
+	, mOutputFormat(outputFormat)
+	, mRadiusField(-1)
+	, mWeightField(-1)
+	, mRadius(parameters.radius)
+	, mPixelSize(parameters.pixelSize)
+	, mShape(parameters.shape)
+	, mDecay(parameters.decayRatio)
+	, mOutputValues(parameters.outputValues)
+	, mBufferSize(-1)
+	, mOutput(nullptr)
+	, mColumns(0)
+	, mRows(0)
+	, mMethod(Automatic)
+	, mTileSize(256)
+	, mThreadCount(0)
+{
+	if (mInputLayer && !parameters.radiusField.isEmpty())
+		mRadiusField = mInputLayer->fields().lookupField(parameters.radiusField);
+	if (mInputLayer && !parameters.weightField.isEmpty())
+		mWeightField = mInputLayer->fields().lookupField(parameters.weightField);
+}
+
+KernelDensityEstimation::~KernelDensityEstimation()
+{
+	delete mOutput;
+}
+
+KernelDensityEstimation::Result KernelDensityEstimation::run()
+{
+	Result result = prepare();
+	if (result != Success)
+		return result;
+
+	QgsAttributeList requiredAttributes;
+	if (mRadiusField >= 0)
+		requiredAttributes << mRadiusField;
+	if (mWeightField >= 0)
+		requiredAttributes << mWeightField;
+
+	QgsFeatureIterator fit = mInputLayer->getFeatures(QgsFeatureRequest().setSubsetOfAttributes(requiredAttributes));
+	QgsFeature f;
+	while (fit.nextFeature(f))
+		addFeature(f);
+
+	return finalise();
+}
+
+KernelDensityEstimation::Result KernelDensityEstimation::prepare()
+{
+	if (!mInputLayer)
+		return InvalidParameters;
+
+	mBounds = calculateBounds();
+	if (mBounds.isNull())
+		return InvalidParameters;
+
+	mRows = qMax(qCeil(mBounds.height() / mPixelSize) + 1, 1);
+	mColumns = qMax(qCeil(mBounds.width() / mPixelSize) + 1, 1);
+
+	double geoTransform[6] = { mBounds.xMinimum(), mPixelSize, 0, mBounds.yMaximum(), 0, -mPixelSize };
+	delete mOutput;
+	mOutput = QgsRasterDataProvider::create("gdal", mOutputFile, mOutputFormat, 1, Qgis::Float32, mColumns, mRows, geoTransform, mInputLayer->crs());
+	if (!mOutput || !mOutput->isValid())
+	{
+		delete mOutput;
+		mOutput = nullptr;
+		return FileCreationError;
+	}
+	mOutput->setNoDataValue(1, NO_DATA);
+
+	mBufferSize = mRadiusField >= 0 ? -1 : radiusSizeInPixels(mRadius);
+	mPoints.clear();
+	return Success;
+}
+
+KernelDensityEstimation::Result KernelDensityEstimation::addFeature(const QgsFeature &feature)
+{
+	const QgsGeometry featureGeometry = feature.geometry();
+	if (featureGeometry.isEmpty())
+		return Success;
+
+	QgsMultiPoint multiPoints;
+	if (!featureGeometry.isMultipart())
+		multiPoints << featureGeometry.asPoint();
+	else
+		multiPoints = featureGeometry.asMultiPoint();
+
+	const int buffer = mRadiusField >= 0 ? radiusSizeInPixels(feature.attribute(mRadiusField).toDouble()) : mBufferSize;
+	const double weight = mWeightField >= 0 ? feature.attribute(mWeightField).toDouble() : 1.0;
+	for (const QgsPoint &p : multiPoints)
+	{
+		if (!mBounds.contains(p))
+			continue;
+		const Point point =
+		{
+			static_cast<int>((p.x() - mBounds.xMinimum()) / mPixelSize),
+			static_cast<int>((mBounds.yMaximum() - p.y()) / mPixelSize),
+			buffer,
+			weight
+		};
+		mPoints.append(point);
+	}
+	return Success;
+}
+
+KernelDensityEstimation::Result KernelDensityEstimation::finalise()
+{
+	if (!mOutput)
+		return InvalidParameters;
+
+	// a table per radius in cells
+	QMap<int, KernelTable> tables;
+	for (const Point &point : mPoints)
+	{
+		if (tables.contains(point.buffer))
+			continue;
+		const int b = point.buffer;
+		const int side = 2 * b + 1;
+		KernelTable table;
+		table.buffer = b;
+		table.halfWidths.fill(-1, side);
+		table.values.fill(0, side * side);
+		for (int dy = -b; dy <= b; ++dy)
+		{
+			for (int dx = -b; dx <= b; ++dx)
+			{
+				const double distance = std::sqrt(static_cast<double>(dx * dx + dy * dy));
+				if (distance > b)
+					continue;
+				table.halfWidths[dy + b] = qMax(table.halfWidths[dy + b], dx);
+				table.values[(dy + b) * side + dx + b] = calculateKernelValue(distance, b);
+			}
+		}
+		tables.insert(b, table);
+	}
+
+	// points by the tiles their footprints reach
+	const int tilesX = (mColumns + mTileSize - 1) / mTileSize;
+	const int tilesY = (mRows + mTileSize - 1) / mTileSize;
+	QVector<QVector<int> > binned(tilesX * tilesY);
+	for (int i = 0; i < mPoints.size(); ++i)
+	{
+		const Point &point = mPoints[i];
+		const int x0 = qMax(point.column - point.buffer, 0) / mTileSize;
+		const int x1 = qMin(point.column + point.buffer, mColumns - 1) / mTileSize;
+		const int y0 = qMax(point.row - point.buffer, 0) / mTileSize;
+		const int y1 = qMin(point.row + point.buffer, mRows - 1) / mTileSize;
+		for (int ty = y0; ty <= y1; ++ty)
+		{
+			for (int tx = x0; tx <= x1; ++tx)
+				binned[ty * tilesX + tx].append(i);
+		}
+	}
+
+	// FFT grid that holds a tile with a footprint on every side; without
+	// room for it every tile is added up by stencil
+	RasterTileWriter writer(mOutput, mColumns, mRows);
+	writer.setTileSize(mTileSize);
+	writer.setThreadCount(mThreadCount);
+	int n = 0;
+	const KernelTable *fixed = mRadiusField < 0 && tables.size() == 1 ? &tables.constBegin().value() : nullptr;
+	if (fixed && mMethod != Stencil)
+	{
+		for (n = 1; n < mTileSize + 2 * fixed->buffer; n <<= 1) {}
+		if (n > MAX_FFT_SIZE || (writer.threadCount() + 1) * static_cast<qint64>(n) * n * sizeof(Complex) > MAX_FFT_BYTES)
+			fixed = nullptr;
+	}
+	const double fftCost = 10.0 * n * n * std::log2(qMax(n, 2));
+
+	// spectrum of the kernel table, placed around the origin, computed by
+	// the first tile that is convolved
+	QMutex spectrumMutex;
+	QVector<Complex> twiddles, spectrum;
+	auto prepareSpectrum = [&]
+	{
+		QMutexLocker locker(&spectrumMutex);
+		if (!spectrum.isEmpty())
+			return;
+		const int b = fixed->buffer;
+		const int side = 2 * b + 1;
+		twiddles.resize(n / 2);
+		for (int k = 0; k < n / 2; ++k)
+			twiddles[k] = std::polar(1.0, -2 * M_PI * k / n);
+		QVector<Complex> grid(n * n);
+		for (int dy = -b; dy <= b; ++dy)
+		{
+			for (int dx = -b; dx <= b; ++dx)
+				grid[((dy + n) % n) * n + (dx + n) % n] = fixed->values[(dy + b) * side + dx + b];
+		}
+		QVector<Complex> column;
+		fft2(grid.data(), n, twiddles.constData(), false, column);
+		spectrum.swap(grid);
+	};
+
+	struct Buffers
+	{
+		QVector<double> sums;
+		QVector<char> touched;
+		QVector<Complex> grid;
+		QVector<Complex> column;
+	};
+
+	QVector<Buffers> buffers(writer.threadCount());
+	const RasterTileWriter::Result result = writer.run([&](int worker, RasterTileWriter::Tile &tile)
+	{
+		const QVector<int> &points = binned[(tile.y / mTileSize) * tilesX + tile.x / mTileSize];
+		const int count = tile.width * tile.height;
+		if (points.isEmpty())
+		{
+			tile.data.fill(NO_DATA);
+			return true;
+		}
+
+		Buffers &b = buffers[worker];
+		b.sums.fill(0, count);
+		b.touched.fill(0, count);
+		bool convolve = false;
+		if (fixed)
+		{
+			const int cells = (2 * fixed->buffer + 1) * (2 * fixed->buffer + 1);
+			convolve = mMethod == Convolution || (mMethod == Automatic && static_cast<double>(points.size()) * cells > fftCost);
+		}
+
+		// footprints row by row; the cells they cover have data
+		for (int i : points)
+		{
+			const Point &point = mPoints[i];
+			const KernelTable &table = tables.constFind(point.buffer).value();
+			const int side = 2 * point.buffer + 1;
+			for (int dy = -point.buffer; dy <= point.buffer; ++dy)
+			{
+				const int r = point.row + dy - tile.y;
+				const int halfWidth = table.halfWidths[dy + point.buffer];
+				if (r < 0 || r >= tile.height || halfWidth < 0)
+					continue;
+				const int c0 = qMax(point.column - halfWidth - tile.x, 0);
+				const int c1 = qMin(point.column + halfWidth - tile.x, tile.width - 1);
+				if (c0 > c1)
+					continue;
+				std::memset(b.touched.data() + r * tile.width + c0, 1, c1 - c0 + 1);
+				if (convolve)
+					continue;
+				const double *kernel = table.values.constData() + (dy + point.buffer) * side + c0 + tile.x - point.column + point.buffer;
+				double *sums = b.sums.data() + r * tile.width;
+				for (int c = c0; c <= c1; ++c)
+					sums[c] += point.weight * kernel[c - c0];
+			}
+		}
+
+		if (convolve)
+		{
+			prepareSpectrum();
+
+			// point weights on the grid, the tile offset by the radius
+			const int offset = fixed->buffer;
+			b.grid.fill(Complex(), n * n);
+			for (int i : points)
+			{
+				const Point &point = mPoints[i];
+				b.grid[(point.row - tile.y + offset) * n + point.column - tile.x + offset] += point.weight;
+			}
+			fft2(b.grid.data(), n, twiddles.constData(), false, b.column);
+			for (int k = 0; k < n * n; ++k)
+				b.grid[k] *= spectrum[k];
+			fft2(b.grid.data(), n, twiddles.constData(), true, b.column);
+			const double scale = 1.0 / (static_cast<double>(n) * n);
+			for (int r = 0; r < tile.height; ++r)
+			{
+				for (int c = 0; c < tile.width; ++c)
+					b.sums[r * tile.width + c] = b.grid[(r + offset) * n + c + offset].real() * scale;
+			}
+		}
+
+		for (int k = 0; k < count; ++k)
+			tile.data[k] = b.touched[k] ? static_cast<float>(b.sums[k]) : NO_DATA;
+		return true;
+	}, nullptr);
+
+	delete mOutput;
+	mOutput = nullptr;
+	mPoints.clear();
+	return result == RasterTileWriter::Success ? Success : RasterIoError;
+}
+
+int KernelDensityEstimation::radiusSizeInPixels(double radius) const
+{
+	int buffer = radius / mPixelSize;
+	if (radius - (mPixelSize * buffer) > 0.5)
+		++buffer;
+	// the stock class divides by a zero bandwidth below half a cell
+	return qMax(buffer, 1);
+}
+
+QgsRectangle KernelDensityEstimation::calculateBounds() const
+{
+	if (!mInputLayer)
+		return QgsRectangle();
+
+	QgsRectangle bbox = mInputLayer->extent();
+	const double radius = mRadiusField >= 0 ? mInputLayer->maximumValue(mRadiusField).toDouble() : mRadius;
+
+	// expanded by the maximum search radius
+	bbox.setXMinimum(bbox.xMinimum() - radius);
+	bbox.setYMinimum(bbox.yMinimum() - radius);
+	bbox.setXMaximum(bbox.xMaximum() + radius);
+	bbox.setYMaximum(bbox.yMaximum() + radius);
+	return bbox;
+}
+
+double KernelDensityEstimation::calculateKernelValue(double distance, double bandwidth) const
+{
+	// as QgsKernelDensityEstimation, after Wand and Jones (1995), p. 175
+	const double ratio = distance / bandwidth;
+	const bool scaled = mOutputValues == OutputScaled;
+	switch (mShape)
+	{
+	case KernelUniform:
+		return scaled ? 2. / (M_PI * bandwidth) * (0.5 / bandwidth) : 1.0;
+	case KernelQuartic:
+		return (scaled ? 116. / (5. * M_PI * bandwidth * bandwidth) * (15. / 16.) : 1.0) * std::pow(1. - ratio * ratio, 2);
+	case KernelTriweight:
+		return (scaled ? 128. / (35. * M_PI * bandwidth * bandwidth) * (35. / 32.) : 1.0) * std::pow(1. - ratio * ratio, 3);
+	case KernelEpanechnikov:
+		return (scaled ? 8. / (3. * M_PI * bandwidth * bandwidth) * (3. / 4.) : 1.0) * (1. - ratio * ratio);
+	case KernelTriangular:
+		// a negative decay is not normalized
+		return (scaled && mDecay >= 0 ? 3. / ((1. + 2. * mDecay) * M_PI * bandwidth * bandwidth) : 1.0) * (1. - (1. - mDecay) * ratio);
+	}
+	return 0.0;
+}
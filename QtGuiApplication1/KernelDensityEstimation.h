@@ -0,0 +1,129 @@
+#pragma once
+
+#include "QString"
+#include "QVector"
+#include "qgsrectangle.h"
+
+class QgsFeature;
+class QgsRasterDataProvider;
+class QgsVectorLayer;
+
+// Replacement for QgsKernelDensityEstimation with the same parameters,
+// steps and results. The stock class reads, adds to and writes back the
+// block under every point's footprint in the GDAL dataset, evaluating the
+// kernel for every cell of it. Here addFeature() only collects the points;
+// finalise() bins them by output tile and lets RasterTileWriter add up the
+// tiles in memory on worker threads, writing them in order. Footprints are
+// tables of kernel values, one per radius in cells, added a row at a time.
+//
+// With a fixed radius the footprints of a tile can instead be added as one
+// FFT convolution of the point weights with the kernel table, whose cost
+// does not depend on the number of points. Automatic picks it per tile
+// when it is cheaper.
+//
+// qgskde.h pulls in gdal.h, which is not part of this project's include
+// path, so the parameter and result types are mirrored here.
+class KernelDensityEstimation
+{
+public:
+	// as QgsKernelDensityEstimation::KernelShape
+	enum KernelShape
+	{
+		KernelQuartic = 0,
+		KernelTriangular,
+		KernelUniform,
+		KernelTriweight,
+		KernelEpanechnikov,
+	};
+
+	// as QgsKernelDensityEstimation::OutputValues
+	enum OutputValues
+	{
+		OutputRaw = 0,
+		OutputScaled,
+	};
+
+	// as QgsKernelDensityEstimation::Result
+	enum Result
+	{
+		Success,
+		DriverError,
+		InvalidParameters,
+		FileCreationError,
+		RasterIoError,
+	};
+
+	// as QgsKernelDensityEstimation::Parameters
+	struct Parameters
+	{
+		QgsVectorLayer *vectorLayer;
+		double radius;
+		QString radiusField;
+		QString weightField;
+		double pixelSize;
+		KernelShape shape;
+		double decayRatio;
+		OutputValues outputValues;
+	};
+
+	enum Method
+	{
+		Automatic,
+		Stencil,
+		Convolution,
+	};
+
+	KernelDensityEstimation(const Parameters &parameters, const QString &outputFile, const QString &outputFormat);
+	~KernelDensityEstimation();
+
+	// Either call run(), or prepare(), addFeature() for every feature and
+	// finalise().
+	Result run();
+	Result prepare();
+	Result addFeature(const QgsFeature &feature);
+	Result finalise();
+
+	// Convolution only applies without a radius field, and while its
+	// grids (tile plus twice the radius, to a power of two) stay within
+	// 1024 cells a side and 256 MB for all workers; otherwise every tile
+	// is added up by stencil.
+	void setMethod(Method method) { mMethod = method; }
+	void setTileSize(int cells) { mTileSize = qMax(16, cells); }
+	// 0 uses QThread::idealThreadCount().
+	void setThreadCount(int threads) { mThreadCount = qMax(0, threads); }
+
+private:
+	// a point, by the cell under it
+	struct Point
+	{
+		int column;
+		int row;
+		int buffer;
+		double weight;
+	};
+
+	double calculateKernelValue(double distance, double bandwidth) const;
+	QgsRectangle calculateBounds() const;
+	int radiusSizeInPixels(double radius) const;
+
+	QgsVectorLayer *mInputLayer;
+	QString mOutputFile;
+	QString mOutputFormat;
+	int mRadiusField;
+	int mWeightField;
+	double mRadius;
+	double mPixelSize;
+	QgsRectangle mBounds;
+	KernelShape mShape;
+	double mDecay;
+	OutputValues mOutputValues;
+	int mBufferSize;
+
+	QgsRasterDataProvider *mOutput;
+	int mColumns;
+	int mRows;
+	QVector<Point> mPoints;
+	Method mMethod;
+	int mTileSize;
+	int mThreadCount;
+};
@@ -0,0 +1,62 @@
+#include "LabelArena.h"
+#include <cstdint>
+
+LabelArena::LabelArena(int blockSize)
+	: mBlockSize(qMax(blockSize, 1024))
+	, mOffset(0)
+	, mBytesUsed(0)
+	, mHeapAllocations(0)
+{
+}
+
+LabelArena::~LabelArena()
+{
+	for (const Block &block : mBlocks)
+		delete[] block.data;
+}
+
+void LabelArena::reset()
+{
+	if (mBlocks.size() > 1)
+	{
+		size_t total = 0;
+		for (const Block &block : mBlocks)
+		{
+			total += block.size;
+			delete[] block.data;
+		}
+		mBlocks.resize(1);
+		mBlocks[0].data = new char[total];
+		mBlocks[0].size = total;
+		++mHeapAllocations;
+	}
+	mOffset = 0;
+	mBytesUsed = 0;
+}
+
+void *LabelArena::allocateBytes(size_t size, size_t alignment)
+{
+	if (!mBlocks.isEmpty())
+	{
+		const Block &block = mBlocks.last();
+		const uintptr_t start = reinterpret_cast<uintptr_t>(block.data) + mOffset;
+		const uintptr_t aligned = (start + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+		const size_t offset = aligned - reinterpret_cast<uintptr_t>(block.data);
+		if (offset + size <= block.size)
+		{
+			mOffset = offset + size;
+			mBytesUsed += size;
+			return block.data + offset;
+		}
+	}
+
+	// new blocks come from operator new[], which is aligned for any type
+	Block block;
+	block.size = qMax(mBlockSize, size);
+	block.data = new char[block.size];
+	mBlocks.append(block);
+	++mHeapAllocations;
+	mOffset = size;
+	mBytesUsed += size;
+	return block.data;
+}
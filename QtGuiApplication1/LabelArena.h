@@ -0,0 +1,53 @@
+#pragma once
+
+#include "QVector"
+#include <type_traits>
+
+// Bump allocator owning the data of one labeling run. Memory is handed out
+// from large blocks and released all at once by reset(), which keeps it for
+// the next run: if a run needed several blocks they are replaced by a single
+// block large enough for all of them, so a steady sequence of renders stops
+// allocating after the first few frames.
+//
+// Objects are never destroyed, so only trivially destructible types may be
+// allocated. Not thread safe; give each thread its own arena.
+class LabelArena
+{
+public:
+	explicit LabelArena(int blockSize = 256 * 1024);
+	~LabelArena();
+
+	// Uninitialised storage for count objects.
+	template <typename T>
+	T *allocate(int count)
+	{
+		static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+		return static_cast<T*>(allocateBytes(sizeof(T) * count, alignof(T)));
+	}
+
+	void reset();
+
+	int blockCount() const { return mBlocks.size(); }
+	// Bytes handed out since the last reset.
+	qint64 bytesUsed() const { return mBytesUsed; }
+	// Blocks allocated from the heap since construction.
+	qint64 heapAllocations() const { return mHeapAllocations; }
+
+private:
+	void *allocateBytes(size_t size, size_t alignment);
+
+	struct Block
+	{
+		char *data;
+		size_t size;
+	};
+
+	QVector<Block> mBlocks;
+	size_t mBlockSize;
+	size_t mOffset;
+	qint64 mBytesUsed;
+	qint64 mHeapAllocations;
+
+	LabelArena(const LabelArena &) = delete;
+	LabelArena &operator=(const LabelArena &) = delete;
+};
@@ -0,0 +1,201 @@
+#include "LabelArenaBenchmark.h"
+#include "LabelArena.h"
+#include "QElapsedTimer"
+#include "QStringList"
+#include <algorithm>
+#include <random>
+
+namespace
+{
+	// pal::FeaturePart and pal::LabelPosition, reduced to their layout
+	struct Shape
+	{
+		int count;
+		double *x;
+		double *y;
+	};
+
+	struct Candidate
+	{
+		double x[4];
+		double y[4];
+		double cost;
+		int feature;
+		Candidate *nextPart;
+	};
+
+	// vertices and candidates (parts per candidate) of each kind of feature
+	struct Kind
+	{
+		int vertices;
+		int candidates;
+		int parts;
+	};
+
+	const Kind POINT_KIND = { 1, 8, 1 };
+	const Kind LINE_KIND = { 40, 10, 3 };
+	const Kind POLYGON_KIND = { 60, 16, 1 };
+
+	// LabelArena's interface over one heap allocation per object, as PAL
+	struct HeapAllocator
+	{
+		HeapAllocator()
+			: bytes(0)
+		{
+		}
+
+		template <typename T>
+		T *allocate(int count)
+		{
+			char *data = new char[sizeof(T) * count];
+			allocated.append(data);
+			bytes += sizeof(T) * count;
+			return reinterpret_cast<T *>(data);
+		}
+
+		void reset()
+		{
+			for (char *data : allocated)
+				delete[] data;
+			allocated.resize(0);
+			bytes = 0;
+		}
+
+		QVector<char *> allocated;
+		qint64 bytes;
+	};
+
+	qint64 median(QVector<qint64> times)
+	{
+		std::sort(times.begin(), times.end());
+		return times.isEmpty() ? 0 : times[times.size() / 2];
+	}
+
+	QString milliseconds(qint64 nsecs)
+	{
+		return QString::number(nsecs / 1e6, 'f', 2) + " ms";
+	}
+
+	// Builds one frame from allocator and returns a checksum of the
+	// candidate walk.
+	template <typename Allocator>
+	double frame(const QVector<int> &kinds, const QVector<double> &coordinates, QVector<Shape *> &shapes, QVector<Candidate *> &candidates, Allocator &allocator)
+	{
+		const Kind table[3] = { POINT_KIND, LINE_KIND, POLYGON_KIND };
+		shapes.resize(0);
+		candidates.resize(0);
+		for (int f = 0; f < kinds.size(); ++f)
+		{
+			const Kind &kind = table[kinds[f]];
+			Shape *shape = allocator.template allocate<Shape>(1);
+			shape->count = kind.vertices;
+			shape->x = allocator.template allocate<double>(kind.vertices);
+			shape->y = allocator.template allocate<double>(kind.vertices);
+			const double *source = coordinates.constData() + 2 * f;
+			for (int i = 0; i < kind.vertices; ++i)
+			{
+				shape->x[i] = source[0] + i;
+				shape->y[i] = source[1] + (i & 1);
+			}
+			shapes.append(shape);
+
+			for (int c = 0; c < kind.candidates; ++c)
+			{
+				Candidate *first = nullptr;
+				Candidate **link = &first;
+				for (int p = 0; p < kind.parts; ++p)
+				{
+					Candidate *part = allocator.template allocate<Candidate>(1);
+					const int v = (c + p) % kind.vertices;
+					for (int k = 0; k < 4; ++k)
+					{
+						part->x[k] = shape->x[v] + (k & 1);
+						part->y[k] = shape->y[v] + (k >> 1);
+					}
+					part->cost = 0.001 * c;
+					part->feature = f;
+					part->nextPart = nullptr;
+					*link = part;
+					link = &part->nextPart;
+				}
+				candidates.append(first);
+			}
+		}
+
+		double checksum = 0;
+		for (const Candidate *candidate : candidates)
+		{
+			for (const Candidate *part = candidate; part; part = part->nextPart)
+				checksum += part->cost + part->x[0] - part->y[3];
+		}
+		return checksum;
+	}
+}
+
+LabelArenaBenchmark::Result LabelArenaBenchmark::run(int points, int lines, int polygons, int frames, unsigned int seed)
+{
+	// features in a shuffled order, as layers and tiles interleave them
+	QVector<int> kinds;
+	kinds.insert(kinds.end(), qMax(points, 0), 0);
+	kinds.insert(kinds.end(), qMax(lines, 0), 1);
+	kinds.insert(kinds.end(), qMax(polygons, 0), 2);
+	std::mt19937 random(seed);
+	std::shuffle(kinds.begin(), kinds.end(), random);
+	std::uniform_real_distribution<double> coordinate(0, 100000);
+	QVector<double> coordinates(2 * kinds.size());
+	for (double &c : coordinates)
+		c = coordinate(random);
+
+	Result result;
+	result.features = kinds.size();
+	result.candidates = 0;
+	result.heapAllocations = 0;
+	result.arenaFirstAllocations = 0;
+	result.arenaAllocations = 0;
+	result.bytes = 0;
+
+	// the pointer lists keep their capacity in both modes
+	QVector<Shape *> shapes;
+	QVector<Candidate *> candidates;
+	QVector<qint64> heapTimes, arenaTimes, arenaAllocations;
+	double checksum = 0;
+	HeapAllocator heap;
+	LabelArena arena;
+	for (int r = 0; r < qMax(frames, 1); ++r)
+	{
+		QElapsedTimer timer;
+		timer.start();
+		checksum += frame(kinds, coordinates, shapes, candidates, heap);
+		result.heapAllocations = heap.allocated.size();
+		result.bytes = heap.bytes;
+		heap.reset();
+		heapTimes.append(timer.nsecsElapsed());
+
+		const qint64 before = arena.heapAllocations();
+		timer.restart();
+		checksum -= frame(kinds, coordinates, shapes, candidates, arena);
+		arena.reset();
+		arenaTimes.append(timer.nsecsElapsed());
+		arenaAllocations.append(arena.heapAllocations() - before);
+		result.candidates = candidates.size();
+	}
+
+	// both modes build the same frames
+	Q_ASSERT(checksum == 0);
+	result.arenaFirstAllocations = arenaAllocations.first();
+	result.arenaAllocations = arenaAllocations.last();
+	result.heapTime = median(heapTimes);
+	result.arenaTime = median(arenaTimes);
+	return result;
+}
+
+QString LabelArenaBenchmark::report(const Result &result)
+{
+	QStringList lines;
+	lines << QString("%1 features, %2 candidates, %3 MB per frame")
+		.arg(result.features).arg(result.candidates).arg(QString::number(result.bytes / 1048576.0, 'f', 1));
+	lines << QString("heap: %1 allocations, %2").arg(result.heapAllocations).arg(milliseconds(result.heapTime));
+	lines << QString("arena: %1 allocations (first frame %2), %3")
+		.arg(result.arenaAllocations).arg(result.arenaFirstAllocations).arg(milliseconds(result.arenaTime));
+	return lines.join('\n');
+}
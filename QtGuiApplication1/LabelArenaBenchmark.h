@@ -0,0 +1,33 @@
+#pragma once
+
+#include "QString"
+#include "QVector"
+
+// Per frame allocation benchmark of LabelArena. Every frame builds the
+// shapes and candidates of a reproducible set of point, line and polygon
+// features as PAL lays them out (a feature part with x and y arrays, and
+// candidates with a chain of parts for curved labels), walks all
+// candidates once as the solver does, and releases everything. This is
+// done either with one heap allocation per object, as PAL does, or from a
+// LabelArena reset after each frame.
+class LabelArenaBenchmark
+{
+public:
+	struct Result
+	{
+		int features;
+		int candidates;
+		// heap allocations in one frame
+		qint64 heapAllocations;
+		qint64 arenaFirstAllocations;
+		qint64 arenaAllocations;
+		// bytes requested in one frame
+		qint64 bytes;
+		// median nanoseconds per frame
+		qint64 heapTime;
+		qint64 arenaTime;
+	};
+
+	static Result run(int points = 20000, int lines = 5000, int polygons = 2000, int frames = 10, unsigned int seed = 1);
+	static QString report(const Result &result);
+};
@@ -0,0 +1,103 @@
+#include "LabelBenchmark.h"
+#include "LabelEngine.h"
+#include "QElapsedTimer"
+#include "QStringList"
+#include "qgspoint.h"
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+namespace
+{
+	qint64 median(QVector<qint64> times)
+	{
+		std::sort(times.begin(), times.end());
+		return times.isEmpty() ? 0 : times[times.size() / 2];
+	}
+
+	QString milliseconds(qint64 nsecs)
+	{
+		return QString::number(nsecs / 1e6, 'f', 2) + " ms";
+	}
+}
+
+LabelBenchmark::Result LabelBenchmark::run(int features, int repeats, double density, unsigned int seed)
+{
+	const double width = 10;
+	const double height = 4;
+	const double side = std::sqrt(features * width * height / qMax(density, 0.01));
+
+	// three layers of different priority, as on a typical map
+	LabelEngine engine;
+	engine.setSearchMethod(LabelEngine::PopmusicChain);
+	engine.setDeterministic(true);
+	for (int l = 0; l < 3; ++l)
+	{
+		LabelEngine::LayerSettings settings;
+		settings.placement = LabelEngine::AroundPoint;
+		settings.distance = 1;
+		settings.priority = 0.25 * (l + 1);
+		engine.addLayer(settings);
+	}
+
+	std::mt19937 random(seed);
+	std::uniform_real_distribution<double> coordinate(0, side);
+	for (int i = 0; i < features; ++i)
+	{
+		const double x = coordinate(random);
+		const double y = coordinate(random);
+		engine.addFeature(i % 3, i, QgsGeometry::fromPoint(QgsPoint(x, y)), width, height);
+	}
+	const QgsRectangle extent(-width - 1, -width - 1, side + width + 1, side + width + 1);
+
+	Result result;
+	result.features = features;
+	result.placed = 0;
+	QVector<qint64> candidates, conflicts, solve, popmusic;
+	QVector<qint64> heaps[3];
+	for (int r = 0; r < qMax(repeats, 1); ++r)
+	{
+		result.placed = engine.run(extent).size();
+		const LabelEngine::Timings &timings = engine.lastTimings();
+		candidates.append(timings.candidates);
+		conflicts.append(timings.conflicts);
+		solve.append(timings.solve);
+		popmusic.append(timings.popmusic);
+
+		// the conflict graph of the run is still in the engine
+		QElapsedTimer timer;
+		timer.start();
+		engine.falp<2>();
+		heaps[0].append(timer.nsecsElapsed());
+		timer.restart();
+		engine.falp<4>();
+		heaps[1].append(timer.nsecsElapsed());
+		timer.restart();
+		engine.falp<8>();
+		heaps[2].append(timer.nsecsElapsed());
+	}
+
+	result.candidates = engine.candidateCount();
+	result.conflicts = engine.conflictCount();
+	result.candidatesTime = median(candidates);
+	result.conflictsTime = median(conflicts);
+	result.solveTime = median(solve);
+	result.popmusicTime = median(popmusic);
+	for (int i = 0; i < 3; ++i)
+		result.heapTimes[i] = median(heaps[i]);
+	return result;
+}
+
+QString LabelBenchmark::report(const Result &result)
+{
+	QStringList lines;
+	lines << QString("%1 features, %2 candidates, %3 conflicts, %4 placed")
+		.arg(result.features).arg(result.candidates).arg(result.conflicts).arg(result.placed);
+	lines << "candidates: " + milliseconds(result.candidatesTime);
+	lines << "conflicts: " + milliseconds(result.conflictsTime);
+	lines << "falp: " + milliseconds(result.solveTime);
+	lines << "popmusic: " + milliseconds(result.popmusicTime);
+	lines << QString("falp heap arity 2/4/8: %1 / %2 / %3")
+		.arg(milliseconds(result.heapTimes[0]), milliseconds(result.heapTimes[1]), milliseconds(result.heapTimes[2]));
+	return lines.join('\n');
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "QString"
+#include "QVector"
+
+// Micro-benchmark of the label problem reduction. Builds a reproducible
+// set of point features dense enough that most candidates conflict, runs
+// LabelEngine on it repeatedly and keeps the median time of every phase.
+// The FALP phase alone is also timed with heaps of arity 2, 4 and 8 on the
+// conflict graph of the same problem.
+class LabelBenchmark
+{
+public:
+	struct Result
+	{
+		int features;
+		int candidates;
+		int conflicts;
+		int placed;
+		// median nanoseconds over all repeats
+		qint64 candidatesTime;
+		qint64 conflictsTime;
+		qint64 solveTime;
+		qint64 popmusicTime;
+		// FALP with a binary, 4-ary and 8-ary heap
+		qint64 heapTimes[3];
+	};
+
+	// features are spread over a square with about density labels per label area
+	static Result run(int features = 50000, int repeats = 5, double density = 3.0, unsigned int seed = 1);
+	static QString report(const Result &result);
+};
@@ -0,0 +1,1114 @@
+#include "LabelEngine.h"
+#include "DaryHeap.h"
+#include "PackedRTree.h"
+#include "QElapsedTimer"
+#include "QMutex"
+#include "QThread"
+#include "QVarLengthArray"
+#include "QWaitCondition"
+#include "QtConcurrentMap"
+#include "QtConcurrentRun"
+#include "TextLayoutCache.h"
+#include "qgsabstractgeometry.h"
+#include "qgspointv2.h"
+#include "qmath.h"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+
+namespace
+{
+	// Rings firstRing .. lastRing of a flattened geometry.
+	struct Rings
+	{
+		const double *x;
+		const double *y;
+		const int *ends;
+		int first;
+		int last;
+
+		int begin(int ring) const { return ring == 0 ? 0 : ends[ring - 1]; }
+		int end(int ring) const { return ends[ring]; }
+	};
+
+	// Even-odd test over all rings, so holes are handled.
+	bool insideRings(double px, double py, const Rings &rings)
+	{
+		bool inside = false;
+		for (int r = rings.first; r < rings.last; ++r)
+		{
+			const int begin = rings.begin(r), end = rings.end(r);
+			for (int i = begin, j = end - 1; i < end; j = i++)
+			{
+				const double ax = rings.x[i], ay = rings.y[i];
+				const double bx = rings.x[j], by = rings.y[j];
+				if ((ay > py) != (by > py) && px < (bx - ax) * (py - ay) / (by - ay) + ax)
+					inside = !inside;
+			}
+		}
+		return inside;
+	}
+
+	// Liang-Barsky clip of segment ab against the open rectangle.
+	bool crossesInterior(double ax, double ay, double bx, double by, const QgsRectangle &r)
+	{
+		const double dx = bx - ax;
+		const double dy = by - ay;
+		const double p[4] = { -dx, dx, -dy, dy };
+		const double q[4] = { ax - r.xMinimum(), r.xMaximum() - ax, ay - r.yMinimum(), r.yMaximum() - ay };
+		double t0 = 0, t1 = 1;
+		for (int i = 0; i < 4; ++i)
+		{
+			if (p[i] == 0)
+			{
+				if (q[i] <= 0)
+					return false;
+				continue;
+			}
+			const double t = q[i] / p[i];
+			if (p[i] < 0)
+				t0 = qMax(t0, t);
+			else
+				t1 = qMin(t1, t);
+			if (t0 >= t1)
+				return false;
+		}
+		const double mx = ax + dx * (t0 + t1) / 2;
+		const double my = ay + dy * (t0 + t1) / 2;
+		return mx > r.xMinimum() && mx < r.xMaximum() && my > r.yMinimum() && my < r.yMaximum();
+	}
+
+	bool rectangleInside(const QgsRectangle &r, const Rings &rings)
+	{
+		if (!insideRings(r.xMinimum(), r.yMinimum(), rings) || !insideRings(r.xMaximum(), r.yMinimum(), rings)
+			|| !insideRings(r.xMaximum(), r.yMaximum(), rings) || !insideRings(r.xMinimum(), r.yMaximum(), rings))
+			return false;
+		for (int ring = rings.first; ring < rings.last; ++ring)
+		{
+			for (int i = rings.begin(ring) + 1; i < rings.end(ring); ++i)
+			{
+				if (crossesInterior(rings.x[i - 1], rings.y[i - 1], rings.x[i], rings.y[i], r))
+					return false;
+			}
+		}
+		return true;
+	}
+
+	QgsPoint ringCentroid(const Rings &rings)
+	{
+		const int begin = rings.begin(rings.first), end = rings.end(rings.first);
+		double area = 0, cx = 0, cy = 0;
+		for (int i = begin, j = end - 1; i < end; j = i++)
+		{
+			const double cross = rings.x[j] * rings.y[i] - rings.x[i] * rings.y[j];
+			area += cross;
+			cx += (rings.x[j] + rings.x[i]) * cross;
+			cy += (rings.y[j] + rings.y[i]) * cross;
+		}
+		if (area == 0)
+		{
+			QgsRectangle r;
+			r.setMinimal();
+			for (int i = begin; i < end; ++i)
+				r.combineExtentWith(rings.x[i], rings.y[i]);
+			return r.center();
+		}
+		return QgsPoint(cx / (3 * area), cy / (3 * area));
+	}
+
+	// FALP order: fewest conflicts, then lowest cost; the candidate index
+	// makes the order total, so the result does not depend on the heap
+	struct QueueKey
+	{
+		int overlaps;
+		double cost;
+		int candidate;
+
+		bool operator<(const QueueKey &other) const
+		{
+			if (overlaps != other.overlaps)
+				return overlaps < other.overlaps;
+			if (cost != other.cost)
+				return cost < other.cost;
+			return candidate < other.candidate;
+		}
+	};
+}
+
+void LabelCandidate::corners(double xs[4], double ys[4]) const
+{
+	const double c = std::cos(angle);
+	const double s = std::sin(angle);
+	xs[0] = x;
+	ys[0] = y;
+	xs[1] = x + width * c;
+	ys[1] = y + width * s;
+	xs[2] = xs[1] - height * s;
+	ys[2] = ys[1] + height * c;
+	xs[3] = x - height * s;
+	ys[3] = y + height * c;
+}
+
+QgsRectangle LabelCandidate::boundingBox() const
+{
+	double xs[4], ys[4];
+	corners(xs, ys);
+	return QgsRectangle(*std::min_element(xs, xs + 4), *std::min_element(ys, ys + 4),
+		*std::max_element(xs, xs + 4), *std::max_element(ys, ys + 4));
+}
+
+bool LabelCandidate::conflicts(const LabelCandidate &other) const
+{
+	const double epsilon = 1e-9 * qMax(qMax(width, height), qMax(other.width, other.height));
+	if (angle == 0 && other.angle == 0)
+	{
+		return x + width > other.x + epsilon && other.x + other.width > x + epsilon
+			&& y + height > other.y + epsilon && other.y + other.height > y + epsilon;
+	}
+
+	double ax[4], ay[4], bx[4], by[4];
+	corners(ax, ay);
+	other.corners(bx, by);
+
+	// separating axis test on the edge normals of both rectangles
+	const double angles[2] = { angle, other.angle };
+	for (double a : angles)
+	{
+		for (int k = 0; k < 2; ++k)
+		{
+			const double nx = k == 0 ? std::cos(a) : -std::sin(a);
+			const double ny = k == 0 ? std::sin(a) : std::cos(a);
+			double amin = ax[0] * nx + ay[0] * ny, amax = amin;
+			double bmin = bx[0] * nx + by[0] * ny, bmax = bmin;
+			for (int i = 1; i < 4; ++i)
+			{
+				const double pa = ax[i] * nx + ay[i] * ny;
+				const double pb = bx[i] * nx + by[i] * ny;
+				amin = qMin(amin, pa);
+				amax = qMax(amax, pa);
+				bmin = qMin(bmin, pb);
+				bmax = qMax(bmax, pb);
+			}
+			if (amax <= bmin + epsilon || bmax <= amin + epsilon)
+				return false;
+		}
+	}
+	return true;
+}
+
+LabelEngine::LayerSettings::LayerSettings()
+	: placement(AroundPoint)
+	, distance(0)
+	, candidates(8)
+	, lineFlags(AboveLine | BelowLine)
+	, priority(0.5)
+{
+}
+
+LabelEngine::LabelEngine()
+	: mChunkSize(256)
+	, mIncremental(false)
+	, mSearchMethod(PopmusicChain)
+	, mSubpartSize(30)
+	, mDeterministic(false)
+{
+	mTimings.candidates = mTimings.conflicts = mTimings.solve = mTimings.popmusic = 0;
+}
+
+void LabelEngine::setIncremental(bool incremental)
+{
+	mIncremental = incremental;
+	if (!incremental)
+		mPrevious.clear();
+}
+
+int LabelEngine::addLayer(const LayerSettings &settings)
+{
+	mLayers.append(settings);
+	return mLayers.size() - 1;
+}
+
+void LabelEngine::addFeature(int layer, QgsFeatureId id, const QgsGeometry &geometry, double width, double height)
+{
+	if (layer < 0 || layer >= mLayers.size() || geometry.isEmpty())
+		return;
+
+	Feature f;
+	f.layer = layer;
+	f.id = id;
+	f.width = width;
+	f.height = height;
+	f.type = geometry.type();
+	f.bounds.setMinimal();
+
+	// walk the vertices instead of asPolyline() and friends, which copy
+	mScratchX.resize(0);
+	mScratchY.resize(0);
+	mScratchRingEnds.resize(0);
+	mScratchPartEnds.resize(0);
+	QgsVertexId vid;
+	QgsVertexId previous;
+	QgsPointV2 p;
+	const QgsAbstractGeometry *g = geometry.geometry();
+	while (g->nextVertex(vid, p))
+	{
+		if (!mScratchX.isEmpty() && (vid.part != previous.part || vid.ring != previous.ring))
+		{
+			mScratchRingEnds.append(mScratchX.size());
+			if (vid.part != previous.part)
+				mScratchPartEnds.append(mScratchRingEnds.size());
+		}
+		mScratchX.append(p.x());
+		mScratchY.append(p.y());
+		f.bounds.combineExtentWith(p.x(), p.y());
+		previous = vid;
+	}
+	if (mScratchX.isEmpty())
+		return;
+	mScratchRingEnds.append(mScratchX.size());
+	mScratchPartEnds.append(mScratchRingEnds.size());
+
+	const int points = mScratchX.size();
+	double *x = mArena.allocate<double>(points);
+	double *y = mArena.allocate<double>(points);
+	int *ringEnds = mArena.allocate<int>(mScratchRingEnds.size());
+	int *partEnds = mArena.allocate<int>(mScratchPartEnds.size());
+	std::copy(mScratchX.constBegin(), mScratchX.constEnd(), x);
+	std::copy(mScratchY.constBegin(), mScratchY.constEnd(), y);
+	std::copy(mScratchRingEnds.constBegin(), mScratchRingEnds.constEnd(), ringEnds);
+	std::copy(mScratchPartEnds.constBegin(), mScratchPartEnds.constEnd(), partEnds);
+	f.x = x;
+	f.y = y;
+	f.ringEnds = ringEnds;
+	f.partEnds = partEnds;
+	f.partCount = mScratchPartEnds.size();
+	mFeatures.append(f);
+}
+
+void LabelEngine::addFeature(int layer, QgsFeatureId id, const QgsGeometry &geometry, const QString &text, const QFont &font, double mapUnitsPerPixel)
+{
+	const QSizeF size = TextLayoutCache::instance()->size(font, text);
+	addFeature(layer, id, geometry, size.width() * mapUnitsPerPixel, size.height() * mapUnitsPerPixel);
+}
+
+void LabelEngine::clear()
+{
+	mFeatures.resize(0);
+	mCandidates.resize(0);
+	mFeatureOffsets.resize(0);
+	mConflictOffsets.resize(0);
+	mConflicts.resize(0);
+	mArena.reset();
+}
+
+QVector<LabelEngine::Label> LabelEngine::run(const QgsRectangle &extent)
+{
+	QElapsedTimer timer;
+	timer.start();
+	mFixedCandidates.resize(0);
+	mFixedOf.fill(-1, mFeatures.size());
+	if (mIncremental)
+	{
+		for (int i = 0; i < mFeatures.size(); ++i)
+		{
+			const Feature &f = mFeatures[i];
+			QHash<QPair<int, QgsFeatureId>, PreviousLabel>::const_iterator it = mPrevious.constFind(qMakePair(f.layer, f.id));
+			if (it == mPrevious.constEnd() || it->width != f.width || it->height != f.height || it->bounds != f.bounds
+				|| !extent.contains(it->candidate.boundingBox()))
+				continue;
+			mFixedOf[i] = mFixedCandidates.size();
+			mFixedCandidates.append(it->candidate);
+			mFixedCandidates.last().feature = i;
+		}
+	}
+	QVector<QgsRectangle> fixedBounds(mFixedCandidates.size());
+	for (int i = 0; i < mFixedCandidates.size(); ++i)
+		fixedBounds[i] = mFixedCandidates[i].boundingBox();
+	const PackedRTree fixedIndex(fixedBounds);
+
+	// chunks keep their buffers from the previous run
+	mChunks.resize((mFeatures.size() + mChunkSize - 1) / mChunkSize);
+	for (int c = 0; c < mChunks.size(); ++c)
+	{
+		Chunk &chunk = mChunks[c];
+		chunk.begin = c * mChunkSize;
+		chunk.end = qMin(chunk.begin + mChunkSize, mFeatures.size());
+		chunk.candidates.resize(0);
+		chunk.offsets.resize(0);
+	}
+
+	QtConcurrent::blockingMap(mChunks, [this, &extent, &fixedIndex](Chunk &chunk)
+	{
+		for (int i = chunk.begin; i < chunk.end; ++i)
+		{
+			const int first = chunk.candidates.size();
+			chunk.offsets.append(first);
+			if (mFixedOf[i] >= 0)
+				continue;
+			createCandidates(i, extent, chunk);
+			if (fixedIndex.isEmpty())
+				continue;
+
+			// kept labels are obstacles for everything else
+			int kept = first;
+			for (int c = first; c < chunk.candidates.size(); ++c)
+			{
+				const LabelCandidate &lp = chunk.candidates[c];
+				bool blocked = false;
+				fixedIndex.visit(lp.boundingBox(), [&](int j)
+				{
+					blocked = lp.conflicts(mFixedCandidates[j]);
+					return !blocked;
+				});
+				if (!blocked)
+					chunk.candidates[kept++] = lp;
+			}
+			chunk.candidates.resize(kept);
+		}
+	});
+
+	mCandidates.resize(0);
+	mFeatureOffsets.resize(mFeatures.size() + 1);
+	for (const Chunk &chunk : mChunks)
+	{
+		const int base = mCandidates.size();
+		for (int i = chunk.begin; i < chunk.end; ++i)
+			mFeatureOffsets[i] = base + chunk.offsets[i - chunk.begin];
+		mCandidates += chunk.candidates;
+	}
+	mFeatureOffsets[mFeatures.size()] = mCandidates.size();
+	mTimings.candidates = timer.nsecsElapsed();
+
+	findConflicts();
+	mTimings.conflicts = timer.nsecsElapsed() - mTimings.candidates;
+	QVector<int> placed = solve();
+	mTimings.solve = timer.nsecsElapsed() - mTimings.candidates - mTimings.conflicts;
+	mTimings.popmusic = 0;
+	if (mSearchMethod == PopmusicChain)
+	{
+		buildSubparts();
+		popmusic(placed);
+		mTimings.popmusic = timer.nsecsElapsed() - mTimings.candidates - mTimings.conflicts - mTimings.solve;
+	}
+
+	QVector<Label> labels;
+	if (mIncremental)
+		mPrevious.clear();
+	for (int i = 0; i < mFeatures.size(); ++i)
+	{
+		if (placed[i] < 0 && mFixedOf[i] < 0)
+			continue;
+		const Feature &f = mFeatures[i];
+		Label label;
+		label.layer = f.layer;
+		label.id = f.id;
+		label.candidate = mFixedOf[i] >= 0 ? mFixedCandidates[mFixedOf[i]] : mCandidates[placed[i]];
+		labels.append(label);
+
+		if (mIncremental)
+		{
+			PreviousLabel previous;
+			previous.bounds = f.bounds;
+			previous.width = f.width;
+			previous.height = f.height;
+			previous.candidate = label.candidate;
+			mPrevious.insert(qMakePair(f.layer, f.id), previous);
+		}
+	}
+	return labels;
+}
+
+void LabelEngine::createCandidates(int feature, const QgsRectangle &extent, Chunk &chunk) const
+{
+	const Feature &f = mFeatures[feature];
+	if (!f.bounds.intersects(extent))
+		return;
+
+	QVector<LabelCandidate> &candidates = chunk.candidates;
+	const int first = candidates.size();
+	for (int part = 0; part < f.partCount; ++part)
+	{
+		const int firstRing = part == 0 ? 0 : f.partEnds[part - 1];
+		switch (f.type)
+		{
+		case QgsWkbTypes::PointGeometry:
+		{
+			const int i = firstRing == 0 ? 0 : f.ringEnds[firstRing - 1];
+			if (mLayers[f.layer].placement == OverPoint)
+				createCandidatesOverPoint(feature, f.x[i], f.y[i], candidates);
+			else
+				createCandidatesAroundPoint(feature, f.x[i], f.y[i], candidates);
+			break;
+		}
+		case QgsWkbTypes::LineGeometry:
+			createCandidatesAlongLine(feature, firstRing, chunk);
+			break;
+		case QgsWkbTypes::PolygonGeometry:
+			createCandidatesForPolygon(feature, firstRing, f.partEnds[part], candidates);
+			break;
+		default:
+			break;
+		}
+	}
+
+	// as PAL, only keep candidates that are fully visible
+	int kept = first;
+	for (int i = first; i < candidates.size(); ++i)
+	{
+		if (extent.contains(candidates[i].boundingBox()))
+			candidates[kept++] = candidates[i];
+	}
+	candidates.resize(kept);
+}
+
+void LabelEngine::createCandidatesAroundPoint(int feature, double x, double y, QVector<LabelCandidate> &candidates) const
+{
+	const Feature &f = mFeatures[feature];
+	const LayerSettings &settings = mLayers[f.layer];
+	const int count = qMax(1, settings.candidates);
+	for (int i = 0; i < count; ++i)
+	{
+		// start top right, which is the preferred position
+		const double a = M_PI_4 + 2 * M_PI * i / count;
+		const double c = std::cos(a);
+		const double s = std::sin(a);
+		const double fx = std::fabs(c) < 1e-6 ? 0.5 : (c > 0 ? 0.0 : 1.0);
+		const double fy = std::fabs(s) < 1e-6 ? 0.5 : (s > 0 ? 0.0 : 1.0);
+
+		LabelCandidate lp;
+		lp.x = x + settings.distance * c - fx * f.width;
+		lp.y = y + settings.distance * s - fy * f.height;
+		lp.width = f.width;
+		lp.height = f.height;
+		lp.angle = 0;
+		lp.cost = 0.0001 + 0.002 * std::fabs(std::remainder(a - M_PI_4, 2 * M_PI)) / M_PI;
+		lp.feature = feature;
+		candidates.append(lp);
+	}
+}
+
+void LabelEngine::createCandidatesOverPoint(int feature, double x, double y, QVector<LabelCandidate> &candidates) const
+{
+	const Feature &f = mFeatures[feature];
+	LabelCandidate lp;
+	lp.x = x - f.width / 2;
+	lp.y = y - f.height / 2;
+	lp.width = f.width;
+	lp.height = f.height;
+	lp.angle = 0;
+	lp.cost = 0.0001;
+	lp.feature = feature;
+	candidates.append(lp);
+}
+
+void LabelEngine::createCandidatesAlongLine(int feature, int ring, Chunk &chunk) const
+{
+	const Feature &f = mFeatures[feature];
+	const LayerSettings &settings = mLayers[f.layer];
+	const int begin = ring == 0 ? 0 : f.ringEnds[ring - 1];
+	const int n = f.ringEnds[ring] - begin;
+	const double *xs = f.x + begin;
+	const double *ys = f.y + begin;
+	if (n < 2)
+		return;
+
+	QVector<double> &lengths = chunk.lengths;
+	lengths.resize(n);
+	lengths[0] = 0;
+	for (int i = 1; i < n; ++i)
+		lengths[i] = lengths[i - 1] + std::sqrt((xs[i] - xs[i - 1]) * (xs[i] - xs[i - 1]) + (ys[i] - ys[i - 1]) * (ys[i] - ys[i - 1]));
+	const double total = lengths[n - 1];
+	if (total < f.width || f.width <= 0)
+		return;
+
+	auto pointAt = [&](double distance)
+	{
+		const int i = qBound(1, static_cast<int>(std::upper_bound(lengths.constBegin(), lengths.constEnd(), distance) - lengths.constBegin()), n - 1);
+		const double segment = lengths[i] - lengths[i - 1];
+		const double t = segment > 0 ? (distance - lengths[i - 1]) / segment : 0;
+		return QgsPoint(xs[i - 1] + t * (xs[i] - xs[i - 1]), ys[i - 1] + t * (ys[i] - ys[i - 1]));
+	};
+
+	const int count = qMax(1, settings.candidates);
+	for (int i = 0; i < count; ++i)
+	{
+		const double start = (total - f.width) * (i + 0.5) / count;
+		QgsPoint p1 = pointAt(start);
+		QgsPoint p2 = pointAt(start + f.width);
+		const double chord = std::sqrt(p1.sqrDist(p2));
+		if (chord <= 0)
+			continue;
+
+		// how far the line strays from the label baseline
+		double deviation = 0;
+		for (int k = 1; k < n - 1; ++k)
+		{
+			if (lengths[k] <= start || lengths[k] >= start + f.width)
+				continue;
+			const double cross = (p2.x() - p1.x()) * (ys[k] - p1.y()) - (p2.y() - p1.y()) * (xs[k] - p1.x());
+			deviation = qMax(deviation, std::fabs(cross) / chord);
+		}
+		if (deviation > f.height)
+			continue;
+
+		// keep the text upright
+		if (p2.x() < p1.x())
+			std::swap(p1, p2);
+		const double angle = std::atan2(p2.y() - p1.y(), p2.x() - p1.x());
+		const double nx = -std::sin(angle);
+		const double ny = std::cos(angle);
+		const double cost = 0.0001 + 0.001 * std::fabs(start + f.width / 2 - total / 2) / (total / 2) + 0.001 * deviation / f.height;
+
+		const double offsets[3] = { -f.height / 2, settings.distance, -settings.distance - f.height };
+		const int flags[3] = { OnLine, AboveLine, BelowLine };
+		for (int k = 0; k < 3; ++k)
+		{
+			if (!(settings.lineFlags & flags[k]))
+				continue;
+			LabelCandidate lp;
+			lp.x = p1.x() + nx * offsets[k];
+			lp.y = p1.y() + ny * offsets[k];
+			lp.width = f.width;
+			lp.height = f.height;
+			lp.angle = angle;
+			lp.cost = cost;
+			lp.feature = feature;
+			chunk.candidates.append(lp);
+		}
+	}
+}
+
+void LabelEngine::createCandidatesForPolygon(int feature, int firstRing, int lastRing, QVector<LabelCandidate> &candidates) const
+{
+	const Feature &f = mFeatures[feature];
+	const LayerSettings &settings = mLayers[f.layer];
+	const Rings rings = { f.x, f.y, f.ringEnds, firstRing, lastRing };
+	if (rings.end(firstRing) - rings.begin(firstRing) < 4)
+		return;
+
+	QgsRectangle bounds;
+	bounds.setMinimal();
+	for (int i = rings.begin(firstRing); i < rings.end(firstRing); ++i)
+		bounds.combineExtentWith(f.x[i], f.y[i]);
+	const QgsPoint centroid = ringCentroid(rings);
+	const double maxDistance = qMax(std::sqrt(bounds.width() * bounds.width() + bounds.height() * bounds.height()) / 2, 1e-12);
+
+	// grid of horizontal candidates, keeping those that fit inside
+	const int count = qMax(1, settings.candidates);
+	const double step = std::sqrt(bounds.width() * bounds.height() / count);
+	const int first = candidates.size();
+	if (step > 0 && f.width <= bounds.width() && f.height <= bounds.height())
+	{
+		for (double y = bounds.yMinimum() + step / 2; y < bounds.yMaximum(); y += step)
+		{
+			for (double x = bounds.xMinimum() + step / 2; x < bounds.xMaximum(); x += step)
+			{
+				const QgsRectangle r(x - f.width / 2, y - f.height / 2, x + f.width / 2, y + f.height / 2);
+				if (!rectangleInside(r, rings))
+					continue;
+				LabelCandidate lp;
+				lp.x = r.xMinimum();
+				lp.y = r.yMinimum();
+				lp.width = f.width;
+				lp.height = f.height;
+				lp.angle = 0;
+				lp.cost = 0.0001 + 0.002 * std::sqrt(centroid.sqrDist(x, y)) / maxDistance;
+				lp.feature = feature;
+				candidates.append(lp);
+			}
+		}
+	}
+
+	if (candidates.size() == first)
+	{
+		LabelCandidate lp;
+		lp.x = centroid.x() - f.width / 2;
+		lp.y = centroid.y() - f.height / 2;
+		lp.width = f.width;
+		lp.height = f.height;
+		lp.angle = 0;
+		lp.cost = 0.0021;
+		lp.feature = feature;
+		candidates.append(lp);
+	}
+}
+
+void LabelEngine::findConflicts()
+{
+	mBounds.resize(mCandidates.size());
+	for (int i = 0; i < mCandidates.size(); ++i)
+		mBounds[i] = mCandidates[i].boundingBox();
+	const PackedRTree index(mBounds);
+
+	mConflictBlocks.resize((mCandidates.size() + 1023) / 1024);
+	for (int b = 0; b < mConflictBlocks.size(); ++b)
+	{
+		ConflictBlock &block = mConflictBlocks[b];
+		block.begin = b * 1024;
+		block.end = qMin(block.begin + 1024, mCandidates.size());
+		block.offsets.resize(0);
+		block.conflicts.resize(0);
+	}
+
+	QtConcurrent::blockingMap(mConflictBlocks, [this, &index](ConflictBlock &block)
+	{
+		for (int i = block.begin; i < block.end; ++i)
+		{
+			block.offsets.append(block.conflicts.size());
+			const LabelCandidate &lp = mCandidates[i];
+			index.visit(mBounds[i], [&](int j)
+			{
+				if (mCandidates[j].feature != lp.feature && lp.conflicts(mCandidates[j]))
+					block.conflicts.append(j);
+				return true;
+			});
+		}
+	});
+
+	// blocks cover consecutive candidates, so merging is concatenation
+	mConflictOffsets.resize(mCandidates.size() + 1);
+	mConflicts.resize(0);
+	for (const ConflictBlock &block : mConflictBlocks)
+	{
+		const int base = mConflicts.size();
+		for (int i = block.begin; i < block.end; ++i)
+			mConflictOffsets[i] = base + block.offsets[i - block.begin];
+		mConflicts += block.conflicts;
+	}
+	mConflictOffsets[mCandidates.size()] = mConflicts.size();
+}
+
+QVector<int> LabelEngine::solve() const
+{
+	return falp<4>();
+}
+
+template <int Arity>
+QVector<int> LabelEngine::falp() const
+{
+	// FALP: repeatedly place the candidate with the fewest remaining
+	// conflicts, then drop its rivals and the other candidates of its feature
+	const int n = mCandidates.size();
+	QVector<int> overlaps(n);
+	DaryHeap<QueueKey, std::less<QueueKey>, Arity> queue(n);
+	for (int i = 0; i < n; ++i)
+	{
+		overlaps[i] = mConflictOffsets[i + 1] - mConflictOffsets[i];
+		const QueueKey key = { overlaps[i], mCandidates[i].cost + mLayers[mFeatures[mCandidates[i].feature].layer].priority, i };
+		queue.push(i, key);
+	}
+
+	// candidates are active while they are queued
+	auto remove = [&](int i)
+	{
+		queue.remove(i);
+		for (int k = mConflictOffsets[i]; k < mConflictOffsets[i + 1]; ++k)
+		{
+			const int j = mConflicts[k];
+			if (!queue.contains(j))
+				continue;
+			QueueKey key = queue.key(j);
+			key.overlaps = --overlaps[j];
+			queue.decrease(j, key);
+		}
+	};
+
+	QVector<int> placed(mFeatures.size(), -1);
+	while (!queue.isEmpty())
+	{
+		const int i = queue.pop();
+		const int feature = mCandidates[i].feature;
+		placed[feature] = i;
+		for (int j = mFeatureOffsets[feature]; j < mFeatureOffsets[feature + 1]; ++j)
+		{
+			if (queue.contains(j))
+				remove(j);
+		}
+		for (int k = mConflictOffsets[i]; k < mConflictOffsets[i + 1]; ++k)
+		{
+			if (queue.contains(mConflicts[k]))
+				remove(mConflicts[k]);
+		}
+	}
+	return placed;
+}
+
+// arities compared by LabelBenchmark
+template QVector<int> LabelEngine::falp<2>() const;
+template QVector<int> LabelEngine::falp<4>() const;
+template QVector<int> LabelEngine::falp<8>() const;
+
+double LabelEngine::placementCost(int feature, int candidate) const
+{
+	if (candidate >= 0)
+		return mCandidates[candidate].cost;
+	// leaving a feature unlabeled costs more than any position, and more for
+	// important layers
+	return 2.0 - mLayers[mFeatures[feature].layer].priority;
+}
+
+void LabelEngine::buildSubparts()
+{
+	const int n = mFeatures.size();
+
+	// features are neighbours when any of their candidates collide
+	QVector<int> graphOffsets(n + 1, 0);
+	QVector<int> graph;
+	QVector<int> seen(n, -1);
+	for (int f = 0; f < n; ++f)
+	{
+		graphOffsets[f] = graph.size();
+		for (int c = mFeatureOffsets[f]; c < mFeatureOffsets[f + 1]; ++c)
+		{
+			for (int k = mConflictOffsets[c]; k < mConflictOffsets[c + 1]; ++k)
+			{
+				const int g = mCandidates[mConflicts[k]].feature;
+				if (seen[g] != f)
+				{
+					seen[g] = f;
+					graph.append(g);
+				}
+			}
+		}
+	}
+	graphOffsets[n] = graph.size();
+
+	// breadth first from every feature up to mSubpartSize features with candidates
+	mSubpartOffsets.resize(n + 1);
+	mClosureOffsets.resize(n + 1);
+	mSubparts.resize(0);
+	mClosures.resize(0);
+	seen.fill(-1);
+	QVector<int> inSubpart(n, -1);
+	for (int seed = 0; seed < n; ++seed)
+	{
+		mSubpartOffsets[seed] = mSubparts.size();
+		mClosureOffsets[seed] = mClosures.size();
+		if (mFeatureOffsets[seed] == mFeatureOffsets[seed + 1])
+			continue;
+
+		const int first = mSubparts.size();
+		mSubparts.append(seed);
+		seen[seed] = seed;
+		for (int i = first; i < mSubparts.size() && mSubparts.size() - first < mSubpartSize; ++i)
+		{
+			const int f = mSubparts[i];
+			for (int k = graphOffsets[f]; k < graphOffsets[f + 1] && mSubparts.size() - first < mSubpartSize; ++k)
+			{
+				const int g = graph[k];
+				if (seen[g] == seed || mFeatureOffsets[g] == mFeatureOffsets[g + 1])
+					continue;
+				seen[g] = seed;
+				mSubparts.append(g);
+			}
+		}
+
+		for (int i = first; i < mSubparts.size(); ++i)
+		{
+			inSubpart[mSubparts[i]] = seed;
+			mClosures.append(mSubparts[i]);
+		}
+		for (int i = first; i < mSubparts.size(); ++i)
+		{
+			const int f = mSubparts[i];
+			for (int k = graphOffsets[f]; k < graphOffsets[f + 1]; ++k)
+			{
+				const int g = graph[k];
+				if (inSubpart[g] == seed)
+					continue;
+				inSubpart[g] = seed;
+				mClosures.append(g);
+			}
+		}
+	}
+	mSubpartOffsets[n] = mSubparts.size();
+	mClosureOffsets[n] = mClosures.size();
+}
+
+bool LabelEngine::optimizeSubpart(int seed, int *solution) const
+{
+	const int *sub = mSubparts.constData() + mSubpartOffsets[seed];
+	const int *subEnd = mSubparts.constData() + mSubpartOffsets[seed + 1];
+
+	auto isFree = [&](int candidate)
+	{
+		for (int k = mConflictOffsets[candidate]; k < mConflictOffsets[candidate + 1]; ++k)
+		{
+			const int j = mConflicts[k];
+			if (solution[mCandidates[j].feature] == j)
+				return false;
+		}
+		return true;
+	};
+
+	// PAL's chain moves: put a feature on another candidate, eject the
+	// labels it collides with and move each of them to its cheapest free
+	// candidate, or drop it
+	bool improved = false;
+	QVarLengthArray<int, 16> moved;
+	QVarLengthArray<int, 16> previous;
+	QVarLengthArray<int, 16> best;
+	for (int pass = 0; pass < 3; ++pass)
+	{
+		bool changed = false;
+		for (const int *f = sub; f != subEnd; ++f)
+		{
+			const int current = solution[*f];
+			double bestDelta = -1e-9;
+			best.clear();
+			for (int c = mFeatureOffsets[*f]; c < mFeatureOffsets[*f + 1]; ++c)
+			{
+				if (c == current)
+					continue;
+
+				moved.clear();
+				bool local = true;
+				for (int k = mConflictOffsets[c]; k < mConflictOffsets[c + 1] && local; ++k)
+				{
+					const int j = mConflicts[k];
+					const int g = mCandidates[j].feature;
+					if (solution[g] != j)
+						continue;
+					// labels outside the sub-problem are fixed
+					local = std::find(sub, subEnd, g) != subEnd;
+					moved.append(g);
+				}
+				if (!local)
+					continue;
+
+				// apply tentatively, then undo
+				previous.clear();
+				previous.append(current);
+				double delta = placementCost(*f, c) - placementCost(*f, current);
+				solution[*f] = c;
+				for (int g : moved)
+				{
+					previous.append(solution[g]);
+					solution[g] = -1;
+				}
+				for (int i = 0; i < moved.size(); ++i)
+				{
+					const int g = moved[i];
+					int target = -1;
+					for (int t = mFeatureOffsets[g]; t < mFeatureOffsets[g + 1]; ++t)
+					{
+						if (t != previous[i + 1] && (target < 0 || mCandidates[t].cost < mCandidates[target].cost) && isFree(t))
+							target = t;
+					}
+					solution[g] = target;
+					delta += placementCost(g, target) - placementCost(g, previous[i + 1]);
+				}
+				if (delta < bestDelta)
+				{
+					bestDelta = delta;
+					best.clear();
+					best.append(*f);
+					best.append(c);
+					for (int g : moved)
+					{
+						best.append(g);
+						best.append(solution[g]);
+					}
+				}
+				solution[*f] = previous[0];
+				for (int i = 0; i < moved.size(); ++i)
+					solution[moved[i]] = previous[i + 1];
+			}
+
+			for (int i = 0; i < best.size(); i += 2)
+				solution[best[i]] = best[i + 1];
+			if (!best.isEmpty())
+				changed = improved = true;
+		}
+		if (!changed)
+			break;
+	}
+	return improved;
+}
+
+void LabelEngine::popmusic(QVector<int> &solution) const
+{
+	QVector<int> queue;
+	for (int f = 0; f < mFeatures.size(); ++f)
+	{
+		if (mSubpartOffsets[f] != mSubpartOffsets[f + 1])
+			queue.append(f);
+	}
+	if (mDeterministic)
+		popmusicRounds(solution.data(), queue);
+	else
+		popmusicDynamic(solution.data(), queue);
+}
+
+void LabelEngine::popmusicRounds(int *solution, QVector<int> &queue) const
+{
+	struct Task
+	{
+		int seed;
+		bool improved;
+	};
+
+	const int n = mFeatures.size();
+	const int maxSolves = 4 * queue.size();
+	QVector<bool> queued(n, false);
+	for (int f : queue)
+		queued[f] = true;
+	QVector<int> subpartMark(n, -1);
+	QVector<int> closureMark(n, -1);
+	QVector<Task> tasks;
+	QVector<int> rest;
+	int solves = 0;
+	for (int round = 0; !queue.isEmpty() && solves < maxSolves; ++round)
+	{
+		// greedy colour class: sub-problems that neither change nor read
+		// anything another one of the round changes
+		tasks.resize(0);
+		rest.resize(0);
+		for (int seed : queue)
+		{
+			bool independent = solves + tasks.size() < maxSolves;
+			for (int i = mSubpartOffsets[seed]; i < mSubpartOffsets[seed + 1] && independent; ++i)
+				independent = closureMark[mSubparts[i]] != round;
+			for (int i = mClosureOffsets[seed]; i < mClosureOffsets[seed + 1] && independent; ++i)
+				independent = subpartMark[mClosures[i]] != round;
+			if (!independent)
+			{
+				rest.append(seed);
+				continue;
+			}
+			for (int i = mSubpartOffsets[seed]; i < mSubpartOffsets[seed + 1]; ++i)
+				subpartMark[mSubparts[i]] = round;
+			for (int i = mClosureOffsets[seed]; i < mClosureOffsets[seed + 1]; ++i)
+				closureMark[mClosures[i]] = round;
+			const Task task = { seed, false };
+			tasks.append(task);
+			queued[seed] = false;
+		}
+
+		QtConcurrent::blockingMap(tasks, [this, solution](Task &task)
+		{
+			task.improved = optimizeSubpart(task.seed, solution);
+		});
+		solves += tasks.size();
+
+		// features around an improvement are worth another look
+		queue.swap(rest);
+		for (const Task &task : tasks)
+		{
+			if (!task.improved)
+				continue;
+			for (int i = mSubpartOffsets[task.seed]; i < mSubpartOffsets[task.seed + 1]; ++i)
+			{
+				const int f = mSubparts[i];
+				if (!queued[f])
+				{
+					queued[f] = true;
+					queue.append(f);
+				}
+			}
+		}
+	}
+}
+
+void LabelEngine::popmusicDynamic(int *solution, QVector<int> &queue) const
+{
+	const int n = mFeatures.size();
+	const int maxSolves = 4 * queue.size();
+	QVector<bool> queued(n, false);
+	for (int f : queue)
+		queued[f] = true;
+	// features being changed, and readers of each feature
+	QVector<bool> changing(n, false);
+	QVector<int> reading(n, 0);
+	int active = 0;
+	int solves = 0;
+	int head = 0;
+	QMutex mutex;
+	QWaitCondition released;
+
+	auto claimable = [&](int seed)
+	{
+		for (int i = mSubpartOffsets[seed]; i < mSubpartOffsets[seed + 1]; ++i)
+		{
+			if (reading[mSubparts[i]] > 0)
+				return false;
+		}
+		for (int i = mClosureOffsets[seed]; i < mClosureOffsets[seed + 1]; ++i)
+		{
+			if (changing[mClosures[i]])
+				return false;
+		}
+		return true;
+	};
+
+	auto worker = [&]()
+	{
+		QMutexLocker locker(&mutex);
+		for (;;)
+		{
+			if (head == queue.size() || solves >= maxSolves)
+			{
+				if (active == 0)
+				{
+					released.wakeAll();
+					return;
+				}
+				released.wait(&mutex);
+				continue;
+			}
+
+			// only look a little ahead, so the queue order is mostly kept
+			int pick = -1;
+			for (int i = head; i < qMin(head + 64, queue.size()) && pick < 0; ++i)
+			{
+				if (claimable(queue[i]))
+					pick = i;
+			}
+			if (pick < 0)
+			{
+				released.wait(&mutex);
+				continue;
+			}
+
+			const int seed = queue[pick];
+			std::rotate(queue.begin() + head, queue.begin() + pick, queue.begin() + pick + 1);
+			++head;
+			queued[seed] = false;
+			for (int i = mSubpartOffsets[seed]; i < mSubpartOffsets[seed + 1]; ++i)
+				changing[mSubparts[i]] = true;
+			for (int i = mClosureOffsets[seed]; i < mClosureOffsets[seed + 1]; ++i)
+				++reading[mClosures[i]];
+			++active;
+			++solves;
+
+			locker.unlock();
+			const bool improved = optimizeSubpart(seed, solution);
+			locker.relock();
+
+			for (int i = mSubpartOffsets[seed]; i < mSubpartOffsets[seed + 1]; ++i)
+				changing[mSubparts[i]] = false;
+			for (int i = mClosureOffsets[seed]; i < mClosureOffsets[seed + 1]; ++i)
+				--reading[mClosures[i]];
+			--active;
+			if (improved)
+			{
+				for (int i = mSubpartOffsets[seed]; i < mSubpartOffsets[seed + 1]; ++i)
+				{
+					const int f = mSubparts[i];
+					if (!queued[f])
+					{
+						queued[f] = true;
+						queue.append(f);
+					}
+				}
+			}
+			released.wakeAll();
+		}
+	};
+
+	QVector<QFuture<void> > workers;
+	for (int i = 0; i < QThread::idealThreadCount(); ++i)
+		workers.append(QtConcurrent::run(worker));
+	for (QFuture<void> &future : workers)
+		future.waitForFinished();
+}
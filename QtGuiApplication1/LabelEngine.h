@@ -0,0 +1,253 @@
+#pragma once
+
+#include "QFont"
+#include "QHash"
+#include "QPair"
+#include "QVector"
+#include "qgsfeature.h"
+#include "qgsgeometry.h"
+#include "qgsrectangle.h"
+#include "LabelArena.h"
+
+// Rectangle a label may be drawn in, in map units.
+struct LabelCandidate
+{
+	// lower left corner before rotation
+	double x;
+	double y;
+	double width;
+	double height;
+	// counter clockwise rotation around (x, y), radians
+	double angle;
+	// 0 is best
+	double cost;
+	int feature;
+
+	void corners(double xs[4], double ys[4]) const;
+	QgsRectangle boundingBox() const;
+	// True if the rotated rectangles overlap by more than a touch.
+	bool conflicts(const LabelCandidate &other) const;
+};
+
+// Label placement in the spirit of PAL. Candidate positions are generated
+// for every feature, candidates of different features that overlap are in
+// conflict, and a greedy search picks one conflict free candidate for as
+// many features as possible, preferring those with the fewest conflicts.
+//
+// PAL's Pal::extractProblem generates candidates one feature after the
+// other. Here the features are split into chunks and each chunk fills its
+// own candidate list on the global thread pool; only the conflict index is
+// built from the merged lists afterwards.
+//
+// Geometries are flattened into coordinate arrays owned by an arena, and
+// all candidate and conflict buffers keep their capacity between runs, so
+// labeling the same view again does not allocate per feature.
+//
+// In incremental mode the placements of the previous run are kept in map
+// coordinates. A feature whose geometry and label size are unchanged and
+// whose label is still fully in view keeps its label; only the remaining
+// features get candidates, and those that collide with a kept label are
+// dropped before solving. Panning at a fixed scale then only solves the
+// newly visible features.
+class LabelEngine
+{
+public:
+	enum Placement
+	{
+		AroundPoint,
+		OverPoint,
+		Line,
+		Horizontal,
+	};
+
+	// Same values as pal::LineArrangementFlag.
+	enum LineFlag
+	{
+		OnLine = 1,
+		AboveLine = 2,
+		BelowLine = 4,
+	};
+
+	// Same meaning as the pal::SearchMethod values of the same name.
+	enum SearchMethod
+	{
+		// greedy initial solution only
+		Falp,
+		// FALP improved by POPMUSIC with chain moves
+		PopmusicChain,
+	};
+
+	struct LayerSettings
+	{
+		LayerSettings();
+
+		Placement placement;
+		// gap between the feature and its label, map units
+		double distance;
+		// candidates around a point, along a line or inside a polygon
+		int candidates;
+		int lineFlags;
+		// 0 for the most important layer up to 1, as with PAL
+		double priority;
+	};
+
+	struct Label
+	{
+		int layer;
+		QgsFeatureId id;
+		LabelCandidate candidate;
+	};
+
+	// Wall time of the phases of the last run, nanoseconds.
+	struct Timings
+	{
+		qint64 candidates;
+		qint64 conflicts;
+		// FALP, the reduction of the conflict graph to an initial solution
+		qint64 solve;
+		qint64 popmusic;
+	};
+
+	LabelEngine();
+
+	int addLayer(const LayerSettings &settings);
+	int layerCount() const { return mLayers.size(); }
+
+	// Geometry in map units, label size in map units.
+	void addFeature(int layer, QgsFeatureId id, const QgsGeometry &geometry, double width, double height);
+	// Label size measured from text through TextLayoutCache.
+	void addFeature(int layer, QgsFeatureId id, const QgsGeometry &geometry, const QString &text, const QFont &font, double mapUnitsPerPixel);
+	void clear();
+
+	void setChunkSize(int features) { mChunkSize = qMax(1, features); }
+
+	// Places the labels of all features, keeping candidates inside extent.
+	QVector<Label> run(const QgsRectangle &extent);
+
+	int candidateCount() const { return mCandidates.size(); }
+	int conflictCount() const { return mConflicts.size() / 2; }
+	const Timings &lastTimings() const { return mTimings; }
+
+	SearchMethod searchMethod() const { return mSearchMethod; }
+	void setSearchMethod(SearchMethod method) { mSearchMethod = method; }
+
+	// Features per POPMUSIC sub-problem, PAL's popmusic_r.
+	void setSubpartSize(int features) { mSubpartSize = qMax(1, features); }
+
+	// POPMUSIC optimizes sub-problems whose neighbourhoods do not overlap at
+	// the same time. By default they are claimed by whichever thread is free,
+	// so the result depends on timing. The deterministic mode runs them in
+	// rounds, each a greedy colour class picked in feature order, and gives
+	// the same labels whatever the number of threads.
+	bool isDeterministic() const { return mDeterministic; }
+	void setDeterministic(bool deterministic) { mDeterministic = deterministic; }
+
+	bool isIncremental() const { return mIncremental; }
+	void setIncremental(bool incremental);
+	// Forgets the kept placements; call after changing layer settings.
+	void resetSolution() { mPrevious.clear(); }
+	// Labels taken over from the previous run by the last run.
+	int reusedCount() const { return mFixedCandidates.size(); }
+
+private:
+	friend class LabelBenchmark;
+
+	struct Feature
+	{
+		int layer;
+		QgsFeatureId id;
+		double width;
+		double height;
+		QgsWkbTypes::GeometryType type;
+		QgsRectangle bounds;
+		// Flattened geometry in mArena. Part p holds rings partEnds[p - 1] to
+		// partEnds[p], ring r holds points ringEnds[r - 1] to ringEnds[r];
+		// a point is a ring of one point, a line a part with one ring.
+		int partCount;
+		const int *partEnds;
+		const int *ringEnds;
+		const double *x;
+		const double *y;
+	};
+
+	struct Chunk
+	{
+		int begin;
+		int end;
+		QVector<LabelCandidate> candidates;
+		// candidates of each feature of the chunk, as offsets into candidates
+		QVector<int> offsets;
+		// per line scratch space
+		QVector<double> lengths;
+	};
+
+	struct ConflictBlock
+	{
+		int begin;
+		int end;
+		QVector<int> offsets;
+		QVector<int> conflicts;
+	};
+
+	void createCandidates(int feature, const QgsRectangle &extent, Chunk &chunk) const;
+	void createCandidatesAroundPoint(int feature, double x, double y, QVector<LabelCandidate> &candidates) const;
+	void createCandidatesOverPoint(int feature, double x, double y, QVector<LabelCandidate> &candidates) const;
+	void createCandidatesAlongLine(int feature, int ring, Chunk &chunk) const;
+	void createCandidatesForPolygon(int feature, int firstRing, int lastRing, QVector<LabelCandidate> &candidates) const;
+
+	struct PreviousLabel
+	{
+		QgsRectangle bounds;
+		double width;
+		double height;
+		LabelCandidate candidate;
+	};
+
+	void findConflicts();
+	QVector<int> solve() const;
+	template <int Arity>
+	QVector<int> falp() const;
+
+	void buildSubparts();
+	void popmusic(QVector<int> &solution) const;
+	void popmusicRounds(int *solution, QVector<int> &queue) const;
+	void popmusicDynamic(int *solution, QVector<int> &queue) const;
+	bool optimizeSubpart(int seed, int *solution) const;
+	double placementCost(int feature, int candidate) const;
+
+	QVector<LayerSettings> mLayers;
+	QVector<Feature> mFeatures;
+	LabelArena mArena;
+	int mChunkSize;
+	bool mIncremental;
+	SearchMethod mSearchMethod;
+	int mSubpartSize;
+	bool mDeterministic;
+	QHash<QPair<int, QgsFeatureId>, PreviousLabel> mPrevious;
+	Timings mTimings;
+
+	// buffers reused by every run
+	QVector<double> mScratchX;
+	QVector<double> mScratchY;
+	QVector<int> mScratchRingEnds;
+	QVector<int> mScratchPartEnds;
+	QVector<Chunk> mChunks;
+	QVector<ConflictBlock> mConflictBlocks;
+	QVector<QgsRectangle> mBounds;
+
+	// state of the last run
+	QVector<LabelCandidate> mCandidates;
+	// candidates of feature i are mFeatureOffsets[i] .. mFeatureOffsets[i + 1]
+	QVector<int> mFeatureOffsets;
+	QVector<int> mConflictOffsets;
+	QVector<int> mConflicts;
+	// POPMUSIC sub-problem of each feature and the features its labels can
+	// collide with, which must stay unchanged while it is optimized
+	QVector<int> mSubpartOffsets;
+	QVector<int> mSubparts;
+	QVector<int> mClosureOffsets;
+	QVector<int> mClosures;
+	// labels kept from the previous run, and their index per feature
+	QVector<LabelCandidate> mFixedCandidates;
+	QVector<int> mFixedOf;
+};
@@ -0,0 +1,81 @@
+#include "PackedRTree.h"
+#include <algorithm>
+#include <cmath>
+
+PackedRTree::PackedRTree()
+	: mItemCount(0)
+	, mNodeSize(16)
+{
+}
+
+PackedRTree::PackedRTree(const QVector<QgsRectangle> &bounds, int nodeSize)
+	: mItemCount(bounds.size())
+	, mNodeSize(qMax(2, nodeSize))
+{
+	if (mItemCount == 0)
+		return;
+
+	QVector<double> cx(mItemCount), cy(mItemCount);
+	QVector<int> order(mItemCount);
+	for (int i = 0; i < mItemCount; ++i)
+	{
+		const QgsRectangle &r = bounds[i];
+		cx[i] = 0.5 * (r.xMinimum() + r.xMaximum());
+		cy[i] = 0.5 * (r.yMinimum() + r.yMaximum());
+		order[i] = i;
+	}
+
+	// Sort-Tile-Recursive: order by x, cut into vertical slices of whole
+	// leaves, then order every slice by y
+	std::sort(order.begin(), order.end(), [&cx](int a, int b) { return cx[a] < cx[b]; });
+	const int leafCount = (mItemCount + mNodeSize - 1) / mNodeSize;
+	const int sliceCount = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(leafCount))));
+	const int sliceSize = ((leafCount + sliceCount - 1) / sliceCount) * mNodeSize;
+	for (int start = 0; start < mItemCount; start += sliceSize)
+	{
+		const int end = qMin(start + sliceSize, mItemCount);
+		std::sort(order.begin() + start, order.begin() + end, [&cy](int a, int b) { return cy[a] < cy[b]; });
+	}
+
+	mBoxes.reserve(mItemCount + mItemCount / (mNodeSize - 1) + 1);
+	mIndices.reserve(mBoxes.capacity());
+	for (int i = 0; i < mItemCount; ++i)
+	{
+		const QgsRectangle &r = bounds[order[i]];
+		const Box b = { r.xMinimum(), r.yMinimum(), r.xMaximum(), r.yMaximum() };
+		mBoxes.append(b);
+		mIndices.append(order[i]);
+	}
+	mLevelEnds.append(mItemCount);
+
+	int levelStart = 0;
+	int levelEnd = mItemCount;
+	while (levelEnd - levelStart > 1)
+	{
+		for (int first = levelStart; first < levelEnd; first += mNodeSize)
+		{
+			const int last = qMin(first + mNodeSize, levelEnd);
+			Box parent = mBoxes[first];
+			for (int child = first + 1; child < last; ++child)
+			{
+				const Box &b = mBoxes[child];
+				parent.xmin = qMin(parent.xmin, b.xmin);
+				parent.ymin = qMin(parent.ymin, b.ymin);
+				parent.xmax = qMax(parent.xmax, b.xmax);
+				parent.ymax = qMax(parent.ymax, b.ymax);
+			}
+			mBoxes.append(parent);
+			mIndices.append(first);
+		}
+		levelStart = levelEnd;
+		levelEnd = mBoxes.size();
+		mLevelEnds.append(levelEnd);
+	}
+}
+
+QVector<int> PackedRTree::intersects(const QgsRectangle &rect) const
+{
+	QVector<int> ids;
+	visit(rect, [&ids](int id) { ids.append(id); return true; });
+	return ids;
+}
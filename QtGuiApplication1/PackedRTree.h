@@ -0,0 +1,79 @@
+#pragma once
+
+#include "QVarLengthArray"
+#include "QVector"
+#include "qgsrectangle.h"
+
+// Read-only R-tree bulk loaded with Sort-Tile-Recursive packing.
+// Items are identified by their position in the vector passed to the
+// constructor. Once built the tree is never modified, so any number of
+// threads may query it at the same time.
+class PackedRTree
+{
+public:
+	PackedRTree();
+	explicit PackedRTree(const QVector<QgsRectangle> &bounds, int nodeSize = 16);
+
+	int size() const { return mItemCount; }
+	bool isEmpty() const { return mItemCount == 0; }
+
+	// Ids of all items whose bounding box intersects rect.
+	QVector<int> intersects(const QgsRectangle &rect) const;
+
+	// Calls visitor(id) for every item intersecting rect until it returns false.
+	template <typename Visitor>
+	void visit(const QgsRectangle &rect, Visitor visitor) const
+	{
+		if (mItemCount == 0)
+			return;
+
+		const double xmin = rect.xMinimum(), ymin = rect.yMinimum();
+		const double xmax = rect.xMaximum(), ymax = rect.yMaximum();
+
+		QVarLengthArray<int, 64> stack;
+		stack.append(mBoxes.size() - 1);
+		while (!stack.isEmpty())
+		{
+			const int node = stack.last();
+			stack.removeLast();
+			const Box &b = mBoxes[node];
+			if (b.xmax < xmin || b.ymax < ymin || b.xmin > xmax || b.ymin > ymax)
+				continue;
+
+			const int level = levelOf(node);
+			if (level == 0)
+			{
+				if (!visitor(mIndices[node]))
+					return;
+				continue;
+			}
+			const int first = mIndices[node];
+			const int last = qMin(first + mNodeSize, mLevelEnds[level - 1]);
+			for (int child = first; child < last; ++child)
+				stack.append(child);
+		}
+	}
+
+private:
+	struct Box
+	{
+		double xmin, ymin, xmax, ymax;
+	};
+
+	int levelOf(int node) const
+	{
+		int level = 0;
+		while (node >= mLevelEnds[level])
+			++level;
+		return level;
+	}
+
+	int mItemCount;
+	int mNodeSize;
+	// Boxes of all levels, leaves first and the root last.
+	QVector<Box> mBoxes;
+	// Leaf level: item id. Upper levels: position of the first child.
+	QVector<int> mIndices;
+	// One past the last box of each level.
+	QVector<int> mLevelEnds;
+};
@@ -0,0 +1,320 @@
+#include "ParallelGraphDirector.h"
+#include "QHash"
+#include "QPair"
+#include "QtConcurrentMap"
+#include "qgscoordinatetransform.h"
+#include "qgsdistancearea.h"
+#include "qgsfeatureiterator.h"
+#include "qgsgraphbuilderinterface.h"
+#include "qgsnetworkstrategy.h"
+#include "qgsvectorlayer.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#pragma comment(lib,"../include/qgis_analysis.lib")
+
+namespace
+{
+	typedef QPair<double, double> GridKey;
+
+	// Same cells as QgsPointCompare: two points are one vertex when they fall
+	// into the same tolerance cell, and only when equal without a tolerance.
+	GridKey gridKey(const QgsPoint &p, double tolerance)
+	{
+		if (tolerance <= 0)
+			return GridKey(p.x(), p.y());
+		return GridKey(std::ceil(p.x() / tolerance), std::ceil(p.y() / tolerance));
+	}
+
+	struct Segment
+	{
+		QgsPoint p1;
+		QgsPoint p2;
+		int feature;
+		QgsVectorLayerDirector::Direction direction;
+		// chunk local vertex ids
+		int v1;
+		int v2;
+	};
+
+	struct Tie
+	{
+		double sqrDist;
+		int segment;
+		QgsPoint point;
+	};
+
+	// Point of a segment where an edge starts or ends.
+	struct Stop
+	{
+		double sqrDist;
+		int vertex;
+		QgsPoint point;
+
+		bool operator<(const Stop &other) const { return sqrDist < other.sqrDist; }
+	};
+
+	struct Edge
+	{
+		int from;
+		int to;
+		QgsPoint p1;
+		QgsPoint p2;
+		QgsVectorLayerDirector::Direction direction;
+		QVector<QVariant> costs;
+	};
+
+	struct Chunk
+	{
+		int begin;
+		int end;
+		QVector<Segment> segments;
+		QVector<QgsPoint> vertices;
+		QVector<int> globalIds;
+		// closest segment of this chunk for every additional point
+		QVector<Tie> ties;
+		// additional points tied to a segment of this chunk
+		QHash<int, QVector<int> > segmentTies;
+		QVector<Edge> edges;
+	};
+}
+
+ParallelGraphDirector::ParallelGraphDirector(QgsVectorLayer *layer, int directionFieldId, const QString &directDirectionValue,
+	const QString &reverseDirectionValue, const QString &bothDirectionValue,
+	QgsVectorLayerDirector::Direction defaultDirection)
+	: mLayer(layer)
+	, mDirectionFieldId(directionFieldId)
+	, mDirectDirectionValue(directDirectionValue)
+	, mReverseDirectionValue(reverseDirectionValue)
+	, mBothDirectionValue(bothDirectionValue)
+	, mDefaultDirection(defaultDirection)
+	, mChunkSize(4096)
+{
+}
+
+QString ParallelGraphDirector::name() const
+{
+	return QStringLiteral("Vector line");
+}
+
+void ParallelGraphDirector::makeGraph(QgsGraphBuilderInterface *builder, const QVector<QgsPoint> &additionalPoints,
+	QVector<QgsPoint> &snappedPoints) const
+{
+	snappedPoints = QVector<QgsPoint>(additionalPoints.size(), QgsPoint(0.0, 0.0));
+	if (!mLayer)
+		return;
+
+	const QgsCoordinateReferenceSystem sourceCrs = mLayer->crs();
+	const QgsCoordinateReferenceSystem destinationCrs = builder->coordinateTransformationEnabled() ? builder->destinationCrs() : sourceCrs;
+	const bool transform = sourceCrs != destinationCrs;
+	const double tolerance = builder->topologyTolerance();
+	const QgsDistanceArea *distanceArea = builder->distanceArea();
+	const QgsCoordinateReferenceSystem measureCrs = distanceArea->sourceCrs();
+	const QString ellipsoid = distanceArea->ellipsoid();
+	const bool ellipsoidal = distanceArea->ellipsoidalEnabled();
+
+	// all provider access stays on this thread
+	QgsAttributeList attributes;
+	if (mDirectionFieldId >= 0)
+		attributes.append(mDirectionFieldId);
+	for (const QgsNetworkStrategy *strategy : mStrategies)
+	{
+		for (int field : strategy->requiredAttributes())
+		{
+			if (!attributes.contains(field))
+				attributes.append(field);
+		}
+	}
+	QVector<QgsFeature> features;
+	QgsFeature f;
+	QgsFeatureIterator it = mLayer->getFeatures(QgsFeatureRequest().setSubsetOfAttributes(attributes));
+	while (it.nextFeature(f))
+		features.append(f);
+
+	QVector<Chunk> chunks;
+	for (int begin = 0; begin < features.size(); begin += mChunkSize)
+	{
+		Chunk chunk;
+		chunk.begin = begin;
+		chunk.end = qMin(begin + mChunkSize, features.size());
+		chunks.append(chunk);
+	}
+
+	// segments of every chunk, with the closest segment for each additional point
+	QtConcurrent::blockingMap(chunks, [&](Chunk &chunk)
+	{
+		QHash<GridKey, int> localIds;
+		auto vertex = [&](const QgsPoint &p)
+		{
+			const GridKey key = gridKey(p, tolerance);
+			QHash<GridKey, int>::const_iterator found = localIds.constFind(key);
+			if (found != localIds.constEnd())
+				return found.value();
+			localIds.insert(key, chunk.vertices.size());
+			chunk.vertices.append(p);
+			return chunk.vertices.size() - 1;
+		};
+
+		const QgsCoordinateTransform ct(sourceCrs, destinationCrs);
+		for (int i = chunk.begin; i < chunk.end; ++i)
+		{
+			const QgsGeometry geom = features[i].geometry();
+			if (geom.isEmpty())
+				continue;
+
+			QgsVectorLayerDirector::Direction direction = mDefaultDirection;
+			if (mDirectionFieldId >= 0)
+			{
+				const QString value = features[i].attribute(mDirectionFieldId).toString();
+				if (value == mBothDirectionValue)
+					direction = QgsVectorLayerDirector::DirectionBoth;
+				else if (value == mDirectDirectionValue)
+					direction = QgsVectorLayerDirector::DirectionForward;
+				else if (value == mReverseDirectionValue)
+					direction = QgsVectorLayerDirector::DirectionBackward;
+			}
+
+			const QgsMultiPolyline lines = geom.isMultipart() ? geom.asMultiPolyline() : QgsMultiPolyline() << geom.asPolyline();
+			for (const QgsPolyline &line : lines)
+			{
+				for (int j = 1; j < line.size(); ++j)
+				{
+					Segment s;
+					s.p1 = transform ? ct.transform(line[j - 1]) : line[j - 1];
+					s.p2 = transform ? ct.transform(line[j]) : line[j];
+					s.feature = i;
+					s.direction = direction;
+					s.v1 = vertex(s.p1);
+					s.v2 = vertex(s.p2);
+					chunk.segments.append(s);
+				}
+			}
+		}
+
+		const Tie none = { std::numeric_limits<double>::infinity(), -1, QgsPoint() };
+		chunk.ties.fill(none, additionalPoints.size());
+		for (int i = 0; i < chunk.segments.size(); ++i)
+		{
+			const Segment &s = chunk.segments[i];
+			for (int j = 0; j < additionalPoints.size(); ++j)
+			{
+				QgsPoint snapped;
+				double d;
+				if (s.p1 == s.p2)
+				{
+					d = additionalPoints[j].sqrDist(s.p1);
+					snapped = s.p1;
+				}
+				else
+					d = additionalPoints[j].sqrDistToSegment(s.p1.x(), s.p1.y(), s.p2.x(), s.p2.y(), snapped, 0);
+				if (d < chunk.ties[j].sqrDist)
+				{
+					const Tie tie = { d, i, snapped };
+					chunk.ties[j] = tie;
+				}
+			}
+		}
+	});
+
+	// merge the chunk vertices in chunk order, so ids do not depend on scheduling
+	QHash<GridKey, int> globalIds;
+	QVector<QgsPoint> vertices;
+	auto vertex = [&](const QgsPoint &p)
+	{
+		const GridKey key = gridKey(p, tolerance);
+		QHash<GridKey, int>::const_iterator found = globalIds.constFind(key);
+		if (found != globalIds.constEnd())
+			return found.value();
+		globalIds.insert(key, vertices.size());
+		vertices.append(p);
+		return vertices.size() - 1;
+	};
+	for (Chunk &chunk : chunks)
+	{
+		chunk.globalIds.resize(chunk.vertices.size());
+		for (int i = 0; i < chunk.vertices.size(); ++i)
+			chunk.globalIds[i] = vertex(chunk.vertices[i]);
+	}
+
+	// the first closest segment wins, as when scanning the features in order
+	QVector<int> tieVertices(additionalPoints.size(), -1);
+	QVector<QgsPoint> tiePoints(additionalPoints.size());
+	for (int j = 0; j < additionalPoints.size(); ++j)
+	{
+		int best = -1;
+		for (int c = 0; c < chunks.size(); ++c)
+		{
+			if (chunks[c].ties[j].segment >= 0 && (best < 0 || chunks[c].ties[j].sqrDist < chunks[best].ties[j].sqrDist))
+				best = c;
+		}
+		if (best < 0)
+			continue;
+		const Tie &tie = chunks[best].ties[j];
+		tiePoints[j] = tie.point;
+		tieVertices[j] = vertex(tie.point);
+		snappedPoints[j] = vertices[tieVertices[j]];
+		chunks[best].segmentTies[tie.segment].append(j);
+	}
+
+	// split segments at tied points and measure the edges
+	QtConcurrent::blockingMap(chunks, [&](Chunk &chunk)
+	{
+		QgsDistanceArea da;
+		da.setSourceCrs(measureCrs);
+		da.setEllipsoid(ellipsoid);
+		da.setEllipsoidalMode(ellipsoidal);
+
+		QVector<Stop> stops;
+		for (int i = 0; i < chunk.segments.size(); ++i)
+		{
+			const Segment &s = chunk.segments[i];
+			stops.clear();
+			const Stop first = { 0.0, chunk.globalIds[s.v1], s.p1 };
+			stops.append(first);
+			QHash<int, QVector<int> >::const_iterator tied = chunk.segmentTies.constFind(i);
+			if (tied != chunk.segmentTies.constEnd())
+			{
+				for (int j : tied.value())
+				{
+					const Stop stop = { s.p1.sqrDist(tiePoints[j]), tieVertices[j], tiePoints[j] };
+					stops.append(stop);
+				}
+			}
+			const Stop last = { s.p1.sqrDist(s.p2), chunk.globalIds[s.v2], s.p2 };
+			stops.append(last);
+			std::stable_sort(stops.begin(), stops.end());
+
+			for (int j = 1; j < stops.size(); ++j)
+			{
+				const Stop &a = stops[j - 1];
+				const Stop &b = stops[j];
+				if (a.vertex == b.vertex)
+					continue;
+				Edge e;
+				e.from = a.vertex;
+				e.to = b.vertex;
+				e.p1 = a.point;
+				e.p2 = b.point;
+				e.direction = s.direction;
+				const double distance = da.measureLine(a.point, b.point);
+				for (const QgsNetworkStrategy *strategy : mStrategies)
+					e.costs.append(strategy->cost(distance, features[s.feature]));
+				chunk.edges.append(e);
+			}
+		}
+		chunk.segments.clear();
+	});
+
+	for (int i = 0; i < vertices.size(); ++i)
+		builder->addVertex(i, vertices[i]);
+	for (const Chunk &chunk : chunks)
+	{
+		for (const Edge &e : chunk.edges)
+		{
+			if (e.direction == QgsVectorLayerDirector::DirectionForward || e.direction == QgsVectorLayerDirector::DirectionBoth)
+				builder->addEdge(e.from, e.p1, e.to, e.p2, e.costs);
+			if (e.direction == QgsVectorLayerDirector::DirectionBackward || e.direction == QgsVectorLayerDirector::DirectionBoth)
+				builder->addEdge(e.to, e.p2, e.from, e.p1, e.costs);
+		}
+	}
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "QVector"
+#include "qgsvectorlayerdirector.h"
+
+class QgsVectorLayer;
+
+// Drop-in replacement for QgsVectorLayerDirector that builds the graph in
+// parallel. Features are read once on the calling thread and split into
+// chunks; the chunks are transformed, tied to the additional points and
+// measured with QgsDistanceArea on the global thread pool. Vertices within
+// the builder's topology tolerance are merged through a grid hash keyed like
+// QgsPointCompare, so the result matches the stock director, without the
+// sort and binary search per segment end.
+//
+// The builder is only called from the calling thread, once all vertices
+// and edges are known. Strategies must be safe to call from several
+// threads, which holds for the distance and speed strategies.
+class ParallelGraphDirector : public QgsGraphDirector
+{
+public:
+	ParallelGraphDirector(QgsVectorLayer *layer, int directionFieldId, const QString &directDirectionValue,
+		const QString &reverseDirectionValue, const QString &bothDirectionValue,
+		QgsVectorLayerDirector::Direction defaultDirection);
+
+	// Features per work item.
+	void setChunkSize(int features) { mChunkSize = qMax(1, features); }
+
+	void makeGraph(QgsGraphBuilderInterface *builder, const QVector<QgsPoint> &additionalPoints,
+		QVector<QgsPoint> &snappedPoints) const override;
+
+	QString name() const override;
+
+private:
+	QgsVectorLayer *mLayer;
+	int mDirectionFieldId;
+	QString mDirectDirectionValue;
+	QString mReverseDirectionValue;
+	QString mBothDirectionValue;
+	QgsVectorLayerDirector::Direction mDefaultDirection;
+	int mChunkSize;
+};
@@ -0,0 +1,155 @@
+#include "PointKdTree.h"
+#include "QPair"
+#include "QVarLengthArray"
+#include <algorithm>
+#include <limits>
+
+namespace
+{
+	// orders neighbours farthest first, so a heap keeps the farthest on top
+	bool closer(const PointKdTree::Neighbour &a, const PointKdTree::Neighbour &b)
+	{
+		return a.distanceSquared < b.distanceSquared || (a.distanceSquared == b.distanceSquared && a.id < b.id);
+	}
+}
+
+PointKdTree::PointKdTree()
+	: mBucketSize(8)
+{
+}
+
+PointKdTree::PointKdTree(const QVector<QgsPoint> &points, int bucketSize)
+	: mBucketSize(qMax(1, bucketSize))
+{
+	const int count = points.size();
+	if (count == 0)
+		return;
+
+	mX.resize(count);
+	mY.resize(count);
+	mIds.resize(count);
+	for (int i = 0; i < count; ++i)
+		mIds[i] = i;
+	mNodes.reserve(2 * (count / mBucketSize) + 1);
+
+	// ids are partitioned first, coordinates copied in tree order after
+	QVector<double> x(count), y(count);
+	for (int i = 0; i < count; ++i)
+	{
+		x[i] = points[i].x();
+		y[i] = points[i].y();
+	}
+	mX.swap(x);
+	mY.swap(y);
+	build(0, count);
+	for (int i = 0; i < count; ++i)
+	{
+		x[i] = mX[mIds[i]];
+		y[i] = mY[mIds[i]];
+	}
+	mX.swap(x);
+	mY.swap(y);
+}
+
+int PointKdTree::build(int begin, int end)
+{
+	const int index = mNodes.size();
+	const Node leaf = { begin, end, -1, -1, -1, 0 };
+	mNodes.append(leaf);
+	if (end - begin <= mBucketSize)
+		return index;
+
+	double xmin = mX[mIds[begin]], xmax = xmin;
+	double ymin = mY[mIds[begin]], ymax = ymin;
+	for (int i = begin + 1; i < end; ++i)
+	{
+		xmin = qMin(xmin, mX[mIds[i]]);
+		xmax = qMax(xmax, mX[mIds[i]]);
+		ymin = qMin(ymin, mY[mIds[i]]);
+		ymax = qMax(ymax, mY[mIds[i]]);
+	}
+	// coincident points stay in one leaf
+	if (xmax == xmin && ymax == ymin)
+		return index;
+
+	const int axis = xmax - xmin >= ymax - ymin ? 0 : 1;
+	const QVector<double> &values = axis == 0 ? mX : mY;
+	const int middle = begin + (end - begin) / 2;
+	std::nth_element(mIds.begin() + begin, mIds.begin() + middle, mIds.begin() + end,
+		[&values](int a, int b) { return values[a] < values[b]; });
+
+	const double split = values[mIds[middle]];
+	const int left = build(begin, middle);
+	const int right = build(middle, end);
+	Node &node = mNodes[index];
+	node.left = left;
+	node.right = right;
+	node.axis = axis;
+	node.split = split;
+	return index;
+}
+
+void PointKdTree::nearest(double x, double y, int count, double maxDistance, QVector<Neighbour> &result) const
+{
+	result.clear();
+	if (mNodes.isEmpty())
+		return;
+	const bool limited = maxDistance > 0;
+	if (!limited && count <= 0)
+		count = mIds.size();
+	const double limit = limited ? maxDistance * maxDistance : std::numeric_limits<double>::max();
+
+	// nodes with the squared distance of their side of the splits
+	QVarLengthArray<QPair<int, double>, 64> stack;
+	stack.append(qMakePair(0, 0.0));
+	while (!stack.isEmpty())
+	{
+		const QPair<int, double> entry = stack.last();
+		stack.removeLast();
+		const double bound = count > 0 && result.size() == count ? result.first().distanceSquared : limit;
+		if (entry.second > bound)
+			continue;
+
+		const Node &node = mNodes[entry.first];
+		if (node.left < 0)
+		{
+			for (int i = node.begin; i < node.end; ++i)
+			{
+				const double dx = mX[i] - x;
+				const double dy = mY[i] - y;
+				const Neighbour n = { mIds[i], dx * dx + dy * dy };
+				if (n.distanceSquared > limit)
+					continue;
+				if (count <= 0 || result.size() < count)
+				{
+					result.append(n);
+					if (count > 0)
+						std::push_heap(result.begin(), result.end(), closer);
+				}
+				else if (closer(n, result.first()))
+				{
+					std::pop_heap(result.begin(), result.end(), closer);
+					result.last() = n;
+					std::push_heap(result.begin(), result.end(), closer);
+				}
+			}
+			continue;
+		}
+
+		// the far side first onto the stack, so the near side is searched
+		// first and tightens the bound
+		const double offset = (node.axis == 0 ? x : y) - node.split;
+		const double far = offset * offset;
+		if (offset < 0)
+		{
+			stack.append(qMakePair(node.right, qMax(entry.second, far)));
+			stack.append(qMakePair(node.left, entry.second));
+		}
+		else
+		{
+			stack.append(qMakePair(node.left, qMax(entry.second, far)));
+			stack.append(qMakePair(node.right, entry.second));
+		}
+	}
+	std::sort(result.begin(), result.end(), closer);
+}
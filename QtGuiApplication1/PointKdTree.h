@@ -0,0 +1,52 @@
+#pragma once
+
+#include "QVector"
+#include "qgspoint.h"
+
+// Read-only two dimensional kd-tree over points, split at the median of
+// the wider axis down to small buckets. Points are identified by their
+// position in the vector passed to the constructor. Once built the tree
+// is never modified, so any number of threads may query it at the same
+// time.
+class PointKdTree
+{
+public:
+	struct Neighbour
+	{
+		int id;
+		double distanceSquared;
+	};
+
+	PointKdTree();
+	explicit PointKdTree(const QVector<QgsPoint> &points, int bucketSize = 8);
+
+	int size() const { return mIds.size(); }
+	bool isEmpty() const { return mIds.isEmpty(); }
+
+	// The count points nearest to x, y that are at most maxDistance away,
+	// closest first and by id among equal distances. A count of 0 returns
+	// every point within maxDistance; a maxDistance of 0 or less does not
+	// limit the search. result is cleared first.
+	void nearest(double x, double y, int count, double maxDistance, QVector<Neighbour> &result) const;
+
+private:
+	struct Node
+	{
+		// leaves have no children and hold points [begin, end)
+		int begin;
+		int end;
+		int left;
+		int right;
+		int axis;
+		double split;
+	};
+
+	int build(int begin, int end);
+
+	int mBucketSize;
+	QVector<Node> mNodes;
+	// points in tree order
+	QVector<double> mX;
+	QVector<double> mY;
+	QVector<int> mIds;
+};
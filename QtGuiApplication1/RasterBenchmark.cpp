@@ -0,0 +1,261 @@
+#include "RasterBenchmark.h"
+#include "FastBilinearResampler.h"
+#include "FastCubicResampler.h"
+#include "FastMultiBandColorRenderer.h"
+#include "FastPseudoColorRenderer.h"
+#include "FastSingleBandGrayRenderer.h"
+#include "FloatLanes.h"
+#include "QElapsedTimer"
+#include "QImage"
+#include "QScopedPointer"
+#include "QSharedPointer"
+#include "QStringList"
+#include "qgsbilinearrasterresampler.h"
+#include "qgscolorrampshader.h"
+#include "qgscontrastenhancement.h"
+#include "qgscubicrasterresampler.h"
+#include "qgsrastershader.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <random>
+
+namespace
+{
+	qint64 median(QVector<qint64> times)
+	{
+		std::sort(times.begin(), times.end());
+		return times.isEmpty() ? 0 : times[times.size() / 2];
+	}
+
+	QString milliseconds(qint64 nsecs)
+	{
+		return QString::number(nsecs / 1e6, 'f', 2) + " ms";
+	}
+
+	// Smooth waves with noise over the range of the data type and a sprinkle
+	// of nodata cells. Bands are generated once per size and copied out, so
+	// reading costs the same for every renderer.
+	class SyntheticRaster : public QgsRasterInterface
+	{
+	public:
+		SyntheticRaster(Qgis::DataType type, int bands, unsigned int seed)
+			: QgsRasterInterface(nullptr)
+			, mType(type)
+			, mBands(bands)
+			, mSeed(seed)
+		{
+		}
+
+		SyntheticRaster *clone() const override { return new SyntheticRaster(mType, mBands, mSeed); }
+		Qgis::DataType dataType(int) const override { return mType; }
+		int bandCount() const override { return mBands; }
+
+		QgsRasterBlock *block(int bandNo, const QgsRectangle &, int width, int height, QgsRasterBlockFeedback *) override
+		{
+			if (bandNo < 1 || bandNo > mBands)
+				return new QgsRasterBlock();
+			if (mBlocks.size() != mBands || mBlocks[0]->width() != width || mBlocks[0]->height() != height)
+				generate(width, height);
+
+			const QgsRasterBlock *source = mBlocks[bandNo - 1].data();
+			QgsRasterBlock *block = new QgsRasterBlock(mType, width, height, source->noDataValue());
+			std::memcpy(block->bits(), const_cast<QgsRasterBlock *>(source)->bits(), static_cast<size_t>(width) * height * block->dataTypeSize());
+			return block;
+		}
+
+		static double maximum(Qgis::DataType type)
+		{
+			switch (type)
+			{
+			case Qgis::Byte:
+				return 255;
+			case Qgis::UInt16:
+				return 65535;
+			default:
+				return 1000;
+			}
+		}
+
+	private:
+		void generate(int width, int height)
+		{
+			mBlocks.clear();
+			std::mt19937 random(mSeed);
+			std::uniform_real_distribution<double> noise(-0.05, 0.05);
+			const double top = maximum(mType);
+			for (int band = 1; band <= mBands; ++band)
+			{
+				QSharedPointer<QgsRasterBlock> block(new QgsRasterBlock(mType, width, height, 0));
+				for (int i = 0; i < height; ++i)
+				{
+					for (int j = 0; j < width; ++j)
+					{
+						const double wave = std::sin(j * 0.01 * band) * std::cos(i * 0.013) + noise(random);
+						double value = std::floor(top * (0.5 + 0.45 * wave));
+						if ((i * width + j) % 97 == 0)
+							value = 0;
+						block->setValue(i, j, value);
+					}
+				}
+				mBlocks.append(block);
+			}
+		}
+
+		Qgis::DataType mType;
+		int mBands;
+		unsigned int mSeed;
+		QVector<QSharedPointer<QgsRasterBlock> > mBlocks;
+	};
+
+	QgsContrastEnhancement *stretch(Qgis::DataType type, QgsContrastEnhancement::ContrastEnhancementAlgorithm algorithm)
+	{
+		const double top = SyntheticRaster::maximum(type);
+		QgsContrastEnhancement *enhancement = new QgsContrastEnhancement(type);
+		enhancement->setMinimumValue(0.1 * top);
+		enhancement->setMaximumValue(0.9 * top);
+		enhancement->setContrastEnhancementAlgorithm(algorithm);
+		return enhancement;
+	}
+
+	QgsRasterShader *shader(double top)
+	{
+		QgsColorRampShader *ramp = new QgsColorRampShader(0, top);
+		ramp->setColorRampType(QgsColorRampShader::Interpolated);
+		QList<QgsColorRampShader::ColorRampItem> items;
+		items << QgsColorRampShader::ColorRampItem(0.05 * top, QColor(43, 131, 186))
+			<< QgsColorRampShader::ColorRampItem(0.3 * top, QColor(171, 221, 164))
+			<< QgsColorRampShader::ColorRampItem(0.5 * top, QColor(255, 255, 191))
+			<< QgsColorRampShader::ColorRampItem(0.7 * top, QColor(253, 174, 97))
+			<< QgsColorRampShader::ColorRampItem(0.95 * top, QColor(215, 25, 28));
+		ramp->setColorRampItemList(items);
+		QgsRasterShader *result = new QgsRasterShader(0, top);
+		result->setRasterShaderFunction(ramp);
+		return result;
+	}
+
+	// pixels differing by more than one in any channel
+	int mismatches(QgsRasterBlock *stock, QgsRasterBlock *fast)
+	{
+		if (!stock || !fast || stock->width() != fast->width() || stock->height() != fast->height())
+			return -1;
+		const QRgb *a = reinterpret_cast<const QRgb *>(stock->bits());
+		const QRgb *b = reinterpret_cast<const QRgb *>(fast->bits());
+		const qgssize count = static_cast<qgssize>(stock->width()) * stock->height();
+		int result = 0;
+		for (qgssize i = 0; i < count; ++i)
+		{
+			if (qAbs(qRed(a[i]) - qRed(b[i])) > 1 || qAbs(qGreen(a[i]) - qGreen(b[i])) > 1
+				|| qAbs(qBlue(a[i]) - qBlue(b[i])) > 1 || qAbs(qAlpha(a[i]) - qAlpha(b[i])) > 1)
+				++result;
+		}
+		return result;
+	}
+
+	// Times both renderers, alternating them, and compares their last output.
+	void compare(QgsRasterInterface *stock, QgsRasterInterface *fast, int width, int height, int repeats,
+		qint64 &stockTime, qint64 &fastTime, int &mismatchCount)
+	{
+		const QgsRectangle extent(0, 0, width, height);
+		QVector<qint64> stockTimes, fastTimes;
+		QScopedPointer<QgsRasterBlock> stockBlock, fastBlock;
+		QElapsedTimer timer;
+		for (int r = 0; r < qMax(repeats, 1); ++r)
+		{
+			timer.start();
+			stockBlock.reset(stock->block(1, extent, width, height));
+			stockTimes.append(timer.nsecsElapsed());
+			timer.restart();
+			fastBlock.reset(fast->block(1, extent, width, height));
+			fastTimes.append(timer.nsecsElapsed());
+		}
+		stockTime = median(stockTimes);
+		fastTime = median(fastTimes);
+		mismatchCount = mismatches(stockBlock.data(), fastBlock.data());
+	}
+
+	void compare(QgsRasterResampler &stock, QgsRasterResampler &fast, const QImage &source, int repeats,
+		qint64 &stockTime, qint64 &fastTime)
+	{
+		QVector<qint64> stockTimes, fastTimes;
+		QElapsedTimer timer;
+		for (int r = 0; r < qMax(repeats, 1); ++r)
+		{
+			QImage stockImage(source.width() * 2, source.height() * 2, QImage::Format_ARGB32_Premultiplied);
+			QImage fastImage(stockImage.size(), QImage::Format_ARGB32_Premultiplied);
+			timer.start();
+			stock.resample(source, stockImage);
+			stockTimes.append(timer.nsecsElapsed());
+			timer.restart();
+			fast.resample(source, fastImage);
+			fastTimes.append(timer.nsecsElapsed());
+		}
+		stockTime = median(stockTimes);
+		fastTime = median(fastTimes);
+	}
+}
+
+RasterBenchmark::Result RasterBenchmark::run(int width, int height, int repeats, unsigned int seed)
+{
+	Result result;
+	result.width = width;
+	result.height = height;
+	result.laneWidth = FloatLanes::width();
+	for (int p = 0; p < PipeCount; ++p)
+		result.mismatches[p] = -1;
+
+	SyntheticRaster elevation(Qgis::UInt16, 1, seed);
+	QgsSingleBandGrayRenderer stockGray(&elevation, 1);
+	stockGray.setContrastEnhancement(stretch(Qgis::UInt16, QgsContrastEnhancement::StretchToMinimumMaximum));
+	FastSingleBandGrayRenderer fastGray(&elevation, 1);
+	fastGray.setContrastEnhancement(stretch(Qgis::UInt16, QgsContrastEnhancement::StretchToMinimumMaximum));
+	compare(&stockGray, &fastGray, width, height, repeats, result.stockTimes[Gray], result.fastTimes[Gray], result.mismatches[Gray]);
+
+	SyntheticRaster image(Qgis::Byte, 3, seed);
+	QgsMultiBandColorRenderer stockColor(&image, 1, 2, 3,
+		stretch(Qgis::Byte, QgsContrastEnhancement::StretchAndClipToMinimumMaximum),
+		stretch(Qgis::Byte, QgsContrastEnhancement::StretchToMinimumMaximum),
+		stretch(Qgis::Byte, QgsContrastEnhancement::ClipToMinimumMaximum));
+	FastMultiBandColorRenderer fastColor(&image, 1, 2, 3,
+		stretch(Qgis::Byte, QgsContrastEnhancement::StretchAndClipToMinimumMaximum),
+		stretch(Qgis::Byte, QgsContrastEnhancement::StretchToMinimumMaximum),
+		stretch(Qgis::Byte, QgsContrastEnhancement::ClipToMinimumMaximum));
+	compare(&stockColor, &fastColor, width, height, repeats, result.stockTimes[MultiBand], result.fastTimes[MultiBand], result.mismatches[MultiBand]);
+
+	SyntheticRaster surface(Qgis::Float32, 1, seed);
+	const double top = SyntheticRaster::maximum(Qgis::Float32);
+	QgsSingleBandPseudoColorRenderer stockRamp(&surface, 1, shader(top));
+	FastPseudoColorRenderer fastRamp(&surface, 1, shader(top));
+	compare(&stockRamp, &fastRamp, width, height, repeats, result.stockTimes[PseudoColor], result.fastTimes[PseudoColor], result.mismatches[PseudoColor]);
+
+	// a rendered image at half the size, upsampled as when zoomed in
+	QScopedPointer<QgsRasterBlock> rendered(fastRamp.block(1, QgsRectangle(0, 0, width, height), qMax(width / 2, 2), qMax(height / 2, 2)));
+	const QImage source = rendered->image();
+
+	QgsBilinearRasterResampler stockBilinear;
+	FastBilinearResampler fastBilinear;
+	compare(stockBilinear, fastBilinear, source, repeats, result.stockTimes[Bilinear], result.fastTimes[Bilinear]);
+
+	QgsCubicRasterResampler stockCubic;
+	FastCubicResampler fastCubic;
+	compare(stockCubic, fastCubic, source, repeats, result.stockTimes[Cubic], result.fastTimes[Cubic]);
+	return result;
+}
+
+QString RasterBenchmark::report(const Result &result)
+{
+	static const char *const names[PipeCount] = { "gray", "multiband", "pseudocolor", "bilinear", "cubic" };
+
+	QStringList lines;
+	lines << QString("%1 x %2 cells, %3 float lanes").arg(result.width).arg(result.height).arg(result.laneWidth);
+	for (int p = 0; p < PipeCount; ++p)
+	{
+		QString line = QString("%1: stock %2, fast %3").arg(names[p], milliseconds(result.stockTimes[p]), milliseconds(result.fastTimes[p]));
+		if (result.fastTimes[p] > 0)
+			line += QString(" (%1x)").arg(static_cast<double>(result.stockTimes[p]) / result.fastTimes[p], 0, 'f', 1);
+		if (result.mismatches[p] >= 0)
+			line += QString(", %1 pixels differ").arg(result.mismatches[p]);
+		lines << line;
+	}
+	return lines.join('\n');
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "QString"
+
+// Micro-benchmark of the raster render path. Renders a reproducible
+// synthetic raster through the stock renderers and resamplers and through
+// their Fast replacements, keeping the median time of each, and counts the
+// pixels where the fast renderers differ from the stock ones by more than
+// one in any channel. The resamplers interpolate differently and are only
+// timed, upsampling a rendered image by two.
+class RasterBenchmark
+{
+public:
+	enum Pipe
+	{
+		Gray,
+		MultiBand,
+		PseudoColor,
+		Bilinear,
+		Cubic,
+		PipeCount
+	};
+
+	struct Result
+	{
+		int width;
+		int height;
+		// floats per vector of the kernels that ran, 1 if scalar
+		int laneWidth;
+		// median nanoseconds over all repeats
+		qint64 stockTimes[PipeCount];
+		qint64 fastTimes[PipeCount];
+		// -1 where not compared
+		int mismatches[PipeCount];
+	};
+
+	static Result run(int width = 2048, int height = 2048, int repeats = 5, unsigned int seed = 1);
+	static QString report(const Result &result);
+};
@@ -0,0 +1,272 @@
+#include "RasterBlockCache.h"
+#include "QCache"
+#include "QMutex"
+#include "QMutexLocker"
+#include "QSharedPointer"
+#include "qgsrasterdataprovider.h"
+#include "qgsrasterpipe.h"
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+	// cells per tile side
+	const int TileSize = 256;
+
+	struct BlockStore
+	{
+		BlockStore() : blocks(256 * 1024 * 1024), hits(0), misses(0) {}
+
+		QMutex mutex;
+		// cost is bytes
+		QCache<QString, QSharedPointer<QgsRasterBlock> > blocks;
+		int hits;
+		int misses;
+	};
+
+	BlockStore &blockStore()
+	{
+		static BlockStore store;
+		return store;
+	}
+
+	// Identifies what the input returns for a band; providers by their
+	// source, so clones share tiles, anything else by address.
+	QString sourceKey(const QgsRasterInterface *input, int bandNo)
+	{
+		QString key;
+		if (const QgsRasterDataProvider *provider = dynamic_cast<const QgsRasterDataProvider *>(input))
+		{
+			key = provider->dataSourceUri() + '|' + QString::number(provider->dataTimestamp().toMSecsSinceEpoch())
+				+ '|' + QString::number(provider->useSourceNoDataValue(bandNo));
+			for (const QgsRasterRange &range : provider->userNoDataValues(bandNo))
+				key += '|' + QString::number(range.min(), 'g', 17) + ':' + QString::number(range.max(), 'g', 17);
+		}
+		else
+		{
+			key = QString::number(reinterpret_cast<quintptr>(input), 16);
+		}
+		return key + '|' + QString::number(bandNo);
+	}
+}
+
+RasterBlockCache::RasterBlockCache(QgsRasterInterface *input)
+	: QgsRasterInterface(input)
+{
+}
+
+RasterBlockCache *RasterBlockCache::clone() const
+{
+	return new RasterBlockCache(nullptr);
+}
+
+int RasterBlockCache::capabilities() const
+{
+	return mInput ? mInput->capabilities() : QgsRasterInterface::NoCapabilities;
+}
+
+int RasterBlockCache::bandCount() const
+{
+	return mInput ? mInput->bandCount() : 0;
+}
+
+Qgis::DataType RasterBlockCache::dataType(int bandNo) const
+{
+	return mInput ? mInput->dataType(bandNo) : Qgis::UnknownDataType;
+}
+
+QgsRasterBandStats RasterBlockCache::bandStatistics(int theBandNo, int theStats, const QgsRectangle &theExtent, int theSampleSize)
+{
+	if (!mInput)
+		return QgsRasterInterface::bandStatistics(theBandNo, theStats, theExtent, theSampleSize);
+	return mInput->bandStatistics(theBandNo, theStats, theExtent, theSampleSize);
+}
+
+QgsRasterHistogram RasterBlockCache::histogram(int theBandNo, int theBinCount, double theMinimum, double theMaximum,
+	const QgsRectangle &theExtent, int theSampleSize, bool theIncludeOutOfRange)
+{
+	if (!mInput)
+		return QgsRasterInterface::histogram(theBandNo, theBinCount, theMinimum, theMaximum, theExtent, theSampleSize, theIncludeOutOfRange);
+	return mInput->histogram(theBandNo, theBinCount, theMinimum, theMaximum, theExtent, theSampleSize, theIncludeOutOfRange);
+}
+
+QgsRasterBlock *RasterBlockCache::block(int bandNo, const QgsRectangle &extent, int width, int height, QgsRasterBlockFeedback *feedback)
+{
+	if (!mInput)
+		return new QgsRasterBlock();
+	const QgsRectangle inputExtent = mInput->extent();
+	const int xSize = mInput->xSize();
+	const int ySize = mInput->ySize();
+	if (!(mInput->capabilities() & Size) || xSize <= 0 || ySize <= 0 || inputExtent.isEmpty() || width <= 0 || height <= 0)
+		return mInput->block(bandNo, extent, width, height, feedback);
+
+	// the coarsest level whose cells are not larger than the requested ones
+	const double nativeX = inputExtent.width() / xSize;
+	const double nativeY = inputExtent.height() / ySize;
+	const double resX = extent.width() / width;
+	const double resY = extent.height() / height;
+	const double ratio = qMin(resX / nativeX, resY / nativeY);
+	int level = 0;
+	while (level < 30 && ratio >= (2 << level) && (xSize >> (level + 1)) > 0 && (ySize >> (level + 1)) > 0)
+		++level;
+	const int scale = 1 << level;
+	const int levelCols = (xSize + scale - 1) / scale;
+	const int levelRows = (ySize + scale - 1) / scale;
+	const double cellX = nativeX * scale;
+	const double cellY = nativeY * scale;
+
+	// level cells under the centres of the output columns and rows, -1
+	// outside the raster
+	QVector<int> columns(width);
+	QVector<int> rows(height);
+	int firstCol = levelCols, lastCol = -1;
+	int firstRow = levelRows, lastRow = -1;
+	for (int j = 0; j < width; ++j)
+	{
+		const double x = extent.xMinimum() + (j + 0.5) * resX;
+		const int c = x < inputExtent.xMinimum() || x >= inputExtent.xMaximum() ? -1 : qMin(static_cast<int>((x - inputExtent.xMinimum()) / cellX), levelCols - 1);
+		columns[j] = c;
+		if (c >= 0)
+		{
+			firstCol = qMin(firstCol, c);
+			lastCol = qMax(lastCol, c);
+		}
+	}
+	for (int i = 0; i < height; ++i)
+	{
+		const double y = extent.yMaximum() - (i + 0.5) * resY;
+		const int r = y > inputExtent.yMaximum() || y <= inputExtent.yMinimum() ? -1 : qMin(static_cast<int>((inputExtent.yMaximum() - y) / cellY), levelRows - 1);
+		rows[i] = r;
+		if (r >= 0)
+		{
+			firstRow = qMin(firstRow, r);
+			lastRow = qMax(lastRow, r);
+		}
+	}
+	if (lastCol < 0 || lastRow < 0)
+		return mInput->block(bandNo, extent, width, height, feedback);
+
+	const int tileX0 = firstCol / TileSize;
+	const int tileY0 = firstRow / TileSize;
+	const int tilesX = lastCol / TileSize - tileX0 + 1;
+	const int tilesY = lastRow / TileSize - tileY0 + 1;
+	const QString prefix = sourceKey(mInput, bandNo) + '|' + QString::number(level) + '|';
+
+	BlockStore &store = blockStore();
+	QVector<QSharedPointer<QgsRasterBlock> > tiles;
+	QgsRasterBlock *first = nullptr;
+	for (int ty = tileY0; ty < tileY0 + tilesY; ++ty)
+	{
+		for (int tx = tileX0; tx < tileX0 + tilesX; ++tx)
+		{
+			const QString key = prefix + QString::number(tx) + '|' + QString::number(ty);
+			{
+				QMutexLocker locker(&store.mutex);
+				if (QSharedPointer<QgsRasterBlock> *cached = store.blocks.object(key))
+				{
+					++store.hits;
+					tiles.append(*cached);
+					if (!first)
+						first = cached->data();
+					continue;
+				}
+				++store.misses;
+			}
+
+			// decoded unlocked, like TextLayoutCache shapes its text
+			const int w = qMin(TileSize, levelCols - tx * TileSize);
+			const int h = qMin(TileSize, levelRows - ty * TileSize);
+			const QgsRectangle tileExtent(inputExtent.xMinimum() + tx * TileSize * cellX, inputExtent.yMaximum() - (ty * TileSize + h) * cellY,
+				inputExtent.xMinimum() + (tx * TileSize + w) * cellX, inputExtent.yMaximum() - ty * TileSize * cellY);
+			QSharedPointer<QgsRasterBlock> tile(mInput->block(bandNo, tileExtent, w, h, feedback));
+			if (feedback && feedback->isCanceled())
+				return new QgsRasterBlock();
+			if (!tile || tile->isEmpty())
+			{
+				tiles.append(QSharedPointer<QgsRasterBlock>());
+				continue;
+			}
+			tiles.append(tile);
+			if (!first)
+				first = tile.data();
+			QMutexLocker locker(&store.mutex);
+			store.blocks.insert(key, new QSharedPointer<QgsRasterBlock>(tile), w * h * tile->dataTypeSize());
+		}
+	}
+	if (!first)
+		return new QgsRasterBlock();
+
+	QgsRasterBlock *outputBlock = new QgsRasterBlock(first->dataType(), width, height);
+	if (first->hasNoDataValue())
+		outputBlock->setNoDataValue(first->noDataValue());
+	if (!outputBlock->isValid())
+		return outputBlock;
+	outputBlock->setIsNoData();
+
+	const int pixelSize = outputBlock->dataTypeSize();
+	for (int i = 0; i < height; ++i)
+	{
+		const int row = rows[i];
+		if (row < 0)
+			continue;
+		const QSharedPointer<QgsRasterBlock> *tileRow = tiles.constData() + (row / TileSize - tileY0) * tilesX;
+		const int r = row % TileSize;
+		for (int j = 0; j < width; ++j)
+		{
+			const int col = columns[j];
+			if (col < 0)
+				continue;
+			QgsRasterBlock *tile = tileRow[col / TileSize - tileX0].data();
+			const int c = col % TileSize;
+			// nodata kept in a bitmap needs isNoData(); values are copied
+			if (!tile || (!tile->hasNoDataValue() && tile->isNoData(r, c)))
+				continue;
+			std::memcpy(outputBlock->bits(i, j), tile->bits(r, c), pixelSize);
+			outputBlock->setIsData(i, j);
+		}
+	}
+	return outputBlock;
+}
+
+bool RasterBlockCache::install(QgsRasterPipe *pipe)
+{
+	if (!pipe || pipe->size() == 0)
+		return false;
+	if (pipe->size() > 1 && dynamic_cast<RasterBlockCache *>(pipe->at(1)))
+		return true;
+	RasterBlockCache *cache = new RasterBlockCache;
+	if (pipe->insert(1, cache))
+		return true;
+	delete cache;
+	return false;
+}
+
+void RasterBlockCache::setMaxBytes(int bytes)
+{
+	BlockStore &store = blockStore();
+	QMutexLocker locker(&store.mutex);
+	store.blocks.setMaxCost(bytes);
+}
+
+void RasterBlockCache::clear()
+{
+	BlockStore &store = blockStore();
+	QMutexLocker locker(&store.mutex);
+	store.blocks.clear();
+	store.hits = 0;
+	store.misses = 0;
+}
+
+int RasterBlockCache::hits()
+{
+	BlockStore &store = blockStore();
+	QMutexLocker locker(&store.mutex);
+	return store.hits;
+}
+
+int RasterBlockCache::misses()
+{
+	BlockStore &store = blockStore();
+	QMutexLocker locker(&store.mutex);
+	return store.misses;
+}
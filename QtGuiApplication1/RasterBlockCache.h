@@ -0,0 +1,46 @@
+#pragma once
+
+#include "qgsrasterinterface.h"
+
+class QgsRasterPipe;
+
+// Pipe stage right behind the data provider that keeps decoded blocks. A
+// render pass asks the provider for exactly the visible extent, so every
+// pan or refresh decodes the same GDAL blocks again. Here requests are
+// answered from tiles of 256 x 256 cells on the raster's own grid, or on a
+// grid coarsened by a power of two when zoomed out, and the tiles live in
+// a process wide LRU cache with a byte budget. Tiles are keyed by data
+// source, band, nodata settings, level and tile index, so the clones of
+// the pipe that every render job makes share them.
+//
+// Cells are picked by nearest neighbour from the finest level not finer
+// than the request, as the provider does from its overviews. Inputs that
+// do not report a size (WMS and the like) are passed through.
+class RasterBlockCache : public QgsRasterInterface
+{
+public:
+	RasterBlockCache(QgsRasterInterface *input = nullptr);
+
+	RasterBlockCache *clone() const override;
+
+	int capabilities() const override;
+	int bandCount() const override;
+	Qgis::DataType dataType(int bandNo) const override;
+
+	QgsRasterBlock *block(int bandNo, const QgsRectangle &extent, int width, int height, QgsRasterBlockFeedback *feedback = nullptr) override;
+
+	// statistics come from the provider, which may know them already
+	QgsRasterBandStats bandStatistics(int theBandNo, int theStats = QgsRasterBandStats::All,
+		const QgsRectangle &theExtent = QgsRectangle(), int theSampleSize = 0) override;
+	QgsRasterHistogram histogram(int theBandNo, int theBinCount = 0,
+		double theMinimum = std::numeric_limits<double>::quiet_NaN(), double theMaximum = std::numeric_limits<double>::quiet_NaN(),
+		const QgsRectangle &theExtent = QgsRectangle(), int theSampleSize = 0, bool theIncludeOutOfRange = false) override;
+
+	// Inserts a cache behind the provider of pipe.
+	static bool install(QgsRasterPipe *pipe);
+
+	static void setMaxBytes(int bytes);
+	static void clear();
+	static int hits();
+	static int misses();
+};
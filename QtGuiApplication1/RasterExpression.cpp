@@ -0,0 +1,555 @@
+#include "RasterExpression.h"
+#include "FloatLanes.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace
+{
+	// pixels evaluated per pass through the program
+	const int Batch = 256;
+
+	struct AddOp
+	{
+		template <typename L>
+		static typename L::V apply(typename L::V a, typename L::V b) { return L::add(a, b); }
+	};
+
+	struct SubtractOp
+	{
+		template <typename L>
+		static typename L::V apply(typename L::V a, typename L::V b) { return L::sub(a, b); }
+	};
+
+	struct MultiplyOp
+	{
+		template <typename L>
+		static typename L::V apply(typename L::V a, typename L::V b) { return L::mul(a, b); }
+	};
+
+	struct DivideOp
+	{
+		template <typename L>
+		static typename L::V apply(typename L::V a, typename L::V b)
+		{
+			const typename L::V nan = L::set(std::numeric_limits<float>::quiet_NaN());
+			return L::select(L::notEqual(b, L::set(0)), L::div(a, b), nan);
+		}
+	};
+
+	// comparisons and logic give 1 or 0, nodata if either side is nodata
+	template <typename L>
+	typename L::V truth(typename L::V mask, typename L::V a, typename L::V b)
+	{
+		const typename L::V nan = L::set(std::numeric_limits<float>::quiet_NaN());
+		const typename L::V value = L::select(mask, L::set(1), L::set(0));
+		return L::select(L::both(L::isNumber(a), L::isNumber(b)), value, nan);
+	}
+
+#define COMPARISON(Name, function) \
+	struct Name \
+	{ \
+		template <typename L> \
+		static typename L::V apply(typename L::V a, typename L::V b) { return truth<L>(L::function(a, b), a, b); } \
+	};
+
+	COMPARISON(EqualOp, equal)
+	COMPARISON(NotEqualOp, notEqual)
+	COMPARISON(GreaterOp, greater)
+	COMPARISON(LessOp, less)
+	COMPARISON(GreaterEqualOp, greaterEqual)
+	COMPARISON(LessEqualOp, lessEqual)
+#undef COMPARISON
+
+	struct AndOp
+	{
+		template <typename L>
+		static typename L::V apply(typename L::V a, typename L::V b)
+		{
+			const typename L::V zero = L::set(0);
+			return truth<L>(L::both(L::notEqual(a, zero), L::notEqual(b, zero)), a, b);
+		}
+	};
+
+	struct OrOp
+	{
+		template <typename L>
+		static typename L::V apply(typename L::V a, typename L::V b)
+		{
+			const typename L::V zero = L::set(0);
+			return truth<L>(L::either(L::notEqual(a, zero), L::notEqual(b, zero)), a, b);
+		}
+	};
+
+	struct NegateOp
+	{
+		template <typename L>
+		static typename L::V apply(typename L::V a, typename L::V) { return L::sub(L::set(0), a); }
+	};
+
+	struct SqrtOp
+	{
+		template <typename L>
+		static typename L::V apply(typename L::V a, typename L::V) { return L::sqrt(a); }
+	};
+
+	template <typename Op, typename L>
+	int applySpan(float *a, const float *b, int i, int count)
+	{
+		for (; i + L::Width <= count; i += L::Width)
+			L::store(a + i, Op::template apply<L>(L::load(a + i), L::load(b + i)));
+		return i;
+	}
+
+	// a = a op b; unary operations ignore b
+	template <typename Op>
+	void apply(float *a, const float *b, int count)
+	{
+		int i = 0;
+#ifdef FLOATLANES_AVX
+		if (FloatLanes::avx())
+		{
+			i = applySpan<Op, AvxLanes>(a, b, i, count);
+			AvxLanes::leave();
+		}
+#endif
+#ifdef FLOATLANES_SSE
+		i = applySpan<Op, SseLanes>(a, b, i, count);
+#endif
+		applySpan<Op, ScalarLanes>(a, b, i, count);
+	}
+
+	template <typename Function>
+	void applyScalar(float *a, int count, Function function)
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			const float value = function(a[i]);
+			a[i] = std::isfinite(value) ? value : std::numeric_limits<float>::quiet_NaN();
+		}
+	}
+
+	bool isReferenceChar(QChar c)
+	{
+		// as raster_ref_char in qgsrastercalclexer.ll
+		return c.isLetterOrNumber() || c == '_' || c == '.' || c == '/' || c == ':' || c.unicode() >= 0x80;
+	}
+}
+
+// Recursive descent over the grammar of qgsrastercalcparser.yy. As there,
+// AND binds weakest, then OR, then !=, >=, <= and =, < and > on four
+// levels, and unary minus binds tighter than ^.
+class RasterExpression::Parser
+{
+public:
+	Parser(const QString &formula, RasterExpression &expression)
+		: mText(formula)
+		, mPos(0)
+		, mExpression(expression)
+	{
+	}
+
+	int parse(QString &error)
+	{
+		const int root = binary(0);
+		skipSpaces();
+		if (mError.isEmpty() && mPos < mText.size())
+			mError = QString("unexpected '%1' at position %2").arg(mText.mid(mPos, 10)).arg(mPos + 1);
+		error = mError;
+		return mError.isEmpty() ? root : -1;
+	}
+
+	QVector<Node> nodes;
+
+private:
+	void skipSpaces()
+	{
+		while (mPos < mText.size() && mText[mPos].isSpace())
+			++mPos;
+	}
+
+	bool lookingAt(const QString &token)
+	{
+		skipSpaces();
+		if (mText.midRef(mPos, token.size()) != token)
+			return false;
+		// keywords must not run into a reference or number
+		const int after = mPos + token.size();
+		return !(token[0].isLetter() && after < mText.size() && (isReferenceChar(mText[after]) || mText[after] == '@'));
+	}
+
+	bool accept(const QString &token)
+	{
+		if (!lookingAt(token))
+			return false;
+		mPos += token.size();
+		return true;
+	}
+
+	int add(OpCode op, int left, int right)
+	{
+		if (left < 0 || (right < 0 && !isUnary(op)))
+			return -1;
+		Node node = { op, left, right, -1, 0 };
+		nodes.append(node);
+		return nodes.size() - 1;
+	}
+
+	int binary(int level)
+	{
+		// loosest first; of tokens sharing a prefix the longer comes first
+		static const struct { const char *token; OpCode op; int level; } operators[] =
+		{
+			{ "AND", And, 0 },
+			{ "OR", Or, 1 },
+			{ "!=", NotEqual, 2 },
+			{ ">=", GreaterEqual, 3 },
+			{ "<=", LessEqual, 4 },
+			{ "=", Equal, 5 },
+			{ "<", Less, 5 },
+			{ ">", Greater, 5 },
+			{ "+", Add, 6 },
+			{ "-", Subtract, 6 },
+			{ "*", Multiply, 7 },
+			{ "/", Divide, 7 },
+			{ "^", Power, 8 },
+		};
+		if (level > 8)
+			return unary();
+
+		int left = binary(level + 1);
+		while (left >= 0)
+		{
+			// the operator here, so that "<" is not taken from "<="
+			const int count = sizeof(operators) / sizeof(operators[0]);
+			int k = 0;
+			while (k < count && !lookingAt(operators[k].token))
+				++k;
+			if (k == count || operators[k].level != level)
+				break;
+			accept(operators[k].token);
+			left = add(operators[k].op, left, binary(level + 1));
+		}
+		return left;
+	}
+
+	int unary()
+	{
+		if (accept("-"))
+			return add(Negate, unary(), -1);
+		if (accept("+"))
+			return unary();
+		return primary();
+	}
+
+	int primary()
+	{
+		static const struct { const char *name; OpCode op; } functions[] =
+		{
+			{ "sqrt", Sqrt }, { "sin", Sin }, { "cos", Cos }, { "tan", Tan }, { "asin", Asin },
+			{ "acos", Acos }, { "atan", Atan }, { "ln", Ln }, { "log10", Log10 },
+		};
+
+		skipSpaces();
+		if (mPos == mText.size())
+			return fail("unexpected end of formula");
+
+		if (accept("("))
+		{
+			const int inner = binary(0);
+			return inner >= 0 && !accept(")") ? fail("missing ')'") : inner;
+		}
+		for (const auto &f : functions)
+		{
+			if (accept(f.name))
+			{
+				if (!accept("("))
+					return fail(QString("missing '(' after %1").arg(f.name));
+				const int argument = binary(0);
+				if (argument >= 0 && !accept(")"))
+					return fail("missing ')'");
+				return add(f.op, argument, -1);
+			}
+		}
+
+		if (mText[mPos] == '"')
+		{
+			QString name;
+			for (++mPos; mPos < mText.size() && mText[mPos] != '"'; ++mPos)
+			{
+				if (mText[mPos] == '\\' && mPos + 1 < mText.size())
+					++mPos;
+				name += mText[mPos];
+			}
+			if (mPos == mText.size())
+				return fail("unterminated raster reference");
+			++mPos;
+			return reference(name);
+		}
+
+		// a run of reference characters followed by @band is a reference,
+		// anything else starting with a digit or point a number
+		int end = mPos;
+		while (end < mText.size() && isReferenceChar(mText[end]))
+			++end;
+		if (end < mText.size() && mText[end] == '@' && end + 1 < mText.size() && mText[end + 1].isDigit())
+		{
+			++end;
+			while (end < mText.size() && mText[end].isDigit())
+				++end;
+			const QString name = mText.mid(mPos, end - mPos);
+			mPos = end;
+			return reference(name);
+		}
+		if (mText[mPos].isDigit() || mText[mPos] == '.')
+		{
+			end = mPos;
+			while (end < mText.size() && (mText[end].isDigit() || mText[end] == '.'))
+				++end;
+			if (end < mText.size() && (mText[end] == 'e' || mText[end] == 'E'))
+			{
+				int exponent = end + 1;
+				if (exponent < mText.size() && (mText[exponent] == '+' || mText[exponent] == '-'))
+					++exponent;
+				if (exponent < mText.size() && mText[exponent].isDigit())
+				{
+					end = exponent;
+					while (end < mText.size() && mText[end].isDigit())
+						++end;
+				}
+			}
+			bool ok = false;
+			const double value = mText.mid(mPos, end - mPos).toDouble(&ok);
+			if (!ok)
+				return fail(QString("invalid number '%1'").arg(mText.mid(mPos, end - mPos)));
+			mPos = end;
+			Node node = { Constant, -1, -1, -1, static_cast<float>(value) };
+			nodes.append(node);
+			return nodes.size() - 1;
+		}
+		return fail(QString("unexpected '%1' at position %2").arg(mText.mid(mPos, 10)).arg(mPos + 1));
+	}
+
+	int reference(const QString &name)
+	{
+		int index = mExpression.mReferences.indexOf(name);
+		if (index < 0)
+		{
+			mExpression.mReferences.append(name);
+			index = mExpression.mReferences.size() - 1;
+		}
+		Node node = { Load, -1, -1, index, 0 };
+		nodes.append(node);
+		return nodes.size() - 1;
+	}
+
+	int fail(const QString &message)
+	{
+		if (mError.isEmpty())
+			mError = message;
+		return -1;
+	}
+
+	QString mText;
+	int mPos;
+	QString mError;
+	RasterExpression &mExpression;
+};
+
+RasterExpression::RasterExpression()
+	: mStackDepth(0)
+{
+}
+
+bool RasterExpression::parse(const QString &formula, QString &error)
+{
+	mProgram.clear();
+	mReferences.clear();
+	mStackDepth = 0;
+
+	Parser parser(formula, *this);
+	const int root = parser.parse(error);
+	if (root < 0)
+	{
+		mReferences.clear();
+		return false;
+	}
+
+	// children come before their parents, so one pass folds bottom up
+	QVector<Node> &nodes = parser.nodes;
+	for (Node &node : nodes)
+	{
+		if (node.op == Load || node.op == Constant)
+			continue;
+		const bool leftConstant = nodes[node.left].op == Constant;
+		const bool rightConstant = isUnary(node.op) || nodes[node.right].op == Constant;
+		if (leftConstant && rightConstant)
+		{
+			node.value = fold(node.op, nodes[node.left].value, isUnary(node.op) ? 0 : nodes[node.right].value);
+			node.op = Constant;
+		}
+	}
+
+	mStackDepth = emit(nodes, root, 0);
+	return true;
+}
+
+int RasterExpression::emit(const QVector<Node> &nodes, int node, int depth)
+{
+	const Node &n = nodes[node];
+	int used = depth + 1;
+	if (n.op != Load && n.op != Constant)
+	{
+		used = emit(nodes, n.left, depth);
+		if (!isUnary(n.op))
+			used = qMax(used, emit(nodes, n.right, depth + 1));
+	}
+	Instruction instruction = { n.op, n.reference, n.value };
+	mProgram.append(instruction);
+	return used;
+}
+
+float RasterExpression::fold(OpCode op, float a, float b)
+{
+	RasterExpression constant;
+	const Instruction instructions[3] = { { Constant, -1, a }, { Constant, -1, b }, { op, -1, 0 } };
+	if (isUnary(op))
+	{
+		constant.mProgram << instructions[0] << instructions[2];
+		constant.mStackDepth = 1;
+	}
+	else
+	{
+		constant.mProgram << instructions[0] << instructions[1] << instructions[2];
+		constant.mStackDepth = 2;
+	}
+	float result;
+	constant.evaluate(nullptr, &result, 1);
+	return result;
+}
+
+void RasterExpression::evaluate(const float *const *inputs, float *output, int count) const
+{
+	if (mProgram.isEmpty())
+	{
+		std::fill(output, output + count, std::numeric_limits<float>::quiet_NaN());
+		return;
+	}
+
+	QVector<float> stack(mStackDepth * Batch);
+	for (int begin = 0; begin < count; begin += Batch)
+	{
+		const int n = qMin(Batch, count - begin);
+		float *top = stack.data() - Batch;
+		for (const Instruction &instruction : mProgram)
+		{
+			switch (instruction.op)
+			{
+			case Load:
+				top += Batch;
+				std::memcpy(top, inputs[instruction.reference] + begin, n * sizeof(float));
+				break;
+			case Constant:
+				top += Batch;
+				std::fill(top, top + n, instruction.value);
+				break;
+			case Add:
+				top -= Batch;
+				apply<AddOp>(top, top + Batch, n);
+				break;
+			case Subtract:
+				top -= Batch;
+				apply<SubtractOp>(top, top + Batch, n);
+				break;
+			case Multiply:
+				top -= Batch;
+				apply<MultiplyOp>(top, top + Batch, n);
+				break;
+			case Divide:
+				top -= Batch;
+				apply<DivideOp>(top, top + Batch, n);
+				break;
+			case Power:
+				top -= Batch;
+				for (int i = 0; i < n; ++i)
+				{
+					// pow(NaN, 0) and pow(1, NaN) are 1, but nodata stays nodata
+					if (std::isnan(top[i]) || std::isnan(top[i + Batch]))
+					{
+						top[i] = std::numeric_limits<float>::quiet_NaN();
+						continue;
+					}
+					const float value = std::pow(top[i], top[i + Batch]);
+					top[i] = std::isfinite(value) ? value : std::numeric_limits<float>::quiet_NaN();
+				}
+				break;
+			case Equal:
+				top -= Batch;
+				apply<EqualOp>(top, top + Batch, n);
+				break;
+			case NotEqual:
+				top -= Batch;
+				apply<NotEqualOp>(top, top + Batch, n);
+				break;
+			case Greater:
+				top -= Batch;
+				apply<GreaterOp>(top, top + Batch, n);
+				break;
+			case Less:
+				top -= Batch;
+				apply<LessOp>(top, top + Batch, n);
+				break;
+			case GreaterEqual:
+				top -= Batch;
+				apply<GreaterEqualOp>(top, top + Batch, n);
+				break;
+			case LessEqual:
+				top -= Batch;
+				apply<LessEqualOp>(top, top + Batch, n);
+				break;
+			case And:
+				top -= Batch;
+				apply<AndOp>(top, top + Batch, n);
+				break;
+			case Or:
+				top -= Batch;
+				apply<OrOp>(top, top + Batch, n);
+				break;
+			case Negate:
+				apply<NegateOp>(top, top, n);
+				break;
+			case Sqrt:
+				apply<SqrtOp>(top, top, n);
+				break;
+			case Sin:
+				applyScalar(top, n, [](float x) { return std::sin(x); });
+				break;
+			case Cos:
+				applyScalar(top, n, [](float x) { return std::cos(x); });
+				break;
+			case Tan:
+				applyScalar(top, n, [](float x) { return std::tan(x); });
+				break;
+			case Asin:
+				applyScalar(top, n, [](float x) { return std::asin(x); });
+				break;
+			case Acos:
+				applyScalar(top, n, [](float x) { return std::acos(x); });
+				break;
+			case Atan:
+				applyScalar(top, n, [](float x) { return std::atan(x); });
+				break;
+			case Ln:
+				applyScalar(top, n, [](float x) { return std::log(x); });
+				break;
+			case Log10:
+				applyScalar(top, n, [](float x) { return std::log10(x); });
+				break;
+			}
+		}
+		// overflows to infinity are nodata too
+		for (int i = 0; i < n; ++i)
+			output[begin + i] = std::isfinite(top[i]) ? top[i] : std::numeric_limits<float>::quiet_NaN();
+	}
+}
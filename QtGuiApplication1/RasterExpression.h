@@ -0,0 +1,89 @@
+#pragma once
+
+#include "QString"
+#include "QStringList"
+#include "QVector"
+
+// Raster calculator formula compiled to a flat postfix program. The stock
+// QgsRasterCalcNode tree evaluates row by row through QgsRasterMatrix and
+// allocates a temporary matrix for every operator and row. Here the whole
+// formula runs over batches of a few hundred pixels in stack slots that
+// stay in the L1 cache, with the arithmetic and comparisons on AVX or SSE
+// lanes. Constant subexpressions are folded at compile time.
+//
+// The syntax, operator precedence and nodata rules are those of
+// QgsRasterCalculator. Nodata is NaN, both in the inputs and the result:
+// any operation on nodata gives nodata, as do a division by zero, the
+// logarithm of a value <= 0 and results that are not finite.
+class RasterExpression
+{
+public:
+	RasterExpression();
+
+	// False with a message on syntax errors.
+	bool parse(const QString &formula, QString &error);
+
+	// Raster band references ("dem@1") in order of first use.
+	QStringList references() const { return mReferences; }
+
+	// inputs[i] holds count values of references()[i].
+	void evaluate(const float *const *inputs, float *output, int count) const;
+
+private:
+	enum OpCode
+	{
+		Load,
+		Constant,
+		Add,
+		Subtract,
+		Multiply,
+		Divide,
+		Power,
+		Equal,
+		NotEqual,
+		Greater,
+		Less,
+		GreaterEqual,
+		LessEqual,
+		And,
+		Or,
+		Negate,
+		Sqrt,
+		Sin,
+		Cos,
+		Tan,
+		Asin,
+		Acos,
+		Atan,
+		Ln,
+		Log10,
+	};
+
+	struct Instruction
+	{
+		OpCode op;
+		// reference index of Load
+		int reference;
+		// value of Constant
+		float value;
+	};
+
+	struct Node
+	{
+		OpCode op;
+		int left;
+		int right;
+		int reference;
+		float value;
+	};
+
+	class Parser;
+
+	static bool isUnary(OpCode op) { return op >= Negate; }
+	static float fold(OpCode op, float a, float b);
+	int emit(const QVector<Node> &nodes, int node, int depth);
+
+	QVector<Instruction> mProgram;
+	QStringList mReferences;
+	int mStackDepth;
+};
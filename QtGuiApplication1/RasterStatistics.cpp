@@ -0,0 +1,575 @@
+#include "RasterStatistics.h"
+#include "QCache"
+#include "QDataStream"
+#include "QDateTime"
+#include "QFile"
+#include "QFileInfo"
+#include "QMap"
+#include "QMutex"
+#include "QMutexLocker"
+#include "QSaveFile"
+#include "QScopedPointer"
+#include "QThread"
+#include "QtConcurrentMap"
+#include "qgsrasterblock.h"
+#include "qgsrasterdataprovider.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <random>
+
+namespace
+{
+	const quint32 FILE_MAGIC = 0x52535431; // "RST1"
+	const qint32 FILE_VERSION = 1;
+
+	struct SummaryStore
+	{
+		SummaryStore() : summaries(64 * 1024 * 1024) {}
+
+		QMutex mutex;
+		// cost is bytes
+		QCache<QString, RasterStatistics::Summary> summaries;
+	};
+
+	SummaryStore &summaryStore()
+	{
+		static SummaryStore store;
+		return store;
+	}
+
+	int cost(const RasterStatistics::Summary &summary)
+	{
+		return static_cast<int>(sizeof(RasterStatistics::Summary)) + summary.sample.size() * static_cast<int>(sizeof(double)) + 16 * 1024;
+	}
+
+	// Nodata settings of a band, which change what a scan counts.
+	QString bandKey(const QgsRasterDataProvider *provider, int bandNo)
+	{
+		QString key = QString::number(bandNo) + '|' + QString::number(provider->useSourceNoDataValue(bandNo));
+		for (const QgsRasterRange &range : provider->userNoDataValues(bandNo))
+			key += '|' + QString::number(range.min(), 'g', 17) + ':' + QString::number(range.max(), 'g', 17);
+		return key;
+	}
+
+	bool isInteger(Qgis::DataType type)
+	{
+		switch (type)
+		{
+		case Qgis::Byte:
+		case Qgis::UInt16:
+		case Qgis::Int16:
+		case Qgis::UInt32:
+		case Qgis::Int32:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	struct Tile
+	{
+		int column;
+		int row;
+		int width;
+		int height;
+	};
+
+	void mergeMoments(qgssize &count, double &mean, double &squares, qgssize otherCount, double otherMean, double otherSquares)
+	{
+		if (!otherCount)
+			return;
+		const double n = static_cast<double>(count);
+		const double m = static_cast<double>(otherCount);
+		const double delta = otherMean - mean;
+		mean += delta * m / (n + m);
+		squares += otherSquares + delta * delta * n * m / (n + m);
+		count += otherCount;
+	}
+
+	void writeSummary(QDataStream &stream, const RasterStatistics::Summary &summary)
+	{
+		stream << qint32(summary.width) << qint32(summary.height) << quint64(summary.count) << summary.sum << summary.mean
+			<< summary.squares << summary.minimum << summary.maximum << summary.digest << summary.sample;
+	}
+
+	void readSummary(QDataStream &stream, RasterStatistics::Summary &summary)
+	{
+		qint32 width = 0, height = 0;
+		quint64 count = 0;
+		stream >> width >> height >> count >> summary.sum >> summary.mean >> summary.squares >> summary.minimum >> summary.maximum
+			>> summary.digest >> summary.sample;
+		summary.width = width;
+		summary.height = height;
+		summary.count = count;
+	}
+
+	// Summaries keyed by band settings; empty unless written for this
+	// version of raster.
+	bool readSidecar(const QString &path, const QFileInfo &raster, QMap<QString, RasterStatistics::Summary> &summaries)
+	{
+		QFile file(path);
+		if (!file.open(QIODevice::ReadOnly))
+			return false;
+
+		QDataStream stream(&file);
+		stream.setVersion(QDataStream::Qt_5_0);
+		quint32 magic = 0;
+		qint32 version = 0, count = 0;
+		qint64 size = -1, modified = -1;
+		stream >> magic >> version >> size >> modified >> count;
+		if (stream.status() != QDataStream::Ok || magic != FILE_MAGIC || version != FILE_VERSION || count < 0)
+			return false;
+		if (size != raster.size() || modified != raster.lastModified().toMSecsSinceEpoch())
+			return false;
+
+		for (int i = 0; i < count; ++i)
+		{
+			QString key;
+			RasterStatistics::Summary summary;
+			stream >> key;
+			readSummary(stream, summary);
+			if (stream.status() != QDataStream::Ok)
+				return false;
+			summaries.insert(key, summary);
+		}
+		return true;
+	}
+
+	bool writeSidecar(const QString &path, const QFileInfo &raster, const QMap<QString, RasterStatistics::Summary> &summaries)
+	{
+		QSaveFile file(path);
+		if (!file.open(QIODevice::WriteOnly))
+			return false;
+
+		QDataStream stream(&file);
+		stream.setVersion(QDataStream::Qt_5_0);
+		stream << FILE_MAGIC << FILE_VERSION << qint64(raster.size()) << qint64(raster.lastModified().toMSecsSinceEpoch())
+			<< qint32(summaries.size());
+		for (auto it = summaries.constBegin(); it != summaries.constEnd(); ++it)
+		{
+			stream << it.key();
+			writeSummary(stream, it.value());
+		}
+		return stream.status() == QDataStream::Ok && file.commit();
+	}
+}
+
+struct RasterStatistics::Histogram
+{
+	double minimum;
+	double maximum;
+	int binCount;
+	bool includeOutOfRange;
+	QVector<qint64> counts;
+
+	// -1 for values left out
+	int bin(double value) const
+	{
+		if (value < minimum || value > maximum)
+		{
+			if (!includeOutOfRange)
+				return -1;
+			return value < minimum ? 0 : binCount - 1;
+		}
+		const int k = static_cast<int>((value - minimum) / (maximum - minimum) * binCount);
+		return qBound(0, k, binCount - 1);
+	}
+};
+
+RasterStatistics::Summary::Summary()
+	: width(0)
+	, height(0)
+	, count(0)
+	, sum(0)
+	, mean(0)
+	, squares(0)
+	, minimum(std::numeric_limits<double>::max())
+	, maximum(-std::numeric_limits<double>::max())
+{
+}
+
+RasterStatistics::RasterStatistics(QgsRasterDataProvider *provider)
+	: mProvider(provider)
+	, mMode(Exact)
+	, mSampleSize(1 << 22)
+	, mReservoirSize(1 << 16)
+	, mCompression(200)
+	, mTileSize(512)
+	, mThreadCount(0)
+	, mUseSidecar(true)
+{
+}
+
+QString RasterStatistics::sidecarPath(const QgsRasterDataProvider *provider)
+{
+	if (!provider)
+		return QString();
+	const QFileInfo info(provider->dataSourceUri());
+	return info.isFile() ? info.absoluteFilePath() + ".stats" : QString();
+}
+
+void RasterStatistics::clearCache()
+{
+	SummaryStore &store = summaryStore();
+	QMutexLocker locker(&store.mutex);
+	store.summaries.clear();
+}
+
+QgsRectangle RasterStatistics::area(const QgsRectangle &extent) const
+{
+	const QgsRectangle full = mProvider ? mProvider->extent() : QgsRectangle();
+	if (extent.isEmpty())
+		return full;
+	return extent.intersect(&full);
+}
+
+bool RasterStatistics::scan(int bandNo, const QgsRectangle &extent, QgsRasterBlockFeedback *feedback, Summary &result, Histogram *histogram)
+{
+	if (!mProvider || bandNo < 1 || bandNo > mProvider->bandCount())
+		return false;
+	const QgsRectangle full = mProvider->extent();
+	const QgsRectangle region = area(extent);
+	if (region.isEmpty())
+		return false;
+
+	int columns, rows;
+	if ((mProvider->capabilities() & QgsRasterInterface::Size) && mProvider->xSize() > 0 && mProvider->ySize() > 0)
+	{
+		columns = qMax(1, qRound(region.width() / full.width() * mProvider->xSize()));
+		rows = qMax(1, qRound(region.height() / full.height() * mProvider->ySize()));
+	}
+	else
+	{
+		// no native grid, as for WMS
+		columns = rows = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(mSampleSize))));
+	}
+	if (mMode == Sketch)
+	{
+		const double factor = std::ceil(std::sqrt(static_cast<double>(columns) * rows / mSampleSize));
+		if (factor > 1)
+		{
+			columns = qMax(1, static_cast<int>(std::ceil(columns / factor)));
+			rows = qMax(1, static_cast<int>(std::ceil(rows / factor)));
+		}
+	}
+	const double cellX = region.width() / columns;
+	const double cellY = region.height() / rows;
+
+	QVector<Tile> tiles;
+	for (int row = 0; row < rows; row += mTileSize)
+	{
+		for (int column = 0; column < columns; column += mTileSize)
+		{
+			const Tile tile = { column, row, qMin(mTileSize, columns - column), qMin(mTileSize, rows - row) };
+			tiles.append(tile);
+		}
+	}
+
+	// what one worker gathers from every threads-th tile
+	struct Partial
+	{
+		int worker;
+		bool failed;
+		Summary summary;
+		// (key, value), a max heap on the random key: the cells with the
+		// reservoirSize smallest keys are a uniform sample of all of them
+		QVector<QPair<double, double> > reservoir;
+		QVector<qint64> bins;
+	};
+	const int threads = qBound(1, mThreadCount > 0 ? mThreadCount : QThread::idealThreadCount(), tiles.size());
+	QVector<Partial> partials(threads);
+	for (int k = 0; k < threads; ++k)
+	{
+		partials[k].worker = k;
+		partials[k].failed = false;
+		partials[k].summary.digest = TDigest(mCompression);
+		if (histogram)
+			partials[k].bins.fill(0, histogram->binCount);
+	}
+
+	QtConcurrent::blockingMap(partials, [&](Partial &partial)
+	{
+		QScopedPointer<QgsRasterInterface> provider(mProvider->clone());
+		if (!provider)
+		{
+			partial.failed = true;
+			return;
+		}
+
+		Summary &summary = partial.summary;
+		QVector<double> values;
+		for (int t = partial.worker; t < tiles.size(); t += threads)
+		{
+			if (feedback && feedback->isCanceled())
+			{
+				partial.failed = true;
+				return;
+			}
+			const Tile &tile = tiles[t];
+			const QgsRectangle tileExtent(region.xMinimum() + tile.column * cellX, region.yMaximum() - (tile.row + tile.height) * cellY,
+				region.xMinimum() + (tile.column + tile.width) * cellX, region.yMaximum() - tile.row * cellY);
+			QScopedPointer<QgsRasterBlock> block(provider->block(bandNo, tileExtent, tile.width, tile.height, feedback));
+			if (!block || !block->isValid() || block->isEmpty() || !block->convert(Qgis::Float64))
+			{
+				partial.failed = true;
+				return;
+			}
+
+			// valid cells of the tile
+			const int cells = tile.width * tile.height;
+			const double *data = reinterpret_cast<const double *>(block->bits());
+			const bool hasNoData = block->hasNoData();
+			values.resize(cells);
+			int n = 0;
+			double sum = 0;
+			for (int k = 0; k < cells; ++k)
+			{
+				const double value = data[k];
+				if (!std::isfinite(value) || (hasNoData && block->isNoData(k)))
+					continue;
+				values[n++] = value;
+				sum += value;
+			}
+			if (!n)
+				continue;
+
+			// two passes over the tile, then merged as moments
+			const double mean = sum / n;
+			double squares = 0;
+			for (int k = 0; k < n; ++k)
+			{
+				const double value = values[k];
+				squares += (value - mean) * (value - mean);
+				summary.minimum = qMin(summary.minimum, value);
+				summary.maximum = qMax(summary.maximum, value);
+				summary.digest.add(value);
+			}
+			summary.sum += sum;
+			mergeMoments(summary.count, summary.mean, summary.squares, n, mean, squares);
+
+			// keys depend on the tile only, so samples do not depend on
+			// the scheduling
+			std::mt19937_64 random(static_cast<quint64>(t) * 0x9e3779b97f4a7c15ULL + 1);
+			std::uniform_real_distribution<double> key(0, 1);
+			for (int k = 0; k < n; ++k)
+			{
+				const double r = key(random);
+				if (partial.reservoir.size() < mReservoirSize)
+				{
+					partial.reservoir.append(qMakePair(r, values[k]));
+					std::push_heap(partial.reservoir.begin(), partial.reservoir.end());
+				}
+				else if (r < partial.reservoir.first().first)
+				{
+					std::pop_heap(partial.reservoir.begin(), partial.reservoir.end());
+					partial.reservoir.last() = qMakePair(r, values[k]);
+					std::push_heap(partial.reservoir.begin(), partial.reservoir.end());
+				}
+			}
+
+			if (histogram)
+			{
+				for (int k = 0; k < n; ++k)
+				{
+					const int b = histogram->bin(values[k]);
+					if (b >= 0)
+						++partial.bins[b];
+				}
+			}
+		}
+	});
+
+	Summary merged;
+	merged.width = columns;
+	merged.height = rows;
+	merged.digest = TDigest(mCompression);
+	QVector<QPair<double, double> > reservoir;
+	if (histogram)
+		histogram->counts.fill(0, histogram->binCount);
+	for (const Partial &partial : partials)
+	{
+		if (partial.failed)
+			return false;
+		const Summary &summary = partial.summary;
+		merged.sum += summary.sum;
+		merged.minimum = qMin(merged.minimum, summary.minimum);
+		merged.maximum = qMax(merged.maximum, summary.maximum);
+		mergeMoments(merged.count, merged.mean, merged.squares, summary.count, summary.mean, summary.squares);
+		merged.digest.merge(summary.digest);
+		reservoir += partial.reservoir;
+		if (histogram)
+		{
+			for (int b = 0; b < histogram->binCount; ++b)
+				histogram->counts[b] += partial.bins[b];
+		}
+	}
+	if (reservoir.size() > mReservoirSize)
+	{
+		std::nth_element(reservoir.begin(), reservoir.begin() + mReservoirSize, reservoir.end());
+		reservoir.resize(mReservoirSize);
+	}
+	merged.sample.reserve(reservoir.size());
+	for (const QPair<double, double> &cell : reservoir)
+		merged.sample.append(cell.second);
+
+	result = merged;
+	return true;
+}
+
+bool RasterStatistics::summary(int bandNo, const QgsRectangle &extent, QgsRasterBlockFeedback *feedback, Summary &result)
+{
+	if (!mProvider || bandNo < 1 || bandNo > mProvider->bandCount())
+		return false;
+
+	const QgsRectangle region = area(extent);
+	const bool whole = region == mProvider->extent();
+	QString settings = bandKey(mProvider, bandNo) + '|' + QString::number(mCompression);
+	settings += '|' + QString::number(mReservoirSize);
+	if (mMode == Sketch)
+		settings += "|sketch|" + QString::number(mSampleSize);
+	QString key = mProvider->dataSourceUri() + '|' + QString::number(mProvider->dataTimestamp().toMSecsSinceEpoch()) + '|' + settings;
+	if (!whole)
+		key += '|' + region.toString(17);
+
+	SummaryStore &store = summaryStore();
+	{
+		QMutexLocker locker(&store.mutex);
+		if (const RasterStatistics::Summary *cached = store.summaries.object(key))
+		{
+			result = *cached;
+			return true;
+		}
+	}
+
+	const QString sidecar = whole && mUseSidecar ? sidecarPath(mProvider) : QString();
+	const QFileInfo raster(mProvider->dataSourceUri());
+	QMap<QString, Summary> stored;
+	if (!sidecar.isEmpty() && readSidecar(sidecar, raster, stored) && stored.contains(settings))
+	{
+		result = stored.value(settings);
+	}
+	else
+	{
+		// scanned unlocked, like TextLayoutCache shapes its text
+		if (!scan(bandNo, region, feedback, result, nullptr))
+			return false;
+		if (!sidecar.isEmpty())
+		{
+			stored.insert(settings, result);
+			writeSidecar(sidecar, raster, stored);
+		}
+	}
+
+	QMutexLocker locker(&store.mutex);
+	store.summaries.insert(key, new Summary(result), cost(result));
+	return true;
+}
+
+QgsRasterBandStats RasterStatistics::bandStatistics(int bandNo, const QgsRectangle &extent, QgsRasterBlockFeedback *feedback)
+{
+	QgsRasterBandStats stats;
+	stats.bandNumber = bandNo;
+	stats.extent = area(extent);
+
+	Summary summary;
+	if (!this->summary(bandNo, extent, feedback, summary))
+		return stats;
+
+	stats.width = summary.width;
+	stats.height = summary.height;
+	stats.elementCount = summary.count;
+	stats.sum = summary.sum;
+	stats.mean = summary.mean;
+	stats.sumOfSquares = summary.squares;
+	stats.stdDev = summary.count > 1 ? std::sqrt(summary.squares / (summary.count - 1)) : 0;
+	if (summary.count)
+	{
+		stats.minimumValue = summary.minimum;
+		stats.maximumValue = summary.maximum;
+		stats.range = summary.maximum - summary.minimum;
+	}
+	stats.statsGathered = QgsRasterBandStats::All;
+	return stats;
+}
+
+QgsRasterHistogram RasterStatistics::histogram(int bandNo, int binCount, double minimum, double maximum,
+	const QgsRectangle &extent, bool includeOutOfRange, QgsRasterBlockFeedback *feedback)
+{
+	QgsRasterHistogram result;
+	result.bandNumber = bandNo;
+	result.binCount = binCount;
+	result.minimum = minimum;
+	result.maximum = maximum;
+	result.extent = area(extent);
+	result.includeOutOfRange = includeOutOfRange;
+
+	Summary summary;
+	if (!this->summary(bandNo, extent, feedback, summary))
+		return result;
+
+	// integer values fall in the middle of their bins
+	const bool integer = isInteger(mProvider->dataType(bandNo));
+	if (std::isnan(minimum))
+		minimum = summary.count ? summary.minimum - (integer ? 0.5 : 0) : 0;
+	if (std::isnan(maximum))
+		maximum = summary.count ? summary.maximum + (integer ? 0.5 : 0) : 1;
+	if (!(maximum > minimum))
+		maximum = minimum + 1;
+	if (binCount <= 0)
+		binCount = integer && maximum - minimum <= 1000 ? qMax(1, qRound(maximum - minimum)) : 1000;
+
+	Histogram bins = { minimum, maximum, binCount, includeOutOfRange, QVector<qint64>() };
+	if (mMode == Exact)
+	{
+		Summary unused;
+		if (!scan(bandNo, extent, feedback, unused, &bins))
+			return result;
+	}
+	else
+	{
+		// every sampled value stands for count / sample size cells
+		QVector<double> weights(binCount, 0.0);
+		const double weight = summary.sample.isEmpty() ? 0 : static_cast<double>(summary.count) / summary.sample.size();
+		for (double value : summary.sample)
+		{
+			const int b = bins.bin(value);
+			if (b >= 0)
+				weights[b] += weight;
+		}
+		bins.counts.resize(binCount);
+		for (int b = 0; b < binCount; ++b)
+			bins.counts[b] = qRound64(weights[b]);
+	}
+
+	result.binCount = binCount;
+	result.minimum = minimum;
+	result.maximum = maximum;
+	result.width = summary.width;
+	result.height = summary.height;
+	result.nonNullCount = static_cast<int>(qMin<qgssize>(summary.count, INT_MAX));
+	result.histogramVector.resize(binCount);
+	for (int b = 0; b < binCount; ++b)
+		result.histogramVector[b] = static_cast<int>(qMin<qint64>(bins.counts[b], INT_MAX));
+	result.valid = true;
+	return result;
+}
+
+bool RasterStatistics::cumulativeCut(int bandNo, double lowerCount, double upperCount, double &lowerValue, double &upperValue,
+	const QgsRectangle &extent, QgsRasterBlockFeedback *feedback)
+{
+	Summary summary;
+	if (!this->summary(bandNo, extent, feedback, summary) || !summary.count)
+		return false;
+	lowerValue = summary.digest.quantile(lowerCount);
+	upperValue = summary.digest.quantile(upperCount);
+	return true;
+}
+
+QVector<double> RasterStatistics::sample(int bandNo, const QgsRectangle &extent, QgsRasterBlockFeedback *feedback)
+{
+	Summary summary;
+	if (!this->summary(bandNo, extent, feedback, summary))
+		return QVector<double>();
+	return summary.sample;
+}
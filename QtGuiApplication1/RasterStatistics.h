@@ -0,0 +1,104 @@
+#pragma once
+
+#include "QString"
+#include "QVector"
+#include "TDigest.h"
+#include "qgsrasterbandstats.h"
+#include "qgsrasterhistogram.h"
+#include "qgsrectangle.h"
+#include <limits>
+
+class QgsRasterBlockFeedback;
+class QgsRasterDataProvider;
+
+// Band statistics, histograms and cumulative cuts of a data provider. The
+// QgsRasterInterface versions read the band in one pass on the calling
+// thread and forget the result. Here the band is read in tiles by worker
+// threads, each through its own provider clone, and one scan yields a
+// summary with the moments, a TDigest for quantiles and a uniform
+// reservoir sample of the values. Summaries are kept in a process wide
+// cache and, for the full extent of local files, in a sidecar file next
+// to the raster ("<file>.stats"), so reopening a large mosaic does not
+// scan it again.
+//
+// In Sketch mode the band is read on a grid coarsened by an integer factor
+// to about sampleSize cells, which GDAL serves from overviews; quantiles
+// then carry the sampling error on top of the digest's rank error of well
+// below 1 / compression. Exact mode reads every cell; its histograms are
+// counted cell by cell, Sketch histograms are scaled from the reservoir.
+class RasterStatistics
+{
+public:
+	enum Mode
+	{
+		Exact,
+		Sketch
+	};
+
+	// What one scan of a band keeps.
+	struct Summary
+	{
+		Summary();
+
+		// grid that was read
+		int width;
+		int height;
+		qgssize count;
+		double sum;
+		double mean;
+		// sum of squared deviations from the mean
+		double squares;
+		double minimum;
+		double maximum;
+		TDigest digest;
+		QVector<double> sample;
+	};
+
+	explicit RasterStatistics(QgsRasterDataProvider *provider);
+
+	void setMode(Mode mode) { mMode = mode; }
+	// Cells read in Sketch mode.
+	void setSampleSize(int cells) { mSampleSize = qMax(1024, cells); }
+	// Values kept in the reservoir sample.
+	void setReservoirSize(int values) { mReservoirSize = qMax(1, values); }
+	void setCompression(double compression) { mCompression = compression; }
+	void setTileSize(int cells) { mTileSize = qMax(16, cells); }
+	// 0 uses QThread::idealThreadCount().
+	void setThreadCount(int threads) { mThreadCount = qMax(0, threads); }
+	void setUseSidecar(bool use) { mUseSidecar = use; }
+
+	// An empty extent is the provider's. Invalid results (statsGathered or
+	// valid unset, false) when the band cannot be read or feedback cancels.
+	QgsRasterBandStats bandStatistics(int bandNo, const QgsRectangle &extent = QgsRectangle(), QgsRasterBlockFeedback *feedback = nullptr);
+	// binCount 0 gives a bin per value for integer bands of at most 1000
+	// values, 1000 bins otherwise; NaN limits are the band's range.
+	QgsRasterHistogram histogram(int bandNo, int binCount = 0,
+		double minimum = std::numeric_limits<double>::quiet_NaN(), double maximum = std::numeric_limits<double>::quiet_NaN(),
+		const QgsRectangle &extent = QgsRectangle(), bool includeOutOfRange = false, QgsRasterBlockFeedback *feedback = nullptr);
+	// The values at the fractions lowerCount and upperCount of the cells.
+	bool cumulativeCut(int bandNo, double lowerCount, double upperCount, double &lowerValue, double &upperValue,
+		const QgsRectangle &extent = QgsRectangle(), QgsRasterBlockFeedback *feedback = nullptr);
+	// Uniform sample of the valid cells, at most reservoirSize of them.
+	QVector<double> sample(int bandNo, const QgsRectangle &extent = QgsRectangle(), QgsRasterBlockFeedback *feedback = nullptr);
+
+	// Sidecar of a local file, empty for other sources.
+	static QString sidecarPath(const QgsRasterDataProvider *provider);
+	// Drops the cached summaries of every provider.
+	static void clearCache();
+
+private:
+	struct Histogram;
+
+	QgsRectangle area(const QgsRectangle &extent) const;
+	bool summary(int bandNo, const QgsRectangle &extent, QgsRasterBlockFeedback *feedback, Summary &result);
+	bool scan(int bandNo, const QgsRectangle &extent, QgsRasterBlockFeedback *feedback, Summary &result, Histogram *histogram);
+
+	QgsRasterDataProvider *mProvider;
+	Mode mMode;
+	int mSampleSize;
+	int mReservoirSize;
+	double mCompression;
+	int mTileSize;
+	int mThreadCount;
+	bool mUseSidecar;
+};
@@ -0,0 +1,128 @@
+#include "RasterTileWriter.h"
+#include "QList"
+#include "QMutex"
+#include "QProgressDialog"
+#include "QThread"
+#include "QWaitCondition"
+#include "QtConcurrentRun"
+#include "qgsrasterdataprovider.h"
+
+RasterTileWriter::RasterTileWriter(QgsRasterDataProvider *output, int xSize, int ySize)
+	: mOutput(output)
+	, mXSize(xSize)
+	, mYSize(ySize)
+	, mTileSize(512)
+	, mThreadCount(0)
+{
+}
+
+int RasterTileWriter::threadCount() const
+{
+	return mThreadCount > 0 ? mThreadCount : QThread::idealThreadCount();
+}
+
+RasterTileWriter::Result RasterTileWriter::run(const std::function<bool(int worker, Tile &tile)> &compute, QProgressDialog *p)
+{
+	const int tilesX = (mXSize + mTileSize - 1) / mTileSize;
+	const int tileCount = tilesX * ((mYSize + mTileSize - 1) / mTileSize);
+	const int threads = qMin(threadCount(), tileCount);
+	if (p)
+		p->setMaximum(tileCount);
+
+	QMutex mutex;
+	QWaitCondition changed;
+	QList<Tile> finished;
+	const int maxFinished = 2 * threads;
+	int next = 0;
+	bool cancelled = false;
+	bool failed = false;
+
+	auto worker = [&](int index)
+	{
+		for (;;)
+		{
+			Tile tile;
+			{
+				QMutexLocker locker(&mutex);
+				while (!cancelled && next < tileCount && finished.size() >= maxFinished)
+					changed.wait(&mutex);
+				if (cancelled || next == tileCount)
+					break;
+				const int t = next++;
+				tile.x = (t % tilesX) * mTileSize;
+				tile.y = (t / tilesX) * mTileSize;
+			}
+			tile.width = qMin(mTileSize, mXSize - tile.x);
+			tile.height = qMin(mTileSize, mYSize - tile.y);
+			tile.data.resize(tile.width * tile.height);
+
+			const bool ok = compute(index, tile);
+			QMutexLocker locker(&mutex);
+			if (!ok)
+			{
+				failed = true;
+				cancelled = true;
+				changed.wakeAll();
+				break;
+			}
+			finished.append(tile);
+			changed.wakeAll();
+		}
+	};
+
+	QVector<QFuture<void> > workers;
+	for (int i = 0; i < threads; ++i)
+		workers.append(QtConcurrent::run(worker, i));
+
+	int written = 0;
+	while (written < tileCount)
+	{
+		QList<Tile> ready;
+		{
+			QMutexLocker locker(&mutex);
+			while (finished.isEmpty() && !cancelled)
+				changed.wait(&mutex);
+			if (cancelled)
+				break;
+			ready.swap(finished);
+			changed.wakeAll();
+		}
+
+		bool writeFailed = false;
+		for (Tile &tile : ready)
+		{
+			if (!mOutput->write(tile.data.data(), 1, tile.width, tile.height, tile.x, tile.y))
+			{
+				writeFailed = true;
+				break;
+			}
+			++written;
+		}
+		if (writeFailed)
+		{
+			// a full disk or a driver error; stop the workers
+			QMutexLocker locker(&mutex);
+			failed = true;
+			cancelled = true;
+			changed.wakeAll();
+			break;
+		}
+		if (p)
+		{
+			p->setValue(written);
+			if (p->wasCanceled())
+			{
+				QMutexLocker locker(&mutex);
+				cancelled = true;
+				changed.wakeAll();
+			}
+		}
+	}
+
+	for (QFuture<void> &future : workers)
+		future.waitForFinished();
+
+	if (failed)
+		return Failed;
+	return written < tileCount ? Cancelled : Success;
+}
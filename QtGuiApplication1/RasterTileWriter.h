@@ -0,0 +1,54 @@
+#pragma once
+
+#include "QVector"
+#include <functional>
+
+class QProgressDialog;
+class QgsRasterDataProvider;
+
+// Computes a Float32 output raster tile by tile on worker threads and
+// writes the finished tiles from the calling thread, which also drives the
+// progress dialog. Workers stop computing ahead when a few tiles per
+// thread wait for writing, so memory does not grow with the raster.
+//
+// Data providers must not be shared between threads; compute gets the
+// index of the worker so callers can keep one clone per worker.
+class RasterTileWriter
+{
+public:
+	enum Result
+	{
+		Success,
+		Failed,
+		Cancelled,
+	};
+
+	struct Tile
+	{
+		int x;
+		int y;
+		int width;
+		int height;
+		// width * height values, row by row
+		QVector<float> data;
+	};
+
+	RasterTileWriter(QgsRasterDataProvider *output, int xSize, int ySize);
+
+	// Output cells per tile side.
+	void setTileSize(int cells) { mTileSize = qMax(16, cells); }
+	// 0 uses QThread::idealThreadCount().
+	void setThreadCount(int threads) { mThreadCount = qMax(0, threads); }
+	int threadCount() const;
+
+	// compute fills tile.data and returns false on failure, which stops
+	// all workers and returns Failed, as does a failed write. p may be 0.
+	Result run(const std::function<bool(int worker, Tile &tile)> &compute, QProgressDialog *p);
+
+private:
+	QgsRasterDataProvider *mOutput;
+	int mXSize;
+	int mYSize;
+	int mTileSize;
+	int mThreadCount;
+};
@@ -0,0 +1,171 @@
+#include "TDigest.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace
+{
+	const double Pi = 3.14159265358979323846;
+
+	// scale function k1: centroids span at most one unit of k
+	double scale(double q, double compression)
+	{
+		return compression / (2 * Pi) * std::asin(2 * qBound(0.0, q, 1.0) - 1);
+	}
+
+	double inverseScale(double k, double compression)
+	{
+		const double limit = compression / 4;
+		return (std::sin(qBound(-limit, k, limit) * 2 * Pi / compression) + 1) / 2;
+	}
+}
+
+TDigest::TDigest(double compression)
+	: mCompression(qMax(20.0, compression))
+	, mTotal(0)
+	, mBufferTotal(0)
+	, mMinimum(std::numeric_limits<double>::max())
+	, mMaximum(-std::numeric_limits<double>::max())
+{
+}
+
+void TDigest::add(double value, double weight)
+{
+	if (!(weight > 0) || !std::isfinite(value))
+		return;
+	const Centroid centroid = { value, weight };
+	mBuffer.append(centroid);
+	mBufferTotal += weight;
+	mMinimum = qMin(mMinimum, value);
+	mMaximum = qMax(mMaximum, value);
+	if (mBuffer.size() >= 8 * static_cast<int>(mCompression))
+		compress();
+}
+
+void TDigest::merge(const TDigest &other)
+{
+	mBuffer += other.mCentroids;
+	mBuffer += other.mBuffer;
+	mBufferTotal += other.mTotal + other.mBufferTotal;
+	mMinimum = qMin(mMinimum, other.mMinimum);
+	mMaximum = qMax(mMaximum, other.mMaximum);
+	compress();
+}
+
+void TDigest::compress()
+{
+	if (mBuffer.isEmpty())
+		return;
+
+	mBuffer += mCentroids;
+	std::sort(mBuffer.begin(), mBuffer.end(), [](const Centroid &a, const Centroid &b) { return a.mean < b.mean; });
+	const double total = mTotal + mBufferTotal;
+
+	QVector<Centroid> merged;
+	merged.reserve(static_cast<int>(mCompression));
+	Centroid current = mBuffer.first();
+	double before = 0;
+	double limit = total * inverseScale(scale(0, mCompression) + 1, mCompression);
+	for (int i = 1; i < mBuffer.size(); ++i)
+	{
+		const Centroid &next = mBuffer[i];
+		if (before + current.weight + next.weight <= limit)
+		{
+			current.weight += next.weight;
+			current.mean += (next.mean - current.mean) * next.weight / current.weight;
+		}
+		else
+		{
+			merged.append(current);
+			before += current.weight;
+			limit = total * inverseScale(scale(before / total, mCompression) + 1, mCompression);
+			current = next;
+		}
+	}
+	merged.append(current);
+
+	mCentroids.swap(merged);
+	mTotal = total;
+	mBuffer.clear();
+	mBufferTotal = 0;
+}
+
+double TDigest::quantile(double q)
+{
+	compress();
+	if (mCentroids.isEmpty())
+		return std::numeric_limits<double>::quiet_NaN();
+	if (q <= 0)
+		return mMinimum;
+	if (q >= 1)
+		return mMaximum;
+
+	// centroids hold half their weight on either side of their mean; the
+	// ends interpolate towards the exact minimum and maximum
+	const double target = q * mTotal;
+	const Centroid &first = mCentroids.first();
+	if (target < first.weight / 2)
+		return mMinimum + (first.mean - mMinimum) * target / (first.weight / 2);
+	double below = first.weight / 2;
+	for (int i = 0; i + 1 < mCentroids.size(); ++i)
+	{
+		const Centroid &a = mCentroids[i];
+		const Centroid &b = mCentroids[i + 1];
+		const double next = below + (a.weight + b.weight) / 2;
+		if (target <= next)
+			return a.mean + (b.mean - a.mean) * (target - below) / (next - below);
+		below = next;
+	}
+	const Centroid &last = mCentroids.last();
+	return last.mean + (mMaximum - last.mean) * qMin(1.0, (target - below) / (last.weight / 2));
+}
+
+double TDigest::cdf(double value)
+{
+	compress();
+	if (mCentroids.isEmpty())
+		return std::numeric_limits<double>::quiet_NaN();
+	if (value < mMinimum)
+		return 0;
+	if (value >= mMaximum)
+		return 1;
+
+	const Centroid &first = mCentroids.first();
+	if (value < first.mean)
+		return first.mean > mMinimum ? (value - mMinimum) / (first.mean - mMinimum) * first.weight / 2 / mTotal : 0;
+	double below = first.weight / 2;
+	for (int i = 0; i + 1 < mCentroids.size(); ++i)
+	{
+		const Centroid &a = mCentroids[i];
+		const Centroid &b = mCentroids[i + 1];
+		const double span = (a.weight + b.weight) / 2;
+		if (value < b.mean)
+			return (below + span * (value - a.mean) / (b.mean - a.mean)) / mTotal;
+		below += span;
+	}
+	const Centroid &last = mCentroids.last();
+	return (below + (value - last.mean) / (mMaximum - last.mean) * last.weight / 2) / mTotal;
+}
+
+QDataStream &operator<<(QDataStream &stream, const TDigest &digest)
+{
+	TDigest compressed(digest);
+	compressed.compress();
+	stream << compressed.mCompression << compressed.mTotal << compressed.mMinimum << compressed.mMaximum
+		<< static_cast<qint32>(compressed.mCentroids.size());
+	for (const TDigest::Centroid &centroid : compressed.mCentroids)
+		stream << centroid.mean << centroid.weight;
+	return stream;
+}
+
+QDataStream &operator>>(QDataStream &stream, TDigest &digest)
+{
+	qint32 size = 0;
+	stream >> digest.mCompression >> digest.mTotal >> digest.mMinimum >> digest.mMaximum >> size;
+	digest.mCentroids.resize(qMax(0, size));
+	for (TDigest::Centroid &centroid : digest.mCentroids)
+		stream >> centroid.mean >> centroid.weight;
+	digest.mBuffer.clear();
+	digest.mBufferTotal = 0;
+	return stream;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "QDataStream"
+#include "QVector"
+
+// Merging t-digest (Dunning and Ertl) of a stream of values: a few hundred
+// weighted centroids, small near the ends of the distribution, from which
+// quantiles are interpolated with a rank error that shrinks towards the
+// tails. Digests of parts of the stream merge into one of the whole, so
+// workers can each keep their own.
+class TDigest
+{
+public:
+	struct Centroid
+	{
+		double mean;
+		double weight;
+	};
+
+	// About compression / 2 centroids are kept.
+	explicit TDigest(double compression = 200.0);
+
+	void add(double value, double weight = 1.0);
+	void merge(const TDigest &other);
+
+	// Value below which a fraction q of the weight lies; NaN when empty.
+	double quantile(double q);
+	// Fraction of the weight below value.
+	double cdf(double value);
+
+	double count() const { return mTotal + mBufferTotal; }
+	double minimum() const { return mMinimum; }
+	double maximum() const { return mMaximum; }
+	const QVector<Centroid> &centroids() { compress(); return mCentroids; }
+
+	void compress();
+
+	friend QDataStream &operator<<(QDataStream &stream, const TDigest &digest);
+	friend QDataStream &operator>>(QDataStream &stream, TDigest &digest);
+
+private:
+	double mCompression;
+	QVector<Centroid> mCentroids;
+	double mTotal;
+	QVector<Centroid> mBuffer;
+	double mBufferTotal;
+	double mMinimum;
+	double mMaximum;
+};
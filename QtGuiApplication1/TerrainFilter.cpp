@@ -0,0 +1,275 @@
+#include "TerrainFilter.h"
+#include "qgsproviderregistry.h"
+#include "qgsrasterblock.h"
+#include "qgsrasterdataprovider.h"
+#include "qmath.h"
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+	// One row or column of the Sobel like operator of QgsDerivativeFilter.
+	// Pairs of cells with data give a central difference of weight 2; at a
+	// nodata border the one sided difference against the middle cell is used
+	// with weight 1.
+	inline void addDifference(float high, float middle, float low, float nodata, float factor, float &sum, float &weight)
+	{
+		const bool hasHigh = high != nodata;
+		const bool hasMiddle = middle != nodata;
+		const bool hasLow = low != nodata;
+		const bool central = hasHigh && hasLow;
+		const bool lowSide = !hasHigh && hasLow && hasMiddle;
+		const bool highSide = hasHigh && !hasLow && hasMiddle;
+		sum += factor * (central ? high - low : 0.0f) + factor * (lowSide ? middle - low : 0.0f) + factor * (highSide ? high - middle : 0.0f);
+		weight += factor * (central ? 2.0f : 0.0f) + factor * (lowSide || highSide ? 1.0f : 0.0f);
+	}
+}
+
+TerrainFilter::TerrainFilter(Product product, const QString &inputFile, const QString &outputFile, const QString &outputFormat)
+	: mProduct(product)
+	, mInputFile(inputFile)
+	, mOutputFile(outputFile)
+	, mOutputFormat(outputFormat)
+	, mCellSizeX(-1)
+	, mCellSizeY(-1)
+	, mInputNodataValue(-1)
+	, mOutputNodataValue(-1)
+	, mZFactor(1.0)
+	, mLightAzimuth(300)
+	, mLightAngle(40)
+	, mTileSize(512)
+	, mThreadCount(0)
+{
+}
+
+int TerrainFilter::processRaster(QProgressDialog *p)
+{
+	QgsRasterDataProvider *input = dynamic_cast<QgsRasterDataProvider *>(QgsProviderRegistry::instance()->provider("gdal", mInputFile));
+	if (!input || !input->isValid())
+	{
+		delete input;
+		return 1;
+	}
+	if (input->bandCount() < 1)
+	{
+		delete input;
+		return 4;
+	}
+
+	const int xSize = input->xSize();
+	const int ySize = input->ySize();
+	const QgsRectangle extent = input->extent();
+	mCellSizeX = extent.width() / xSize;
+	mCellSizeY = extent.height() / ySize;
+	if (input->sourceHasNoDataValue(1))
+		mInputNodataValue = input->sourceNoDataValue(1);
+
+	double geoTransform[6] = { extent.xMinimum(), mCellSizeX, 0, extent.yMaximum(), 0, -mCellSizeY };
+	QgsRasterDataProvider *output = QgsRasterDataProvider::create("gdal", mOutputFile, mOutputFormat, 1, Qgis::Float32,
+		xSize, ySize, geoTransform, input->crs());
+	if (!output || !output->isValid())
+	{
+		delete output;
+		delete input;
+		return 3;
+	}
+	output->setNoDataValue(1, mOutputNodataValue);
+
+	// GDAL handles must not be shared between threads
+	RasterTileWriter writer(output, xSize, ySize);
+	writer.setTileSize(mTileSize);
+	writer.setThreadCount(mThreadCount);
+	QVector<QgsRasterDataProvider *> providers;
+	QVector<QVector<float> > buffers(writer.threadCount());
+	for (int i = 0; i < writer.threadCount(); ++i)
+		providers.append(dynamic_cast<QgsRasterDataProvider *>(input->clone()));
+
+	const RasterTileWriter::Result result = writer.run([&](int worker, RasterTileWriter::Tile &tile)
+	{
+		QVector<float> &buffer = buffers[worker];
+		if (!providers[worker] || !readTile(providers[worker], extent, xSize, ySize, tile, buffer))
+			return false;
+		processBlock(buffer.constData(), tile.width + 2, tile.data.data(), tile.width, tile.width, tile.height);
+		return true;
+	}, p);
+
+	qDeleteAll(providers);
+	delete output;
+	delete input;
+	switch (result)
+	{
+	case RasterTileWriter::Failed:
+		return 1;
+	case RasterTileWriter::Cancelled:
+		return 7;
+	default:
+		return 0;
+	}
+}
+
+bool TerrainFilter::readTile(QgsRasterDataProvider *provider, const QgsRectangle &extent, int xSize, int ySize, const RasterTileWriter::Tile &tile, QVector<float> &input) const
+{
+	const int stride = tile.width + 2;
+	input.fill(mInputNodataValue, stride * (tile.height + 2));
+
+	// the halo, clipped to the raster
+	const int x0 = qMax(tile.x - 1, 0);
+	const int y0 = qMax(tile.y - 1, 0);
+	const int x1 = qMin(tile.x + tile.width + 1, xSize);
+	const int y1 = qMin(tile.y + tile.height + 1, ySize);
+	const QgsRectangle window(extent.xMinimum() + x0 * mCellSizeX, extent.yMaximum() - y1 * mCellSizeY,
+		extent.xMinimum() + x1 * mCellSizeX, extent.yMaximum() - y0 * mCellSizeY);
+
+	QgsRasterBlock *block = provider->block(1, window, x1 - x0, y1 - y0);
+	if (!block || !block->isValid() || block->isEmpty() || !block->convert(Qgis::Float32))
+	{
+		delete block;
+		return false;
+	}
+
+	const bool hasNoData = block->hasNoData();
+	for (int row = 0; row < y1 - y0; ++row)
+	{
+		float *target = input.data() + (row + y0 - tile.y + 1) * stride + (x0 - tile.x + 1);
+		std::memcpy(target, block->bits(row, 0), (x1 - x0) * sizeof(float));
+		if (!hasNoData)
+			continue;
+		for (int column = 0; column < x1 - x0; ++column)
+		{
+			if (block->isNoData(row, column))
+				target[column] = mInputNodataValue;
+		}
+	}
+	delete block;
+	return true;
+}
+
+void TerrainFilter::derivatives(const float *above, const float *row, const float *below, int width,
+	float *derX, float *derY, float *valid) const
+{
+	const float nodata = mInputNodataValue;
+	const float scaleX = static_cast<float>(mZFactor / mCellSizeX);
+	const float scaleY = static_cast<float>(mZFactor / mCellSizeY);
+	for (int i = 0; i < width; ++i)
+	{
+		// cells named as in processNineCellWindow, column then row
+		const float x11 = above[i], x21 = above[i + 1], x31 = above[i + 2];
+		const float x12 = row[i], x22 = row[i + 1], x32 = row[i + 2];
+		const float x13 = below[i], x23 = below[i + 1], x33 = below[i + 2];
+
+		float sumX = 0, weightX = 0;
+		addDifference(x31, x21, x11, nodata, 1, sumX, weightX);
+		addDifference(x32, x22, x12, nodata, 2, sumX, weightX);
+		addDifference(x33, x23, x13, nodata, 1, sumX, weightX);
+
+		float sumY = 0, weightY = 0;
+		addDifference(x11, x12, x13, nodata, 1, sumY, weightY);
+		addDifference(x21, x22, x23, nodata, 2, sumY, weightY);
+		addDifference(x31, x32, x33, nodata, 1, sumY, weightY);
+
+		const bool ok = x22 != nodata && weightX > 0 && weightY > 0;
+		derX[i] = ok ? sumX / weightX * scaleX : 0.0f;
+		derY[i] = ok ? sumY / weightY * scaleY : 0.0f;
+		valid[i] = ok ? 1.0f : 0.0f;
+	}
+}
+
+void TerrainFilter::processBlock(const float *input, int stride, float *output, int outputStride, int width, int height) const
+{
+	const float nodata = mInputNodataValue;
+	const float outputNodata = mOutputNodataValue;
+	QVector<float> derX(width);
+	QVector<float> derY(width);
+	QVector<float> valid(width);
+	const float toDegrees = static_cast<float>(180.0 / M_PI);
+
+	// hillshade constants, as in QgsHillshadeFilter
+	const float zenith = qMax(0.0f, 90.0f - mLightAngle) * static_cast<float>(M_PI / 180.0);
+	const float azimuth = -mLightAzimuth * static_cast<float>(M_PI / 180.0);
+	const float cosZenith = std::cos(zenith);
+	const float sinZenith = std::sin(zenith);
+
+	for (int r = 0; r < height; ++r)
+	{
+		const float *above = input + r * stride;
+		const float *row = above + stride;
+		const float *below = row + stride;
+		float *out = output + r * outputStride;
+
+		switch (mProduct)
+		{
+		case Slope:
+			derivatives(above, row, below, width, derX.data(), derY.data(), valid.data());
+			for (int i = 0; i < width; ++i)
+			{
+				const float slope = std::atan(std::sqrt(derX[i] * derX[i] + derY[i] * derY[i])) * toDegrees;
+				out[i] = valid[i] != 0 ? slope : outputNodata;
+			}
+			break;
+
+		case Aspect:
+			derivatives(above, row, below, width, derX.data(), derY.data(), valid.data());
+			for (int i = 0; i < width; ++i)
+			{
+				const float aspect = 180.0f + std::atan2(derX[i], derY[i]) * toDegrees;
+				const bool flat = derX[i] == 0 && derY[i] == 0;
+				out[i] = valid[i] != 0 && !flat ? aspect : outputNodata;
+			}
+			break;
+
+		case Hillshade:
+			derivatives(above, row, below, width, derX.data(), derY.data(), valid.data());
+			for (int i = 0; i < width; ++i)
+			{
+				const float slope = std::atan(std::sqrt(derX[i] * derX[i] + derY[i] * derY[i]));
+				const bool flat = derX[i] == 0 && derY[i] == 0;
+				const float aspect = flat ? azimuth / 2.0f : static_cast<float>(M_PI) + std::atan2(derX[i], derY[i]);
+				const float shade = 255.0f * (cosZenith * std::cos(slope) + sinZenith * std::sin(slope) * std::cos(azimuth - aspect));
+				out[i] = valid[i] != 0 ? qMax(0.0f, shade) : outputNodata;
+			}
+			break;
+
+		case Ruggedness:
+			// root of the summed squared differences to the neighbours with data
+			for (int i = 0; i < width; ++i)
+			{
+				const float center = row[i + 1];
+				const float cells[8] = { above[i], above[i + 1], above[i + 2], row[i], row[i + 2], below[i], below[i + 1], below[i + 2] };
+				float sum = 0;
+				for (int k = 0; k < 8; ++k)
+				{
+					const float d = cells[k] - center;
+					sum += cells[k] != nodata ? d * d : 0.0f;
+				}
+				out[i] = center != nodata ? std::sqrt(sum) : outputNodata;
+			}
+			break;
+
+		case TotalCurvature:
+		{
+			// neighbours without data take the value of the centre cell
+			const float cellSizeAverage = static_cast<float>((mCellSizeX + mCellSizeY) / 2.0);
+			const float xx = static_cast<float>(1.0 / (mCellSizeX * mCellSizeX));
+			const float yy = static_cast<float>(1.0 / (mCellSizeY * mCellSizeY));
+			const float xy = 1.0f / (4 * cellSizeAverage * cellSizeAverage);
+			for (int i = 0; i < width; ++i)
+			{
+				const float x22 = row[i + 1];
+				const float x11 = above[i] != nodata ? above[i] : x22;
+				const float x21 = above[i + 1] != nodata ? above[i + 1] : x22;
+				const float x31 = above[i + 2] != nodata ? above[i + 2] : x22;
+				const float x12 = row[i] != nodata ? row[i] : x22;
+				const float x32 = row[i + 2] != nodata ? row[i + 2] : x22;
+				const float x13 = below[i] != nodata ? below[i] : x22;
+				const float x23 = below[i + 1] != nodata ? below[i + 1] : x22;
+				const float x33 = below[i + 2] != nodata ? below[i + 2] : x22;
+				const float dxx = (x32 - 2 * x22 + x12) * xx;
+				const float dyy = (x21 - 2 * x22 + x23) * yy;
+				const float dxy = (-x11 + x31 + x13 - x33) * xy;
+				out[i] = x22 != nodata ? dxx * dxx + 2 * dxy * dxy + dyy * dyy : outputNodata;
+			}
+			break;
+		}
+		}
+	}
+}
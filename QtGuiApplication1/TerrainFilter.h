@@ -0,0 +1,94 @@
+#pragma once
+
+#include "QString"
+#include "QVector"
+#include "RasterTileWriter.h"
+
+class QProgressDialog;
+class QgsRasterDataProvider;
+class QgsRectangle;
+
+// Tiled, multithreaded replacement for the QgsNineCellFilter subclasses.
+// QgsNineCellFilter::processRaster reads the DEM three scanlines at a time
+// and calls the virtual processNineCellWindow for every pixel on the
+// calling thread. Here RasterTileWriter cuts the raster into tiles that
+// worker threads read with a one pixel halo through their own clone of the
+// data provider and filter a whole row at a time, while the calling thread
+// writes finished tiles, so reading, filtering and writing overlap.
+//
+// The row kernels are plain loops over float arrays with nodata handled by
+// selects instead of branches, so the compiler vectorizes them. The
+// derivatives follow QgsDerivativeFilter, including its nodata rules:
+// cells without data are left out, with one sided differences at borders.
+class TerrainFilter
+{
+public:
+	enum Product
+	{
+		Slope,
+		Aspect,
+		Hillshade,
+		Ruggedness,
+		TotalCurvature,
+	};
+
+	TerrainFilter(Product product, const QString &inputFile, const QString &outputFile, const QString &outputFormat);
+
+	// Same return values as QgsNineCellFilter::processRaster: 0 on success,
+	// 1 if the input, 3 if the output could not be opened, 4 without an
+	// input band and 7 when cancelled. p may be 0.
+	int processRaster(QProgressDialog *p);
+
+	// Filters rows of a block already in memory. input holds height + 2
+	// rows of width + 2 cells, stride floats apart; output holds height
+	// rows of width cells.
+	void processBlock(const float *input, int stride, float *output, int outputStride, int width, int height) const;
+
+	Product product() const { return mProduct; }
+
+	double cellSizeX() const { return mCellSizeX; }
+	void setCellSizeX(double size) { mCellSizeX = size; }
+	double cellSizeY() const { return mCellSizeY; }
+	void setCellSizeY(double size) { mCellSizeY = size; }
+
+	double zFactor() const { return mZFactor; }
+	void setZFactor(double factor) { mZFactor = factor; }
+
+	// The input nodata value is replaced by the one of the dataset, if set.
+	double inputNodataValue() const { return mInputNodataValue; }
+	void setInputNodataValue(double value) { mInputNodataValue = value; }
+	double outputNodataValue() const { return mOutputNodataValue; }
+	void setOutputNodataValue(double value) { mOutputNodataValue = value; }
+
+	float lightAzimuth() const { return mLightAzimuth; }
+	void setLightAzimuth(float azimuth) { mLightAzimuth = azimuth; }
+	float lightAngle() const { return mLightAngle; }
+	void setLightAngle(float angle) { mLightAngle = angle; }
+
+	// Output cells per tile side.
+	void setTileSize(int cells) { mTileSize = qMax(16, cells); }
+	// 0 uses QThread::idealThreadCount().
+	void setThreadCount(int threads) { mThreadCount = qMax(0, threads); }
+
+private:
+	// Reads the tile and its halo into input, nodata outside the raster.
+	bool readTile(QgsRasterDataProvider *provider, const QgsRectangle &extent, int xSize, int ySize, const RasterTileWriter::Tile &tile, QVector<float> &input) const;
+
+	// Derivatives of one row; valid is 0 where the QGIS filters give nodata.
+	void derivatives(const float *above, const float *row, const float *below, int width,
+		float *derX, float *derY, float *valid) const;
+
+	Product mProduct;
+	QString mInputFile;
+	QString mOutputFile;
+	QString mOutputFormat;
+	double mCellSizeX;
+	double mCellSizeY;
+	float mInputNodataValue;
+	float mOutputNodataValue;
+	double mZFactor;
+	float mLightAzimuth;
+	float mLightAngle;
+	int mTileSize;
+	int mThreadCount;
+};
@@ -0,0 +1,83 @@
+#include "TextLayoutCache.h"
+#include "QFontMetricsF"
+#include "QMutexLocker"
+
+namespace
+{
+	QString layoutKey(const QFont &font, const QString &text)
+	{
+		return font.key() + QChar(0x1f) + text;
+	}
+}
+
+TextLayoutCache *TextLayoutCache::instance()
+{
+	static TextLayoutCache cache;
+	return &cache;
+}
+
+TextLayoutCache::TextLayoutCache(int maxLayouts)
+	: mLayouts(maxLayouts)
+	, mHits(0)
+	, mMisses(0)
+{
+}
+
+QSharedPointer<const TextLayoutCache::Layout> TextLayoutCache::layout(const QFont &font, const QString &text)
+{
+	const QString key = layoutKey(font, text);
+	{
+		QMutexLocker locker(&mMutex);
+		if (QSharedPointer<const Layout> *cached = mLayouts.object(key))
+		{
+			++mHits;
+			return *cached;
+		}
+		++mMisses;
+	}
+
+	// shaping happens unlocked; two threads may shape the same text, the
+	// later insert simply replaces the earlier one
+	QSharedPointer<Layout> layout(new Layout);
+	const QFontMetricsF metrics(font);
+	layout->ascent = metrics.ascent();
+	layout->descent = metrics.descent();
+	layout->lineHeight = metrics.lineSpacing();
+	layout->lines = text.split(QLatin1Char('\n'));
+	layout->lineWidths.reserve(layout->lines.size());
+
+	double width = 0;
+	for (int i = 0; i < layout->lines.size(); ++i)
+	{
+		const QString &line = layout->lines.at(i);
+		const double lineWidth = metrics.width(line);
+		layout->lineWidths.append(lineWidth);
+		width = qMax(width, lineWidth);
+		layout->path.addText(0, layout->ascent + i * layout->lineHeight, font, line);
+	}
+	layout->size = QSizeF(width, layout->ascent + layout->descent + (layout->lines.size() - 1) * layout->lineHeight);
+
+	QMutexLocker locker(&mMutex);
+	mLayouts.insert(key, new QSharedPointer<const Layout>(layout));
+	return layout;
+}
+
+void TextLayoutCache::clear()
+{
+	QMutexLocker locker(&mMutex);
+	mLayouts.clear();
+	mHits = 0;
+	mMisses = 0;
+}
+
+int TextLayoutCache::hits() const
+{
+	QMutexLocker locker(&mMutex);
+	return mHits;
+}
+
+int TextLayoutCache::misses() const
+{
+	QMutexLocker locker(&mMutex);
+	return mMisses;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "QCache"
+#include "QFont"
+#include "QMutex"
+#include "QPainterPath"
+#include "QSharedPointer"
+#include "QSizeF"
+#include "QStringList"
+
+// Process wide cache of shaped label text. Measuring a label with
+// QFontMetricsF and building its outline with QPainterPath::addText is
+// repeated for every feature on every render, although street names and
+// house numbers repeat all over a map. Layouts are keyed by QFont::key()
+// and text.
+//
+// All functions are thread safe. Text is shaped outside the lock, so
+// threads labeling different layers do not wait for each other.
+class TextLayoutCache
+{
+public:
+	struct Layout
+	{
+		QSizeF size;
+		double ascent;
+		double descent;
+		double lineHeight;
+		QStringList lines;
+		QVector<double> lineWidths;
+		// outline of all lines, top left of the text at (0, 0)
+		QPainterPath path;
+	};
+
+	static TextLayoutCache *instance();
+
+	// Limited to maxLayouts layouts.
+	TextLayoutCache(int maxLayouts = 20000);
+
+	// Lines are separated by '\n'.
+	QSharedPointer<const Layout> layout(const QFont &font, const QString &text);
+	QSizeF size(const QFont &font, const QString &text) { return layout(font, text)->size; }
+
+	void clear();
+
+	// Layout lookups since the last clear().
+	int hits() const;
+	int misses() const;
+
+private:
+	mutable QMutex mMutex;
+	QCache<QString, QSharedPointer<const Layout> > mLayouts;
+	int mHits;
+	int mMisses;
+};
@@ -0,0 +1,222 @@
+#include "TinInterpolator.h"
+#include "QProgressDialog"
+#include "QScopedPointer"
+#include "qgstininterpolator.h"
+#include <algorithm>
+
+namespace
+{
+	// Bezier ordinates of the Clough-Tocher pieces; cijkl weighs
+	// b1^i b2^j b3^k b4^l with b4 the weight of the centroid
+	enum Ordinate
+	{
+		C3000, C0300, C0030,
+		C2100, C2010, C1200, C0210, C1020, C0120,
+		C2001, C0201, C0021,
+		C1101, C0111, C1011,
+		C1002, C0102, C0012,
+		C0003,
+	};
+
+	// The ordinate between the ends of an edge and the centroid such that
+	// the derivative across the edge varies linearly along it. a are the
+	// ordinates along the edge, d0 and d2 the ones next to its ends towards
+	// the centroid, g the coordinate along the edge of the direction normal
+	// to it (see Farin, Triangular Bernstein-Bezier patches).
+	double crossEdge(double a0, double a1, double a2, double a3, double d0, double d2, double g)
+	{
+		return (g * (-a0 + 3 * a1 - 3 * a2 + a3) + (-a0 + 2 * a1 - a2 + d0 + d2)) / 2;
+	}
+
+	// g for the edge p to q of a triangle with centroid c
+	double normalCoordinate(double px, double py, double qx, double qy, double cx, double cy)
+	{
+		const double ex = qx - px, ey = qy - py;
+		return -((cx - px) * ex + (cy - py) * ey) / (ex * ex + ey * ey);
+	}
+}
+
+TinInterpolator::TinInterpolator(const QList<LayerData> &inputData, TIN_INTERPOLATION interpolation, bool showProgressDialog)
+	: QgsInterpolator(inputData)
+	, mInterpolation(interpolation)
+	, mShowProgressDialog(showProgressDialog)
+	, mPrepared(false)
+{
+	for (const LayerData &layer : inputData)
+	{
+		if (layer.mInputType != POINTS)
+		{
+			mStock.reset(new QgsTINInterpolator(inputData, static_cast<QgsTINInterpolator::TIN_INTERPOLATION>(interpolation), showProgressDialog));
+			break;
+		}
+	}
+}
+
+TinInterpolator::~TinInterpolator()
+{
+}
+
+int TinInterpolator::prepare()
+{
+	if (mPrepared)
+		return 0;
+	if (mStock)
+		return 1;
+
+	QScopedPointer<QProgressDialog> progressDialog;
+	if (mShowProgressDialog)
+	{
+		progressDialog.reset(new QProgressDialog(QObject::tr("Building triangulation..."), QObject::tr("Abort"), 0, 3, nullptr));
+		progressDialog->setWindowModality(Qt::WindowModal);
+		progressDialog->setCancelButton(nullptr);
+		progressDialog->setValue(0);
+	}
+
+	if (!mDataIsCached)
+	{
+		const int error = cacheBaseData();
+		if (error != 0)
+			return error;
+	}
+	if (progressDialog)
+		progressDialog->setValue(1);
+
+	QVector<QgsPoint> points(mCachedBaseData.size());
+	for (int i = 0; i < points.size(); ++i)
+		points[i] = QgsPoint(mCachedBaseData[i].x, mCachedBaseData[i].y);
+	mTriangulation.build(points);
+	if (progressDialog)
+		progressDialog->setValue(2);
+
+	if (mInterpolation == CloughTocher)
+		estimateGradients();
+	mPrepared = true;
+	return 0;
+}
+
+void TinInterpolator::estimateGradients()
+{
+	const QVector<int> &triangles = mTriangulation.triangles();
+	const int count = mCachedBaseData.size();
+	QVector<double> nx(count, 0.0), ny(count, 0.0), nz(count, 0.0);
+	for (int t = 0; t < triangles.size(); t += 3)
+	{
+		// the normal's length is twice the area
+		const vertexData &p1 = mCachedBaseData[triangles[t]];
+		const vertexData &p2 = mCachedBaseData[triangles[t + 1]];
+		const vertexData &p3 = mCachedBaseData[triangles[t + 2]];
+		const double ux = p2.x - p1.x, uy = p2.y - p1.y, uz = p2.z - p1.z;
+		const double vx = p3.x - p1.x, vy = p3.y - p1.y, vz = p3.z - p1.z;
+		const double x = uy * vz - uz * vy;
+		const double y = uz * vx - ux * vz;
+		const double z = ux * vy - uy * vx;
+		for (int k = 0; k < 3; ++k)
+		{
+			nx[triangles[t + k]] += x;
+			ny[triangles[t + k]] += y;
+			nz[triangles[t + k]] += z;
+		}
+	}
+
+	mGradientX.resize(count);
+	mGradientY.resize(count);
+	for (int i = 0; i < count; ++i)
+	{
+		mGradientX[i] = nz[i] > 0 ? -nx[i] / nz[i] : 0.0;
+		mGradientY[i] = nz[i] > 0 ? -ny[i] / nz[i] : 0.0;
+	}
+}
+
+TinInterpolator::Patch TinInterpolator::patch(int t) const
+{
+	const QVector<int> &triangles = mTriangulation.triangles();
+	const int i1 = triangles[3 * t], i2 = triangles[3 * t + 1], i3 = triangles[3 * t + 2];
+	const vertexData &p1 = mCachedBaseData[i1];
+	const vertexData &p2 = mCachedBaseData[i2];
+	const vertexData &p3 = mCachedBaseData[i3];
+
+	// relative to the third vertex, which keeps map coordinates precise
+	Patch patch;
+	const double det = (p2.y - p3.y) * (p1.x - p3.x) + (p3.x - p2.x) * (p1.y - p3.y);
+	patch.transform[0] = p3.x;
+	patch.transform[1] = p3.y;
+	patch.transform[2] = (p2.y - p3.y) / det;
+	patch.transform[3] = (p3.x - p2.x) / det;
+	patch.transform[4] = (p3.y - p1.y) / det;
+	patch.transform[5] = (p1.x - p3.x) / det;
+
+	double *c = patch.c;
+	c[C3000] = p1.z;
+	c[C0300] = p2.z;
+	c[C0030] = p3.z;
+	if (mInterpolation != CloughTocher)
+		return patch;
+
+	const double g1x = mGradientX[i1], g1y = mGradientY[i1];
+	const double g2x = mGradientX[i2], g2y = mGradientY[i2];
+	const double g3x = mGradientX[i3], g3y = mGradientY[i3];
+	c[C2100] = p1.z + (g1x * (p2.x - p1.x) + g1y * (p2.y - p1.y)) / 3;
+	c[C2010] = p1.z + (g1x * (p3.x - p1.x) + g1y * (p3.y - p1.y)) / 3;
+	c[C1200] = p2.z + (g2x * (p1.x - p2.x) + g2y * (p1.y - p2.y)) / 3;
+	c[C0210] = p2.z + (g2x * (p3.x - p2.x) + g2y * (p3.y - p2.y)) / 3;
+	c[C1020] = p3.z + (g3x * (p1.x - p3.x) + g3y * (p1.y - p3.y)) / 3;
+	c[C0120] = p3.z + (g3x * (p2.x - p3.x) + g3y * (p2.y - p3.y)) / 3;
+
+	// the tangent planes at the vertices
+	c[C2001] = (c[C3000] + c[C2100] + c[C2010]) / 3;
+	c[C0201] = (c[C0300] + c[C1200] + c[C0210]) / 3;
+	c[C0021] = (c[C0030] + c[C1020] + c[C0120]) / 3;
+
+	const double cx = (p1.x + p2.x + p3.x) / 3;
+	const double cy = (p1.y + p2.y + p3.y) / 3;
+	c[C0111] = crossEdge(c[C0300], c[C0210], c[C0120], c[C0030], c[C0201], c[C0021], normalCoordinate(p2.x, p2.y, p3.x, p3.y, cx, cy));
+	c[C1011] = crossEdge(c[C0030], c[C1020], c[C2010], c[C3000], c[C0021], c[C2001], normalCoordinate(p3.x, p3.y, p1.x, p1.y, cx, cy));
+	c[C1101] = crossEdge(c[C3000], c[C2100], c[C1200], c[C0300], c[C2001], c[C0201], normalCoordinate(p1.x, p1.y, p2.x, p2.y, cx, cy));
+
+	// smooth across the edges to the centroid
+	c[C1002] = (c[C1101] + c[C1011] + c[C2001]) / 3;
+	c[C0102] = (c[C1101] + c[C0111] + c[C0201]) / 3;
+	c[C0012] = (c[C1011] + c[C0111] + c[C0021]) / 3;
+	c[C0003] = (c[C1002] + c[C0102] + c[C0012]) / 3;
+	return patch;
+}
+
+double TinInterpolator::value(const Patch &patch, double x, double y) const
+{
+	const double dx = x - patch.transform[0];
+	const double dy = y - patch.transform[1];
+	const double b1 = patch.transform[2] * dx + patch.transform[3] * dy;
+	const double b2 = patch.transform[4] * dx + patch.transform[5] * dy;
+	const double b3 = 1 - b1 - b2;
+	const double *c = patch.c;
+	if (mInterpolation != CloughTocher)
+		return b1 * c[C3000] + b2 * c[C0300] + b3 * c[C0030];
+
+	// coordinates in the piece holding x, y; the one of the vertex it does
+	// not touch is 0
+	const double low = qMin(b1, qMin(b2, b3));
+	const double u = b1 - low, v = b2 - low, w = b3 - low, s = 3 * low;
+	return u * u * u * c[C3000] + v * v * v * c[C0300] + w * w * w * c[C0030] + s * s * s * c[C0003]
+		+ 3 * (u * u * v * c[C2100] + u * u * w * c[C2010] + u * u * s * c[C2001]
+			+ u * v * v * c[C1200] + v * v * w * c[C0210] + v * v * s * c[C0201]
+			+ u * w * w * c[C1020] + v * w * w * c[C0120] + w * w * s * c[C0021]
+			+ u * s * s * c[C1002] + v * s * s * c[C0102] + w * s * s * c[C0012])
+		+ 6 * (u * v * s * c[C1101] + v * w * s * c[C0111] + u * w * s * c[C1011]);
+}
+
+int TinInterpolator::interpolatePoint(double x, double y, double &result)
+{
+	if (mStock)
+		return mStock->interpolatePoint(x, y, result);
+	if (!mPrepared && prepare() != 0)
+	{
+		result = 0.0;
+		return 1;
+	}
+
+	const int t = mTriangulation.locate(x, y);
+	if (t < 0)
+		return 1;
+	result = value(patch(t), x, y);
+	return 0;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "DelaunayTriangulation.h"
+#include "QScopedPointer"
+#include "QString"
+#include "qgsinterpolator.h"
+
+class QgsTINInterpolator;
+
+// QgsTINInterpolator on a DelaunayTriangulation of the cached vertices,
+// built in one pass instead of inserting feature by feature into a
+// DualEdgeTriangulation. The bulk build only takes points: with structure
+// or break lines in the input, prepare() fails and interpolatePoint() is
+// answered by a QgsTINInterpolator, which forces the lines into its
+// triangulation.
+//
+// Clough-Tocher estimates each vertex's gradient from the area weighted
+// normals of its triangles and splits every triangle into three cubic
+// pieces whose derivative across the triangle edges varies linearly, so
+// the surface is smooth across triangles.
+//
+// interpolatePoint() triangulates on first use; call prepare() first to
+// use one interpolator from several threads.
+class TinInterpolator : public QgsInterpolator
+{
+public:
+	enum TIN_INTERPOLATION
+	{
+		Linear,
+		CloughTocher
+	};
+
+	// The surface over one triangle.
+	struct Patch
+	{
+		// barycentric coordinates of the first two vertices from x and y
+		double transform[6];
+		// vertex values, or Bezier ordinates of the cubic pieces
+		double c[19];
+	};
+
+	TinInterpolator(const QList<LayerData> &inputData, TIN_INTERPOLATION interpolation = Linear, bool showProgressDialog = false);
+	~TinInterpolator();
+
+	int interpolatePoint(double x, double y, double &result) override;
+
+	// 0 uses QThread::idealThreadCount().
+	void setThreadCount(int threads) { mTriangulation.setThreadCount(threads); }
+
+	// Caches the base data and triangulates it. 0 in case of success, not
+	// 0 with structure or break lines.
+	int prepare();
+
+	TIN_INTERPOLATION interpolation() const { return mInterpolation; }
+	const DelaunayTriangulation &triangulation() const { return mTriangulation; }
+
+	// The surface over triangle t of triangulation().
+	Patch patch(int t) const;
+	// The surface of patch at x, y.
+	double value(const Patch &patch, double x, double y) const;
+
+private:
+	void estimateGradients();
+
+	TIN_INTERPOLATION mInterpolation;
+	bool mShowProgressDialog;
+	bool mPrepared;
+	DelaunayTriangulation mTriangulation;
+	// for input with structure or break lines
+	QScopedPointer<QgsTINInterpolator> mStock;
+	// per vertex, for Clough-Tocher
+	QVector<double> mGradientX;
+	QVector<double> mGradientY;
+};
@@ -0,0 +1,166 @@
+#include "TinRasterWriter.h"
+#include "QFile"
+#include "QProgressDialog"
+#include "QScopedPointer"
+#include "RasterTileWriter.h"
+#include "TinInterpolator.h"
+#include "qgsrasterdataprovider.h"
+#include "qgsvectorlayer.h"
+#include <cmath>
+
+namespace
+{
+	const float NO_DATA = -9999;
+
+	// in cells; centres this close to an edge are filled from both sides
+	const double Tolerance = 1e-9;
+
+	// Narrows first and last to the cells between low and high; false if
+	// there are none
+	bool cellRange(double low, double high, int &first, int &last)
+	{
+		low = qMax(std::ceil(low - Tolerance), static_cast<double>(first));
+		high = qMin(std::floor(high + Tolerance), static_cast<double>(last));
+		first = static_cast<int>(low);
+		last = static_cast<int>(high);
+		return low <= high;
+	}
+}
+
+TinRasterWriter::TinRasterWriter(TinInterpolator *i, const QString &outputPath, const QgsRectangle &extent, int nCols, int nRows, double cellSizeX, double cellSizeY)
+	: mInterpolator(i)
+	, mOutputFilePath(outputPath)
+	, mOutputFormat("GTiff")
+	, mInterpolationExtent(extent)
+	, mNumColumns(nCols)
+	, mNumRows(nRows)
+	, mCellSizeX(cellSizeX)
+	, mCellSizeY(cellSizeY)
+	, mTileSize(512)
+	, mThreadCount(0)
+{
+}
+
+int TinRasterWriter::writeFile(bool showProgressDialog)
+{
+	if (!mInterpolator || mInterpolator->prepare() != 0)
+		return 2;
+
+	double geoTransform[6] = { mInterpolationExtent.xMinimum(), mCellSizeX, 0, mInterpolationExtent.yMaximum(), 0, -mCellSizeY };
+	QgsVectorLayer *vl = mInterpolator->layerData().first().vectorLayer;
+	QScopedPointer<QgsRasterDataProvider> output(QgsRasterDataProvider::create("gdal", mOutputFilePath, mOutputFormat, 1, Qgis::Float32,
+		mNumColumns, mNumRows, geoTransform, vl->crs()));
+	if (!output || !output->isValid())
+		return 1;
+	output->setNoDataValue(1, NO_DATA);
+
+	// triangles by the tiles whose cell centres they may cover, in cell
+	// coordinates: the centre of cell (row, column) is at (column, row)
+	const DelaunayTriangulation &triangulation = mInterpolator->triangulation();
+	const QVector<int> &triangles = triangulation.triangles();
+	const int tilesX = (mNumColumns + mTileSize - 1) / mTileSize;
+	const int tilesY = (mNumRows + mTileSize - 1) / mTileSize;
+	QVector<double> columns(triangulation.pointCount());
+	QVector<double> rows(triangulation.pointCount());
+	for (int v = 0; v < triangulation.pointCount(); ++v)
+	{
+		columns[v] = (triangulation.x(v) - mInterpolationExtent.xMinimum()) / mCellSizeX - 0.5;
+		rows[v] = (mInterpolationExtent.yMaximum() - triangulation.y(v)) / mCellSizeY - 0.5;
+	}
+	QVector<QVector<int> > binned(tilesX * tilesY);
+	for (int t = 0; t < triangulation.triangleCount(); ++t)
+	{
+		const int a = triangles[3 * t], b = triangles[3 * t + 1], c = triangles[3 * t + 2];
+		int c0 = 0, c1 = mNumColumns - 1, r0 = 0, r1 = mNumRows - 1;
+		if (!cellRange(qMin(columns[a], qMin(columns[b], columns[c])), qMax(columns[a], qMax(columns[b], columns[c])), c0, c1)
+			|| !cellRange(qMin(rows[a], qMin(rows[b], rows[c])), qMax(rows[a], qMax(rows[b], rows[c])), r0, r1))
+			continue;
+		for (int ty = r0 / mTileSize; ty <= r1 / mTileSize; ++ty)
+		{
+			for (int tx = c0 / mTileSize; tx <= c1 / mTileSize; ++tx)
+				binned[ty * tilesX + tx].append(t);
+		}
+	}
+
+	QScopedPointer<QProgressDialog> progressDialog;
+	if (showProgressDialog)
+	{
+		progressDialog.reset(new QProgressDialog(QObject::tr("Interpolating..."), QObject::tr("Abort"), 0, 0, nullptr));
+		progressDialog->setWindowModality(Qt::WindowModal);
+	}
+
+	RasterTileWriter writer(output.data(), mNumColumns, mNumRows);
+	writer.setTileSize(mTileSize);
+	writer.setThreadCount(mThreadCount);
+	const RasterTileWriter::Result result = writer.run([&](int, RasterTileWriter::Tile &tile)
+	{
+		tile.data.fill(NO_DATA);
+		for (int t : binned.at((tile.y / mTileSize) * tilesX + tile.x / mTileSize))
+		{
+			const int v[3] = { triangles.at(3 * t), triangles.at(3 * t + 1), triangles.at(3 * t + 2) };
+			double top = rows.at(v[0]), bottom = top;
+			for (int k = 1; k < 3; ++k)
+			{
+				top = qMin(top, rows.at(v[k]));
+				bottom = qMax(bottom, rows.at(v[k]));
+			}
+
+			// the span of every row of centres between the edges
+			int r0 = tile.y, r1 = tile.y + tile.height - 1;
+			if (!cellRange(top, bottom, r0, r1))
+				continue;
+
+			// set up when the first centre is found; triangles smaller than
+			// the cells mostly cover none
+			TinInterpolator::Patch patch;
+			bool patched = false;
+			for (int r = r0; r <= r1; ++r)
+			{
+				double left = mNumColumns, right = -1;
+				for (int k = 0; k < 3; ++k)
+				{
+					const double ua = columns.at(v[k]), va = rows.at(v[k]);
+					const double ub = columns.at(v[(k + 1) % 3]), vb = rows.at(v[(k + 1) % 3]);
+					if (r < qMin(va, vb) - Tolerance || r > qMax(va, vb) + Tolerance)
+						continue;
+					if (va == vb)
+					{
+						left = qMin(left, qMin(ua, ub));
+						right = qMax(right, qMax(ua, ub));
+						continue;
+					}
+					const double u = ua + qBound(0.0, (r - va) / (vb - va), 1.0) * (ub - ua);
+					left = qMin(left, u);
+					right = qMax(right, u);
+				}
+				int c0 = tile.x, c1 = tile.x + tile.width - 1;
+				if (!cellRange(left, right, c0, c1))
+					continue;
+				if (!patched)
+				{
+					patch = mInterpolator->patch(t);
+					patched = true;
+				}
+
+				// cell centres as GridFileWriter
+				const double y = mInterpolationExtent.yMaximum() - mCellSizeY / 2.0 - r * mCellSizeY;
+				float *out = tile.data.data() + (r - tile.y) * tile.width;
+				for (int c = c0; c <= c1; ++c)
+					out[c - tile.x] = static_cast<float>(mInterpolator->value(patch, mInterpolationExtent.xMinimum() + mCellSizeX / 2.0 + c * mCellSizeX, y));
+			}
+		}
+		return true;
+	}, progressDialog.data());
+	output.reset();
+
+	switch (result)
+	{
+	case RasterTileWriter::Failed:
+		return 1;
+	case RasterTileWriter::Cancelled:
+		QFile::remove(mOutputFilePath);
+		return 3;
+	default:
+		return 0;
+	}
+}
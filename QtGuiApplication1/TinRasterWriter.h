@@ -0,0 +1,46 @@
+#pragma once
+
+#include "QString"
+#include "qgsrectangle.h"
+
+class TinInterpolator;
+
+// Writes the surface of a TinInterpolator over a grid as GridFileWriter
+// does, but walks the triangles instead of locating every cell: triangles
+// are binned by output tile, and each one fills the rows of cell centres
+// it covers between its edges. The patch of a triangle, with its
+// Clough-Tocher ordinates, is computed at most once per tile rather than
+// once per cell.
+//
+// Tiles are filled on worker threads by RasterTileWriter and streamed to
+// a Float32 GDAL raster, GeoTIFF by default, instead of an ASCII grid.
+// Cells outside the triangulation are -9999, the nodata value.
+class TinRasterWriter
+{
+public:
+	TinRasterWriter(TinInterpolator *i, const QString &outputPath, const QgsRectangle &extent, int nCols, int nRows, double cellSizeX, double cellSizeY);
+
+	// Writes the raster; 1 if the file cannot be written, 2 without an
+	// interpolator or if it cannot be prepared (as with structure or break
+	// lines), 3 when cancelled. 0 in case of success.
+	int writeFile(bool showProgressDialog = false);
+
+	// GDAL driver name.
+	void setOutputFormat(const QString &format) { mOutputFormat = format; }
+	// Output cells per tile side.
+	void setTileSize(int cells) { mTileSize = qMax(16, cells); }
+	// 0 uses QThread::idealThreadCount().
+	void setThreadCount(int threads) { mThreadCount = qMax(0, threads); }
+
+private:
+	TinInterpolator *mInterpolator;
+	QString mOutputFilePath;
+	QString mOutputFormat;
+	QgsRectangle mInterpolationExtent;
+	int mNumColumns;
+	int mNumRows;
+	double mCellSizeX;
+	double mCellSizeY;
+	int mTileSize;
+	int mThreadCount;
+};
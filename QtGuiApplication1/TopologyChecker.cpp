@@ -0,0 +1,418 @@
+#include "TopologyChecker.h"
+#include "QScopedPointer"
+#include "QtConcurrentMap"
+#include "qgsfeatureiterator.h"
+#include "qgsgeometryengine.h"
+
+namespace
+{
+	// Lines of a line geometry, rings of a polygon geometry.
+	QVector<QgsPolyline> lineParts(const QgsGeometry &geom)
+	{
+		QVector<QgsPolyline> parts;
+		if (geom.type() == QgsWkbTypes::LineGeometry)
+		{
+			if (geom.isMultipart())
+				parts = geom.asMultiPolyline();
+			else
+				parts.append(geom.asPolyline());
+		}
+		else if (geom.type() == QgsWkbTypes::PolygonGeometry)
+		{
+			const QgsMultiPolygon polygons = geom.isMultipart() ? geom.asMultiPolygon() : QgsMultiPolygon() << geom.asPolygon();
+			for (const QgsPolygon &polygon : polygons)
+				parts += polygon;
+		}
+		return parts;
+	}
+
+	QgsRectangle pointBox(const QgsPoint &p, double tolerance)
+	{
+		return QgsRectangle(p.x() - tolerance, p.y() - tolerance, p.x() + tolerance, p.y() + tolerance);
+	}
+}
+
+TopologyLayerCache::TopologyLayerCache(QgsVectorLayer *layer, const QgsRectangle &extent, bool selectedOnly)
+	: layer(layer)
+{
+	QgsFeatureRequest request;
+	request.setSubsetOfAttributes(QgsAttributeList());
+	if (selectedOnly)
+		request.setFilterFids(layer->selectedFeatureIds());
+	if (!extent.isNull())
+		request.setFilterRect(extent);
+
+	QgsFeatureIterator it = layer->getFeatures(request);
+	QgsFeature f;
+	while (it.nextFeature(f))
+	{
+		if (!f.hasGeometry())
+			continue;
+		const QgsGeometry geom = f.geometry();
+		// not every provider applies the rectangle along with the ids
+		if (selectedOnly && !extent.isNull() && !geom.boundingBox().intersects(extent))
+			continue;
+		ids.append(f.id());
+		geometries.append(geom);
+		bounds.append(geom.boundingBox());
+	}
+	index = PackedRTree(bounds);
+}
+
+TopologyChecker::TopologyChecker()
+	: mCancelled(0)
+	, mChunkSize(128)
+{
+}
+
+const QMap<QString, TopologyChecker::RuleDefinition> &TopologyChecker::ruleMap()
+{
+	static const QMap<QString, RuleDefinition> rules = []
+	{
+		QMap<QString, RuleDefinition> map;
+		map.insert("must not have invalid geometries", RuleDefinition{ &TopologyChecker::checkValid, nullptr, false, false });
+		map.insert("must not have duplicates", RuleDefinition{ &TopologyChecker::checkDuplicates, nullptr, false, false });
+		map.insert("must not overlap", RuleDefinition{ &TopologyChecker::checkOverlaps, nullptr, false, false });
+		map.insert("must not have gaps", RuleDefinition{ &TopologyChecker::checkGaps, &TopologyChecker::finishGaps, false, false });
+		map.insert("must not have dangles", RuleDefinition{ &TopologyChecker::checkDanglingLines, nullptr, false, true });
+		map.insert("must not have multi-part geometries", RuleDefinition{ &TopologyChecker::checkMultipart, nullptr, false, false });
+		map.insert("segments must have minimum length", RuleDefinition{ &TopologyChecker::checkSegmentLength, nullptr, false, true });
+		map.insert("must not overlap with", RuleDefinition{ &TopologyChecker::checkOverlapWithLayer, nullptr, true, false });
+		map.insert("must be inside", RuleDefinition{ &TopologyChecker::checkPointInPolygon, nullptr, true, false });
+		return map;
+	}();
+	return rules;
+}
+
+QStringList TopologyChecker::ruleNames()
+{
+	return ruleMap().keys();
+}
+
+bool TopologyChecker::ruleUsesSecondLayer(const QString &rule)
+{
+	return ruleMap().value(rule).useSecondLayer;
+}
+
+bool TopologyChecker::ruleUsesTolerance(const QString &rule)
+{
+	return ruleMap().value(rule).useTolerance;
+}
+
+bool TopologyChecker::addRule(const QString &rule, QgsVectorLayer *layer1, QgsVectorLayer *layer2, double tolerance)
+{
+	if (!ruleMap().contains(rule) || !layer1)
+		return false;
+	if (ruleUsesSecondLayer(rule) && !layer2)
+		return false;
+
+	RuleSetting setting = { rule, layer1, ruleUsesSecondLayer(rule) ? layer2 : nullptr, tolerance };
+	mRules.append(setting);
+	return true;
+}
+
+void TopologyChecker::clearRules()
+{
+	mRules.clear();
+}
+
+void TopologyChecker::cancel()
+{
+	mCancelled.store(1);
+}
+
+void TopologyChecker::invalidateCache(QgsVectorLayer *layer)
+{
+	if (!layer)
+	{
+		mCaches.clear();
+		return;
+	}
+
+	const QString prefix = layer->id() + '|';
+	for (auto it = mCaches.begin(); it != mCaches.end();)
+	{
+		if (it.key().startsWith(prefix))
+			it = mCaches.erase(it);
+		else
+			++it;
+	}
+}
+
+QSharedPointer<TopologyLayerCache> TopologyChecker::layerCache(QgsVectorLayer *layer, const QgsRectangle &extent, bool selectedOnly)
+{
+	const QString key = QString("%1|%2|%3").arg(layer->id(), extent.isNull() ? QString() : extent.toString(), selectedOnly ? "s" : "");
+	QSharedPointer<TopologyLayerCache> &cache = mCaches[key];
+	if (!cache)
+		cache.reset(new TopologyLayerCache(layer, extent, selectedOnly));
+	return cache;
+}
+
+QList<TopologyIssue> TopologyChecker::run(const QgsRectangle &extent, bool selectedOnly)
+{
+	mCancelled.store(0);
+
+	// Layers can only be read from this thread, so load all of them first.
+	QList<Job> jobs;
+	for (const RuleSetting &setting : mRules)
+	{
+		Job job;
+		job.rule = setting.rule;
+		job.tolerance = setting.tolerance;
+		job.cache1 = layerCache(setting.layer1, extent, selectedOnly);
+		// the second layer is always read in full around the checked extent
+		if (setting.layer2)
+			job.cache2 = layerCache(setting.layer2, extent, false);
+		jobs.append(job);
+	}
+
+	QVector<Chunk> chunks;
+	for (Job &job : jobs)
+	{
+		const int count = job.cache1->geometries.size();
+		int index = 0;
+		for (int begin = 0; begin < count; begin += mChunkSize, ++index)
+		{
+			Chunk chunk = { &job, index, begin, qMin(begin + mChunkSize, count), QList<TopologyIssue>() };
+			chunks.append(chunk);
+		}
+		job.partials.resize(index);
+	}
+
+	QtConcurrent::blockingMap(chunks, [this](Chunk &chunk)
+	{
+		if (!cancelled())
+			(this->*ruleMap()[chunk.job->rule].check)(chunk);
+	});
+
+	// Concatenate in rule and feature order so output does not depend on scheduling.
+	QList<TopologyIssue> issues;
+	int next = 0;
+	for (Job &job : jobs)
+	{
+		for (; next < chunks.size() && chunks[next].job == &job; ++next)
+			issues += chunks[next].issues;
+		const FinishFunction finish = ruleMap()[job.rule].finish;
+		if (finish && !cancelled())
+			(this->*finish)(job, issues);
+	}
+	return issues;
+}
+
+TopologyIssue TopologyChecker::issue(const Chunk &chunk, int i, int j, const QgsGeometry &conflict) const
+{
+	const TopologyLayerCache *cache1 = chunk.job->cache1.data();
+	const TopologyLayerCache *cache2 = chunk.job->cache2 ? chunk.job->cache2.data() : cache1;
+
+	TopologyIssue result;
+	result.rule = chunk.job->rule;
+	result.layer1 = cache1->layer;
+	result.fid1 = cache1->ids[i];
+	result.layer2 = j < 0 ? nullptr : cache2->layer;
+	result.fid2 = j < 0 ? -1 : cache2->ids[j];
+	result.conflict = conflict;
+	result.boundingBox = conflict.isEmpty() ? cache1->bounds[i] : conflict.boundingBox();
+	return result;
+}
+
+void TopologyChecker::checkValid(Chunk &chunk) const
+{
+	const TopologyLayerCache &cache = *chunk.job->cache1;
+	for (int i = chunk.begin; i < chunk.end; ++i)
+	{
+		if (!cache.geometries[i].isGeosValid())
+			chunk.issues.append(issue(chunk, i, -1, cache.geometries[i]));
+	}
+}
+
+void TopologyChecker::checkDuplicates(Chunk &chunk) const
+{
+	const TopologyLayerCache &cache = *chunk.job->cache1;
+	for (int i = chunk.begin; i < chunk.end && !cancelled(); ++i)
+	{
+		const QgsGeometry &g1 = cache.geometries[i];
+		cache.index.visit(cache.bounds[i], [&](int j)
+		{
+			// each pair is reported once, by its lower index
+			if (j > i && g1.isGeosEqual(cache.geometries[j]))
+				chunk.issues.append(issue(chunk, i, j, g1));
+			return true;
+		});
+	}
+}
+
+void TopologyChecker::checkOverlaps(Chunk &chunk) const
+{
+	const TopologyLayerCache &cache = *chunk.job->cache1;
+	for (int i = chunk.begin; i < chunk.end && !cancelled(); ++i)
+	{
+		const QgsGeometry &g1 = cache.geometries[i];
+		if (g1.type() != QgsWkbTypes::PolygonGeometry)
+			continue;
+
+		QScopedPointer<QgsGeometryEngine> engine;
+		cache.index.visit(cache.bounds[i], [&](int j)
+		{
+			if (j <= i)
+				return true;
+			const QgsGeometry &g2 = cache.geometries[j];
+			if (!engine)
+			{
+				engine.reset(QgsGeometry::createGeometryEngine(g1.geometry()));
+				engine->prepareGeometry();
+			}
+			if (!engine->intersects(*g2.geometry()) || engine->touches(*g2.geometry()))
+				return true;
+
+			const QgsGeometry conflict = g1.intersection(g2);
+			if (conflict.type() == QgsWkbTypes::PolygonGeometry && conflict.area() > 0)
+				chunk.issues.append(issue(chunk, i, j, conflict));
+			return true;
+		});
+	}
+}
+
+void TopologyChecker::checkGaps(Chunk &chunk) const
+{
+	const TopologyLayerCache &cache = *chunk.job->cache1;
+	QList<QgsGeometry> polygons;
+	for (int i = chunk.begin; i < chunk.end; ++i)
+	{
+		if (cache.geometries[i].type() == QgsWkbTypes::PolygonGeometry)
+			polygons.append(cache.geometries[i]);
+	}
+	chunk.job->partials[chunk.index] = QgsGeometry::unaryUnion(polygons);
+}
+
+void TopologyChecker::finishGaps(Job &job, QList<TopologyIssue> &issues) const
+{
+	QList<QgsGeometry> partials;
+	for (const QgsGeometry &g : job.partials)
+	{
+		if (!g.isEmpty())
+			partials.append(g);
+	}
+	if (partials.isEmpty())
+		return;
+
+	// holes of the dissolved layer are the gaps between its polygons
+	const QgsGeometry dissolved = QgsGeometry::unaryUnion(partials);
+	const QgsMultiPolygon polygons = dissolved.isMultipart() ? dissolved.asMultiPolygon() : QgsMultiPolygon() << dissolved.asPolygon();
+	for (const QgsPolygon &polygon : polygons)
+	{
+		for (int ring = 1; ring < polygon.size(); ++ring)
+		{
+			TopologyIssue gap;
+			gap.rule = job.rule;
+			gap.layer1 = job.cache1->layer;
+			gap.fid1 = -1;
+			gap.layer2 = nullptr;
+			gap.fid2 = -1;
+			gap.conflict = QgsGeometry::fromPolygon(QgsPolygon() << polygon[ring]);
+			gap.boundingBox = gap.conflict.boundingBox();
+			issues.append(gap);
+		}
+	}
+}
+
+void TopologyChecker::checkDanglingLines(Chunk &chunk) const
+{
+	const TopologyLayerCache &cache = *chunk.job->cache1;
+	const double tolerance = chunk.job->tolerance;
+	for (int i = chunk.begin; i < chunk.end && !cancelled(); ++i)
+	{
+		if (cache.geometries[i].type() != QgsWkbTypes::LineGeometry)
+			continue;
+
+		for (const QgsPolyline &line : lineParts(cache.geometries[i]))
+		{
+			if (line.size() < 2 || line.first().sqrDist(line.last()) <= tolerance * tolerance)
+				continue;
+
+			for (const QgsPoint &end : { line.first(), line.last() })
+			{
+				const QgsGeometry endGeom = QgsGeometry::fromPoint(end);
+				bool connected = false;
+				cache.index.visit(pointBox(end, tolerance), [&](int j)
+				{
+					if (j != i && cache.geometries[j].distance(endGeom) <= tolerance)
+						connected = true;
+					return !connected;
+				});
+				if (!connected)
+					chunk.issues.append(issue(chunk, i, -1, endGeom));
+			}
+		}
+	}
+}
+
+void TopologyChecker::checkMultipart(Chunk &chunk) const
+{
+	const TopologyLayerCache &cache = *chunk.job->cache1;
+	for (int i = chunk.begin; i < chunk.end; ++i)
+	{
+		if (cache.geometries[i].isMultipart())
+			chunk.issues.append(issue(chunk, i, -1, cache.geometries[i]));
+	}
+}
+
+void TopologyChecker::checkSegmentLength(Chunk &chunk) const
+{
+	const TopologyLayerCache &cache = *chunk.job->cache1;
+	const double minLength2 = chunk.job->tolerance * chunk.job->tolerance;
+	for (int i = chunk.begin; i < chunk.end; ++i)
+	{
+		for (const QgsPolyline &line : lineParts(cache.geometries[i]))
+		{
+			for (int v = 1; v < line.size(); ++v)
+			{
+				if (line[v - 1].sqrDist(line[v]) < minLength2)
+					chunk.issues.append(issue(chunk, i, -1, QgsGeometry::fromPolyline(QgsPolyline() << line[v - 1] << line[v])));
+			}
+		}
+	}
+}
+
+void TopologyChecker::checkOverlapWithLayer(Chunk &chunk) const
+{
+	const TopologyLayerCache &cache1 = *chunk.job->cache1;
+	const TopologyLayerCache &cache2 = *chunk.job->cache2;
+	const bool sameLayer = cache1.layer == cache2.layer;
+	for (int i = chunk.begin; i < chunk.end && !cancelled(); ++i)
+	{
+		const QgsGeometry &g1 = cache1.geometries[i];
+		QScopedPointer<QgsGeometryEngine> engine;
+		cache2.index.visit(cache1.bounds[i], [&](int j)
+		{
+			if (sameLayer && cache2.ids[j] == cache1.ids[i])
+				return true;
+			const QgsGeometry &g2 = cache2.geometries[j];
+			if (!engine)
+			{
+				engine.reset(QgsGeometry::createGeometryEngine(g1.geometry()));
+				engine->prepareGeometry();
+			}
+			if (engine->intersects(*g2.geometry()) && !engine->touches(*g2.geometry()))
+				chunk.issues.append(issue(chunk, i, j, g1.intersection(g2)));
+			return true;
+		});
+	}
+}
+
+void TopologyChecker::checkPointInPolygon(Chunk &chunk) const
+{
+	const TopologyLayerCache &points = *chunk.job->cache1;
+	const TopologyLayerCache &polygons = *chunk.job->cache2;
+	for (int i = chunk.begin; i < chunk.end && !cancelled(); ++i)
+	{
+		const QgsGeometry &point = points.geometries[i];
+		bool inside = false;
+		polygons.index.visit(points.bounds[i], [&](int j)
+		{
+			inside = polygons.geometries[j].contains(point);
+			return !inside;
+		});
+		if (!inside)
+			chunk.issues.append(issue(chunk, i, -1, point));
+	}
+}
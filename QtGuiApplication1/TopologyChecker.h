@@ -0,0 +1,122 @@
+#pragma once
+
+#include "QAtomicInt"
+#include "QList"
+#include "QMap"
+#include "QSharedPointer"
+#include "QStringList"
+#include "qgsgeometry.h"
+#include "qgsvectorlayer.h"
+#include "PackedRTree.h"
+
+struct TopologyIssue
+{
+	QString rule;
+	QgsVectorLayer *layer1;
+	QgsFeatureId fid1;
+	QgsVectorLayer *layer2;
+	QgsFeatureId fid2;
+	QgsGeometry conflict;
+	QgsRectangle boundingBox;
+};
+
+// Geometries of one layer, loaded once and shared by every rule checked
+// against that layer.
+class TopologyLayerCache
+{
+public:
+	TopologyLayerCache(QgsVectorLayer *layer, const QgsRectangle &extent, bool selectedOnly);
+
+	QgsVectorLayer *layer;
+	QVector<QgsFeatureId> ids;
+	QVector<QgsGeometry> geometries;
+	QVector<QgsRectangle> bounds;
+	PackedRTree index;
+};
+
+// Parallel counterpart of the topol plugin's topolTest. Layers are read once
+// on the calling thread, then every configured rule is split into chunks of
+// features and all chunks of all rules are checked on the global thread pool.
+class TopologyChecker
+{
+public:
+	TopologyChecker();
+
+	static QStringList ruleNames();
+	static bool ruleUsesSecondLayer(const QString &rule);
+	static bool ruleUsesTolerance(const QString &rule);
+
+	// Returns false if the rule is unknown or misses its second layer.
+	bool addRule(const QString &rule, QgsVectorLayer *layer1, QgsVectorLayer *layer2 = nullptr, double tolerance = 0.0);
+	void clearRules();
+
+	// Checks all rules. A null extent checks whole layers.
+	QList<TopologyIssue> run(const QgsRectangle &extent = QgsRectangle(), bool selectedOnly = false);
+	void cancel();
+
+	// Drops cached geometries; call after a layer has been edited.
+	void invalidateCache(QgsVectorLayer *layer = nullptr);
+
+	void setChunkSize(int features) { mChunkSize = qMax(1, features); }
+
+private:
+	struct Job
+	{
+		QString rule;
+		double tolerance;
+		QSharedPointer<TopologyLayerCache> cache1;
+		QSharedPointer<TopologyLayerCache> cache2;
+		// per chunk results of rules that need a final reduction
+		QVector<QgsGeometry> partials;
+	};
+
+	struct Chunk
+	{
+		Job *job;
+		int index;
+		int begin;
+		int end;
+		QList<TopologyIssue> issues;
+	};
+
+	typedef void (TopologyChecker::*ChunkFunction)(Chunk &chunk) const;
+	typedef void (TopologyChecker::*FinishFunction)(Job &job, QList<TopologyIssue> &issues) const;
+
+	struct RuleDefinition
+	{
+		ChunkFunction check;
+		FinishFunction finish;
+		bool useSecondLayer;
+		bool useTolerance;
+	};
+
+	struct RuleSetting
+	{
+		QString rule;
+		QgsVectorLayer *layer1;
+		QgsVectorLayer *layer2;
+		double tolerance;
+	};
+
+	static const QMap<QString, RuleDefinition> &ruleMap();
+
+	QSharedPointer<TopologyLayerCache> layerCache(QgsVectorLayer *layer, const QgsRectangle &extent, bool selectedOnly);
+	bool cancelled() const { return mCancelled.load() != 0; }
+	TopologyIssue issue(const Chunk &chunk, int i, int j, const QgsGeometry &conflict) const;
+
+	void checkValid(Chunk &chunk) const;
+	void checkDuplicates(Chunk &chunk) const;
+	void checkOverlaps(Chunk &chunk) const;
+	void checkGaps(Chunk &chunk) const;
+	void finishGaps(Job &job, QList<TopologyIssue> &issues) const;
+	void checkDanglingLines(Chunk &chunk) const;
+	void checkMultipart(Chunk &chunk) const;
+	void checkSegmentLength(Chunk &chunk) const;
+	void checkOverlapWithLayer(Chunk &chunk) const;
+	void checkPointInPolygon(Chunk &chunk) const;
+
+	QList<RuleSetting> mRules;
+	QMap<QString, QSharedPointer<TopologyLayerCache> > mCaches;
+	QAtomicInt mCancelled;
+	int mChunkSize;
+};
@@ -0,0 +1,583 @@
+#include "ZonalStatistics.h"
+#include "QHash"
+#include "QProgressDialog"
+#include "QScopedPointer"
+#include "QStringList"
+#include "QThread"
+#include "QtConcurrentMap"
+#include "TDigest.h"
+#include "qgsfeatureiterator.h"
+#include "qgsgeometry.h"
+#include "qgsproviderregistry.h"
+#include "qgsrasterblock.h"
+#include "qgsrasterdataprovider.h"
+#include "qgsvectordataprovider.h"
+#include "qgsvectorlayer.h"
+#include <algorithm>
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace
+{
+	struct Edge
+	{
+		double x0;
+		double y0;
+		double x1;
+		double y1;
+	};
+
+	struct Zone
+	{
+		QgsFeatureId id;
+		QgsGeometry geometry;
+		// cells under the bounding box, clipped to the raster
+		int firstColumn;
+		int lastColumn;
+		int firstRow;
+		int lastRow;
+		QVector<Edge> edges;
+	};
+
+	struct Tile
+	{
+		int x;
+		int y;
+		int width;
+		int height;
+		QVector<int> zones;
+	};
+
+	// Running moments of one zone, as QgsZonalStatistics::FeatureStats
+	// counts them: weights below one only come from cell intersections.
+	struct Moments
+	{
+		Moments() : count(0), sum(0), mean(0), squares(0), min(FLT_MAX), max(-FLT_MAX) {}
+
+		void add(float value, double weight)
+		{
+			const double w = weight < 1.0 ? weight : 1.0;
+			count += w;
+			sum += w * value;
+			const double delta = value - mean;
+			mean += delta * w / count;
+			squares += w * delta * (value - mean);
+			min = qMin(min, value);
+			max = qMax(max, value);
+		}
+
+		void merge(const Moments &other)
+		{
+			if (!(other.count > 0))
+				return;
+			const double total = count + other.count;
+			const double delta = other.mean - mean;
+			mean += delta * other.count / total;
+			squares += other.squares + delta * delta * count * other.count / total;
+			count = total;
+			sum += other.sum;
+			min = qMin(min, other.min);
+			max = qMax(max, other.max);
+		}
+
+		double count;
+		double sum;
+		double mean;
+		double squares;
+		float min;
+		float max;
+	};
+
+	// Everything kept for the zones, by zone index.
+	struct Accumulators
+	{
+		QVector<Moments> moments;
+		QHash<int, QHash<float, int> > valueCounts;
+		QHash<int, TDigest> digests;
+
+		void add(int zone, float value, double weight, bool storeValueCounts, bool storeDigest)
+		{
+			moments[zone].add(value, weight);
+			if (storeValueCounts)
+			{
+				QHash<float, int> &counts = valueCounts[zone];
+				++counts[value];
+			}
+			else if (storeDigest)
+			{
+				auto it = digests.find(zone);
+				if (it == digests.end())
+					it = digests.insert(zone, TDigest(100));
+				it->add(value);
+			}
+		}
+
+		void merge(const Accumulators &other)
+		{
+			for (int z = 0; z < moments.size(); ++z)
+				moments[z].merge(other.moments[z]);
+			for (auto it = other.valueCounts.constBegin(); it != other.valueCounts.constEnd(); ++it)
+			{
+				QHash<float, int> &counts = valueCounts[it.key()];
+				for (auto v = it->constBegin(); v != it->constEnd(); ++v)
+					counts[v.key()] += v.value();
+			}
+			for (auto it = other.digests.constBegin(); it != other.digests.constEnd(); ++it)
+			{
+				auto d = digests.find(it.key());
+				if (d == digests.end())
+					digests.insert(it.key(), it.value());
+				else
+					d->merge(it.value());
+			}
+		}
+	};
+
+	// Reads cells of a window as floats, NaN for nodata.
+	bool readCells(QgsRasterInterface *provider, int band, const QgsRectangle &extent, double cellX, double cellY,
+		int x, int y, int width, int height, QVector<float> &values)
+	{
+		const QgsRectangle window(extent.xMinimum() + x * cellX, extent.yMaximum() - (y + height) * cellY,
+			extent.xMinimum() + (x + width) * cellX, extent.yMaximum() - y * cellY);
+		QScopedPointer<QgsRasterBlock> block(provider->block(band, window, width, height));
+		if (!block || !block->isValid() || block->isEmpty() || !block->convert(Qgis::Float32))
+			return false;
+
+		const int count = width * height;
+		values.resize(count);
+		std::memcpy(values.data(), block->bits(), count * sizeof(float));
+		if (block->hasNoData())
+		{
+			for (int k = 0; k < count; ++k)
+			{
+				if (block->isNoData(k))
+					values[k] = std::numeric_limits<float>::quiet_NaN();
+			}
+		}
+		return true;
+	}
+
+	// Median of the stored values, as the stock class takes it from the
+	// sorted list.
+	double medianOf(const QHash<float, int> &counts)
+	{
+		QVector<float> keys;
+		keys.reserve(counts.size());
+		qint64 total = 0;
+		for (auto it = counts.constBegin(); it != counts.constEnd(); ++it)
+		{
+			keys.append(it.key());
+			total += it.value();
+		}
+		std::sort(keys.begin(), keys.end());
+
+		const qint64 upper = total / 2;
+		const qint64 lower = total % 2 ? upper : upper - 1;
+		double lowerValue = 0, upperValue = 0;
+		qint64 seen = 0;
+		for (float key : keys)
+		{
+			const qint64 next = seen + counts.value(key);
+			if (lower >= seen && lower < next)
+				lowerValue = key;
+			if (upper >= seen && upper < next)
+			{
+				upperValue = key;
+				break;
+			}
+			seen = next;
+		}
+		return (lowerValue + upperValue) / 2;
+	}
+}
+
+ZonalStatistics::ZonalStatistics(QgsVectorLayer *polygonLayer, const QString &rasterFile, const QString &attributePrefix, int rasterBand,
+	QgsZonalStatistics::Statistics stats)
+	: mPolygonLayer(polygonLayer)
+	, mRasterFilePath(rasterFile)
+	, mAttributePrefix(attributePrefix)
+	, mRasterBand(rasterBand)
+	, mStatistics(stats)
+	, mTileSize(512)
+	, mThreadCount(0)
+{
+}
+
+QString ZonalStatistics::uniqueFieldName(const QString &fieldName) const
+{
+	// as QgsZonalStatistics: shapefiles keep ten characters
+	const QgsVectorDataProvider *provider = mPolygonLayer->dataProvider();
+	if (!provider->storageType().contains("ESRI Shapefile"))
+		return fieldName;
+
+	const QgsFields fields = mPolygonLayer->fields();
+	QString name = fieldName.left(10);
+	for (int n = 1; fields.lookupField(name) >= 0 && n < 100; ++n)
+		name = QString("%1_%2").arg(fieldName.left(n < 10 ? 8 : 7)).arg(n);
+	return name;
+}
+
+int ZonalStatistics::calculateStatistics(QProgressDialog *p)
+{
+	if (!mPolygonLayer || mPolygonLayer->geometryType() != QgsWkbTypes::PolygonGeometry)
+		return 1;
+	QgsVectorDataProvider *vectorProvider = mPolygonLayer->dataProvider();
+	if (!vectorProvider)
+		return 2;
+
+	QgsRasterDataProvider *raster = dynamic_cast<QgsRasterDataProvider *>(QgsProviderRegistry::instance()->provider("gdal", mRasterFilePath));
+	if (!raster || !raster->isValid() || raster->xSize() <= 0 || raster->ySize() <= 0)
+	{
+		delete raster;
+		return 3;
+	}
+	if (mRasterBand < 1 || mRasterBand > raster->bandCount())
+	{
+		delete raster;
+		return 4;
+	}
+
+	const int xSize = raster->xSize();
+	const int ySize = raster->ySize();
+	const QgsRectangle extent = raster->extent();
+	const double cellX = extent.width() / xSize;
+	const double cellY = extent.height() / ySize;
+
+	// the fields of the stock class
+	struct Output
+	{
+		QgsZonalStatistics::Statistic statistic;
+		const char *name;
+		QVariant::Type type;
+		int index;
+	};
+	Output outputs[] =
+	{
+		{ QgsZonalStatistics::Count, "count", QVariant::Double, -1 },
+		{ QgsZonalStatistics::Sum, "sum", QVariant::Double, -1 },
+		{ QgsZonalStatistics::Mean, "mean", QVariant::Double, -1 },
+		{ QgsZonalStatistics::Median, "median", QVariant::Double, -1 },
+		{ QgsZonalStatistics::StDev, "stdev", QVariant::Double, -1 },
+		{ QgsZonalStatistics::Min, "min", QVariant::Double, -1 },
+		{ QgsZonalStatistics::Max, "max", QVariant::Double, -1 },
+		{ QgsZonalStatistics::Range, "range", QVariant::Double, -1 },
+		{ QgsZonalStatistics::Minority, "minority", QVariant::Double, -1 },
+		{ QgsZonalStatistics::Majority, "majority", QVariant::Double, -1 },
+		{ QgsZonalStatistics::Variety, "variety", QVariant::Int, -1 },
+	};
+	QList<QgsField> newFields;
+	QStringList names;
+	for (Output &output : outputs)
+	{
+		if (!(mStatistics & output.statistic))
+			continue;
+		const QString name = uniqueFieldName(mAttributePrefix + output.name);
+		newFields.append(QgsField(name, output.type, output.type == QVariant::Int ? "int" : "double precision"));
+		names.append(name);
+	}
+	vectorProvider->addAttributes(newFields);
+	mPolygonLayer->updateFields();
+	for (Output &output : outputs)
+	{
+		if (mStatistics & output.statistic)
+			output.index = vectorProvider->fieldNameIndex(names.takeFirst());
+	}
+
+	const bool storeValueCounts = mStatistics & (QgsZonalStatistics::Minority | QgsZonalStatistics::Majority | QgsZonalStatistics::Variety);
+	const bool storeDigest = !storeValueCounts && (mStatistics & QgsZonalStatistics::Median);
+
+	// zones on the raster, with their rings as edges
+	QVector<Zone> zones;
+	QgsFeatureIterator it = vectorProvider->getFeatures(QgsFeatureRequest().setSubsetOfAttributes(QgsAttributeList()));
+	QgsFeature f;
+	while (it.nextFeature(f))
+	{
+		if (!f.hasGeometry())
+			continue;
+		const QgsRectangle bounds = f.geometry().boundingBox();
+		if (!bounds.intersects(extent))
+			continue;
+
+		Zone zone;
+		zone.id = f.id();
+		zone.geometry = f.geometry();
+		zone.firstColumn = qBound(0, static_cast<int>(std::floor((bounds.xMinimum() - extent.xMinimum()) / cellX)), xSize - 1);
+		zone.lastColumn = qBound(0, static_cast<int>(std::floor((bounds.xMaximum() - extent.xMinimum()) / cellX)), xSize - 1);
+		zone.firstRow = qBound(0, static_cast<int>(std::floor((extent.yMaximum() - bounds.yMaximum()) / cellY)), ySize - 1);
+		zone.lastRow = qBound(0, static_cast<int>(std::floor((extent.yMaximum() - bounds.yMinimum()) / cellY)), ySize - 1);
+		const QgsMultiPolygon polygons = zone.geometry.isMultipart() ? zone.geometry.asMultiPolygon() : QgsMultiPolygon() << zone.geometry.asPolygon();
+		for (const QgsPolygon &polygon : polygons)
+		{
+			for (const QgsPolyline &ring : polygon)
+			{
+				for (int i = 1; i < ring.size(); ++i)
+				{
+					const Edge edge = { ring[i - 1].x(), ring[i - 1].y(), ring[i].x(), ring[i].y() };
+					zone.edges.append(edge);
+				}
+			}
+		}
+		zones.append(zone);
+	}
+
+	// tiles that have zones on them, each with its zones
+	const int tilesX = (xSize + mTileSize - 1) / mTileSize;
+	const int tilesY = (ySize + mTileSize - 1) / mTileSize;
+	QVector<Tile> grid(tilesX * tilesY);
+	for (int ty = 0; ty < tilesY; ++ty)
+	{
+		for (int tx = 0; tx < tilesX; ++tx)
+		{
+			Tile &tile = grid[ty * tilesX + tx];
+			tile.x = tx * mTileSize;
+			tile.y = ty * mTileSize;
+			tile.width = qMin(mTileSize, xSize - tile.x);
+			tile.height = qMin(mTileSize, ySize - tile.y);
+		}
+	}
+	for (int z = 0; z < zones.size(); ++z)
+	{
+		const Zone &zone = zones[z];
+		for (int ty = zone.firstRow / mTileSize; ty <= zone.lastRow / mTileSize; ++ty)
+		{
+			for (int tx = zone.firstColumn / mTileSize; tx <= zone.lastColumn / mTileSize; ++tx)
+				grid[ty * tilesX + tx].zones.append(z);
+		}
+	}
+	QVector<Tile> tiles;
+	for (const Tile &tile : grid)
+	{
+		if (!tile.zones.isEmpty())
+			tiles.append(tile);
+	}
+
+	// every worker reads every threads-th tile of a batch through its own
+	// provider clone into its own accumulators
+	struct Worker
+	{
+		int index;
+		bool failed;
+		QgsRasterInterface *provider;
+		Accumulators accumulators;
+		QVector<float> values;
+		QVector<double> crossings;
+		QVector<Edge> edges;
+	};
+	const int threads = qBound(1, mThreadCount > 0 ? mThreadCount : QThread::idealThreadCount(), qMax(1, tiles.size()));
+	QVector<Worker> workers(threads);
+	for (int k = 0; k < threads; ++k)
+	{
+		workers[k].index = k;
+		workers[k].failed = false;
+		workers[k].provider = raster->clone();
+		workers[k].accumulators.moments.resize(zones.size());
+	}
+
+	if (p)
+		p->setMaximum(tiles.size());
+	const int batchSize = threads * 4;
+	bool cancelled = false;
+	for (int batch = 0; batch < tiles.size() && !cancelled; batch += batchSize)
+	{
+		const int batchEnd = qMin(batch + batchSize, tiles.size());
+		QtConcurrent::blockingMap(workers, [&](Worker &worker)
+		{
+			for (int t = batch + worker.index; t < batchEnd && !worker.failed; t += threads)
+			{
+				const Tile &tile = tiles[t];
+				if (!worker.provider || !readCells(worker.provider, mRasterBand, extent, cellX, cellY, tile.x, tile.y, tile.width, tile.height, worker.values))
+				{
+					worker.failed = true;
+					return;
+				}
+
+				for (int z : tile.zones)
+				{
+					const Zone &zone = zones[z];
+					const int rowBegin = qMax(zone.firstRow, tile.y);
+					const int rowEnd = qMin(zone.lastRow + 1, tile.y + tile.height);
+					const double top = extent.yMaximum() - (rowBegin + 0.5) * cellY;
+					const double bottom = extent.yMaximum() - (rowEnd - 0.5) * cellY;
+
+					// edges crossing the rows of the tile
+					worker.edges.resize(0);
+					for (const Edge &edge : zone.edges)
+					{
+						if (qMax(edge.y0, edge.y1) >= bottom && qMin(edge.y0, edge.y1) <= top)
+							worker.edges.append(edge);
+					}
+
+					// runs of cell centres inside the rings, even-odd
+					for (int row = rowBegin; row < rowEnd; ++row)
+					{
+						const double y = extent.yMaximum() - (row + 0.5) * cellY;
+						worker.crossings.resize(0);
+						for (const Edge &edge : worker.edges)
+						{
+							if ((edge.y0 > y) != (edge.y1 > y))
+								worker.crossings.append(edge.x0 + (y - edge.y0) * (edge.x1 - edge.x0) / (edge.y1 - edge.y0));
+						}
+						std::sort(worker.crossings.begin(), worker.crossings.end());
+
+						const float *line = worker.values.constData() + (row - tile.y) * tile.width - tile.x;
+						for (int k = 0; k + 1 < worker.crossings.size(); k += 2)
+						{
+							const int begin = qMax(tile.x, static_cast<int>(std::ceil((worker.crossings[k] - extent.xMinimum()) / cellX - 0.5)));
+							const int end = qMin(tile.x + tile.width, static_cast<int>(std::ceil((worker.crossings[k + 1] - extent.xMinimum()) / cellX - 0.5)));
+							for (int column = begin; column < end; ++column)
+							{
+								const float value = line[column];
+								if (value == value)
+									worker.accumulators.add(z, value, 1.0, storeValueCounts, storeDigest);
+							}
+						}
+					}
+				}
+			}
+		});
+
+		if (p)
+		{
+			p->setValue(batchEnd);
+			cancelled = p->wasCanceled();
+		}
+	}
+
+	bool failed = false;
+	Accumulators result;
+	result.moments.resize(zones.size());
+	for (Worker &worker : workers)
+	{
+		failed = failed || worker.failed;
+		result.merge(worker.accumulators);
+		delete worker.provider;
+	}
+	workers.clear();
+	if (cancelled || failed)
+	{
+		delete raster;
+		return cancelled ? 9 : 3;
+	}
+
+	// the cell resolution is probably larger than the polygon, so cells
+	// are weighted by the share of them it covers
+	const double cellArea = cellX * cellY;
+	QVector<float> values;
+	for (int z = 0; z < zones.size(); ++z)
+	{
+		if (result.moments[z].count > 1)
+			continue;
+		const Zone &zone = zones[z];
+		const int width = zone.lastColumn - zone.firstColumn + 1;
+		const int height = zone.lastRow - zone.firstRow + 1;
+		if (!readCells(raster, mRasterBand, extent, cellX, cellY, zone.firstColumn, zone.firstRow, width, height, values))
+			continue;
+
+		result.moments[z] = Moments();
+		result.valueCounts.remove(z);
+		result.digests.remove(z);
+		for (int i = 0; i < height; ++i)
+		{
+			for (int j = 0; j < width; ++j)
+			{
+				const float value = values[i * width + j];
+				if (value != value)
+					continue;
+				const double x = extent.xMinimum() + (zone.firstColumn + j) * cellX;
+				const double y = extent.yMaximum() - (zone.firstRow + i) * cellY;
+				const QgsGeometry cell = QgsGeometry::fromRect(QgsRectangle(x, y - cellY, x + cellX, y));
+				const double weight = zone.geometry.intersection(cell).area() / cellArea;
+				if (weight > 0)
+					result.add(z, value, weight, storeValueCounts, storeDigest);
+			}
+		}
+	}
+	delete raster;
+
+	QgsChangedAttributesMap changes;
+	for (int z = 0; z < zones.size(); ++z)
+	{
+		const Moments &m = result.moments[z];
+		const bool empty = !(m.count > 0);
+		const QHash<float, int> counts = result.valueCounts.value(z);
+
+		// minority and majority take the smallest value of a tie, as the
+		// stock class does walking its QMap
+		float minority = 0, majority = 0;
+		int fewest = INT_MAX, most = 0;
+		for (auto v = counts.constBegin(); v != counts.constEnd(); ++v)
+		{
+			if (v.value() < fewest || (v.value() == fewest && v.key() < minority))
+			{
+				fewest = v.value();
+				minority = v.key();
+			}
+			if (v.value() > most || (v.value() == most && v.key() < majority))
+			{
+				most = v.value();
+				majority = v.key();
+			}
+		}
+
+		QgsAttributeMap attributes;
+		for (const Output &output : outputs)
+		{
+			if (output.index < 0)
+				continue;
+			QVariant value;
+			switch (output.statistic)
+			{
+			case QgsZonalStatistics::Count:
+				value = m.count;
+				break;
+			case QgsZonalStatistics::Sum:
+				value = m.sum;
+				break;
+			case QgsZonalStatistics::Mean:
+				if (!empty)
+					value = m.sum / m.count;
+				break;
+			case QgsZonalStatistics::Median:
+				if (!empty)
+					value = storeValueCounts ? medianOf(counts) : result.digests[z].quantile(0.5);
+				break;
+			case QgsZonalStatistics::StDev:
+				if (!empty)
+					value = std::sqrt(m.squares / m.count);
+				break;
+			case QgsZonalStatistics::Min:
+				if (!empty)
+					value = static_cast<double>(m.min);
+				break;
+			case QgsZonalStatistics::Max:
+				if (!empty)
+					value = static_cast<double>(m.max);
+				break;
+			case QgsZonalStatistics::Range:
+				if (!empty)
+					value = static_cast<double>(m.max) - m.min;
+				break;
+			case QgsZonalStatistics::Minority:
+				if (!counts.isEmpty())
+					value = static_cast<double>(minority);
+				break;
+			case QgsZonalStatistics::Majority:
+				if (!counts.isEmpty())
+					value = static_cast<double>(majority);
+				break;
+			case QgsZonalStatistics::Variety:
+				value = counts.size();
+				break;
+			default:
+				break;
+			}
+			attributes.insert(output.index, value);
+		}
+		changes.insert(zones[z].id, attributes);
+	}
+	vectorProvider->changeAttributeValues(changes);
+	return 0;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "QString"
+#include "qgszonalstatistics.h"
+
+class QProgressDialog;
+class QgsVectorLayer;
+
+// Replacement for QgsZonalStatistics with the same constructor, fields and
+// results. The stock class reads the raster under every polygon's bounding
+// box and tests each cell against the polygon with GEOS. Here the raster is
+// read once, in tiles, by worker threads with their own provider clones.
+// Every tile knows the zones whose bounding boxes touch it. Those zones are
+// turned into runs of cells whose centres lie inside them by a scanline
+// over their edges, and each run is added to its zone. Runs instead of one
+// zone id per cell keep overlapping polygons counting a cell each, as in
+// the stock class.
+//
+// Each worker keeps count, sum, mean, squared deviations, minimum and
+// maximum for every zone. Value counts are only kept when minority,
+// majority or variety are asked for; they also give exact medians.
+// Otherwise medians come from a TDigest per zone. Zones with at most one
+// cell centre inside are redone with the weighted cell intersections of the
+// stock class.
+class ZonalStatistics
+{
+public:
+	ZonalStatistics(QgsVectorLayer *polygonLayer, const QString &rasterFile, const QString &attributePrefix = "", int rasterBand = 1,
+		QgsZonalStatistics::Statistics stats = QgsZonalStatistics::Statistics(QgsZonalStatistics::Count | QgsZonalStatistics::Sum | QgsZonalStatistics::Mean));
+
+	// Same return values as QgsZonalStatistics::calculateStatistics: 0 on
+	// success, 1 without a polygon layer, 2 without its provider, 3 if the
+	// raster and 4 if its band cannot be opened, 9 when cancelled. p may
+	// be 0.
+	int calculateStatistics(QProgressDialog *p);
+
+	void setTileSize(int cells) { mTileSize = qMax(16, cells); }
+	// 0 uses QThread::idealThreadCount().
+	void setThreadCount(int threads) { mThreadCount = qMax(0, threads); }
+
+private:
+	QString uniqueFieldName(const QString &fieldName) const;
+
+	QgsVectorLayer *mPolygonLayer;
+	QString mRasterFilePath;
+	QString mAttributePrefix;
+	int mRasterBand;
+	QgsZonalStatistics::Statistics mStatistics;
+	int mTileSize;
+	int mThreadCount;
+};